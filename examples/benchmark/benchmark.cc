@@ -0,0 +1,223 @@
+#define TINY_XPD_IMPLEMENTATION
+#include "tiny_xpd.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+using namespace tiny_xpd;
+
+// Generate spline XPD data with `num_prims` prims in total(1000 prims per
+// face).
+static bool GenerateSplineXPD(const uint32_t num_prims, const uint32_t num_cvs,
+                              std::vector<uint8_t> *xpd, std::string *err) {
+  const uint32_t prims_per_face = 1000;
+  const uint32_t num_faces = (num_prims + prims_per_face - 1) / prims_per_face;
+
+  XPDHeaderInput header;
+  header.primType = Xpd::PrimType::Spline;
+  header.primVersion = 3;
+  header.coordSpace = Xpd::CoordSpace::Object;
+  header.numCVs = num_cvs;
+  header.numFaces = num_faces;
+  header.numBlocks = 1;
+  header.block.push_back("BakedGroom");
+  header.primSize.push_back(10 + 3 * num_cvs);
+
+  std::vector<float> prim_data;
+  prim_data.reserve(size_t(num_prims) * header.primSize[0]);
+
+  uint32_t remaining = num_prims;
+  for (uint32_t f = 0; f < num_faces; f++) {
+    const uint32_t n = std::min(remaining, prims_per_face);
+    remaining -= n;
+
+    header.faceid.push_back(int(f));
+    header.numPrims.push_back(n);
+    header.blockOffset.push_back(prim_data.size() * sizeof(float));
+
+    for (uint32_t i = 0; i < n; i++) {
+      prim_data.push_back(float(i));  // id
+      prim_data.push_back(0.5f);      // u
+      prim_data.push_back(0.5f);      // v
+      for (uint32_t c = 0; c < num_cvs; c++) {
+        prim_data.push_back(float(f));
+        prim_data.push_back(float(c));
+        prim_data.push_back(float(i));
+      }
+      prim_data.push_back(1.0f);  // length
+      prim_data.push_back(0.1f);  // width
+      prim_data.push_back(1.0f);  // taper
+      prim_data.push_back(0.0f);  // taper start
+      prim_data.push_back(1.0f);  // width vector
+      prim_data.push_back(0.0f);
+      prim_data.push_back(0.0f);
+    }
+  }
+
+  std::vector<uint8_t> data(prim_data.size() * sizeof(float));
+  memcpy(data.data(), prim_data.data(), data.size());
+
+  return SerializeToXPD(header, data, xpd, err);
+}
+
+// Return the best time of `iterations` runs in milliseconds.
+template <typename F>
+static double Measure(const int iterations, F func) {
+  double best = 1.0e30;
+  for (int i = 0; i < iterations; i++) {
+    auto start = std::chrono::steady_clock::now();
+    if (!func()) {
+      return -1.0;
+    }
+    auto end = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(end - start).count();
+    best = std::min(best, ms);
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  uint32_t num_prims = 200000;
+  uint32_t num_threads = 1;
+
+  if (argc > 1) {
+    num_prims = uint32_t(std::stoi(argv[1]));
+  }
+
+  if (argc > 2) {
+    num_threads = uint32_t(std::stoi(argv[2]));
+  }
+
+  const int iterations = 5;
+  const uint32_t cv_counts[] = {4, 5, 6, 8, 16};
+
+  printf("prims: %u, threads: %u, cpu simd: %s\n", num_prims, num_threads,
+         GetSIMDLevelName(GetCPUSIMDLevel()));
+  printf("%-7s %-6s %-20s %12s %12s %8s\n", "simd", "numCVs", "extractor",
+         "generic(ms)", "special(ms)", "speedup");
+
+  for (size_t i = 0; i < sizeof(cv_counts) / sizeof(cv_counts[0]); i++) {
+    const uint32_t num_cvs = cv_counts[i];
+
+    std::string err;
+    std::vector<uint8_t> xpd;
+    if (!GenerateSplineXPD(num_prims, num_cvs, &xpd, &err)) {
+      std::cerr << err << "\n";
+      return EXIT_FAILURE;
+    }
+
+    XPDHeader header;
+    if (!ParseXPDHeaderFromMemory(xpd.data(), xpd.size(), &header, &err)) {
+      std::cerr << err << "\n";
+      return EXIT_FAILURE;
+    }
+
+    // Measure each SIMD level supported by the CPU.
+    for (int level = XPDSIMDScalar; level <= GetCPUSIMDLevel(); level++) {
+      if (!SetSIMDLevel(XPDSIMDLevel(level), &err)) {
+        std::cerr << err << "\n";
+        return EXIT_FAILURE;
+      }
+
+      double times[2][2];  // [extractor][specialize]
+      for (int s = 0; s < 2; s++) {
+        XPDSplineSoAOption soa_option;
+        soa_option.numThreads = num_threads;
+        soa_option.specialize = (s == 1);
+        XPDSplineSoA soa;
+        times[0][s] = Measure(iterations, [&]() {
+          return ExtractSplineSoA(header, xpd.data(), xpd.size(), 0,
+                                  soa_option, &soa, &err);
+        });
+
+        XPDCurveBufferOption curve_option;
+        curve_option.numThreads = num_threads;
+        curve_option.specialize = (s == 1);
+        XPDCurveBuffers buffers;
+        times[1][s] = Measure(iterations, [&]() {
+          return ExtractCurveBuffers(header, xpd.data(), xpd.size(), 0,
+                                     curve_option, &buffers, &err);
+        });
+      }
+
+      const char *names[2] = {"ExtractSplineSoA", "ExtractCurveBuffers"};
+      for (int e = 0; e < 2; e++) {
+        printf("%-7s %-6u %-20s %12.3f %12.3f %7.2fx\n",
+               GetSIMDLevelName(XPDSIMDLevel(level)), num_cvs, names[e],
+               times[e][0], times[e][1], times[e][0] / times[e][1]);
+      }
+    }
+  }
+
+  // Serializer: flatten + SerializeToXPD vs SerializeToXPDParallel.
+  {
+    const uint32_t num_cvs = 5;
+    std::string err;
+    std::vector<uint8_t> xpd;
+    if (!GenerateSplineXPD(num_prims, num_cvs, &xpd, &err)) {
+      std::cerr << err << "\n";
+      return EXIT_FAILURE;
+    }
+
+    XPDHeader header;
+    if (!ParseXPDHeaderFromMemory(xpd.data(), xpd.size(), &header, &err)) {
+      std::cerr << err << "\n";
+      return EXIT_FAILURE;
+    }
+
+    XPDHeaderInput input;
+    input.primType = header.primType;
+    input.primVersion = header.primVersion;
+    input.coordSpace = header.coordSpace;
+    input.numCVs = header.numCVs;
+    input.numFaces = header.numFaces;
+    input.numBlocks = header.numBlocks;
+    input.block = header.block;
+    input.primSize = header.primSize;
+    input.faceid = header.faceid;
+    input.numPrims = header.numPrims;
+
+    // Encode a face by copying prims from the source XPD(stands in for
+    // converting app data).
+    XPDEncodeBlockCallback encode = [&](uint32_t face, uint32_t block_id,
+                                        uint8_t *dst, std::string *) {
+      XPDBlockView view;
+      if (!GetBlockView(header, xpd.data(), xpd.size(), face, block_id, &view,
+                        nullptr)) {
+        return false;
+      }
+      memcpy(dst, view.data, view.numPrims * view.stride());
+      return true;
+    };
+
+    const double serial_ms = Measure(iterations, [&]() {
+      XPDHeaderInput in = input;
+      std::vector<uint8_t> prim_data;
+      in.blockOffset.clear();
+      for (uint32_t f = 0; f < in.numFaces; f++) {
+        in.blockOffset.push_back(prim_data.size());
+        prim_data.resize(prim_data.size() +
+                         in.numPrims[f] * in.primSize[0] * sizeof(float));
+        encode(f, 0, prim_data.data() + in.blockOffset.back(), nullptr);
+      }
+      std::vector<uint8_t> out;
+      return SerializeToXPD(in, prim_data, &out, &err);
+    });
+
+    XPDParallelSerializeOption option;
+    option.numThreads = num_threads;
+    const double parallel_ms = Measure(iterations, [&]() {
+      XPDHeaderInput in = input;
+      std::vector<uint8_t> out;
+      return SerializeToXPDParallel(in, encode, option, &out, &err);
+    });
+
+    printf("\nserialize(numCVs=%u) serial: %.3f ms, parallel: %.3f ms(%.2fx)\n",
+           num_cvs, serial_ms, parallel_ms, serial_ms / parallel_ms);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,96 @@
+/*
+ * Read a XPD file through the C API(libtiny_xpd).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tiny_xpd_c.h"
+
+static float GetFloat(const tiny_xpd_block_view *view, uint64_t prim,
+                      uint32_t i) {
+  float value;
+  /* Prim data may be unaligned. */
+  memcpy(&value, view->data + prim * view->stride + i * sizeof(float),
+         sizeof(float));
+  return value;
+}
+
+int main(int argc, char **argv) {
+  tiny_xpd_file *file = NULL;
+  tiny_xpd_header header;
+  tiny_xpd_soa *soa = NULL;
+  tiny_xpd_spline_layout layout;
+  uint32_t b, c, f, num_curves = 0;
+  const void *px = NULL;
+  uint64_t count = 0;
+
+  if (argc < 2) {
+    printf("Usage: c_api_example input.xpd\n");
+    return EXIT_FAILURE;
+  }
+
+  if (tiny_xpd_open(argv[1], &file) != TINY_XPD_OK) {
+    fprintf(stderr, "%s\n", tiny_xpd_last_error());
+    return EXIT_FAILURE;
+  }
+
+  /* Structs filled by the library start with their size. */
+  header.struct_size = sizeof(header);
+  layout.struct_size = sizeof(layout);
+  tiny_xpd_get_header(file, &header);
+  printf("numFaces %u, numBlocks %u, numCVs %u, numChannels %u\n",
+         header.numFaces, header.numBlocks, header.numCVs,
+         header.numChannels);
+
+  for (b = 0; b < header.numBlocks; b++) {
+    tiny_xpd_string name;
+    uint32_t prim_size;
+    tiny_xpd_block_view range;
+    range.struct_size = sizeof(range);
+    tiny_xpd_get_block(file, b, &name, &prim_size);
+    printf("block[%u] %s primSize %u", b, name.data, prim_size);
+    if (tiny_xpd_get_block_range(file, b, &range) == TINY_XPD_OK) {
+      printf(", %llu prims contiguous", (unsigned long long)range.numPrims);
+    }
+    printf("\n");
+  }
+
+  for (c = 0; c < header.numChannels; c++) {
+    tiny_xpd_channel channel;
+    channel.struct_size = sizeof(channel);
+    tiny_xpd_get_channel(file, c, &channel);
+    printf("channel %s block %u offset %u arity %u\n", channel.name.data,
+           channel.blockId, channel.offset, channel.arity);
+  }
+
+  /* Root CV of the first prim of each face(zero copy). */
+  if ((header.numBlocks > 0) &&
+      (tiny_xpd_get_spline_layout(file, 0, &layout) == TINY_XPD_OK)) {
+    for (f = 0; (f < header.numFaces) && (f < 4); f++) {
+      tiny_xpd_block_view view;
+      view.struct_size = sizeof(view);
+      if ((tiny_xpd_get_block_view(file, f, 0, &view) != TINY_XPD_OK) ||
+          (view.numPrims == 0)) {
+        continue;
+      }
+      printf("face[%u] root (%g, %g, %g)\n", f,
+             (double)GetFloat(&view, 0, layout.cv),
+             (double)GetFloat(&view, 0, layout.cv + 1),
+             (double)GetFloat(&view, 0, layout.cv + 2));
+    }
+
+    if (tiny_xpd_extract_spline_soa(file, 0, 0, NULL, NULL, &soa) ==
+        TINY_XPD_OK) {
+      tiny_xpd_soa_get_counts(soa, &num_curves, NULL);
+      tiny_xpd_soa_get_array(soa, TINY_XPD_SOA_PX, &px, &count);
+      printf("%u curves, %llu CVs\n", num_curves, (unsigned long long)count);
+      tiny_xpd_soa_free(soa);
+    } else {
+      fprintf(stderr, "%s\n", tiny_xpd_last_error());
+    }
+  }
+
+  tiny_xpd_release(file);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,338 @@
+#define TINY_XPD_IMPLEMENTATION
+#include "tiny_xpd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+using namespace tiny_xpd;
+
+static const char *PrimTypeName(const Xpd::PrimType prim) {
+  switch (prim) {
+    case Xpd::PrimType::Point:
+      return "Point";
+    case Xpd::PrimType::Spline:
+      return "Spline";
+    case Xpd::PrimType::Card:
+      return "Card";
+    case Xpd::PrimType::Sphere:
+      return "Sphere";
+    case Xpd::PrimType::Archive:
+      return "Archive";
+    case Xpd::PrimType::CustomPT:
+      return "CustomPT";
+  }
+  return "Unknown";
+}
+
+static const char *CoordSpaceName(const Xpd::CoordSpace space) {
+  switch (space) {
+    case Xpd::CoordSpace::World:
+      return "World";
+    case Xpd::CoordSpace::Object:
+      return "Object";
+    case Xpd::CoordSpace::Local:
+      return "Local";
+    case Xpd::CoordSpace::Micro:
+      return "Micro";
+    case Xpd::CoordSpace::CustomCS:
+      return "CustomCS";
+  }
+  return "Unknown";
+}
+
+static void PrintStat(const std::string &name,
+                      const XPDReductionResult &result) {
+  if (result.count == 0) {
+    printf("  %-16s (no finite values) nonfinite %llu\n", name.c_str(),
+           static_cast<unsigned long long>(result.nonFinite));
+    return;
+  }
+  printf("  %-16s min % .6g  max % .6g  mean % .6g  nonfinite %llu\n",
+         name.c_str(), double(result.min), double(result.max), result.mean(),
+         static_cast<unsigned long long>(result.nonFinite));
+}
+
+struct Options {
+  std::string filename;
+  std::string block;
+  uint32_t numThreads;
+  uint32_t sample;
+  uint32_t seed;
+  uint32_t bins;
+
+  Options() : numThreads(0), sample(0), seed(0), bins(16) {}
+};
+
+static void Usage() {
+  printf(
+      "Usage: xpd-inspect [options] input.xpd\n"
+      "  --block NAME   Block to summarize(default: first block)\n"
+      "  --threads N    Number of threads(default: all cores)\n"
+      "  --sample N     Print N randomly sampled prims\n"
+      "  --seed S       Random seed for --sample\n"
+      "  --bins B       Bins of per-face prim count histogram(default: 16)\n");
+}
+
+static bool ParseArgs(int argc, char **argv, Options *options) {
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool has_value = (i + 1) < argc;
+    if ((arg == "--block") && has_value) {
+      options->block = argv[++i];
+    } else if ((arg == "--threads") && has_value) {
+      options->numThreads = uint32_t(std::stoul(argv[++i]));
+    } else if ((arg == "--sample") && has_value) {
+      options->sample = uint32_t(std::stoul(argv[++i]));
+    } else if ((arg == "--seed") && has_value) {
+      options->seed = uint32_t(std::stoul(argv[++i]));
+    } else if ((arg == "--bins") && has_value) {
+      options->bins = std::max(1u, uint32_t(std::stoul(argv[++i])));
+    } else if (!arg.empty() && (arg[0] != '-') && options->filename.empty()) {
+      options->filename = arg;
+    } else {
+      return false;
+    }
+  }
+  return !options->filename.empty();
+}
+
+static void PrintHeader(const XPDHeader &xpd, const size_t file_size) {
+  printf("file size   : %llu bytes\n",
+         static_cast<unsigned long long>(file_size));
+  printf("fileVersion : %d\n", int(xpd.fileVersion));
+  printf("primType    : %s\n", PrimTypeName(xpd.primType));
+  printf("primVersion : %d\n", int(xpd.primVersion));
+  printf("time        : %g\n", double(xpd.time));
+  printf("numCVs      : %u\n", xpd.numCVs);
+  printf("coordSpace  : %s\n", CoordSpaceName(xpd.coordSpace));
+  printf("numFaces    : %u\n", xpd.numFaces);
+  printf("numBlocks   : %u\n", xpd.numBlocks);
+  for (size_t b = 0; b < xpd.block.size(); b++) {
+    printf("  block[%zu] %s(primSize %u)\n", b, xpd.block[b].c_str(),
+           (b < xpd.primSize.size()) ? xpd.primSize[b] : 0);
+  }
+  printf("numKeys     : %zu\n", xpd.key.size());
+  for (size_t k = 0; (k < xpd.key.size()) && (k < 32); k++) {
+    printf("  key[%zu] %s\n", k, xpd.key[k].c_str());
+  }
+  if (xpd.key.size() > 32) {
+    printf("  ...\n");
+  }
+}
+
+static void PrintFaceHistogram(const XPDHeader &xpd, const uint32_t bins) {
+  uint64_t total = 0;
+  uint32_t lo = 0xffffffffu, hi = 0, empty = 0;
+  for (size_t f = 0; f < xpd.numPrims.size(); f++) {
+    const uint32_t n = xpd.numPrims[f];
+    total += n;
+    lo = std::min(lo, n);
+    hi = std::max(hi, n);
+    empty += (n == 0) ? 1 : 0;
+  }
+  if (xpd.numPrims.empty()) {
+    return;
+  }
+
+  printf("\nprims      : %llu total, %u..%u per face, mean %.2f, %u empty "
+         "faces\n",
+         static_cast<unsigned long long>(total), lo, hi,
+         double(total) / double(xpd.numPrims.size()), empty);
+
+  const uint64_t range = uint64_t(hi - lo) + 1;
+  const uint32_t num_bins = uint32_t(std::min(uint64_t(bins), range));
+  std::vector<uint64_t> hist(num_bins, 0);
+  for (size_t f = 0; f < xpd.numPrims.size(); f++) {
+    hist[size_t(uint64_t(xpd.numPrims[f] - lo) * num_bins / range)]++;
+  }
+  const uint64_t peak = *std::max_element(hist.begin(), hist.end());
+
+  printf("prims per face histogram:\n");
+  for (uint32_t i = 0; i < num_bins; i++) {
+    const uint64_t begin = lo + (range * i + num_bins - 1) / num_bins;
+    const uint64_t end = lo + (range * (i + 1) + num_bins - 1) / num_bins - 1;
+    const int width = int(40 * hist[i] / peak);
+    printf("  [%8llu, %8llu] %10llu %.*s\n",
+           static_cast<unsigned long long>(begin),
+           static_cast<unsigned long long>(end),
+           static_cast<unsigned long long>(hist[i]), width,
+           "########################################");
+  }
+}
+
+// Reduce spline attributes(or raw prim values of a non-spline block) and
+// channels over all faces of `block_id`.
+static bool Summarize(const XPDHeader &xpd, const uint8_t *data,
+                      const size_t size, const uint32_t block_id,
+                      const uint32_t num_threads, std::string *err) {
+  XPDSplineLayout layout;
+  const bool spline = GetSplineLayout(xpd, block_id, &layout, nullptr);
+
+  uint32_t ext_block_id;
+  const bool varying =
+      spline && FindVaryingCVBlock(xpd, block_id, &ext_block_id);
+
+  std::vector<std::string> names;
+  if (spline) {
+    const char *attrib_names[13] = {
+        "cv.x",          "cv.y",          "cv.z",  "id",
+        "u",             "v",             "length", "width",
+        "taper",         "taperStart",    "widthVector.x",
+        "widthVector.y", "widthVector.z"};
+    names.assign(attrib_names, attrib_names + 13);
+  }
+
+  std::vector<XPDChannel> channels;
+  GetChannels(xpd, &channels, nullptr);
+  for (size_t c = 0; c < channels.size(); c++) {
+    if (channels[c].blockId != block_id) {
+      continue;
+    }
+    for (uint32_t i = 0; i < channels[c].arity; i++) {
+      names.push_back(channels[c].name + "[" + std::to_string(i) + "]");
+    }
+  }
+
+  if (!spline && names.empty()) {
+    // Unknown layout: summarize each float of a prim.
+    for (uint32_t i = 0; i < xpd.primSize[block_id]; i++) {
+      names.push_back("value[" + std::to_string(i) + "]");
+    }
+  }
+
+  std::vector<XPDReduction> reductions(names.size());
+  for (size_t r = 0; r < names.size(); r++) {
+    reductions[r].attribute = names[r];
+  }
+
+  XPDReduceOption option;
+  option.numThreads = num_threads;
+  std::vector<XPDReductionResult> results;
+  if (!ReduceSplineAttributes(xpd, data, size, block_id, reductions, option,
+                              &results, err)) {
+    return false;
+  }
+
+  printf("\nblock %s statistics%s:\n", xpd.block[block_id].c_str(),
+         varying ? "(variable CV count)" : "");
+  for (size_t r = 0; r < names.size(); r++) {
+    PrintStat(names[r], results[r]);
+  }
+
+  return true;
+}
+
+// Print `count` prims picked uniformly from all prims.
+static void PrintSamples(const XPDHeader &xpd, const uint8_t *data,
+                         const size_t size, const uint32_t block_id,
+                         const uint32_t count, const uint32_t seed) {
+  std::vector<uint64_t> face_offsets(xpd.numPrims.size() + 1, 0);
+  for (size_t f = 0; f < xpd.numPrims.size(); f++) {
+    face_offsets[f + 1] = face_offsets[f] + xpd.numPrims[f];
+  }
+  const uint64_t total = face_offsets.back();
+  if ((total == 0) || (count == 0)) {
+    return;
+  }
+
+  // Pick distinct prims(Floyd's algorithm).
+  std::mt19937_64 rng(seed);
+  std::unordered_set<uint64_t> picked;
+  const uint64_t n = std::min(uint64_t(count), total);
+  for (uint64_t j = total - n; j < total; j++) {
+    const uint64_t t = rng() % (j + 1);
+    picked.insert(picked.count(t) ? j : t);
+  }
+  std::vector<uint64_t> picks(picked.begin(), picked.end());
+  std::sort(picks.begin(), picks.end());
+
+  printf("\nsampled prims of block %s:\n", xpd.block[block_id].c_str());
+  for (size_t i = 0; i < picks.size(); i++) {
+    const size_t f = size_t(std::upper_bound(face_offsets.begin(),
+                                             face_offsets.end(), picks[i]) -
+                            face_offsets.begin()) -
+                     1;
+    const size_t p = size_t(picks[i] - face_offsets[f]);
+
+    XPDBlockView view;
+    if (!GetBlockView(xpd, data, size, uint32_t(f), block_id, &view,
+                      nullptr)) {
+      continue;
+    }
+    printf("  face %zu(faceid %d) prim %zu:", f, xpd.faceid[f], p);
+    for (uint32_t k = 0; k < view.primSize; k++) {
+      printf(" %g", double(view.get(p, k)));
+    }
+    printf("\n");
+  }
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  if (!ParseArgs(argc, argv, &options)) {
+    Usage();
+    return EXIT_FAILURE;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+
+  std::string err;
+  XPDMappedFile file;
+  if (!file.open(options.filename, &err)) {
+    fprintf(stderr, "%s", err.c_str());
+    return EXIT_FAILURE;
+  }
+
+  XPDHeader xpd;
+  if (!ParseXPDHeaderFromMemory(file.data(), file.size(), &xpd, &err)) {
+    fprintf(stderr, "Failed to parse XPD header: %s\n%s",
+            options.filename.c_str(), err.c_str());
+    return EXIT_FAILURE;
+  }
+
+  PrintHeader(xpd, file.size());
+  PrintFaceHistogram(xpd, options.bins);
+
+  if (xpd.numBlocks == 0) {
+    return EXIT_SUCCESS;
+  }
+
+  uint32_t block_id = 0;
+  if (!options.block.empty()) {
+    const int id = xpd.findBlock(options.block);
+    if (id < 0) {
+      fprintf(stderr, "Block not found: %s\n", options.block.c_str());
+      return EXIT_FAILURE;
+    }
+    block_id = uint32_t(id);
+  }
+
+  uint32_t num_threads = options.numThreads;
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  if (!Summarize(xpd, file.data(), file.size(), block_id, num_threads,
+                 &err)) {
+    fprintf(stderr, "%s", err.c_str());
+    return EXIT_FAILURE;
+  }
+
+  PrintSamples(xpd, file.data(), file.size(), block_id, options.sample,
+               options.seed);
+
+  const auto end = std::chrono::steady_clock::now();
+  printf("\nsummarized in %.1f ms(%u threads)\n",
+         std::chrono::duration<double, std::milli>(end - start).count(),
+         num_threads);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,203 @@
+#define TINY_XPD_IMPLEMENTATION
+#include "tiny_xpd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <vector>
+
+using namespace tiny_xpd;
+
+struct Options {
+  std::string input;
+  std::string output;
+  std::string block;
+  uint32_t numThreads = 0;
+  XPDSpatialOrder order = XPDSpatialOrderMorton;
+  bool sortPrims = true;
+};
+
+static void Usage() {
+  printf(
+      "Usage: xpd-reorder [options] input.xpd output.xpd\n"
+      "  --order ORDER  morton or hilbert(default: morton)\n"
+      "  --block NAME   Spline block giving root positions(default: first "
+      "block)\n"
+      "  --threads N    Number of threads(default: all cores)\n"
+      "  --no-prim-sort Keep the order of prims in each face\n");
+}
+
+static bool ParseArgs(int argc, char **argv, Options *options) {
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool has_value = (i + 1) < argc;
+    if ((arg == "--order") && has_value) {
+      const std::string order = argv[++i];
+      if (order == "morton") {
+        options->order = XPDSpatialOrderMorton;
+      } else if (order == "hilbert") {
+        options->order = XPDSpatialOrderHilbert;
+      } else {
+        return false;
+      }
+    } else if ((arg == "--block") && has_value) {
+      options->block = argv[++i];
+    } else if ((arg == "--threads") && has_value) {
+      options->numThreads = uint32_t(std::stoul(argv[++i]));
+    } else if (arg == "--no-prim-sort") {
+      options->sortPrims = false;
+    } else if (!arg.empty() && (arg[0] != '-') && options->input.empty()) {
+      options->input = arg;
+    } else if (!arg.empty() && (arg[0] != '-') && options->output.empty()) {
+      options->output = arg;
+    } else {
+      return false;
+    }
+  }
+  return !options->input.empty() && !options->output.empty();
+}
+
+// Center of the bounds of root CVs of each face. Empty faces get NaN.
+static bool FaceCenters(const XPDHeader &xpd, const uint8_t *data,
+                        const size_t size, const uint32_t block_id,
+                        std::vector<float> *centers, std::string *err) {
+  XPDSplineLayout layout;
+  if (!GetSplineLayout(xpd, block_id, &layout, err)) {
+    return false;
+  }
+
+  centers->assign(size_t(xpd.numFaces) * 3,
+                  std::numeric_limits<float>::quiet_NaN());
+  for (uint32_t f = 0; f < xpd.numFaces; f++) {
+    XPDBlockView view;
+    if (!GetBlockView(xpd, data, size, f, block_id, &view, err)) {
+      return false;
+    }
+    if (view.numPrims == 0) {
+      continue;
+    }
+    for (uint32_t k = 0; k < 3; k++) {
+      float lo = view.get(0, layout.cv + k);
+      float hi = lo;
+      for (size_t p = 1; p < view.numPrims; p++) {
+        lo = std::min(lo, view.get(p, layout.cv + k));
+        hi = std::max(hi, view.get(p, layout.cv + k));
+      }
+      (*centers)[f * 3 + k] = 0.5f * (lo + hi);
+    }
+  }
+  return true;
+}
+
+// The number of runs of consecutive faces in the same tile of a 8x8x8 grid
+// over face centers. Empty faces are skipped.
+static size_t CountTileRuns(const std::vector<float> &centers) {
+  const int kTiles = 8;
+  float lo[3], hi[3];
+  for (int k = 0; k < 3; k++) {
+    lo[k] = std::numeric_limits<float>::infinity();
+    hi[k] = -std::numeric_limits<float>::infinity();
+  }
+  for (size_t i = 0; i < centers.size(); i++) {
+    if (std::isfinite(centers[i])) {
+      lo[i % 3] = std::min(lo[i % 3], centers[i]);
+      hi[i % 3] = std::max(hi[i % 3], centers[i]);
+    }
+  }
+
+  size_t runs = 0;
+  int prev = -1;
+  for (size_t f = 0; f < centers.size() / 3; f++) {
+    int tile = 0;
+    bool valid = true;
+    for (int k = 0; k < 3; k++) {
+      const float c = centers[f * 3 + size_t(k)];
+      valid = valid && std::isfinite(c);
+      const float extent = hi[k] - lo[k];
+      int t = (extent > 0.0f) ? int(float(kTiles) * (c - lo[k]) / extent) : 0;
+      t = std::max(0, std::min(kTiles - 1, t));
+      tile = tile * kTiles + t;
+    }
+    if (!valid) {
+      continue;
+    }
+    if (tile != prev) {
+      runs++;
+    }
+    prev = tile;
+  }
+  return runs;
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  if (!ParseArgs(argc, argv, &options)) {
+    Usage();
+    return EXIT_FAILURE;
+  }
+
+  std::string err;
+  XPDMappedFile file;
+  if (!file.open(options.input, &err)) {
+    fprintf(stderr, "%s", err.c_str());
+    return EXIT_FAILURE;
+  }
+
+  XPDHeader xpd;
+  if (!ParseXPDHeaderFromMemory(file.data(), file.size(), &xpd, &err)) {
+    fprintf(stderr, "Failed to parse XPD header: %s\n%s",
+            options.input.c_str(), err.c_str());
+    return EXIT_FAILURE;
+  }
+
+  XPDReorderOption option;
+  option.numThreads = options.numThreads;
+  option.order = options.order;
+  option.sortPrims = options.sortPrims;
+  if (!options.block.empty()) {
+    const int id = xpd.findBlock(options.block);
+    if (id < 0) {
+      fprintf(stderr, "Block not found: %s\n", options.block.c_str());
+      return EXIT_FAILURE;
+    }
+    option.blockId = uint32_t(id);
+  }
+
+  std::vector<float> centers;
+  if (!FaceCenters(xpd, file.data(), file.size(), option.blockId, &centers,
+                   &err)) {
+    fprintf(stderr, "%s", err.c_str());
+    return EXIT_FAILURE;
+  }
+  const size_t runs_before = CountTileRuns(centers);
+
+  const auto start = std::chrono::steady_clock::now();
+  if (!ReorderXPDFile(xpd, file.data(), file.size(), option, options.output,
+                      &err)) {
+    fprintf(stderr, "%s", err.c_str());
+    return EXIT_FAILURE;
+  }
+  const auto end = std::chrono::steady_clock::now();
+
+  XPDMappedFile out;
+  XPDHeader out_xpd;
+  if (!out.open(options.output, &err) ||
+      !ParseXPDHeaderFromMemory(out.data(), out.size(), &out_xpd, &err) ||
+      !FaceCenters(out_xpd, out.data(), out.size(), option.blockId, &centers,
+                   &err)) {
+    fprintf(stderr, "%s", err.c_str());
+    return EXIT_FAILURE;
+  }
+  const size_t runs_after = CountTileRuns(centers);
+
+  printf("%u faces reordered(%s) in %.1f ms\n", xpd.numFaces,
+         (options.order == XPDSpatialOrderHilbert) ? "hilbert" : "morton",
+         std::chrono::duration<double, std::milli>(end - start).count());
+  printf("tile runs: %zu -> %zu\n", runs_before, runs_after);
+
+  return EXIT_SUCCESS;
+}
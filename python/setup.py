@@ -0,0 +1,36 @@
+#
+# Build the tiny_xpd Python module against an installed NumPy(no download):
+#
+#   python setup.py build_ext --inplace
+#   pip install --no-build-isolation .
+#
+import os
+import sys
+
+import numpy
+from setuptools import Extension, setup
+
+root = os.path.dirname(os.path.abspath(__file__))
+
+extra_compile_args = []
+extra_link_args = []
+if sys.platform != "win32":
+    extra_compile_args = ["-std=c++11", "-pthread"]
+    extra_link_args = ["-pthread"]
+
+setup(
+    name="tiny_xpd",
+    version="0.1.0",
+    description="XGen XPD reader with zero-copy NumPy views.",
+    license="MIT",
+    ext_modules=[
+        Extension(
+            "tiny_xpd",
+            sources=["tiny_xpd_module.cc"],
+            include_dirs=[os.path.join(root, ".."), numpy.get_include()],
+            extra_compile_args=extra_compile_args,
+            extra_link_args=extra_link_args,
+            language="c++",
+        )
+    ],
+)
@@ -0,0 +1,62 @@
+#
+# Tests of the tiny_xpd module. Build the module first, then run:
+#
+#   python setup.py build_ext --inplace
+#   python -m unittest test_tiny_xpd
+#
+import gc
+import os
+import unittest
+
+import numpy as np
+
+import tiny_xpd
+
+SAMPLE = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..",
+                      "samples", "sample.xpd")
+
+
+class TinyXPDTest(unittest.TestCase):
+
+    def test_views_outlive_file(self):
+        f = tiny_xpd.open(SAMPLE)
+        soa = f.extract_spline_soa(num_threads=2)
+        num_cvs = soa["num_cvs_per_curve"]
+        num_faces = f.num_faces
+        face_offset = soa["faceCurveOffset"].copy()
+
+        width = f.attribute("width")
+        cvs = f.attribute("cv", face=num_faces - 1)
+        del f
+        gc.collect()
+
+        self.assertEqual(width.shape, (soa["num_curves"],))
+        np.testing.assert_array_equal(width, soa["width"])
+
+        first = face_offset[num_faces - 1] * num_cvs
+        px = soa["px"][first:first + cvs.shape[0] * num_cvs]
+        np.testing.assert_array_equal(cvs[:, :, 0].ravel(), px)
+
+    def test_from_bytes(self):
+        with open(SAMPLE, "rb") as fp:
+            data = fp.read()
+        f = tiny_xpd.from_bytes(data)
+        g = tiny_xpd.open(SAMPLE)
+        np.testing.assert_array_equal(f.num_prims, g.num_prims)
+        np.testing.assert_array_equal(f.block(0), g.block(0))
+        self.assertEqual(bytes(memoryview(f)), data)
+
+    def test_errors(self):
+        with self.assertRaises(tiny_xpd.XPDError):
+            tiny_xpd.open(SAMPLE + ".missing")
+        with self.assertRaises(tiny_xpd.XPDError):
+            tiny_xpd.from_bytes(b"XPD")
+        f = tiny_xpd.open(SAMPLE)
+        with self.assertRaises(KeyError):
+            f.attribute("nope")
+        with self.assertRaises(IndexError):
+            f.block(0, face=f.num_faces)
+
+
+if __name__ == "__main__":
+    unittest.main()
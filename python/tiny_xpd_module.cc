@@ -0,0 +1,759 @@
+//
+// Python bindings of tiny_xpd. Block, attribute and channel views are NumPy
+// arrays backed by the mapped XPD data(no copy). See README.md.
+//
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+
+#define TINY_XPD_IMPLEMENTATION
+#include "tiny_xpd.h"
+
+#include <exception>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace tiny_xpd;
+
+namespace {
+
+PyObject *g_error = nullptr;  // tiny_xpd.XPDError
+
+struct FileState {
+  std::shared_ptr<const XPDFile> file;
+  std::vector<XPDChannel> channels;
+};
+
+struct PyXPDFile {
+  PyObject_HEAD
+  FileState *state;
+};
+
+PyTypeObject PyXPDFileType = {PyVarObject_HEAD_INIT(nullptr, 0)};
+
+PyObject *SetError(const std::string &err) {
+  PyErr_SetString(g_error, err.c_str());
+  return nullptr;
+}
+
+// Convert the C++ exception being handled to a Python exception. Call only
+// from a catch block. Methods are function-try-blocks, so no C++ exception
+// reaches the interpreter.
+PyObject *SetException() {
+  try {
+    throw;
+  } catch (const std::bad_alloc &) {
+    return PyErr_NoMemory();
+  } catch (const std::exception &e) {
+    PyErr_SetString(g_error, e.what());
+  } catch (...) {
+    PyErr_SetString(g_error, "Unknown C++ exception.");
+  }
+  return nullptr;
+}
+
+// Run `func` with the GIL released. C++ exceptions are caught before the
+// GIL is reacquired, then rethrown as Python exceptions. Return false when
+// an exception was raised.
+template <typename F>
+bool RunWithoutGIL(F func) {
+  std::exception_ptr exception;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    func();
+  } catch (...) {
+    exception = std::current_exception();
+  }
+  Py_END_ALLOW_THREADS
+  if (exception) {
+    try {
+      std::rethrow_exception(exception);
+    } catch (...) {
+      SetException();
+    }
+    return false;
+  }
+  return true;
+}
+
+const XPDFile &File(PyObject *self) {
+  return *reinterpret_cast<PyXPDFile *>(self)->state->file;
+}
+
+// Read-only array viewing `data`, which keeps `owner` alive.
+PyObject *MakeView(PyObject *owner, const uint8_t *data, const int type,
+                   const int nd, npy_intp *dims, npy_intp *strides) {
+  PyObject *array = PyArray_NewFromDescr(
+      &PyArray_Type, PyArray_DescrFromType(type), nd, dims, strides,
+      const_cast<uint8_t *>(data), 0, nullptr);
+  if (!array) {
+    return nullptr;
+  }
+  Py_INCREF(owner);
+  if (PyArray_SetBaseObject(reinterpret_cast<PyArrayObject *>(array),
+                            owner) < 0) {
+    Py_DECREF(array);
+    return nullptr;
+  }
+  return array;
+}
+
+// Accept a block index or name.
+bool ResolveBlock(PyObject *self, PyObject *block, uint32_t *block_id) {
+  const XPDHeader &h = File(self).header();
+  if (PyUnicode_Check(block)) {
+    Py_ssize_t length;
+    const char *name = PyUnicode_AsUTF8AndSize(block, &length);
+    if (!name) {
+      return false;
+    }
+    const int id = h.findBlock(name, size_t(length));
+    if (id < 0) {
+      PyErr_Format(PyExc_KeyError, "Block not found: %s", name);
+      return false;
+    }
+    (*block_id) = uint32_t(id);
+    return true;
+  }
+
+  const long id = PyLong_AsLong(block);
+  if ((id == -1) && PyErr_Occurred()) {
+    return false;
+  }
+  if ((id < 0) || (uint64_t(id) >= h.numBlocks)) {
+    PyErr_Format(PyExc_IndexError, "Block index %ld out of range.", id);
+    return false;
+  }
+  (*block_id) = uint32_t(id);
+  return true;
+}
+
+// Block view of `face`, or of all faces when `face` is None(prim data of
+// faces with prims must be contiguous).
+bool GetView(PyObject *self, PyObject *face, const uint32_t block_id,
+             XPDBlockView *view) {
+  const XPDFile &file = File(self);
+  const XPDHeader &h = file.header();
+  std::string err;
+
+  if (face && (face != Py_None)) {
+    const long f = PyLong_AsLong(face);
+    if ((f == -1) && PyErr_Occurred()) {
+      return false;
+    }
+    if ((f < 0) || (uint64_t(f) >= h.numFaces)) {
+      PyErr_Format(PyExc_IndexError, "Face index %ld out of range.", f);
+      return false;
+    }
+    if (!file.blockView(uint32_t(f), block_id, view, &err)) {
+      SetError(err);
+      return false;
+    }
+    return true;
+  }
+
+  XPDBlockView range;
+  range.primSize = h.primSize[block_id];
+  for (uint32_t f = 0; f < h.numFaces; f++) {
+    XPDBlockView v;
+    if (!file.blockView(f, block_id, &v, &err)) {
+      SetError(err);
+      return false;
+    }
+    // Empty faces may be anywhere.
+    if (v.numPrims == 0) {
+      continue;
+    }
+    if (!range.data) {
+      range.data = v.data;
+    } else if (v.data != range.data + range.numPrims * range.stride()) {
+      SetError("Prim data of block " + h.block[block_id] +
+               " is not contiguous. Pass `face`.");
+      return false;
+    }
+    range.numPrims += v.numPrims;
+  }
+  (*view) = range;
+  return true;
+}
+
+// View of `width` floats at `offset` of each prim. Shape is (numPrims,),
+// (numPrims, width) or (numPrims, width / 3, 3).
+PyObject *MakeAttributeView(PyObject *self, const XPDBlockView &view,
+                            const uint32_t offset, const uint32_t width,
+                            const bool xyz) {
+  const uint8_t *data = view.data ? view.data : File(self).data();
+  data += size_t(offset) * sizeof(float);
+  npy_intp dims[3] = {npy_intp(view.numPrims), npy_intp(width), 3};
+  npy_intp strides[3] = {npy_intp(view.stride()), npy_intp(sizeof(float)),
+                         npy_intp(sizeof(float))};
+  if (xyz) {
+    dims[1] = npy_intp(width / 3);
+    strides[1] = npy_intp(3 * sizeof(float));
+    return MakeView(self, data, NPY_FLOAT32, 3, dims, strides);
+  }
+  return MakeView(self, data, NPY_FLOAT32, (width == 1) ? 1 : 2, dims,
+                  strides);
+}
+
+// ---------------------------------------------
+// XPDFile type.
+
+// May throw(called from methods which catch C++ exceptions).
+PyObject *CreateFile(const std::shared_ptr<const XPDFile> &file) {
+  std::unique_ptr<FileState> state(new FileState());
+  state->file = file;
+  std::string err;
+  if (!GetChannels(file->header(), &state->channels, &err)) {
+    return SetError(err);
+  }
+
+  PyXPDFile *self = PyObject_New(PyXPDFile, &PyXPDFileType);
+  if (!self) {
+    return nullptr;
+  }
+  self->state = state.release();
+  return reinterpret_cast<PyObject *>(self);
+}
+
+void FileDealloc(PyObject *self) {
+  delete reinterpret_cast<PyXPDFile *>(self)->state;
+  PyObject_Del(self);
+}
+
+// Buffer protocol: whole XPD data(read only).
+int FileGetBuffer(PyObject *self, Py_buffer *view, int flags) {
+  const XPDFile &file = File(self);
+  return PyBuffer_FillInfo(view, self,
+                           const_cast<uint8_t *>(file.data()),
+                           Py_ssize_t(file.size()), 1, flags);
+}
+
+PyBufferProcs g_file_buffer = {FileGetBuffer, nullptr};
+
+PyObject *GetNumFaces(PyObject *self, void *) {
+  return PyLong_FromUnsignedLong(File(self).header().numFaces);
+}
+
+PyObject *GetNumBlocks(PyObject *self, void *) {
+  return PyLong_FromUnsignedLong(File(self).header().numBlocks);
+}
+
+PyObject *GetNumCVs(PyObject *self, void *) {
+  return PyLong_FromUnsignedLong(File(self).header().numCVs);
+}
+
+PyObject *GetFileVersion(PyObject *self, void *) {
+  return PyLong_FromUnsignedLong(File(self).header().fileVersion);
+}
+
+PyObject *GetPrimType(PyObject *self, void *) {
+  return PyLong_FromLong(long(File(self).header().primType));
+}
+
+PyObject *GetPrimVersion(PyObject *self, void *) {
+  return PyLong_FromUnsignedLong(File(self).header().primVersion);
+}
+
+PyObject *GetCoordSpace(PyObject *self, void *) {
+  return PyLong_FromLong(long(File(self).header().coordSpace));
+}
+
+PyObject *GetTime(PyObject *self, void *) {
+  return PyFloat_FromDouble(double(File(self).header().time));
+}
+
+PyObject *StringList(const std::vector<std::string> &names) {
+  PyObject *list = PyList_New(Py_ssize_t(names.size()));
+  if (!list) {
+    return nullptr;
+  }
+  for (size_t i = 0; i < names.size(); i++) {
+    PyObject *s = PyUnicode_DecodeUTF8(names[i].data(),
+                                       Py_ssize_t(names[i].size()), "replace");
+    if (!s) {
+      Py_DECREF(list);
+      return nullptr;
+    }
+    PyList_SET_ITEM(list, Py_ssize_t(i), s);
+  }
+  return list;
+}
+
+PyObject *GetBlocks(PyObject *self, void *) try {
+  return StringList(File(self).header().block);
+} catch (...) {
+  return SetException();
+}
+
+PyObject *GetKeys(PyObject *self, void *) try {
+  return StringList(File(self).header().key);
+} catch (...) {
+  return SetException();
+}
+
+PyObject *GetPrimSizes(PyObject *self, void *) {
+  const std::vector<uint32_t> &sizes = File(self).header().primSize;
+  npy_intp dims[1] = {npy_intp(sizes.size())};
+  return MakeView(self, reinterpret_cast<const uint8_t *>(sizes.data()),
+                  NPY_UINT32, 1, dims, nullptr);
+}
+
+PyObject *GetFaceids(PyObject *self, void *) {
+  const std::vector<int> &faceid = File(self).header().faceid;
+  static_assert(sizeof(int) == sizeof(int32_t), "faceid must be 32 bit.");
+  npy_intp dims[1] = {npy_intp(faceid.size())};
+  return MakeView(self, reinterpret_cast<const uint8_t *>(faceid.data()),
+                  NPY_INT32, 1, dims, nullptr);
+}
+
+PyObject *GetNumPrims(PyObject *self, void *) {
+  const std::vector<uint32_t> &num_prims = File(self).header().numPrims;
+  npy_intp dims[1] = {npy_intp(num_prims.size())};
+  return MakeView(self, reinterpret_cast<const uint8_t *>(num_prims.data()),
+                  NPY_UINT32, 1, dims, nullptr);
+}
+
+PyObject *GetBlockPositions(PyObject *self, void *) {
+  const XPDHeader &h = File(self).header();
+  npy_intp dims[2] = {npy_intp(h.numFaces), npy_intp(h.numBlocks)};
+  return MakeView(
+      self, reinterpret_cast<const uint8_t *>(h.blockPosition.data()),
+      NPY_UINT64, 2, dims, nullptr);
+}
+
+PyObject *GetChannelList(PyObject *self, void *) try {
+  const FileState *state = reinterpret_cast<PyXPDFile *>(self)->state;
+  const XPDHeader &h = state->file->header();
+  PyObject *list = PyList_New(Py_ssize_t(state->channels.size()));
+  if (!list) {
+    return nullptr;
+  }
+  for (size_t i = 0; i < state->channels.size(); i++) {
+    const XPDChannel &c = state->channels[i];
+    PyObject *item =
+        Py_BuildValue("{s:s,s:s,s:I,s:I}", "block", h.block[c.blockId].c_str(),
+                      "name", c.name.c_str(), "offset", c.offset, "arity",
+                      c.arity);
+    if (!item) {
+      Py_DECREF(list);
+      return nullptr;
+    }
+    PyList_SET_ITEM(list, Py_ssize_t(i), item);
+  }
+  return list;
+} catch (...) {
+  return SetException();
+}
+
+PyGetSetDef g_file_getset[] = {
+    {"num_faces", GetNumFaces, nullptr, nullptr, nullptr},
+    {"num_blocks", GetNumBlocks, nullptr, nullptr, nullptr},
+    {"num_cvs", GetNumCVs, nullptr, nullptr, nullptr},
+    {"file_version", GetFileVersion, nullptr, nullptr, nullptr},
+    {"prim_type", GetPrimType, nullptr, nullptr, nullptr},
+    {"prim_version", GetPrimVersion, nullptr, nullptr, nullptr},
+    {"coord_space", GetCoordSpace, nullptr, nullptr, nullptr},
+    {"time", GetTime, nullptr, nullptr, nullptr},
+    {"blocks", GetBlocks, nullptr, "Block names.", nullptr},
+    {"keys", GetKeys, nullptr, "Key names.", nullptr},
+    {"prim_sizes", GetPrimSizes, nullptr,
+     "The number of floats per prim of each block.", nullptr},
+    {"faceid", GetFaceids, nullptr, "faceid of each face(int32).", nullptr},
+    {"num_prims", GetNumPrims, nullptr,
+     "The number of prims of each face(uint32).", nullptr},
+    {"block_positions", GetBlockPositions, nullptr,
+     "Absolute byte position of each block(uint64, [num_faces, "
+     "num_blocks]).",
+     nullptr},
+    {"channels", GetChannelList, nullptr,
+     "Custom attribute channels decoded from keys.", nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr}};
+
+PyObject *FileBlock(PyObject *self, PyObject *args, PyObject *kwargs) try {
+  static const char *kwlist[] = {"block", "face", nullptr};
+  PyObject *block = nullptr;
+  PyObject *face = Py_None;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O",
+                                   const_cast<char **>(kwlist), &block,
+                                   &face)) {
+    return nullptr;
+  }
+
+  uint32_t block_id;
+  XPDBlockView view;
+  if (!ResolveBlock(self, block, &block_id) ||
+      !GetView(self, face, block_id, &view)) {
+    return nullptr;
+  }
+  return MakeAttributeView(self, view, 0, view.primSize, false);
+} catch (...) {
+  return SetException();
+}
+
+PyObject *FileAttribute(PyObject *self, PyObject *args, PyObject *kwargs) try {
+  static const char *kwlist[] = {"name", "face", "block", nullptr};
+  const char *name = nullptr;
+  PyObject *face = Py_None;
+  PyObject *block = nullptr;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|OO",
+                                   const_cast<char **>(kwlist), &name, &face,
+                                   &block)) {
+    return nullptr;
+  }
+
+  uint32_t block_id = 0;
+  if (block && !ResolveBlock(self, block, &block_id)) {
+    return nullptr;
+  }
+
+  XPDSplineLayout layout;
+  std::string err;
+  if (!GetSplineLayout(File(self).header(), block_id, &layout, &err)) {
+    return SetError(err);
+  }
+
+  const std::string attr = name;
+  uint32_t offset = 0;
+  uint32_t width = 1;
+  bool xyz = false;
+  if (attr == "id") {
+    offset = layout.id;
+  } else if (attr == "u") {
+    offset = layout.u;
+  } else if (attr == "v") {
+    offset = layout.v;
+  } else if (attr == "cv") {
+    uint32_t ext_block_id;
+    if (FindVaryingCVBlock(File(self).header(), block_id, &ext_block_id)) {
+      return SetError("CV count of block " +
+                      File(self).header().block[block_id] +
+                      " varies per prim. Use `extract_spline_soa`.");
+    }
+    offset = layout.cv;
+    width = layout.numCVs * 3;
+    xyz = true;
+  } else if (attr == "length") {
+    offset = layout.length;
+  } else if (attr == "width") {
+    offset = layout.width;
+  } else if (attr == "taper") {
+    offset = layout.taper;
+  } else if (attr == "taperStart") {
+    offset = layout.taperStart;
+  } else if (attr == "widthVector") {
+    offset = layout.widthVector;
+    width = 3;
+  } else {
+    PyErr_Format(PyExc_KeyError, "Unknown spline attribute: %s", name);
+    return nullptr;
+  }
+
+  XPDBlockView view;
+  if (!GetView(self, face, block_id, &view)) {
+    return nullptr;
+  }
+  return MakeAttributeView(self, view, offset, width, xyz);
+} catch (...) {
+  return SetException();
+}
+
+PyObject *FileChannel(PyObject *self, PyObject *args, PyObject *kwargs) try {
+  static const char *kwlist[] = {"name", "face", "block", nullptr};
+  const char *name = nullptr;
+  PyObject *face = Py_None;
+  PyObject *block = nullptr;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|OO",
+                                   const_cast<char **>(kwlist), &name, &face,
+                                   &block)) {
+    return nullptr;
+  }
+
+  uint32_t block_id = 0;
+  if (block && !ResolveBlock(self, block, &block_id)) {
+    return nullptr;
+  }
+
+  XPDChannel channel;
+  if (!File(self).findChannel(File(self).header().block[block_id], name,
+                              &channel)) {
+    PyErr_Format(PyExc_KeyError, "Channel not found: %s", name);
+    return nullptr;
+  }
+
+  XPDBlockView view;
+  if (!GetView(self, face, block_id, &view)) {
+    return nullptr;
+  }
+  return MakeAttributeView(self, view, channel.offset, channel.arity, false);
+} catch (...) {
+  return SetException();
+}
+
+void FreeSoA(PyObject *capsule) {
+  delete reinterpret_cast<XPDSplineSoA *>(
+      PyCapsule_GetPointer(capsule, "tiny_xpd.XPDSplineSoA"));
+}
+
+// Add an array viewing `values`(owned by `capsule`) to `dict`.
+template <typename T>
+bool AddSoAArray(PyObject *dict, PyObject *capsule, const char *name,
+                 const std::vector<T> &values, const int type) {
+  npy_intp dims[1] = {npy_intp(values.size())};
+  static const T empty = T();
+  const T *data = values.empty() ? &empty : values.data();
+  PyObject *array = MakeView(capsule, reinterpret_cast<const uint8_t *>(data),
+                             type, 1, dims, nullptr);
+  if (!array) {
+    return false;
+  }
+  const int ret = PyDict_SetItemString(dict, name, array);
+  Py_DECREF(array);
+  return ret == 0;
+}
+
+PyObject *FileExtractSplineSoA(PyObject *self, PyObject *args,
+                               PyObject *kwargs) try {
+  static const char *kwlist[] = {"block", "num_threads", "matrix", nullptr};
+  PyObject *block = nullptr;
+  unsigned int num_threads = 0;
+  PyObject *matrix = Py_None;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OIO",
+                                   const_cast<char **>(kwlist), &block,
+                                   &num_threads, &matrix)) {
+    return nullptr;
+  }
+
+  uint32_t block_id = 0;
+  if (block && !ResolveBlock(self, block, &block_id)) {
+    return nullptr;
+  }
+
+  XPDSplineSoAOption option;
+  option.numThreads = num_threads;
+  if (matrix != Py_None) {
+    // Row-major 4x4 transform.
+    PyObject *m = PyArray_FROM_OTF(matrix, NPY_FLOAT32,
+                                   NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST);
+    if (!m) {
+      return nullptr;
+    }
+    PyArrayObject *a = reinterpret_cast<PyArrayObject *>(m);
+    if (PyArray_SIZE(a) != 16) {
+      Py_DECREF(m);
+      PyErr_SetString(PyExc_ValueError, "`matrix` must have 16 elements.");
+      return nullptr;
+    }
+    const float *p = reinterpret_cast<const float *>(PyArray_DATA(a));
+    option.transform.matrix.assign(p, p + 16);
+    Py_DECREF(m);
+  }
+
+  // `file` keeps data alive while the GIL is released.
+  std::shared_ptr<const XPDFile> file =
+      reinterpret_cast<PyXPDFile *>(self)->state->file;
+  std::unique_ptr<XPDSplineSoA> soa(new XPDSplineSoA());
+  std::string err;
+  bool ok = false;
+  if (!RunWithoutGIL([&]() {
+        ok = file->extractSplineSoA(block_id, option, soa.get(), &err);
+      })) {
+    return nullptr;
+  }
+  if (!ok) {
+    return SetError(err);
+  }
+
+  PyObject *capsule =
+      PyCapsule_New(soa.get(), "tiny_xpd.XPDSplineSoA", FreeSoA);
+  if (!capsule) {
+    return nullptr;
+  }
+  const XPDSplineSoA &s = *soa.release();
+
+  PyObject *dict = PyDict_New();
+  PyObject *num_curves = PyLong_FromUnsignedLong(s.numCurves);
+  PyObject *num_cvs = PyLong_FromUnsignedLong(s.numCVsPerCurve);
+  bool valid = dict && num_curves && num_cvs &&
+               (PyDict_SetItemString(dict, "num_curves", num_curves) == 0) &&
+               (PyDict_SetItemString(dict, "num_cvs_per_curve", num_cvs) ==
+                0);
+  Py_XDECREF(num_curves);
+  Py_XDECREF(num_cvs);
+
+  const struct {
+    const char *name;
+    const std::vector<float> *values;
+  } floats[] = {{"px", &s.px},
+                {"py", &s.py},
+                {"pz", &s.pz},
+                {"id", &s.id},
+                {"u", &s.u},
+                {"v", &s.v},
+                {"length", &s.length},
+                {"width", &s.width},
+                {"taper", &s.taper},
+                {"taperStart", &s.taperStart},
+                {"widthVectorX", &s.widthVectorX},
+                {"widthVectorY", &s.widthVectorY},
+                {"widthVectorZ", &s.widthVectorZ}};
+  for (size_t i = 0; valid && (i < sizeof(floats) / sizeof(floats[0]));
+       i++) {
+    valid = AddSoAArray(dict, capsule, floats[i].name, *floats[i].values,
+                        NPY_FLOAT32);
+  }
+  valid = valid && AddSoAArray(dict, capsule, "faceCurveOffset",
+                               s.faceCurveOffset, NPY_UINT32) &&
+          AddSoAArray(dict, capsule, "curveCVOffset", s.curveCVOffset,
+                      NPY_UINT32);
+
+  Py_DECREF(capsule);  // Arrays hold references.
+  if (!valid) {
+    Py_XDECREF(dict);
+    return nullptr;
+  }
+  return dict;
+} catch (...) {
+  return SetException();
+}
+
+// METH_KEYWORDS functions take(self, args, kwargs).
+template <typename F>
+PyCFunction KeywordMethod(F f) {
+  return reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)(void)>(f));
+}
+
+PyMethodDef g_file_methods[] = {
+    {"block", KeywordMethod(FileBlock),
+     METH_VARARGS | METH_KEYWORDS,
+     "block(block, face=None)\n\n"
+     "Prim data of `block`(index or name) as a float32 array view "
+     "[numPrims, primSize]. All faces when `face` is None(prim data must be "
+     "contiguous)."},
+    {"attribute", KeywordMethod(FileAttribute),
+     METH_VARARGS | METH_KEYWORDS,
+     "attribute(name, face=None, block=0)\n\n"
+     "Spline attribute view: id, u, v, length, width, taper, taperStart "
+     "[numPrims], cv [numPrims, numCVs, 3] or widthVector [numPrims, 3]."},
+    {"channel", KeywordMethod(FileChannel),
+     METH_VARARGS | METH_KEYWORDS,
+     "channel(name, face=None, block=0)\n\n"
+     "Custom attribute channel view [numPrims] or [numPrims, arity]."},
+    {"extract_spline_soa", KeywordMethod(FileExtractSplineSoA),
+     METH_VARARGS | METH_KEYWORDS,
+     "extract_spline_soa(block=0, num_threads=0, matrix=None)\n\n"
+     "Decode spline data in SoA form in parallel(GIL released). Return a "
+     "dict of arrays(see XPDSplineSoA)."},
+    {nullptr, nullptr, 0, nullptr}};
+
+// ---------------------------------------------
+// Module.
+
+PyObject *Open(PyObject *, PyObject *args) try {
+  const char *filename = nullptr;
+  if (!PyArg_ParseTuple(args, "s", &filename)) {
+    return nullptr;
+  }
+
+  std::shared_ptr<const XPDFile> file;
+  std::string err;
+  bool ok = false;
+  if (!RunWithoutGIL(
+          [&]() { ok = OpenXPDFile(filename, &file, &err); })) {
+    return nullptr;
+  }
+  if (!ok) {
+    return SetError(err);
+  }
+  return CreateFile(file);
+} catch (...) {
+  return SetException();
+}
+
+PyObject *FromBytes(PyObject *, PyObject *args) try {
+  Py_buffer buffer;
+  if (!PyArg_ParseTuple(args, "y*", &buffer)) {
+    return nullptr;
+  }
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(buffer.buf);
+  std::vector<uint8_t> data;
+  try {
+    data.assign(p, p + buffer.len);
+  } catch (...) {
+    PyBuffer_Release(&buffer);
+    throw;
+  }
+  PyBuffer_Release(&buffer);
+
+  std::shared_ptr<const XPDFile> file;
+  std::string err;
+  if (!CreateXPDFileFromMemory(&data, &file, &err)) {
+    return SetError(err);
+  }
+  return CreateFile(file);
+} catch (...) {
+  return SetException();
+}
+
+PyMethodDef g_module_methods[] = {
+    {"open", Open, METH_VARARGS,
+     "open(filename)\n\nOpen and map a XPD file."},
+    {"from_bytes", FromBytes, METH_VARARGS,
+     "from_bytes(data)\n\nCreate a file from XPD data in a bytes-like "
+     "object(copied)."},
+    {nullptr, nullptr, 0, nullptr}};
+
+PyModuleDef g_module = {PyModuleDef_HEAD_INIT,
+                        "tiny_xpd",
+                        "XGen XPD reader with zero-copy NumPy views.",
+                        -1,
+                        g_module_methods,
+                        nullptr,
+                        nullptr,
+                        nullptr,
+                        nullptr};
+
+}  // namespace
+
+PyMODINIT_FUNC PyInit_tiny_xpd(void) {
+  import_array();
+
+  PyXPDFileType.tp_name = "tiny_xpd.XPDFile";
+  PyXPDFileType.tp_basicsize = sizeof(PyXPDFile);
+  PyXPDFileType.tp_dealloc = FileDealloc;
+  PyXPDFileType.tp_as_buffer = &g_file_buffer;
+  PyXPDFileType.tp_flags = Py_TPFLAGS_DEFAULT;
+  PyXPDFileType.tp_doc =
+      "Opened XPD file. Array views keep the file(and its mapping) alive.";
+  PyXPDFileType.tp_methods = g_file_methods;
+  PyXPDFileType.tp_getset = g_file_getset;
+  if (PyType_Ready(&PyXPDFileType) < 0) {
+    return nullptr;
+  }
+
+  PyObject *module = PyModule_Create(&g_module);
+  if (!module) {
+    return nullptr;
+  }
+
+  g_error = PyErr_NewException("tiny_xpd.XPDError", PyExc_RuntimeError,
+                               nullptr);
+  Py_XINCREF(g_error);
+  Py_INCREF(&PyXPDFileType);
+  if (!g_error ||
+      (PyModule_AddObject(module, "XPDError", g_error) < 0) ||
+      (PyModule_AddObject(module, "XPDFile",
+                          reinterpret_cast<PyObject *>(&PyXPDFileType)) <
+       0)) {
+    Py_XDECREF(g_error);
+    Py_DECREF(&PyXPDFileType);
+    Py_DECREF(module);
+    return nullptr;
+  }
+
+  return module;
+}
@@ -0,0 +1,351 @@
+/*
+ * Tests of the C API(tiny_xpd_c.h), linked against libtiny_xpd.so. Run from
+ * this directory(see Makefile):
+ *
+ *   $ make check
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tiny_xpd_c.h"
+
+static int g_failures = 0;
+static const char *g_samples = "../samples";
+
+#define EXPECT(cond)                                                  \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "  %s:%d: EXPECT(%s) failed.\n", __FILE__,      \
+              __LINE__, #cond);                                       \
+      g_failures++;                                                   \
+    }                                                                 \
+  } while (0)
+
+/* Stop the test when `cond` fails. The last error is printed. */
+#define REQUIRE(cond)                                                 \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "  %s:%d: REQUIRE(%s) failed. %s\n", __FILE__,  \
+              __LINE__, #cond, tiny_xpd_last_error());                \
+      g_failures++;                                                   \
+      return;                                                         \
+    }                                                                 \
+  } while (0)
+
+static void SamplePath(const char *name, char *path, size_t size) {
+  snprintf(path, size, "%s/%s", g_samples, name);
+}
+
+/* Read a whole file. Free with free(). */
+static uint8_t *ReadFile(const char *filename, size_t *length) {
+  FILE *fp = fopen(filename, "rb");
+  uint8_t *data = NULL;
+  long size;
+  if (!fp) {
+    return NULL;
+  }
+  if ((fseek(fp, 0, SEEK_END) == 0) && ((size = ftell(fp)) > 0) &&
+      (fseek(fp, 0, SEEK_SET) == 0)) {
+    data = (uint8_t *)malloc((size_t)size);
+    if (data && (fread(data, 1, (size_t)size, fp) != (size_t)size)) {
+      free(data);
+      data = NULL;
+    }
+    *length = (size_t)size;
+  }
+  fclose(fp);
+  return data;
+}
+
+/* Little endian writer of hand made XPD data. */
+typedef struct {
+  uint8_t data[256];
+  size_t size;
+} Buffer;
+
+static void Append(Buffer *buf, const void *data, size_t size) {
+  memcpy(buf->data + buf->size, data, size);
+  buf->size += size;
+}
+
+static void AppendU8(Buffer *buf, uint8_t value) {
+  Append(buf, &value, sizeof(value));
+}
+
+static void AppendU32(Buffer *buf, uint32_t value) {
+  Append(buf, &value, sizeof(value));
+}
+
+static void AppendU64(Buffer *buf, uint64_t value) {
+  Append(buf, &value, sizeof(value));
+}
+
+static void AppendF32(Buffer *buf, float value) {
+  Append(buf, &value, sizeof(value));
+}
+
+/*
+ * Point XPD data with one block("Points", 3 floats per prim) and faces with
+ * {0, 0, 2, 0, 1} prims. Prim i has (i, 10 + i, 20 + i).
+ */
+static void MakeLeadingEmptyFacesXPD(Buffer *buf) {
+  static const uint32_t kNumPrims[5] = {0, 0, 2, 0, 1};
+  /* Offsets of blocks from the end of the header. */
+  static const uint64_t kOffsets[5] = {0, 0, 0, 24, 24};
+  size_t header_size;
+  uint32_t f;
+  int i;
+
+  buf->size = 0;
+  Append(buf, "XPD3", 4);
+  AppendU8(buf, 0);   /* fileVersion */
+  AppendU32(buf, 0);  /* primType(Point) */
+  AppendU8(buf, 3);   /* primVersion */
+  AppendF32(buf, 1.0f);
+  AppendU32(buf, 0);  /* numCVs */
+  AppendU32(buf, 1);  /* coordSpace(Object) */
+  AppendU32(buf, 1);  /* numBlocks */
+  AppendU32(buf, 7);
+  Append(buf, "Points", 7);
+  AppendU32(buf, 3);  /* primSize */
+  AppendU32(buf, 0);  /* numKeys */
+  AppendU32(buf, 0);
+  AppendU32(buf, 5);  /* numFaces */
+  for (f = 0; f < 5; f++) {
+    AppendU32(buf, 100 + f);
+  }
+  for (f = 0; f < 5; f++) {
+    AppendU32(buf, kNumPrims[f]);
+  }
+  header_size = buf->size + 5 * sizeof(uint64_t);
+  for (f = 0; f < 5; f++) {
+    AppendU64(buf, header_size + kOffsets[f]);
+  }
+  for (i = 0; i < 3; i++) {
+    AppendF32(buf, (float)i);
+    AppendF32(buf, (float)(10 + i));
+    AppendF32(buf, (float)(20 + i));
+  }
+}
+
+static void TestOpen(void) {
+  char path[1024];
+  tiny_xpd_file *file = NULL;
+  tiny_xpd_file *memory = NULL;
+  tiny_xpd_header header;
+  tiny_xpd_header memory_header;
+  const uint8_t *data = NULL;
+  uint64_t size = 0;
+  uint8_t *bytes;
+  size_t length = 0;
+
+  EXPECT(tiny_xpd_api_version() == TINY_XPD_C_API_VERSION);
+
+  EXPECT(tiny_xpd_open(NULL, &file) == TINY_XPD_ERROR_INVALID_ARGUMENT);
+  EXPECT(tiny_xpd_open("test_tmp/missing.xpd", &file) == TINY_XPD_ERROR_IO);
+  EXPECT(!file && (tiny_xpd_last_error()[0] != '\0'));
+  EXPECT(tiny_xpd_open("Makefile", &file) == TINY_XPD_ERROR_PARSE);
+  EXPECT(!file);
+
+  SamplePath("sample.xpd", path, sizeof(path));
+  REQUIRE(tiny_xpd_open(path, &file) == TINY_XPD_OK);
+  EXPECT(tiny_xpd_last_error()[0] == '\0');
+  header.struct_size = sizeof(header);
+  EXPECT(tiny_xpd_get_header(file, &header) == TINY_XPD_OK);
+  EXPECT((header.numFaces == 444) && (header.numBlocks == 1));
+  EXPECT(tiny_xpd_get_data(file, &data, &size) == TINY_XPD_OK);
+
+  bytes = ReadFile(path, &length);
+  if (!bytes) {
+    tiny_xpd_release(file);
+    REQUIRE(bytes);
+  }
+  EXPECT((size == length) && (memcmp(data, bytes, length) == 0));
+
+  /* `open_memory` copies data. */
+  EXPECT(tiny_xpd_open_memory(NULL, length, &memory) ==
+         TINY_XPD_ERROR_INVALID_ARGUMENT);
+  EXPECT(tiny_xpd_open_memory(bytes, length, &memory) == TINY_XPD_OK);
+  free(bytes);
+  if (memory) {
+    memory_header.struct_size = sizeof(memory_header);
+    EXPECT(tiny_xpd_get_header(memory, &memory_header) == TINY_XPD_OK);
+    EXPECT(memcmp(&memory_header, &header, sizeof(header)) == 0);
+    EXPECT(tiny_xpd_get_data(memory, &data, &size) == TINY_XPD_OK);
+    EXPECT((size == length) && (memcmp(data, "XPD3", 4) == 0));
+    tiny_xpd_release(memory);
+  }
+
+  /* A retained handle outlives the first release. */
+  tiny_xpd_retain(file);
+  tiny_xpd_release(file);
+  EXPECT(tiny_xpd_get_header(file, &header) == TINY_XPD_OK);
+  tiny_xpd_release(file);
+}
+
+static void TestStructSize(void) {
+  char path[1024];
+  tiny_xpd_file *file = NULL;
+  tiny_xpd_header header;
+  tiny_xpd_block_view view;
+  tiny_xpd_spline_layout layout;
+
+  SamplePath("sample.xpd", path, sizeof(path));
+  REQUIRE(tiny_xpd_open(path, &file) == TINY_XPD_OK);
+
+  /* Structs smaller than API version 2 ones are rejected, and not written. */
+  memset(&header, 0xab, sizeof(header));
+  header.struct_size = sizeof(header) - sizeof(uint32_t);
+  EXPECT(tiny_xpd_get_header(file, &header) ==
+         TINY_XPD_ERROR_INVALID_ARGUMENT);
+  EXPECT(tiny_xpd_last_error()[0] != '\0');
+  EXPECT(header.fileVersion == 0xababababu);
+
+  view.struct_size = sizeof(uint32_t);
+  EXPECT(tiny_xpd_get_block_view(file, 0, 0, &view) ==
+         TINY_XPD_ERROR_INVALID_ARGUMENT);
+  layout.struct_size = 0;
+  EXPECT(tiny_xpd_get_spline_layout(file, 0, &layout) ==
+         TINY_XPD_ERROR_INVALID_ARGUMENT);
+
+  header.struct_size = sizeof(header);
+  EXPECT(tiny_xpd_get_header(file, &header) == TINY_XPD_OK);
+  EXPECT(header.struct_size == sizeof(header));
+  tiny_xpd_release(file);
+}
+
+static void TestBlockRangeLeadingEmptyFaces(void) {
+  Buffer buf;
+  tiny_xpd_file *file = NULL;
+  tiny_xpd_block_view view;
+  const uint8_t *data = NULL;
+  uint64_t size = 0;
+  float value;
+
+  MakeLeadingEmptyFacesXPD(&buf);
+  REQUIRE(tiny_xpd_open_memory(buf.data, buf.size, &file) == TINY_XPD_OK);
+  REQUIRE(tiny_xpd_get_data(file, &data, &size) == TINY_XPD_OK);
+
+  view.struct_size = sizeof(view);
+  EXPECT(tiny_xpd_get_block_range(file, 0, &view) == TINY_XPD_OK);
+  EXPECT(view.numPrims == 3);
+  EXPECT((view.primSize == 3) && (view.stride == 12));
+  /* Starts at the first prim of face 2. */
+  EXPECT(view.data == data + size - 36);
+  memcpy(&value, view.data + 2 * view.stride + sizeof(float), sizeof(float));
+  EXPECT(value == 12.0f);
+
+  EXPECT(tiny_xpd_get_block_view(file, 0, 0, &view) == TINY_XPD_OK);
+  EXPECT(view.numPrims == 0);
+  EXPECT(tiny_xpd_get_block_range(file, 1, &view) ==
+         TINY_XPD_ERROR_OUT_OF_RANGE);
+  tiny_xpd_release(file);
+}
+
+static void TestSoAArrays(void) {
+  char path[1024];
+  tiny_xpd_file *file = NULL;
+  tiny_xpd_soa *soa = NULL;
+  tiny_xpd_header header;
+  tiny_xpd_block_view view;
+  tiny_xpd_spline_layout layout;
+  const uint32_t *num_prims = NULL;
+  const void *array = NULL;
+  const float *px;
+  const uint32_t *face_curve_offset;
+  uint32_t num_curves = 0, num_cvs = 0, total = 0, f;
+  uint64_t count = 0;
+  float x;
+  int a;
+
+  SamplePath("sample.xpd", path, sizeof(path));
+  REQUIRE(tiny_xpd_open(path, &file) == TINY_XPD_OK);
+  header.struct_size = sizeof(header);
+  layout.struct_size = sizeof(layout);
+  view.struct_size = sizeof(view);
+  if ((tiny_xpd_get_header(file, &header) != TINY_XPD_OK) ||
+      (tiny_xpd_get_num_prims(file, &num_prims) != TINY_XPD_OK) ||
+      (tiny_xpd_get_spline_layout(file, 0, &layout) != TINY_XPD_OK) ||
+      (tiny_xpd_extract_spline_soa(file, 0, 2, NULL, NULL, &soa) !=
+       TINY_XPD_OK)) {
+    tiny_xpd_release(file);
+    REQUIRE(0);
+  }
+  for (f = 0; f < header.numFaces; f++) {
+    total += num_prims[f];
+  }
+
+  EXPECT(tiny_xpd_soa_get_counts(soa, &num_curves, &num_cvs) == TINY_XPD_OK);
+  EXPECT((num_curves == total) && (num_cvs == layout.numCVs));
+
+  /* Float arrays have one value per curve, or per CV for positions. */
+  for (a = 0; a < TINY_XPD_SOA_FACE_CURVE_OFFSET; a++) {
+    const uint64_t expected =
+        (a <= TINY_XPD_SOA_PZ) ? (uint64_t)total * num_cvs : total;
+    EXPECT(tiny_xpd_soa_get_array(soa, (tiny_xpd_soa_array)a, &array,
+                                  &count) == TINY_XPD_OK);
+    EXPECT((count == expected) && array);
+  }
+
+  /* The first CV of the first curve of face 0. */
+  EXPECT(tiny_xpd_soa_get_array(soa, TINY_XPD_SOA_PX, &array, &count) ==
+         TINY_XPD_OK);
+  px = (const float *)array;
+  EXPECT(tiny_xpd_get_block_view(file, 0, 0, &view) == TINY_XPD_OK);
+  memcpy(&x, view.data + layout.cv * sizeof(float), sizeof(float));
+  EXPECT(px && (px[0] == x));
+
+  EXPECT(tiny_xpd_soa_get_array(soa, TINY_XPD_SOA_FACE_CURVE_OFFSET, &array,
+                                &count) == TINY_XPD_OK);
+  face_curve_offset = (const uint32_t *)array;
+  EXPECT(count == (uint64_t)header.numFaces + 1);
+  EXPECT(face_curve_offset && (face_curve_offset[0] == 0) &&
+         (face_curve_offset[header.numFaces] == total));
+
+  /* No curveCVOffset for fixed CV count splines. */
+  EXPECT(tiny_xpd_soa_get_array(soa, TINY_XPD_SOA_CURVE_CV_OFFSET, &array,
+                                &count) == TINY_XPD_OK);
+  EXPECT(count == 0);
+  EXPECT(tiny_xpd_soa_get_array(soa, TINY_XPD_SOA_NUM_ARRAYS, &array,
+                                &count) == TINY_XPD_ERROR_OUT_OF_RANGE);
+
+  tiny_xpd_soa_free(soa);
+  tiny_xpd_release(file);
+}
+
+typedef struct {
+  const char *name;
+  void (*func)(void);
+} TestCase;
+
+static const TestCase kTests[] = {
+    {"c_open", TestOpen},
+    {"c_struct_size", TestStructSize},
+    {"c_block_range_leading_empty_faces", TestBlockRangeLeadingEmptyFaces},
+    {"c_soa_arrays", TestSoAArrays},
+};
+
+int main(int argc, char **argv) {
+  /* c_api_test [filter] [samples dir] */
+  const char *filter = (argc > 1) ? argv[1] : NULL;
+  int num_run = 0;
+  size_t i;
+  if (argc > 2) {
+    g_samples = argv[2];
+  }
+
+  for (i = 0; i < sizeof(kTests) / sizeof(kTests[0]); i++) {
+    int failures = g_failures;
+    if (filter && !strstr(kTests[i].name, filter)) {
+      continue;
+    }
+    kTests[i].func();
+    printf("[%s] %s\n", (g_failures == failures) ? " OK " : "FAIL",
+           kTests[i].name);
+    num_run++;
+  }
+
+  printf("%d tests, %d failures.\n", num_run, g_failures);
+  return (g_failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,1972 @@
+//
+// Regression tests of tiny_xpd. Run from this directory(see Makefile):
+//
+//   $ make check
+//
+// Temporary files are written to `test_tmp/`.
+//
+#define TINY_XPD_IMPLEMENTATION
+#include "tiny_xpd.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace tiny_xpd;
+
+static int g_failures = 0;
+static std::string g_samples = "../samples";
+static std::string g_tmpdir = "test_tmp";
+
+#define EXPECT(cond)                                                  \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "  %s:%d: EXPECT(%s) failed.\n", __FILE__,      \
+              __LINE__, #cond);                                       \
+      g_failures++;                                                   \
+    }                                                                 \
+  } while (0)
+
+// Stop the test when `cond` fails. `err` is printed.
+#define REQUIRE(cond)                                                 \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "  %s:%d: REQUIRE(%s) failed. %s\n", __FILE__,  \
+              __LINE__, #cond, err.c_str());                          \
+      g_failures++;                                                   \
+      return;                                                         \
+    }                                                                 \
+  } while (0)
+
+static std::string SamplePath(const std::string &name) {
+  return g_samples + "/" + name;
+}
+
+static std::string TempPath(const std::string &name) {
+  return g_tmpdir + "/" + name;
+}
+
+//
+// Spline XPD with `num_faces` faces, `num_prims + face % 3` prims per face
+// and `num_cvs` CVs. Adds a `color`[3] channel when `with_channel` is true.
+// CV = (face, cv, prim) and channel = (face, prim, 7).
+//
+static bool MakeSplineXPD(const uint32_t num_faces, const uint32_t num_prims,
+                          const uint32_t num_cvs, const bool with_channel,
+                          std::vector<uint8_t> *out, std::string *err) {
+  XPDHeaderInput input;
+  input.primType = Xpd::PrimType::Spline;
+  input.primVersion = 3;
+  input.numCVs = num_cvs;
+  input.numFaces = num_faces;
+  input.numBlocks = 1;
+  input.block.push_back("Groom");
+  input.primSize.push_back(10 + 3 * num_cvs);
+
+  uint32_t color_offset = 0;
+  if (with_channel &&
+      !AddChannel(&input, "Groom", "color", 3, &color_offset, err)) {
+    return false;
+  }
+
+  std::vector<float> data;
+  for (uint32_t f = 0; f < num_faces; f++) {
+    const uint32_t n = num_prims + f % 3;
+    input.faceid.push_back(int(f * 2));
+    input.numPrims.push_back(n);
+    input.blockOffset.push_back(data.size() * sizeof(float));
+    for (uint32_t p = 0; p < n; p++) {
+      data.push_back(float(p));  // id
+      data.push_back(0.25f);     // u
+      data.push_back(0.5f);      // v
+      for (uint32_t c = 0; c < num_cvs; c++) {
+        data.push_back(float(f));
+        data.push_back(float(c));
+        data.push_back(float(p));
+      }
+      data.push_back(float(num_cvs - 1));  // length
+      data.push_back(0.1f);                // width
+      data.push_back(1.0f);                // taper
+      data.push_back(0.0f);                // taper start
+      data.push_back(1.0f);                // width vector
+      data.push_back(0.0f);
+      data.push_back(0.0f);
+      if (with_channel) {
+        data.push_back(float(f));
+        data.push_back(float(p));
+        data.push_back(7.0f);
+      }
+    }
+  }
+
+  std::vector<uint8_t> prim_data(data.size() * sizeof(float));
+  if (!data.empty()) {
+    memcpy(prim_data.data(), data.data(), prim_data.size());
+  }
+  return SerializeToXPD(input, prim_data, out, err);
+}
+
+//
+// `MakeSplineXPD` with the `color` channel and a second block `Extra`
+// holding (face, prim) of each prim.
+//
+static bool MakeTwoBlockSplineXPD(const uint32_t num_faces,
+                                  const uint32_t num_prims,
+                                  const uint32_t num_cvs,
+                                  std::vector<uint8_t> *out,
+                                  std::string *err) {
+  std::vector<uint8_t> data;
+  XPDHeader xpd;
+  if (!MakeSplineXPD(num_faces, num_prims, num_cvs, true, &data, err) ||
+      !ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, err)) {
+    return false;
+  }
+
+  XPDHeaderInput input;
+  input.primType = xpd.primType;
+  input.primVersion = xpd.primVersion;
+  input.numCVs = xpd.numCVs;
+  input.numFaces = xpd.numFaces;
+  input.numBlocks = 2;
+  input.block = xpd.block;
+  input.block.push_back("Extra");
+  input.primSize = xpd.primSize;
+  input.primSize.push_back(2);
+  input.key = xpd.key;
+  input.keyToId = xpd.keyToId;
+  input.faceid = xpd.faceid;
+  input.numPrims = xpd.numPrims;
+
+  std::vector<uint8_t> prim_data;
+  for (uint32_t f = 0; f < num_faces; f++) {
+    XPDBlockView view;
+    if (!GetBlockView(xpd, data.data(), data.size(), f, 0, &view, err)) {
+      return false;
+    }
+    input.blockOffset.push_back(prim_data.size());
+    prim_data.insert(prim_data.end(), view.data,
+                     view.data + view.numPrims * view.stride());
+    input.blockOffset.push_back(prim_data.size());
+    for (size_t p = 0; p < view.numPrims; p++) {
+      const float extra[2] = {float(f), float(p)};
+      const uint8_t *bytes = reinterpret_cast<const uint8_t *>(extra);
+      prim_data.insert(prim_data.end(), bytes, bytes + sizeof(extra));
+    }
+  }
+  return SerializeToXPD(input, prim_data, out, err);
+}
+
+static bool ReadFile(const std::string &filename, std::vector<uint8_t> *data) {
+  std::ifstream ifs(filename.c_str(), std::ios::binary);
+  if (!ifs) {
+    return false;
+  }
+  data->assign(std::istreambuf_iterator<char>(ifs),
+               std::istreambuf_iterator<char>());
+  return true;
+}
+
+// Sum of all prim data of a face.
+static double FaceSum(const XPDFile &file, const uint32_t face) {
+  double sum = 0.0;
+  for (uint32_t b = 0; b < file.header().numBlocks; b++) {
+    XPDBlockView view;
+    std::string err;
+    if (!file.blockView(face, b, &view, &err)) {
+      return -1.0;
+    }
+    for (size_t p = 0; p < view.numPrims; p++) {
+      for (uint32_t i = 0; i < view.primSize; i++) {
+        sum += double(view.get(p, i));
+      }
+    }
+  }
+  return sum;
+}
+
+// (faceid, prim values) of all prims of a block, sorted.
+static std::vector<std::pair<int, std::vector<float> > > CollectPrims(
+    const XPDHeader &xpd, const std::vector<uint8_t> &data,
+    const uint32_t block_id) {
+  std::vector<std::pair<int, std::vector<float> > > prims;
+  for (uint32_t f = 0; f < xpd.numFaces; f++) {
+    XPDBlockView view;
+    std::string err;
+    if (!GetBlockView(xpd, data.data(), data.size(), f, block_id, &view,
+                      &err)) {
+      prims.clear();
+      return prims;
+    }
+    for (size_t p = 0; p < view.numPrims; p++) {
+      std::vector<float> values;
+      for (uint32_t i = 0; i < view.primSize; i++) {
+        values.push_back(view.get(p, i));
+      }
+      prims.push_back(std::make_pair(xpd.faceid[f], values));
+    }
+  }
+  std::sort(prims.begin(), prims.end());
+  return prims;
+}
+
+static bool ExtractSoA(const std::vector<uint8_t> &data, XPDSplineSoA *soa,
+                       std::string *err) {
+  XPDHeader xpd;
+  return ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, err) &&
+         ExtractSplineSoA(xpd, data.data(), data.size(), 0,
+                          XPDSplineSoAOption(), soa, err);
+}
+
+// ---------------------------------------------
+
+static void TestChannels() {
+  std::string err;
+  XPDHeaderInput input;
+  input.numFaces = 3;
+  input.numBlocks = 2;
+  input.block.push_back("Groom");
+  input.block.push_back("Extra");
+  input.primSize.push_back(4);
+  input.primSize.push_back(2);
+  input.key.push_back("plain");  // Not a channel.
+  input.keyToId["plain"] = 0;
+
+  uint32_t color_offset = 0, clump_offset = 0, mask_offset = 0;
+  REQUIRE(AddChannel(&input, "Groom", "color", 3, &color_offset, &err));
+  REQUIRE(AddChannel(&input, "Extra", "mask", 1, &mask_offset, &err));
+  REQUIRE(AddChannel(&input, "Groom", "clump", 1, &clump_offset, &err));
+  EXPECT(color_offset == 4);
+  EXPECT(clump_offset == 7);
+  EXPECT(mask_offset == 2);
+  EXPECT(input.primSize[0] == 8);
+  EXPECT(input.primSize[1] == 3);
+  std::string e;
+  EXPECT(!AddChannel(&input, "Groom", "color", 1, nullptr, &e));
+  EXPECT(!AddChannel(&input, "Missing", "color", 1, nullptr, &e));
+  EXPECT(!AddChannel(&input, "Groom", "zero", 0, nullptr, &e));
+
+  // Prim value = face * 100 + block * 10 + prim + component / 10.
+  std::vector<float> values;
+  for (uint32_t f = 0; f < input.numFaces; f++) {
+    input.faceid.push_back(int(f));
+    input.numPrims.push_back(f + 1);
+    for (uint32_t b = 0; b < input.numBlocks; b++) {
+      input.blockOffset.push_back(values.size() * sizeof(float));
+      for (uint32_t p = 0; p <= f; p++) {
+        for (uint32_t i = 0; i < input.primSize[b]; i++) {
+          values.push_back(float(f * 100 + b * 10 + p) + 0.1f * float(i));
+        }
+      }
+    }
+  }
+  std::vector<uint8_t> prim_data(values.size() * sizeof(float));
+  memcpy(prim_data.data(), values.data(), prim_data.size());
+  std::vector<uint8_t> data;
+  REQUIRE(SerializeToXPD(input, prim_data, &data, &err));
+  XPDHeader xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, &err));
+
+  std::vector<XPDChannel> channels;
+  REQUIRE(GetChannels(xpd, &channels, &err));
+  REQUIRE(channels.size() == 3);
+  EXPECT(channels[0].name == "color" && channels[0].blockId == 0 &&
+         channels[0].keyId == 1 && channels[0].offset == 4 &&
+         channels[0].arity == 3);
+  EXPECT(channels[1].name == "mask" && channels[1].blockId == 1 &&
+         channels[1].offset == 2 && channels[1].arity == 1);
+  EXPECT(channels[2].name == "clump" && channels[2].blockId == 0 &&
+         channels[2].offset == 7 && channels[2].arity == 1);
+
+  XPDChannel color;
+  REQUIRE(FindChannel(xpd, "Groom", "color", &color));
+  EXPECT(color.offset == channels[0].offset);
+  XPDChannel missing;
+  EXPECT(!FindChannel(xpd, "Extra", "color", &missing));
+  EXPECT(!FindChannel(xpd, "Missing", "color", &missing));
+  XPDChannel mask;
+  REQUIRE(FindChannel(xpd, "Extra", "mask", &mask));
+
+  for (uint32_t f = 0; f < xpd.numFaces; f++) {
+    XPDChannelView view;
+    REQUIRE(GetChannelView(xpd, data.data(), data.size(), f, color, &view,
+                           &err));
+    EXPECT(view.numPrims == f + 1);
+    EXPECT(view.arity == 3);
+    EXPECT(view.stride == 8 * sizeof(float));
+    for (uint32_t p = 0; p <= f; p++) {
+      float rgb[3];
+      view.copy(p, rgb);
+      for (uint32_t c = 0; c < 3; c++) {
+        const float expected = float(f * 100 + p) + 0.1f * float(4 + c);
+        EXPECT(view.get(p, c) == expected);
+        EXPECT(rgb[c] == expected);
+      }
+    }
+
+    REQUIRE(GetChannelView(xpd, data.data(), data.size(), f, mask, &view,
+                           &err));
+    EXPECT(view.stride == 3 * sizeof(float));
+    for (uint32_t p = 0; p <= f; p++) {
+      EXPECT(view.get(p) == float(f * 100 + 10 + p) + 0.1f * float(2));
+    }
+  }
+
+  // A channel past the end of the prim is rejected.
+  XPDChannel bad = color;
+  bad.offset = 6;
+  XPDChannelView view;
+  EXPECT(!GetChannelView(xpd, data.data(), data.size(), 0, bad, &view, &e));
+}
+
+static void TestCompactHeaderDuplicatedNames() {
+  std::string err;
+  XPDHeaderInput input;
+  input.numFaces = 1;
+  input.numBlocks = 6;
+  const char *names[] = {"b", "a", "c", "a", "b", "a"};
+  for (uint32_t i = 0; i < input.numBlocks; i++) {
+    input.block.push_back(names[i]);
+    input.primSize.push_back(1);
+    input.blockOffset.push_back(i * sizeof(float));
+  }
+  input.faceid.push_back(0);
+  input.numPrims.push_back(1);
+  std::vector<uint8_t> prim_data(input.numBlocks * sizeof(float));
+  std::vector<uint8_t> data;
+  REQUIRE(SerializeToXPD(input, prim_data, &data, &err));
+
+  XPDCompactHeader compact;
+  REQUIRE(ParseXPDCompactHeaderFromMemory(data.data(), data.size(), &compact,
+                                          &err));
+  EXPECT(compact.findBlock("a") == 1);
+  EXPECT(compact.findBlock("b") == 0);
+  EXPECT(compact.findBlock("c") == 2);
+  EXPECT(compact.findBlock("d") == -1);
+
+  XPDHeader xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, &err));
+  EXPECT(xpd.findBlock("a") == 1);
+  EXPECT(xpd.findBlock("b") == 0);
+
+  // Edited names are found after `rebuildNameTables()`.
+  xpd.block[1] = "d";
+  xpd.block[2] = "a";
+  xpd.block[3] = "e";
+  xpd.block[5] = "e";
+  xpd.rebuildNameTables();
+  EXPECT(xpd.findBlock("a") == 2);
+  EXPECT(xpd.findBlock("d") == 1);
+  EXPECT(xpd.findBlock("e") == 3);
+  EXPECT(xpd.findBlock("c") == -1);
+
+  // A stale index never resolves to an out of range name.
+  xpd.block.push_back("f");
+  EXPECT(xpd.findBlock("f") == -1);
+  EXPECT(xpd.findBlock("a") == -1);
+  xpd.rebuildNameTables();
+  EXPECT(xpd.findBlock("f") == 6);
+}
+
+static bool WriteFile(const std::string &filename,
+                      const std::vector<uint8_t> &data) {
+  std::ofstream ofs(filename.c_str(), std::ios::binary);
+  ofs.write(reinterpret_cast<const char *>(data.data()),
+            std::streamsize(data.size()));
+  return bool(ofs);
+}
+
+// Patch `numFaces` of XPD data(a corrupt header).
+static void SetNumFaces(std::vector<uint8_t> *data, const uint32_t num_faces) {
+  uint32_t num_blocks, block_size, key_size;
+  memcpy(&num_blocks, data->data() + 22, sizeof(uint32_t));
+  memcpy(&block_size, data->data() + 26, sizeof(uint32_t));
+  const size_t key_offset = 30 + block_size + 4 * size_t(num_blocks);
+  memcpy(&key_size, data->data() + key_offset + 4, sizeof(uint32_t));
+  memcpy(data->data() + key_offset + 8 + key_size, &num_faces,
+         sizeof(uint32_t));
+}
+
+static void TestBatchOpenRejectsOversizedHeader() {
+  std::string err;
+  std::vector<uint8_t> data;
+  REQUIRE(ReadFile(SamplePath("sample.xpd"), &data));
+  SetNumFaces(&data, 0x7fffffffu);  // ~52GB of face tables.
+  const std::string filename = TempPath("huge_header.xpd");
+  REQUIRE(WriteFile(filename, data));
+
+  std::vector<std::string> filenames;
+  filenames.push_back(filename);
+  filenames.push_back(SamplePath("sample.xpd"));
+  for (int uring = 0; uring < 2; uring++) {
+    XPDBatchOpenOption option;
+    option.useIOUring = (uring == 1);
+    option.numThreads = 2;
+    std::vector<XPDBatchOpenResult> results;
+    std::string e;
+    EXPECT(!BatchOpenXPDFiles(filenames, option, &results, &e));
+    REQUIRE(results.size() == 2);
+    EXPECT(!results[0].ok);
+    EXPECT(results[0].err.find("exceeds the file size") != std::string::npos);
+    EXPECT(results[1].ok);
+    EXPECT(results[1].header.numFaces == 444);
+  }
+}
+
+static void TestPartialReaderRejectsCorruptCounts() {
+  std::string err;
+  std::vector<uint8_t> data;
+  REQUIRE(ReadFile(SamplePath("sample.xpd"), &data));
+
+  const XPDReadCallback read = [&data](uint64_t offset, size_t n,
+                                       uint8_t *dst) {
+    if ((offset > data.size()) || (n > data.size() - offset)) {
+      return false;
+    }
+    memcpy(dst, data.data() + offset, n);
+    return true;
+  };
+
+  // Huge face tables.
+  std::vector<uint8_t> original = data;
+  SetNumFaces(&data, 0x7fffffffu);
+  XPDPartialReader reader;
+  std::string e;
+  EXPECT(!reader.open(read, uint64_t(data.size()), &e));
+  EXPECT(e.find("exceeds the data size") != std::string::npos);
+  e.clear();
+  EXPECT(!reader.open(read, &e) && !e.empty());
+
+  // Huge prim count of a face.
+  data = original;
+  XPDHeader xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, &err));
+  REQUIRE(reader.open(read, &err));
+  const size_t num_prims_offset =
+      size_t(reader.headerSize()) -
+      xpd.numFaces * (sizeof(uint32_t) + sizeof(uint64_t) * xpd.numBlocks);
+  const uint32_t huge = 0x7fffffffu;
+  memcpy(data.data() + num_prims_offset, &huge, sizeof(uint32_t));
+  for (int known = 0; known < 2; known++) {
+    if (known) {
+      REQUIRE(reader.open(read, uint64_t(data.size()), &err));
+    } else {
+      REQUIRE(reader.open(read, &err));
+    }
+    REQUIRE(reader.header().numPrims[0] == huge);
+    std::shared_ptr<const XPDFaceData> face;
+    e.clear();
+    EXPECT(!reader.readFace(0, &face, &e) && !e.empty());
+    EXPECT(reader.readFace(1, &face, &err));
+  }
+}
+
+// Parse `io` and compare the header and prim data with `ref`.
+static bool CheckIO(XPDIO *io, const XPDHeader &ref,
+                    const std::vector<uint8_t> &ref_data) {
+  XPDHeader xpd;
+  std::string err;
+  if ((io->size() != ref_data.size()) ||
+      !ParseXPDFromIO(io, &xpd, &err) || (xpd.block != ref.block) ||
+      (xpd.primSize != ref.primSize) || (xpd.faceid != ref.faceid) ||
+      (xpd.numPrims != ref.numPrims) ||
+      (xpd.blockPosition != ref.blockPosition)) {
+    return false;
+  }
+  std::vector<uint8_t> data(ref_data.size());
+  if (!io->readAt(0, data.size(), data.data(), &err) || (data != ref_data)) {
+    return false;
+  }
+  if (io->map() &&
+      (memcmp(io->map(), ref_data.data(), ref_data.size()) != 0)) {
+    return false;
+  }
+  // Reading past the end fails.
+  uint8_t byte;
+  return !io->readAt(ref_data.size(), 1, &byte, &err);
+}
+
+static void TestIOBackends() {
+  std::string err;
+  XPDHeaderInput input;
+  input.numFaces = 9;
+  input.numBlocks = 2;
+  input.block.push_back("A");
+  input.block.push_back("B");
+  input.primSize.push_back(5);
+  input.primSize.push_back(2);
+  std::vector<float> values;
+  for (uint32_t f = 0; f < input.numFaces; f++) {
+    input.faceid.push_back(int(f + 10));
+    input.numPrims.push_back(f % 4);
+    for (uint32_t b = 0; b < input.numBlocks; b++) {
+      input.blockOffset.push_back(values.size() * sizeof(float));
+      for (uint32_t i = 0; i < input.numPrims[f] * input.primSize[b]; i++) {
+        values.push_back(float(f * 100 + b * 10 + i));
+      }
+    }
+  }
+  std::vector<uint8_t> prim_data(values.size() * sizeof(float));
+  memcpy(prim_data.data(), values.data(), prim_data.size());
+
+  std::vector<uint8_t> ref;
+  XPDHeaderInput ref_input = input;
+  REQUIRE(SerializeToXPD(ref_input, prim_data, &ref, &err));
+  XPDHeader ref_xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(ref.data(), ref.size(), &ref_xpd, &err));
+
+  // Same values encoded per face for the parallel serializer.
+  const XPDEncodeBlockCallback encode = [&input, &prim_data](
+      uint32_t f, uint32_t b, uint8_t *dst, std::string *) {
+    const size_t n = input.numPrims[f] * input.primSize[b] * sizeof(float);
+    if (n > 0) {
+      memcpy(dst, prim_data.data() + input.blockOffset[f * 2 + b], n);
+    }
+    return true;
+  };
+  XPDParallelSerializeOption option;
+  option.numThreads = 3;
+
+  const std::string filename = TempPath("io.xpd");
+  for (int parallel = 0; parallel < 2; parallel++) {
+    XPDHeaderInput a = input, b = input, c = input;
+
+    // Writable memory.
+    XPDMemoryIO memory;
+    if (parallel) {
+      REQUIRE(SerializeToXPDParallel(a, encode, option, &memory, &err));
+    } else {
+      REQUIRE(SerializeToXPD(a, prim_data, &memory, &err));
+    }
+    EXPECT(memory.buffer() == ref);
+    EXPECT(CheckIO(&memory, ref_xpd, ref));
+
+    // Object store.
+    XPDFakeObjectStoreIO store;
+    if (parallel) {
+      REQUIRE(SerializeToXPDParallel(b, encode, option, &store, &err));
+    } else {
+      REQUIRE(SerializeToXPD(b, prim_data, &store, &err));
+    }
+    EXPECT(store.object() == ref);
+    EXPECT(store.numRequests() > 0);
+    EXPECT(CheckIO(&store, ref_xpd, ref));
+
+    // File, read back with pread and mmap.
+    {
+      XPDFileIO file;
+      REQUIRE(file.open(filename, true, &err));
+      if (parallel) {
+        REQUIRE(SerializeToXPDParallel(c, encode, option, &file, &err));
+      } else {
+        REQUIRE(SerializeToXPD(c, prim_data, &file, &err));
+      }
+    }
+    std::vector<uint8_t> file_data;
+    REQUIRE(ReadFile(filename, &file_data));
+    EXPECT(file_data == ref);
+    XPDFileIO file;
+    REQUIRE(file.open(filename, false, &err));
+    EXPECT(CheckIO(&file, ref_xpd, ref));
+    XPDMmapIO mmap_io;
+    REQUIRE(mmap_io.open(filename, &err));
+    EXPECT(CheckIO(&mmap_io, ref_xpd, ref));
+  }
+
+  // External memory is read-only.
+  XPDMemoryIO external(ref.data(), ref.size());
+  EXPECT(CheckIO(&external, ref_xpd, ref));
+  XPDHeaderInput d = input;
+  std::string e;
+  EXPECT(!SerializeToXPD(d, prim_data, &external, &e));
+}
+
+// Overwrite float `i` of `prim` in block 0 of `face`.
+static bool SetPrimFloat(const XPDHeader &xpd, const uint32_t face,
+                         const size_t prim, const uint32_t i, const float value,
+                         std::vector<uint8_t> *data) {
+  XPDBlockView view;
+  std::string err;
+  if (!GetBlockView(xpd, data->data(), data->size(), face, 0, &view, &err) ||
+      (prim >= view.numPrims) || (i >= view.primSize)) {
+    return false;
+  }
+  const size_t offset = size_t(view.data - data->data()) +
+                        prim * view.stride() + i * sizeof(float);
+  memcpy(data->data() + offset, &value, sizeof(float));
+  return true;
+}
+
+static void TestCurveBuffers() {
+  std::string err;
+  const uint32_t num_cvs = 5;
+  std::vector<uint8_t> data;
+  REQUIRE(MakeSplineXPD(4, 2, num_cvs, true, &data, &err));
+  XPDHeader xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, &err));
+  XPDSplineLayout layout;
+  REQUIRE(GetSplineLayout(xpd, 0, &layout, &err));
+
+  // Taper of prim 1 of face 2 starts at 0.2.
+  REQUIRE(SetPrimFloat(xpd, 2, 1, layout.width, 0.3f, &data));
+  REQUIRE(SetPrimFloat(xpd, 2, 1, layout.taper, 0.9f, &data));
+  REQUIRE(SetPrimFloat(xpd, 2, 1, layout.taperStart, 0.2f, &data));
+
+  const XPDCurveBufferOption::SegmentType types[] = {
+      XPDCurveBufferOption::Linear, XPDCurveBufferOption::Cubic};
+  for (size_t k = 0; k < 2; k++) {
+    XPDCurveBufferOption option;
+    option.segmentType = types[k];
+    option.numThreads = 2;
+    XPDCurveBuffers buffers;
+    REQUIRE(ExtractCurveBuffers(xpd, data.data(), data.size(), 0, option,
+                                &buffers, &err));
+    const uint32_t num_segments = (k == 0) ? (num_cvs - 1) : (num_cvs - 3);
+    REQUIRE(buffers.numCVsPerCurve == num_cvs);
+    REQUIRE(buffers.cvs.size() == buffers.numCurves * num_cvs * 4);
+    REQUIRE(buffers.curveFirstCV.size() == buffers.numCurves);
+    REQUIRE(buffers.segmentIndices.size() == buffers.numCurves * num_segments);
+
+    uint32_t curve = 0;
+    for (uint32_t f = 0; f < xpd.numFaces; f++) {
+      for (uint32_t p = 0; p < xpd.numPrims[f]; p++, curve++) {
+        EXPECT(buffers.curveFirstCV[curve] == curve * num_cvs);
+        for (uint32_t s = 0; s < num_segments; s++) {
+          EXPECT(buffers.segmentIndices[curve * num_segments + s] ==
+                 curve * num_cvs + s);
+        }
+        const bool tapered = (f == 2) && (p == 1);
+        for (uint32_t c = 0; c < num_cvs; c++) {
+          const float *cv = &buffers.cvs[(curve * num_cvs + c) * 4];
+          EXPECT(cv[0] == float(f));
+          EXPECT(cv[1] == float(c));
+          EXPECT(cv[2] == float(p));
+          const float t = float(c) / float(num_cvs - 1);
+          const float radius = tapered ? XPDSplineRadius(0.3f, 0.9f, 0.2f, t)
+                                       : XPDSplineRadius(0.1f, 1.0f, 0.0f, t);
+          EXPECT(cv[3] == radius);
+        }
+        if (tapered) {
+          // Untapered at the root, 1 - 0.9 of the width at the tip.
+          EXPECT(buffers.cvs[curve * num_cvs * 4 + 3] == 0.15f);
+          EXPECT(std::fabs(buffers.cvs[(curve * num_cvs + 4) * 4 + 3] -
+                           0.015f) < 1e-6f);
+        }
+      }
+    }
+    EXPECT(curve == buffers.numCurves);
+
+    // Resampling to the same CV count by parameter gives identical radii.
+    XPDCurveBufferOption same = option;
+    same.resampleCVs = num_cvs;
+    XPDCurveBuffers resampled;
+    REQUIRE(ExtractCurveBuffers(xpd, data.data(), data.size(), 0, same,
+                                &resampled, &err));
+    REQUIRE(resampled.cvs.size() == buffers.cvs.size());
+    for (size_t i = 3; i < buffers.cvs.size(); i += 4) {
+      EXPECT(memcmp(&resampled.cvs[i], &buffers.cvs[i], sizeof(float)) == 0);
+    }
+    EXPECT(resampled.segmentIndices == buffers.segmentIndices);
+  }
+
+  // Too few CVs for cubic segments.
+  std::vector<uint8_t> short_data;
+  REQUIRE(MakeSplineXPD(2, 2, 3, false, &short_data, &err));
+  XPDHeader short_xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(short_data.data(), short_data.size(),
+                                   &short_xpd, &err));
+  XPDCurveBuffers buffers;
+  std::string e;
+  EXPECT(!ExtractCurveBuffers(short_xpd, short_data.data(), short_data.size(),
+                              0, XPDCurveBufferOption(), &buffers, &e));
+}
+
+static void TestCurveResample() {
+  std::string err;
+  // Curve 0: CVs on the x axis at 0, 1, 3, 6, 10.
+  // Curve 1: zigzag (0, 0), (1, 1), (2, 0), (3, 1), (4, 0).
+  const float xs[2][5] = {{0.0f, 1.0f, 3.0f, 6.0f, 10.0f},
+                          {0.0f, 1.0f, 2.0f, 3.0f, 4.0f}};
+  const float ys[2][5] = {{0.0f, 0.0f, 0.0f, 0.0f, 0.0f},
+                          {0.0f, 1.0f, 0.0f, 1.0f, 0.0f}};
+  XPDSplineSoA soa;
+  soa.numCurves = 2;
+  soa.numCVsPerCurve = 5;
+  for (uint32_t i = 0; i < 2; i++) {
+    soa.id.push_back(float(i));
+    for (uint32_t c = 0; c < 5; c++) {
+      soa.px.push_back(xs[i][c]);
+      soa.py.push_back(ys[i][c]);
+      soa.pz.push_back(0.0f);
+    }
+  }
+  const std::vector<int> faceid(1, 0);
+  std::vector<uint8_t> data;
+  REQUIRE(WriteSplineXPDFromSoA(soa, faceid, std::vector<uint32_t>(2, 0),
+                                XPDSplineWriteOption(), &data, &err));
+  XPDHeader xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, &err));
+
+  struct Resample {
+    static bool Run(const XPDHeader &x, const std::vector<uint8_t> &d,
+                    const uint32_t n, const XPDCurveBufferOption::ResampleMode m,
+                    const XPDCurveBufferOption::Interpolation i,
+                    XPDCurveBuffers *out, std::string *e) {
+      XPDCurveBufferOption option;
+      option.resampleCVs = n;
+      option.resampleMode = m;
+      option.interpolation = i;
+      return ExtractCurveBuffers(x, d.data(), d.size(), 0, option, out, e);
+    }
+  };
+  const XPDCurveBufferOption::ResampleMode modes[] = {
+      XPDCurveBufferOption::ResampleParameter,
+      XPDCurveBufferOption::ResampleArcLength};
+  const XPDCurveBufferOption::Interpolation interps[] = {
+      XPDCurveBufferOption::InterpolateLinear,
+      XPDCurveBufferOption::InterpolateCatmullRom};
+
+  // End points are kept in every mode.
+  for (size_t m = 0; m < 2; m++) {
+    for (size_t k = 0; k < 2; k++) {
+      XPDCurveBuffers b;
+      REQUIRE(Resample::Run(xpd, data, 9, modes[m], interps[k], &b, &err));
+      REQUIRE(b.numCVsPerCurve == 9);
+      REQUIRE(b.cvs.size() == 2 * 9 * 4);
+      EXPECT(b.segmentIndices.size() == 2 * 6);
+      EXPECT(b.curveFirstCV[1] == 9);
+      for (uint32_t i = 0; i < 2; i++) {
+        const float *first = &b.cvs[i * 9 * 4];
+        const float *last = &b.cvs[(i * 9 + 8) * 4];
+        EXPECT(first[0] == xs[i][0] && first[1] == ys[i][0]);
+        EXPECT(std::fabs(last[0] - xs[i][4]) < 1e-5f);
+        EXPECT(std::fabs(last[1] - ys[i][4]) < 1e-5f);
+      }
+    }
+  }
+
+  // Parameter vs arc length on curve 0. 11 CVs are 1 apart in arc length,
+  // and 0.4 apart in parameter(CV 5 is at parameter 2, x = 3).
+  XPDCurveBuffers param, arc;
+  REQUIRE(Resample::Run(xpd, data, 11, modes[0], interps[0], &param, &err));
+  REQUIRE(Resample::Run(xpd, data, 11, modes[1], interps[0], &arc, &err));
+  for (uint32_t j = 0; j < 11; j++) {
+    EXPECT(std::fabs(arc.cvs[j * 4] - float(j)) < 1e-5f);
+  }
+  EXPECT(std::fabs(param.cvs[5 * 4] - 3.0f) < 1e-5f);
+  EXPECT(std::fabs(param.cvs[1 * 4] - 0.4f) < 1e-5f);
+
+  // Catmull-Rom vs linear on curve 1. Both pass through CVs, and differ
+  // between them.
+  XPDCurveBuffers linear, cr;
+  REQUIRE(Resample::Run(xpd, data, 9, modes[0], interps[0], &linear, &err));
+  REQUIRE(Resample::Run(xpd, data, 9, modes[0], interps[1], &cr, &err));
+  const float *lin1 = &linear.cvs[9 * 4];
+  const float *cr1 = &cr.cvs[9 * 4];
+  for (uint32_t j = 0; j < 9; j += 2) {
+    EXPECT(std::fabs(lin1[j * 4 + 1] - ys[1][j / 2]) < 1e-5f);
+    EXPECT(std::fabs(cr1[j * 4 + 1] - ys[1][j / 2]) < 1e-5f);
+  }
+  EXPECT(std::fabs(lin1[1 * 4 + 1] - 0.5f) < 1e-5f);
+  // Phantom root CV at (-1, -1): 0.5 * (1 + 0.5 - 0.25) at t = 0.5.
+  EXPECT(std::fabs(cr1[1 * 4 + 1] - 0.625f) < 1e-5f);
+  EXPECT(std::fabs(cr1[3 * 4 + 1] - 0.5f) < 1e-5f);
+
+  // Too few CVs.
+  XPDCurveBuffers b;
+  std::string e;
+  EXPECT(!Resample::Run(xpd, data, 1, modes[0], interps[0], &b, &e));
+  EXPECT(!Resample::Run(xpd, data, 3, modes[0], interps[0], &b, &e));
+}
+
+template <typename T>
+static bool SameBits(const std::vector<T> &a, const std::vector<T> &b) {
+  return (a.size() == b.size()) &&
+         (a.empty() || (memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0));
+}
+
+static bool SameBits(const XPDSplineSoA &a, const XPDSplineSoA &b) {
+  return (a.numCurves == b.numCurves) && SameBits(a.px, b.px) &&
+         SameBits(a.py, b.py) && SameBits(a.pz, b.pz) && SameBits(a.id, b.id) &&
+         SameBits(a.u, b.u) && SameBits(a.v, b.v) &&
+         SameBits(a.length, b.length) && SameBits(a.width, b.width) &&
+         SameBits(a.taper, b.taper) && SameBits(a.taperStart, b.taperStart) &&
+         SameBits(a.widthVectorX, b.widthVectorX) &&
+         SameBits(a.widthVectorY, b.widthVectorY) &&
+         SameBits(a.widthVectorZ, b.widthVectorZ) &&
+         SameBits(a.faceCurveOffset, b.faceCurveOffset);
+}
+
+static bool SameBits(const XPDCurveBuffers &a, const XPDCurveBuffers &b) {
+  return (a.numCurves == b.numCurves) && SameBits(a.cvs, b.cvs) &&
+         SameBits(a.curveFirstCV, b.curveFirstCV) &&
+         SameBits(a.segmentIndices, b.segmentIndices);
+}
+
+// SoA and curve buffers of spline XPD, extracted with several options.
+struct DecodeOutputs {
+  XPDSplineSoA soa;
+  XPDSplineSoA transformed;
+  std::vector<XPDCurveBuffers> buffers;
+
+  bool extract(const XPDHeader &xpd, const std::vector<uint8_t> &data,
+               const bool specialize, std::string *err) {
+    const float m[16] = {0.0f, -2.0f, 0.0f, 1.0f, 2.0f, 0.0f, 0.0f, 3.0f,
+                         0.0f, 0.0f, 2.0f, -1.0f, 0.0f, 0.0f, 0.0f, 1.0f};
+    XPDSplineSoAOption soa_option;
+    soa_option.numThreads = 2;
+    soa_option.specialize = specialize;
+    if (!ExtractSplineSoA(xpd, data.data(), data.size(), 0, soa_option, &soa,
+                          err)) {
+      return false;
+    }
+    soa_option.transform.matrix.assign(m, m + 16);
+    if (!ExtractSplineSoA(xpd, data.data(), data.size(), 0, soa_option,
+                          &transformed, err)) {
+      return false;
+    }
+
+    // Plain, transformed, and resampled in both modes.
+    buffers.resize(4);
+    for (size_t i = 0; i < buffers.size(); i++) {
+      XPDCurveBufferOption option;
+      option.numThreads = 2;
+      option.specialize = specialize;
+      if (i == 1) {
+        option.transform.matrix.assign(m, m + 16);
+      } else if (i >= 2) {
+        option.resampleCVs = 7;
+        option.resampleMode = (i == 2)
+                                  ? XPDCurveBufferOption::ResampleParameter
+                                  : XPDCurveBufferOption::ResampleArcLength;
+      }
+      if (!ExtractCurveBuffers(xpd, data.data(), data.size(), 0, option,
+                               &buffers[i], err)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool operator==(const DecodeOutputs &rhs) const {
+    if (!SameBits(soa, rhs.soa) || !SameBits(transformed, rhs.transformed) ||
+        (buffers.size() != rhs.buffers.size())) {
+      return false;
+    }
+    for (size_t i = 0; i < buffers.size(); i++) {
+      if (!SameBits(buffers[i], rhs.buffers[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// Spline XPD with pseudo random CVs and attributes.
+static bool MakeRandomSplineXPD(const uint32_t num_cvs,
+                                std::vector<uint8_t> *out, std::string *err) {
+  uint32_t rng = 1234567u + num_cvs;
+  struct Random {
+    static float Next(uint32_t *state) {
+      (*state) = (*state) * 1664525u + 1013904223u;
+      return float((*state) >> 8) / float(1u << 24);
+    }
+  };
+
+  XPDSplineSoA soa;
+  soa.numCurves = 37;
+  soa.numCVsPerCurve = num_cvs;
+  std::vector<uint32_t> curve_face;
+  for (uint32_t i = 0; i < soa.numCurves; i++) {
+    curve_face.push_back(i % 5);
+    soa.id.push_back(float(i));
+    soa.u.push_back(Random::Next(&rng));
+    soa.v.push_back(Random::Next(&rng));
+    soa.length.push_back(Random::Next(&rng));
+    soa.width.push_back(Random::Next(&rng));
+    soa.taper.push_back(Random::Next(&rng));
+    soa.taperStart.push_back(Random::Next(&rng));
+    soa.widthVectorX.push_back(Random::Next(&rng));
+    soa.widthVectorY.push_back(Random::Next(&rng));
+    soa.widthVectorZ.push_back(Random::Next(&rng));
+    for (uint32_t c = 0; c < num_cvs; c++) {
+      soa.px.push_back(10.0f * Random::Next(&rng) - 5.0f);
+      soa.py.push_back(float(c) + Random::Next(&rng));
+      soa.pz.push_back(Random::Next(&rng) - 0.5f);
+    }
+  }
+  const std::vector<int> faceid(5, 0);
+  return WriteSplineXPDFromSoA(soa, faceid, curve_face,
+                               XPDSplineWriteOption(), out, err);
+}
+
+// Restore the SIMD level at the end of a test.
+struct SIMDLevelGuard {
+  XPDSIMDLevel level;
+  SIMDLevelGuard() : level(GetSIMDLevel()) {}
+  ~SIMDLevelGuard() { SetSIMDLevel(level, nullptr); }
+};
+
+static void TestSpecializedDecoders() {
+  std::string err;
+  SIMDLevelGuard guard;
+  const XPDSIMDLevel levels[] = {XPDSIMDScalar, XPDSIMDSSE42, XPDSIMDAVX2,
+                                 XPDSIMDAVX512};
+
+  // Specialized(4, 5, 8, 16) and generic CV counts.
+  const uint32_t num_cvs_list[] = {4, 5, 8, 16, 19, 32};
+  for (size_t k = 0; k < sizeof(num_cvs_list) / sizeof(num_cvs_list[0]);
+       k++) {
+    std::vector<uint8_t> data;
+    REQUIRE(MakeRandomSplineXPD(num_cvs_list[k], &data, &err));
+    XPDHeader xpd;
+    REQUIRE(ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, &err));
+
+    // Reference: generic scalar decoders.
+    REQUIRE(SetSIMDLevel(XPDSIMDScalar, &err));
+    DecodeOutputs ref;
+    REQUIRE(ref.extract(xpd, data, false, &err));
+
+    // Every level the CPU supports, with and without specialization.
+    for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+      std::string ignored;
+      if (!SetSIMDLevel(levels[l], &ignored)) {
+        continue;
+      }
+      for (int specialize = 0; specialize < 2; specialize++) {
+        DecodeOutputs outputs;
+        REQUIRE(outputs.extract(xpd, data, specialize == 1, &err));
+        if (!(outputs == ref)) {
+          fprintf(stderr, "  numCVs %u, %s, specialize %d differ.\n",
+                  num_cvs_list[k], GetSIMDLevelName(levels[l]), specialize);
+          g_failures++;
+        }
+      }
+    }
+  }
+}
+
+static void TestXPDFileConcurrentReaders() {
+  std::string err;
+  std::shared_ptr<const XPDFile> file;
+  REQUIRE(OpenXPDFile(SamplePath("sample.xpd"), &file, &err));
+
+  XPDSplineSoA ref;
+  REQUIRE(file->extractSplineSoA(0, XPDSplineSoAOption(), &ref, &err));
+  std::vector<double> sums(file->numFaces());
+  for (uint32_t f = 0; f < file->numFaces(); f++) {
+    sums[f] = FaceSum(*file, f);
+  }
+
+  // Threads share copies of the handle, read overlapping faces and extract
+  // concurrently. The last reference is released by a reader.
+  std::atomic<int> failures(0);
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < 8; t++) {
+    std::shared_ptr<const XPDFile> local = file;
+    threads.emplace_back([local, t, &sums, &ref, &failures]() {
+      const uint32_t n = local->numFaces();
+      for (uint32_t k = 0; k < n; k++) {
+        const uint32_t f = (k * 7 + t * 13) % n;
+        if (FaceSum(*local, f) != sums[f]) {
+          failures++;
+        }
+      }
+      XPDSplineSoAOption option;
+      option.numThreads = 2;
+      XPDSplineSoA soa;
+      std::string e;
+      if (!local->extractSplineSoA(0, option, &soa, &e) ||
+          (soa.px != ref.px) || (soa.width != ref.width)) {
+        failures++;
+      }
+    });
+  }
+  file.reset();
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+  EXPECT(failures == 0);
+
+  // Owned memory.
+  std::vector<uint8_t> data;
+  REQUIRE(MakeSplineXPD(5, 3, 4, true, &data, &err));
+  std::vector<uint8_t> copy = data;
+  std::shared_ptr<const XPDFile> mem;
+  REQUIRE(CreateXPDFileFromMemory(&copy, &mem, &err));
+  EXPECT(copy.empty());
+  EXPECT(mem->size() == data.size());
+  XPDChannel color;
+  REQUIRE(mem->findChannel("Groom", "color", &color));
+  XPDChannelView view;
+  REQUIRE(mem->channelView(4, color, &view, &err));
+  EXPECT(view.get(1, 0) == 4.0f);
+  EXPECT(view.get(1, 2) == 7.0f);
+}
+
+static void TestParallelSerializer() {
+  std::string err;
+  XPDHeaderInput input;
+  input.primType = Xpd::PrimType::Spline;
+  input.primVersion = 3;
+  input.numCVs = 2;
+  input.numFaces = 23;
+  input.numBlocks = 2;
+  input.block.push_back("A");
+  input.block.push_back("B");
+  input.primSize.push_back(16);
+  input.primSize.push_back(3);
+  for (uint32_t f = 0; f < input.numFaces; f++) {
+    input.faceid.push_back(int(f * 3));
+    input.numPrims.push_back((f % 5 == 0) ? 0 : (f % 7 + 1));
+  }
+
+  struct Value {
+    static float Get(uint32_t f, uint32_t b, uint32_t p, uint32_t i) {
+      return float(f * 1000 + b * 100 + p * 10 + i);
+    }
+  };
+
+  // Reference with the serial writer.
+  XPDHeaderInput serial = input;
+  std::vector<float> flat;
+  for (uint32_t f = 0; f < input.numFaces; f++) {
+    for (uint32_t b = 0; b < input.numBlocks; b++) {
+      serial.blockOffset.push_back(flat.size() * sizeof(float));
+      for (uint32_t p = 0; p < input.numPrims[f]; p++) {
+        for (uint32_t i = 0; i < input.primSize[b]; i++) {
+          flat.push_back(Value::Get(f, b, p, i));
+        }
+      }
+    }
+  }
+  std::vector<uint8_t> prim_data(flat.size() * sizeof(float));
+  memcpy(prim_data.data(), flat.data(), prim_data.size());
+  std::vector<uint8_t> ref;
+  REQUIRE(SerializeToXPD(serial, prim_data, &ref, &err));
+
+  XPDEncodeBlockCallback encode = [&input](uint32_t f, uint32_t b,
+                                           uint8_t *dst, std::string *) {
+    for (uint32_t p = 0; p < input.numPrims[f]; p++) {
+      for (uint32_t i = 0; i < input.primSize[b]; i++) {
+        const float v = Value::Get(f, b, p, i);
+        memcpy(dst + (p * input.primSize[b] + i) * sizeof(float), &v,
+               sizeof(float));
+      }
+    }
+    return true;
+  };
+
+  XPDParallelSerializeOption option;
+  option.numThreads = 4;
+  XPDHeaderInput a = input;
+  std::vector<uint8_t> out;
+  REQUIRE(SerializeToXPDParallel(a, encode, option, &out, &err));
+  EXPECT(out == ref);
+
+  XPDHeaderInput b = input;
+  const std::string filename = TempPath("parallel.xpd");
+  REQUIRE(SerializeToXPDFileParallel(b, encode, option, filename, &err));
+  std::vector<uint8_t> file_data;
+  REQUIRE(ReadFile(filename, &file_data));
+  EXPECT(file_data == ref);
+
+  // Failure of the callback is reported.
+  XPDEncodeBlockCallback fail = [](uint32_t f, uint32_t, uint8_t *,
+                                   std::string *e) {
+    if (f == 13) {
+      (*e) += "boom\n";
+      return false;
+    }
+    return true;
+  };
+  XPDHeaderInput c = input;
+  std::string e;
+  EXPECT(!SerializeToXPDParallel(c, fail, option, &out, &e));
+  EXPECT(e.find("boom") != std::string::npos);
+
+  // A failed file write keeps the existing file.
+  XPDHeaderInput d = input;
+  EXPECT(!SerializeToXPDFileParallel(d, fail, option, filename, &e));
+  REQUIRE(ReadFile(filename, &file_data));
+  EXPECT(file_data == ref);
+
+  // No prims in any face.
+  XPDHeaderInput empty = input;
+  for (uint32_t f = 0; f < empty.numFaces; f++) {
+    empty.numPrims[f] = 0;
+  }
+  XPDHeaderInput e1 = empty;
+  REQUIRE(SerializeToXPDParallel(e1, encode, option, &out, &err));
+  XPDHeader xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(out.data(), out.size(), &xpd, &err));
+  EXPECT(xpd.numFaces == empty.numFaces);
+  XPDHeaderInput e2 = empty;
+  REQUIRE(SerializeToXPDFileParallel(e2, encode, option, filename, &err));
+  REQUIRE(ReadFile(filename, &file_data));
+  EXPECT(file_data == out);
+}
+
+static void TestSplineWriterRoundTrip() {
+  std::string err;
+  const uint32_t num_cvs_list[] = {1, 4, 5, 16, 19};
+  for (size_t k = 0; k < sizeof(num_cvs_list) / sizeof(num_cvs_list[0]);
+       k++) {
+    const uint32_t num_cvs = num_cvs_list[k];
+    std::vector<uint8_t> data;
+    REQUIRE(MakeSplineXPD(7, 5, num_cvs, false, &data, &err));
+    XPDHeader xpd;
+    REQUIRE(ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, &err));
+    XPDSplineSoA soa;
+    REQUIRE(ExtractSplineSoA(xpd, data.data(), data.size(), 0,
+                             XPDSplineSoAOption(), &soa, &err));
+
+    XPDSplineWriteOption option;
+    option.blockName = "Groom";
+    option.coordSpace = Xpd::CoordSpace::World;
+    option.numThreads = 3;
+    std::vector<uint8_t> out;
+    REQUIRE(WriteSplineXPDFromSoA(soa, xpd.faceid, std::vector<uint32_t>(),
+                                  option, &out, &err));
+    EXPECT(out == data);
+
+    // Curves given in reverse order with their faces.
+    XPDSplineSoA reversed = soa;
+    std::vector<uint32_t> curve_face(soa.numCurves);
+    reversed.faceCurveOffset.clear();
+    for (uint32_t f = 0; f < xpd.numFaces; f++) {
+      for (uint32_t c = soa.faceCurveOffset[f]; c < soa.faceCurveOffset[f + 1];
+           c++) {
+        curve_face[c] = f;
+      }
+    }
+    // Keep the order of curves in a face: reverse faces only.
+    std::vector<uint32_t> order;
+    for (uint32_t f = xpd.numFaces; f-- > 0;) {
+      for (uint32_t c = soa.faceCurveOffset[f]; c < soa.faceCurveOffset[f + 1];
+           c++) {
+        order.push_back(c);
+      }
+    }
+    std::vector<uint32_t> reversed_face(soa.numCurves);
+    for (uint32_t i = 0; i < soa.numCurves; i++) {
+      const uint32_t c = order[i];
+      reversed_face[i] = curve_face[c];
+      reversed.id[i] = soa.id[c];
+      reversed.u[i] = soa.u[c];
+      reversed.v[i] = soa.v[c];
+      reversed.length[i] = soa.length[c];
+      reversed.width[i] = soa.width[c];
+      reversed.taper[i] = soa.taper[c];
+      reversed.taperStart[i] = soa.taperStart[c];
+      reversed.widthVectorX[i] = soa.widthVectorX[c];
+      reversed.widthVectorY[i] = soa.widthVectorY[c];
+      reversed.widthVectorZ[i] = soa.widthVectorZ[c];
+      for (uint32_t j = 0; j < num_cvs; j++) {
+        reversed.px[i * num_cvs + j] = soa.px[c * num_cvs + j];
+        reversed.py[i * num_cvs + j] = soa.py[c * num_cvs + j];
+        reversed.pz[i * num_cvs + j] = soa.pz[c * num_cvs + j];
+      }
+    }
+    const std::string filename = TempPath("spline.xpd");
+    REQUIRE(WriteSplineXPDFileFromSoA(reversed, xpd.faceid, reversed_face,
+                                      option, filename, &err));
+    std::vector<uint8_t> file_data;
+    REQUIRE(ReadFile(filename, &file_data));
+    EXPECT(file_data == data);
+  }
+
+  // No curves, with fixed and variable CV counts.
+  for (int varying = 0; varying < 2; varying++) {
+    XPDSplineSoA empty;
+    empty.numCVsPerCurve = 4;
+    empty.faceCurveOffset.assign(4, 0);
+    if (varying) {
+      empty.curveCVOffset.assign(1, 0);
+    }
+    const std::vector<int> faceid(3, 0);
+    XPDSplineWriteOption option;
+    option.blockName = "Groom";
+    std::vector<uint8_t> out;
+    REQUIRE(WriteSplineXPDFromSoA(empty, faceid, std::vector<uint32_t>(),
+                                  option, &out, &err));
+    XPDSplineSoA soa;
+    REQUIRE(ExtractSoA(out, &soa, &err));
+    EXPECT(soa.numCurves == 0);
+    EXPECT(soa.px.empty());
+    EXPECT(soa.faceCurveOffset == empty.faceCurveOffset);
+  }
+}
+
+static void TestVaryingCVRoundTrip() {
+  std::string err;
+  XPDSplineSoA soa;
+  std::vector<int> faceid;
+  std::vector<uint32_t> curve_face;
+  soa.curveCVOffset.push_back(0);
+  for (uint32_t f = 0; f < 4; f++) {
+    faceid.push_back(int(f));
+  }
+  for (uint32_t i = 0; i < 50; i++) {
+    const uint32_t n = 1 + (i * 7) % 11;
+    for (uint32_t c = 0; c < n; c++) {
+      soa.px.push_back(float(i));
+      soa.py.push_back(float(c));
+      soa.pz.push_back(0.5f);
+    }
+    soa.curveCVOffset.push_back(uint32_t(soa.px.size()));
+    soa.id.push_back(float(i));
+    curve_face.push_back((i % 3 == 0) ? 0 : 2);  // Faces 1 and 3 are empty.
+  }
+  soa.numCurves = 50;
+
+  std::vector<uint8_t> data;
+  REQUIRE(WriteSplineXPDFromSoA(soa, faceid, curve_face,
+                                XPDSplineWriteOption(), &data, &err));
+  XPDHeader xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, &err));
+  uint32_t ext_block_id = 0;
+  EXPECT(FindVaryingCVBlock(xpd, 0, &ext_block_id) && (ext_block_id == 1));
+
+  XPDSplineSoA r;
+  REQUIRE(ExtractSplineSoA(xpd, data.data(), data.size(), 0,
+                           XPDSplineSoAOption(), &r, &err));
+  REQUIRE(r.numCurves == soa.numCurves);
+  REQUIRE(r.curveCVOffset.size() == soa.curveCVOffset.size());
+  for (uint32_t k = 0; k < r.numCurves; k++) {
+    const uint32_t i = uint32_t(r.id[k]);
+    const uint32_t n = soa.curveCVOffset[i + 1] - soa.curveCVOffset[i];
+    EXPECT(r.curveCVOffset[k + 1] - r.curveCVOffset[k] == n);
+    for (uint32_t c = 0; c < n; c++) {
+      EXPECT(r.px[r.curveCVOffset[k] + c] == float(i));
+      EXPECT(r.py[r.curveCVOffset[k] + c] == float(c));
+    }
+  }
+
+  // Rewriting the extracted data gives identical bytes.
+  std::vector<uint8_t> out;
+  REQUIRE(WriteSplineXPDFromSoA(r, faceid, std::vector<uint32_t>(),
+                                XPDSplineWriteOption(), &out, &err));
+  EXPECT(out == data);
+
+  // XPDPartialReader fetches CVs of the extension with the face.
+  XPDPartialReader reader;
+  REQUIRE(reader.open(
+      [&data](uint64_t offset, size_t n, uint8_t *dst) {
+        if ((offset > data.size()) || (n > data.size() - offset)) {
+          return false;
+        }
+        memcpy(dst, data.data() + offset, n);
+        return true;
+      },
+      data.size(), &err));
+  for (uint32_t f = 0; f < xpd.numFaces; f++) {
+    std::shared_ptr<const XPDFaceData> face;
+    REQUIRE(reader.readFace(f, &face, &err));
+    XPDVaryingCVView expected;
+    REQUIRE(GetVaryingCVView(xpd, data.data(), data.size(), f, 0, &expected,
+                             &err));
+    REQUIRE(face->varyingCVs.size() == xpd.numBlocks);
+    EXPECT(face->varyingCVs[1].table == nullptr);
+    const XPDVaryingCVView &v = face->varyingCVs[0];
+    REQUIRE(v.numPrims == expected.numPrims && v.numCVs == expected.numCVs);
+    for (size_t p = 0; p < v.numPrims; p++) {
+      EXPECT(v.count(p) == expected.count(p));
+      EXPECT(v.offset(p) == expected.offset(p));
+    }
+    EXPECT((v.numCVs == 0) ||
+           (memcmp(v.cvs, expected.cvs, v.numCVs * 3 * sizeof(float)) == 0));
+  }
+}
+
+static void TestResidencyBudget() {
+  std::string err;
+  std::vector<uint8_t> data;
+  REQUIRE(MakeSplineXPD(64, 300, 5, false, &data, &err));
+  const std::string filename = TempPath("residency.xpd");
+  REQUIRE(WriteFile(filename, data));
+
+  // Faces are 30KB. Strided access leaves prefetched faces unacquired.
+  XPDResidencyOption option;
+  option.residentBudget = 128 * 1024;
+  option.prefetchWindow = 256 * 1024;
+  XPDResidencyManager manager;
+  REQUIRE(manager.open(filename, option, &err));
+  for (uint32_t i = 0; i < 3 * 64; i++) {
+    const uint32_t face = (i * 7) % 64;
+    manager.acquire(face);
+    EXPECT(manager.residentBytes() <= option.residentBudget);
+    XPDBlockView view;
+    EXPECT(GetBlockView(manager.header(), manager.data(), manager.size(),
+                        face, 0, &view, &err));
+    manager.release(face);
+  }
+  EXPECT(manager.peakResidentBytes() <= option.residentBudget);
+  EXPECT(manager.droppedBytes() > 0);
+  EXPECT(manager.adviseFailures() == 0);
+
+  manager.dropAll();
+  EXPECT(manager.residentBytes() == 0);
+}
+
+static void TestReduceDeterministic() {
+  std::string err;
+  std::vector<uint8_t> data;
+  REQUIRE(MakeSplineXPD(97, 40, 7, true, &data, &err));
+  XPDHeader xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, &err));
+
+  std::vector<XPDReduction> reductions(3);
+  reductions[0].attribute = "cv.x";
+  reductions[0].ops = XPDReduction::ReduceAll;
+  reductions[1].attribute = "color[1]";
+  reductions[1].ops = XPDReduction::ReduceHistogram;
+  reductions[1].histogramMax = 64.0f;
+  reductions[2].attribute = "width";
+  reductions[2].ops = 0;
+
+  std::vector<XPDReductionResult> ref;
+  XPDReduceOption option;
+  option.numThreads = 1;
+  REQUIRE(ReduceSplineAttributes(xpd, data.data(), data.size(), 0, reductions,
+                                 option, &ref, &err));
+  const uint32_t num_threads[] = {2, 3, 8, 0};
+  for (size_t t = 0; t < 4; t++) {
+    option.numThreads = num_threads[t];
+    std::vector<XPDReductionResult> results;
+    REQUIRE(ReduceSplineAttributes(xpd, data.data(), data.size(), 0,
+                                   reductions, option, &results, &err));
+    // Bitwise identical sums for any number of threads.
+    EXPECT(memcmp(&results[0].sum, &ref[0].sum, sizeof(double)) == 0);
+    EXPECT(results[0].faceSum == ref[0].faceSum);
+    EXPECT(results[1].histogram == ref[1].histogram);
+  }
+
+  uint64_t num_prims = 0;
+  for (uint32_t f = 0; f < xpd.numFaces; f++) {
+    num_prims += xpd.numPrims[f];
+  }
+  EXPECT(ref[0].count == num_prims * 7);
+  EXPECT(ref[1].count == num_prims);
+  EXPECT(ref[1].sum == 0.0);
+  uint64_t binned = ref[1].underflow + ref[1].overflow;
+  for (size_t i = 0; i < ref[1].histogram.size(); i++) {
+    binned += ref[1].histogram[i];
+  }
+  EXPECT(binned == num_prims);
+  EXPECT(ref[2].count == 0);
+
+  // `value[i]` reads raw prim floats.
+  XPDSplineLayout layout;
+  REQUIRE(GetSplineLayout(xpd, 0, &layout, &err));
+  reductions.resize(2);
+  reductions[0].attribute = "width";
+  reductions[0].ops = XPDReduction::ReduceSum;
+  reductions[1].attribute = "value[" + std::to_string(layout.width) + "]";
+  reductions[1].ops = XPDReduction::ReduceSum;
+  std::vector<XPDReductionResult> results;
+  REQUIRE(ReduceSplineAttributes(xpd, data.data(), data.size(), 0, reductions,
+                                 option, &results, &err));
+  EXPECT(results[0].count == num_prims);
+  EXPECT(results[1].sum == results[0].sum);
+  reductions[1].attribute =
+      "value[" + std::to_string(xpd.primSize[0]) + "]";
+  std::string ignored;
+  EXPECT(!ReduceSplineAttributes(xpd, data.data(), data.size(), 0,
+                                 reductions, option, &results, &ignored));
+}
+
+static void TestRebindNonFiniteRoot() {
+  std::string err;
+  std::vector<uint8_t> data;
+  REQUIRE(MakeSplineXPD(2, 2, 3, false, &data, &err));
+  XPDHeader xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, &err));
+  XPDSplineLayout layout;
+  REQUIRE(GetSplineLayout(xpd, 0, &layout, &err));
+  XPDBlockView view;
+  REQUIRE(GetBlockView(xpd, data.data(), data.size(), 0, 0, &view, &err));
+
+  // Root x of prim 0 is NaN, prim 1 is far away but finite.
+  const float roots[2] = {std::numeric_limits<float>::quiet_NaN(), 1.0e12f};
+  for (uint32_t p = 0; p < 2; p++) {
+    const size_t offset = size_t(view.data - data.data()) +
+                          p * view.stride() + layout.cv * sizeof(float);
+    memcpy(&data[offset], &roots[p], sizeof(float));
+  }
+
+  // A quad in the y = 0 plane.
+  XPDRebindMesh mesh;
+  const float vertices[12] = {0.0f, 0.0f, 0.0f, 4.0f, 0.0f, 0.0f,
+                              4.0f, 0.0f, 4.0f, 0.0f, 0.0f, 4.0f};
+  mesh.vertices.assign(vertices, vertices + 12);
+  mesh.faceVertexCounts.push_back(4);
+  for (uint32_t i = 0; i < 4; i++) {
+    mesh.faceVertexIndices.push_back(i);
+  }
+
+  XPDRebindOption option;
+  XPDRebindStats stats;
+  std::vector<uint8_t> out;
+  REQUIRE(RebindSplineXPD(xpd, data.data(), data.size(), 0, mesh, option,
+                          &out, &stats, &err));
+  EXPECT(stats.numDropped == 1);
+  EXPECT(stats.numStrands == xpd.numPrims[0] + xpd.numPrims[1] - 1);
+
+  // Non-finite mesh vertices are rejected.
+  mesh.vertices[4] = std::numeric_limits<float>::infinity();
+  std::string ignored;
+  EXPECT(!RebindSplineXPD(xpd, data.data(), data.size(), 0, mesh, option,
+                          &out, &stats, &ignored));
+}
+
+static void TestRebindKeepsRecords() {
+  std::string err;
+  std::vector<uint8_t> data;
+  REQUIRE(MakeTwoBlockSplineXPD(3, 2, 3, &data, &err));
+  XPDHeader xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, &err));
+  XPDChannel color;
+  REQUIRE(FindChannel(xpd, "Groom", "color", &color));
+  XPDSplineLayout layout;
+  REQUIRE(GetSplineLayout(xpd, 0, &layout, &err));
+
+  // Roots are (face, 0, prim). Faces 0 and 1 go to the first quad and face
+  // 2 to the second, in the y = 0 plane.
+  XPDRebindMesh mesh;
+  const float vertices[18] = {-0.5f, 0.0f, -1.0f, 1.5f, 0.0f, -1.0f,
+                              1.5f,  0.0f, 8.0f,  -0.5f, 0.0f, 8.0f,
+                              4.0f,  0.0f, -1.0f, 4.0f,  0.0f, 8.0f};
+  const uint32_t indices[8] = {0, 1, 2, 3, 1, 4, 5, 2};
+  mesh.vertices.assign(vertices, vertices + 18);
+  mesh.faceVertexCounts.assign(2, 4);
+  mesh.faceVertexIndices.assign(indices, indices + 8);
+  mesh.faceid.push_back(10);
+  mesh.faceid.push_back(20);
+
+  XPDRebindOption option;
+  option.numThreads = 2;
+  XPDRebindStats stats;
+  std::vector<uint8_t> out;
+  REQUIRE(RebindSplineXPD(xpd, data.data(), data.size(), 0, mesh, option,
+                          &out, &stats, &err));
+  EXPECT(stats.numDropped == 0);
+  EXPECT(stats.numStrands == 2 + 3 + 4);
+
+  XPDHeader out_xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(out.data(), out.size(), &out_xpd, &err));
+  REQUIRE(out_xpd.numFaces == 2);
+  EXPECT(out_xpd.faceid[0] == 10);
+  EXPECT(out_xpd.faceid[1] == 20);
+  EXPECT(out_xpd.numPrims[0] == 2 + 3);
+  EXPECT(out_xpd.numPrims[1] == 4);
+  EXPECT(out_xpd.block == xpd.block);
+  EXPECT(out_xpd.key == xpd.key);
+
+  // The channel and the `Extra` block follow their strand, and only u/v of
+  // the spline block change.
+  std::vector<std::vector<float> > before, after;
+  for (int pass = 0; pass < 2; pass++) {
+    const XPDHeader &h = (pass == 0) ? xpd : out_xpd;
+    const std::vector<uint8_t> &d = (pass == 0) ? data : out;
+    std::vector<std::vector<float> > &records = (pass == 0) ? before : after;
+    for (uint32_t f = 0; f < h.numFaces; f++) {
+      XPDBlockView groom, extra;
+      REQUIRE(GetBlockView(h, d.data(), d.size(), f, 0, &groom, &err));
+      REQUIRE(GetBlockView(h, d.data(), d.size(), f, 1, &extra, &err));
+      for (size_t p = 0; p < groom.numPrims; p++) {
+        const float x = groom.get(p, layout.cv);
+        const float z = groom.get(p, layout.cv + 2);
+        EXPECT(groom.get(p, color.offset + 0) == x);
+        EXPECT(groom.get(p, color.offset + 1) == z);
+        EXPECT(extra.get(p, 0) == x);
+        EXPECT(extra.get(p, 1) == z);
+        if (pass == 1) {
+          EXPECT((f == 0) == (x < 1.5f));
+          EXPECT(groom.get(p, layout.u) >= 0.0f);
+          EXPECT(groom.get(p, layout.u) <= 1.0f);
+          EXPECT(groom.get(p, layout.v) > 0.0f);  // z > -1.
+        }
+        std::vector<float> record;
+        for (uint32_t i = 0; i < groom.primSize; i++) {
+          if ((i != layout.u) && (i != layout.v)) {
+            record.push_back(groom.get(p, i));
+          }
+        }
+        records.push_back(record);
+      }
+    }
+  }
+  EXPECT(before == after);
+
+  // The file version writes the same bytes.
+  const std::string filename = TempPath("rebind.xpd");
+  XPDRebindStats file_stats;
+  REQUIRE(RebindSplineXPDFile(xpd, data.data(), data.size(), 0, mesh, option,
+                              filename, &file_stats, &err));
+  std::vector<uint8_t> file_data;
+  REQUIRE(ReadFile(filename, &file_data));
+  EXPECT(file_data == out);
+  EXPECT(file_stats.numStrands == stats.numStrands);
+}
+
+static void ApplyMatrix(const std::vector<float> &m, const bool translate,
+                        float *x, float *y, float *z) {
+  const float w = translate ? 1.0f : 0.0f;
+  const float tx = m[0] * (*x) + m[1] * (*y) + m[2] * (*z) + m[3] * w;
+  const float ty = m[4] * (*x) + m[5] * (*y) + m[6] * (*z) + m[7] * w;
+  const float tz = m[8] * (*x) + m[9] * (*y) + m[10] * (*z) + m[11] * w;
+  (*x) = tx;
+  (*y) = ty;
+  (*z) = tz;
+}
+
+static void TestTransformRoundTrip() {
+  std::string err;
+  std::vector<uint8_t> data;
+  REQUIRE(MakeSplineXPD(6, 4, 5, false, &data, &err));
+  XPDHeader xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, &err));
+  XPDSplineSoA ref;
+  REQUIRE(ExtractSplineSoA(xpd, data.data(), data.size(), 0,
+                           XPDSplineSoAOption(), &ref, &err));
+
+  // Rotation and translation.
+  const float m[16] = {0.8f, -0.6f, 0.0f, 1.5f, 0.6f, 0.8f, 0.0f, -2.0f,
+                       0.0f, 0.0f,  1.0f, 3.0f, 0.0f, 0.0f, 0.0f, 1.0f};
+  XPDTransform transform;
+  transform.matrix.assign(m, m + 16);
+
+  std::vector<uint8_t> out;
+  REQUIRE(TransformSplineXPD(xpd, data.data(), data.size(), 0, transform,
+                             Xpd::CoordSpace::World, 2, &out, &err));
+  XPDHeader out_xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(out.data(), out.size(), &out_xpd, &err));
+  EXPECT(out_xpd.coordSpace == Xpd::CoordSpace::World);
+  EXPECT(out_xpd.faceid == xpd.faceid);
+
+  XPDSplineSoA soa;
+  REQUIRE(ExtractSplineSoA(out_xpd, out.data(), out.size(), 0,
+                           XPDSplineSoAOption(), &soa, &err));
+  REQUIRE(soa.px.size() == ref.px.size());
+  for (size_t i = 0; i < ref.px.size(); i++) {
+    float x = ref.px[i], y = ref.py[i], z = ref.pz[i];
+    ApplyMatrix(transform.matrix, true, &x, &y, &z);
+    EXPECT(std::fabs(soa.px[i] - x) < 1e-5f);
+    EXPECT(std::fabs(soa.py[i] - y) < 1e-5f);
+    EXPECT(std::fabs(soa.pz[i] - z) < 1e-5f);
+  }
+  EXPECT(soa.id == ref.id);
+  EXPECT(soa.u == ref.u);
+  for (uint32_t c = 0; c < ref.numCurves; c++) {
+    EXPECT(std::fabs(soa.length[c] - ref.length[c]) < 1e-4f);
+  }
+
+  // Uniform scale: lengths and widths follow the transform.
+  const float scale[16] = {2.0f, 0.0f, 0.0f, 1.0f, 0.0f, 2.0f, 0.0f, 0.0f,
+                           0.0f, 0.0f, 2.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f};
+  transform.matrix.assign(scale, scale + 16);
+  out.clear();
+  REQUIRE(TransformSplineXPD(xpd, data.data(), data.size(), 0, transform,
+                             Xpd::CoordSpace::World, 2, &out, &err));
+  REQUIRE(ParseXPDHeaderFromMemory(out.data(), out.size(), &out_xpd, &err));
+  REQUIRE(ExtractSplineSoA(out_xpd, out.data(), out.size(), 0,
+                           XPDSplineSoAOption(), &soa, &err));
+  REQUIRE(soa.numCurves == ref.numCurves);
+  for (uint32_t c = 0; c < ref.numCurves; c++) {
+    EXPECT(std::fabs(soa.length[c] - 2.0f * ref.length[c]) < 1e-4f);
+    EXPECT(std::fabs(soa.width[c] - 2.0f * ref.width[c]) < 1e-6f);
+  }
+
+  // Extraction scales widths and radii by the same rule.
+  XPDSplineSoAOption soa_option;
+  soa_option.transform = transform;
+  REQUIRE(ExtractSplineSoA(xpd, data.data(), data.size(), 0, soa_option,
+                           &soa, &err));
+  for (uint32_t c = 0; c < ref.numCurves; c++) {
+    EXPECT(std::fabs(soa.width[c] - 2.0f * ref.width[c]) < 1e-6f);
+  }
+  XPDCurveBuffers ref_buffers, buffers;
+  XPDCurveBufferOption buffer_option;
+  REQUIRE(ExtractCurveBuffers(xpd, data.data(), data.size(), 0, buffer_option,
+                              &ref_buffers, &err));
+  buffer_option.transform = transform;
+  REQUIRE(ExtractCurveBuffers(xpd, data.data(), data.size(), 0, buffer_option,
+                              &buffers, &err));
+  REQUIRE(buffers.cvs.size() == ref_buffers.cvs.size());
+  for (size_t i = 3; i < buffers.cvs.size(); i += 4) {
+    EXPECT(std::fabs(buffers.cvs[i] - 2.0f * ref_buffers.cvs[i]) < 1e-6f);
+  }
+
+  // Other blocks, channels and prim attributes are kept byte for byte.
+  std::vector<uint8_t> two;
+  REQUIRE(MakeTwoBlockSplineXPD(4, 3, 4, &two, &err));
+  REQUIRE(ParseXPDHeaderFromMemory(two.data(), two.size(), &xpd, &err));
+  XPDSplineLayout layout;
+  REQUIRE(GetSplineLayout(xpd, 0, &layout, &err));
+  out.clear();
+  REQUIRE(TransformSplineXPD(xpd, two.data(), two.size(), 0, transform,
+                             Xpd::CoordSpace::World, 2, &out, &err));
+  REQUIRE(out.size() == two.size());
+  REQUIRE(ParseXPDHeaderFromMemory(out.data(), out.size(), &out_xpd, &err));
+  EXPECT(out_xpd.coordSpace == Xpd::CoordSpace::World);
+  EXPECT(out_xpd.block == xpd.block);
+  EXPECT(out_xpd.key == xpd.key);
+  for (uint32_t f = 0; f < xpd.numFaces; f++) {
+    XPDBlockView in_view, out_view;
+    REQUIRE(GetBlockView(xpd, two.data(), two.size(), f, 1, &in_view, &err));
+    REQUIRE(GetBlockView(out_xpd, out.data(), out.size(), f, 1, &out_view,
+                         &err));
+    EXPECT(memcmp(in_view.data, out_view.data,
+                  in_view.numPrims * in_view.stride()) == 0);
+
+    REQUIRE(GetBlockView(xpd, two.data(), two.size(), f, 0, &in_view, &err));
+    REQUIRE(GetBlockView(out_xpd, out.data(), out.size(), f, 0, &out_view,
+                         &err));
+    for (size_t p = 0; p < in_view.numPrims; p++) {
+      for (uint32_t i = 0; i < in_view.primSize; i++) {
+        const bool transformed =
+            ((i >= layout.cv) && (i < layout.cv + 3 * layout.numCVs)) ||
+            (i == layout.length) || (i == layout.width) ||
+            ((i >= layout.widthVector) && (i < layout.widthVector + 3));
+        if (i == layout.width) {
+          EXPECT(out_view.get(p, i) == 2.0f * in_view.get(p, i));
+        } else if (!transformed) {
+          EXPECT(out_view.get(p, i) == in_view.get(p, i));
+        }
+      }
+    }
+  }
+}
+
+static void TestSequenceRoundTrip() {
+  std::string err;
+  const uint32_t num_frames = 30;
+  std::vector<uint8_t> base;
+  REQUIRE(MakeSplineXPD(8, 6, 6, false, &base, &err));
+  XPDSplineSoA soa;
+  REQUIRE(ExtractSoA(base, &soa, &err));
+  std::vector<int> faceid;
+  for (uint32_t f = 0; f < 8; f++) {
+    faceid.push_back(int(f * 2));
+  }
+
+  std::vector<std::vector<uint8_t> > frames(num_frames);
+  for (uint32_t t = 0; t < num_frames; t++) {
+    XPDSplineSoA s = soa;
+    for (size_t i = 0; i < s.px.size(); i++) {
+      s.px[i] += 0.01f * float(t) * std::sin(0.1f * float(i));
+    }
+    XPDSplineWriteOption option;
+    option.blockName = "Groom";
+    option.time = float(t);
+    REQUIRE(WriteSplineXPDFromSoA(s, faceid, std::vector<uint32_t>(), option,
+                                  &frames[t], &err));
+  }
+
+  XPDSequenceOption option;
+  option.numThreads = 2;
+  XPDSequenceWriter writer(option);
+  for (uint32_t t = 0; t < num_frames; t++) {
+    REQUIRE(writer.addFrame(frames[t].data(), frames[t].size(), &err));
+  }
+  std::vector<uint8_t> seq;
+  REQUIRE(writer.finish(&seq, &err));
+  const std::string filename = TempPath("sequence.xpds");
+  REQUIRE(writer.finishToFile(filename, &err));
+  std::vector<uint8_t> file_data;
+  REQUIRE(ReadFile(filename, &file_data));
+  EXPECT(file_data == seq);
+  std::string ignored;
+  EXPECT(!writer.finishToFile(TempPath("missing-dir/sequence.xpds"),
+                              &ignored));
+
+  XPDSequenceReader reader;
+  REQUIRE(reader.open(filename, &err));
+  REQUIRE(reader.numFrames() == num_frames);
+  const uint32_t order[] = {0, 29, 3, 17, 16, 1, 28};
+  for (size_t k = 0; k < sizeof(order) / sizeof(order[0]); k++) {
+    XPDHeader xpd;
+    std::vector<uint8_t> frame;
+    REQUIRE(reader.readFrame(order[k], &xpd, &frame, &err));
+    EXPECT(frame == frames[order[k]]);
+  }
+
+  // Streaming writes payloads as frames are added and the frame table at
+  // the end.
+  XPDSequenceWriter streamer(option);
+  const std::string stream_filename = TempPath("sequence_stream.xpds");
+  REQUIRE(streamer.beginStream(stream_filename, &err));
+  EXPECT(streamer.streaming());
+  for (uint32_t t = 0; t < num_frames; t++) {
+    REQUIRE(streamer.addFrame(frames[t].data(), frames[t].size(), &err));
+  }
+  EXPECT(streamer.numKeyframes() == writer.numKeyframes());
+  std::vector<uint8_t> unused;
+  EXPECT(!streamer.finish(&unused, &ignored));
+  REQUIRE(streamer.finishStream(&err));
+  EXPECT(!streamer.streaming());
+  EXPECT(streamer.numFrames() == 0);
+  EXPECT(!writer.beginStream(stream_filename, &ignored));
+
+  XPDSequenceReader stream_reader;
+  REQUIRE(stream_reader.open(stream_filename, &err));
+  REQUIRE(stream_reader.numFrames() == num_frames);
+  for (uint32_t t = 0; t < num_frames; t++) {
+    XPDHeader xpd;
+    std::vector<uint8_t> frame;
+    REQUIRE(stream_reader.readFrame(t, &xpd, &frame, &err));
+    EXPECT(frame == frames[t]);
+    EXPECT(stream_reader.isKeyframe(t) == reader.isKeyframe(t));
+  }
+
+  // Version 1 data(24 byte header followed by the frame table) is read.
+  std::vector<uint8_t> v1(seq.begin(), seq.begin() + 24);
+  v1.insert(v1.end(), seq.begin() + 32, seq.end());
+  const uint32_t version = 1;
+  memcpy(&v1[4], &version, sizeof(uint32_t));
+  for (uint32_t i = 0; i < num_frames; i++) {
+    uint64_t offset;
+    memcpy(&offset, &v1[24 + i * 24], sizeof(uint64_t));
+    offset -= 8;
+    memcpy(&v1[24 + i * 24], &offset, sizeof(uint64_t));
+  }
+  XPDSequenceReader v1_reader;
+  REQUIRE(v1_reader.open(v1.data(), v1.size(), &err));
+  XPDHeader xpd;
+  std::vector<uint8_t> frame;
+  REQUIRE(v1_reader.readFrame(num_frames - 1, &xpd, &frame, &err));
+  EXPECT(frame == frames[num_frames - 1]);
+}
+
+static void TestDecodeCacheRoundTrip() {
+  std::string err;
+  std::vector<uint8_t> data;
+  REQUIRE(ReadFile(SamplePath("sample.xpd"), &data));
+  XPDHeader xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, &err));
+  const uint64_t content_hash = XPDContentHash(data.data(), data.size());
+
+  XPDSplineSoA ref;
+  REQUIRE(ExtractSplineSoA(xpd, data.data(), data.size(), 0,
+                           XPDSplineSoAOption(), &ref, &err));
+
+  const std::string dir = TempPath("cache");
+  {
+    // Clear entries of previous runs.
+    XPDDecodeCache cache;
+    REQUIRE(cache.open(dir, 1, &err));
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    XPDDecodeCache cache;
+    REQUIRE(cache.open(dir, 0, &err));
+    XPDSplineSoA soa;
+    REQUIRE(ExtractSplineSoACached(&cache, content_hash, xpd, data.data(),
+                                   data.size(), 0, XPDSplineSoAOption(), &soa,
+                                   &err));
+    EXPECT(soa.numCurves == ref.numCurves);
+    EXPECT(soa.px == ref.px);
+    EXPECT(soa.width == ref.width);
+    EXPECT(soa.faceCurveOffset == ref.faceCurveOffset);
+    EXPECT(cache.stats().hits == uint64_t(pass));
+  }
+
+  XPDDecodeCache cache;
+  REQUIRE(cache.open(dir, 0, &err));
+
+  // Views read arrays in place on a hit, and decoded arrays on a miss.
+  {
+    XPDSplineSoAView view;
+    REQUIRE(ExtractSplineSoAViewCached(&cache, content_hash, xpd, data.data(),
+                                       data.size(), 0, XPDSplineSoAOption(),
+                                       &view, &err));
+    EXPECT(cache.stats().hits == 1);
+    EXPECT(view.numCurves == ref.numCurves);
+    EXPECT(view.decoded.px.empty());
+    const uint8_t *px = nullptr;
+    uint64_t px_size = 0;
+    EXPECT(view.entry.section("px", &px, &px_size));
+    EXPECT(reinterpret_cast<const uint8_t *>(view.px.data) == px);
+    EXPECT(std::vector<float>(view.px.data, view.px.data + view.px.size) ==
+           ref.px);
+    EXPECT(std::vector<float>(view.width.data,
+                              view.width.data + view.width.size) ==
+           ref.width);
+    EXPECT(std::vector<uint32_t>(view.faceCurveOffset.data,
+                                 view.faceCurveOffset.data +
+                                     view.faceCurveOffset.size) ==
+           ref.faceCurveOffset);
+
+    XPDSplineSoAView uncached;
+    REQUIRE(ExtractSplineSoAViewCached(nullptr, content_hash, xpd,
+                                       data.data(), data.size(), 0,
+                                       XPDSplineSoAOption(), &uncached, &err));
+    EXPECT(uncached.px.data == uncached.decoded.px.data());
+    EXPECT(uncached.px.size == ref.px.size());
+    EXPECT(uncached.decoded.px == ref.px);
+  }
+  for (int pass = 0; pass < 2; pass++) {
+    XPDCurveBuffers buffers;
+    REQUIRE(ExtractCurveBuffers(xpd, data.data(), data.size(), 0,
+                                XPDCurveBufferOption(), &buffers, &err));
+    XPDCurveBuffersView view;
+    REQUIRE(ExtractCurveBuffersViewCached(&cache, content_hash, xpd,
+                                          data.data(), data.size(), 0,
+                                          XPDCurveBufferOption(), &view,
+                                          &err));
+    EXPECT(view.decoded.cvs.empty() == (pass == 1));
+    EXPECT(view.numCurves == buffers.numCurves);
+    EXPECT(std::vector<float>(view.cvs.data, view.cvs.data + view.cvs.size) ==
+           buffers.cvs);
+    EXPECT(std::vector<uint32_t>(view.segmentIndices.data,
+                                 view.segmentIndices.data +
+                                     view.segmentIndices.size) ==
+           buffers.segmentIndices);
+  }
+  const float bounds[6] = {1, 2, 3, 4, 5, 6};
+  const XPDCacheKey key = MakeXPDCacheKey(content_hash, "bounds", nullptr, 0);
+  std::vector<XPDCacheSection> sections;
+  sections.push_back(XPDCacheSection("bounds", bounds, sizeof(bounds)));
+  REQUIRE(cache.store(key, sections, &err));
+  XPDCacheEntry entry;
+  REQUIRE(cache.lookup(key, &entry));
+  const uint8_t *p = nullptr;
+  uint64_t n = 0;
+  EXPECT(entry.section("bounds", &p, &n) && (n == sizeof(bounds)) &&
+         (memcmp(p, bounds, sizeof(bounds)) == 0));
+}
+
+static void TestReorderRoundTrip() {
+  std::string err;
+  // 64 faces on a 8x8 grid in shuffled order.
+  const uint32_t num_faces = 64;
+  XPDSplineSoA soa;
+  std::vector<int> faceid;
+  std::vector<uint32_t> curve_face;
+  for (uint32_t f = 0; f < num_faces; f++) {
+    faceid.push_back(int(100 + f));
+  }
+  uint32_t rng = 12345;
+  for (uint32_t i = 0; i < 500; i++) {
+    rng = rng * 1664525u + 1013904223u;
+    const uint32_t f = (rng >> 8) % num_faces;
+    const uint32_t cell = (f * 37) % num_faces;
+    for (uint32_t c = 0; c < 3; c++) {
+      soa.px.push_back(float(cell % 8) + 0.001f * float(i));
+      soa.py.push_back(float(c));
+      soa.pz.push_back(float(cell / 8));
+    }
+    soa.id.push_back(float(i));
+    curve_face.push_back(f);
+  }
+  soa.numCurves = 500;
+  soa.numCVsPerCurve = 3;
+
+  std::vector<uint8_t> data;
+  REQUIRE(WriteSplineXPDFromSoA(soa, faceid, curve_face,
+                                XPDSplineWriteOption(), &data, &err));
+  XPDHeader xpd;
+  REQUIRE(ParseXPDHeaderFromMemory(data.data(), data.size(), &xpd, &err));
+
+  const XPDSpatialOrder orders[] = {XPDSpatialOrderMorton,
+                                    XPDSpatialOrderHilbert};
+  for (size_t k = 0; k < 2; k++) {
+    XPDReorderOption option;
+    option.order = orders[k];
+    option.numThreads = 3;
+    std::vector<uint8_t> out;
+    REQUIRE(ReorderXPD(xpd, data.data(), data.size(), option, &out, &err));
+    XPDHeader out_xpd;
+    REQUIRE(ParseXPDHeaderFromMemory(out.data(), out.size(), &out_xpd, &err));
+    EXPECT(out.size() == data.size());
+    EXPECT(CollectPrims(out_xpd, out, 0) == CollectPrims(xpd, data, 0));
+    EXPECT(out_xpd.faceid != xpd.faceid);
+  }
+
+  XPDReorderOption none;
+  none.order = XPDSpatialOrderNone;
+  none.sortPrims = false;
+  std::vector<uint8_t> out;
+  REQUIRE(ReorderXPD(xpd, data.data(), data.size(), none, &out, &err));
+  EXPECT(out == data);
+
+  // Prims of face 0 moved to the end of the data, followed by padding.
+  // Block positions are no longer increasing and padding is not copied.
+  std::vector<uint8_t> moved = data;
+  XPDHeader moved_xpd = xpd;
+  const size_t face0 = size_t(xpd.blockPosition[0]);
+  const size_t face0_size = size_t(xpd.numPrims[0]) * xpd.primSize[0] * 4;
+  moved_xpd.blockPosition[0] = moved.size();
+  moved.insert(moved.end(), data.begin() + std::ptrdiff_t(face0),
+               data.begin() + std::ptrdiff_t(face0 + face0_size));
+  moved.resize(moved.size() + 16, 0xcd);
+  std::vector<uint8_t> moved_out;
+  REQUIRE(ReorderXPD(moved_xpd, moved.data(), moved.size(), none, &moved_out,
+                     &err));
+  EXPECT(moved_out == data);
+}
+
+// ---------------------------------------------
+
+struct TestCase {
+  const char *name;
+  void (*func)();
+};
+
+static const TestCase kTests[] = {
+    {"channels", TestChannels},
+    {"compact_header_duplicated_names", TestCompactHeaderDuplicatedNames},
+    {"batch_open_rejects_oversized_header",
+     TestBatchOpenRejectsOversizedHeader},
+    {"partial_reader_rejects_corrupt_counts",
+     TestPartialReaderRejectsCorruptCounts},
+    {"io_backends", TestIOBackends},
+    {"curve_buffers", TestCurveBuffers},
+    {"curve_resample", TestCurveResample},
+    {"specialized_decoders", TestSpecializedDecoders},
+    {"xpd_file_concurrent_readers", TestXPDFileConcurrentReaders},
+    {"parallel_serializer", TestParallelSerializer},
+    {"spline_writer_round_trip", TestSplineWriterRoundTrip},
+    {"varying_cv_round_trip", TestVaryingCVRoundTrip},
+    {"residency_budget", TestResidencyBudget},
+    {"reduce_deterministic", TestReduceDeterministic},
+    {"rebind_non_finite_root", TestRebindNonFiniteRoot},
+    {"rebind_keeps_records", TestRebindKeepsRecords},
+    {"transform_round_trip", TestTransformRoundTrip},
+    {"sequence_round_trip", TestSequenceRoundTrip},
+    {"decode_cache_round_trip", TestDecodeCacheRoundTrip},
+    {"reorder_round_trip", TestReorderRoundTrip},
+};
+
+int main(int argc, char **argv) {
+  // tester [filter] [samples dir]
+  const char *filter = (argc > 1) ? argv[1] : nullptr;
+  if (argc > 2) {
+    g_samples = argv[2];
+  }
+
+  int num_run = 0;
+  for (size_t i = 0; i < sizeof(kTests) / sizeof(kTests[0]); i++) {
+    if (filter && !strstr(kTests[i].name, filter)) {
+      continue;
+    }
+    const int failures = g_failures;
+    kTests[i].func();
+    printf("[%s] %s\n", (g_failures == failures) ? " OK " : "FAIL",
+           kTests[i].name);
+    num_run++;
+  }
+
+  printf("%d tests, %d failures.\n", num_run, g_failures);
+  return (g_failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -34,8 +34,19 @@ THE SOFTWARE.
 */
 
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace tiny_xpd {
@@ -49,6 +60,78 @@ struct Xpd {
 
 // ---------------------------------------------
 
+///
+/// Reference to a name. Not null-terminated.
+///
+struct XPDStringRef {
+  const char *data;
+  uint32_t length;  // Excluding '\0'.
+
+  XPDStringRef() : data(nullptr), length(0) {}
+  XPDStringRef(const char *_data, uint32_t _length)
+      : data(_data), length(_length) {}
+
+  std::string str() const { return std::string(data, length); }
+};
+
+///
+/// Compare name `a` with `s`(`length` characters) like `memcmp`: by
+/// characters, then a shorter name first.
+///
+inline int CompareXPDNames(const XPDStringRef &a, const char *s,
+                           const size_t length) {
+  const size_t len = (a.length < length) ? a.length : length;
+  const int c = (len > 0) ? memcmp(a.data, s, len) : 0;
+  if (c != 0) {
+    return c;
+  }
+  return (a.length < length) ? -1 : ((a.length > length) ? 1 : 0);
+}
+
+///
+/// Sorted name index, the name lookup of `XPDHeader` and `XPDCompactHeader`.
+/// `order` holds name indices sorted by name, with equal names in index
+/// order. `name_at(i)` returns the `XPDStringRef` of name `i`.
+///
+template <typename NameAt>
+void SortXPDNameIndex(const NameAt &name_at, const uint32_t n,
+                      uint32_t *order) {
+  for (uint32_t i = 0; i < n; i++) {
+    order[i] = i;
+  }
+  // Stable, so that duplicated names stay in index order.
+  std::stable_sort(order, order + n,
+                   [&name_at](const uint32_t a, const uint32_t b) {
+                     const XPDStringRef rb = name_at(b);
+                     return CompareXPDNames(name_at(a), rb.data, rb.length) <
+                            0;
+                   });
+}
+
+///
+/// Find a name in a sorted name index with binary search. No allocation.
+/// Duplicated names resolve to the first occurrence. Return -1 when not
+/// found.
+///
+template <typename NameAt>
+int FindXPDNameIndex(const NameAt &name_at, const uint32_t *order,
+                     const uint32_t n, const char *s, const size_t length) {
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (CompareXPDNames(name_at(order[mid]), s, length) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  // Leftmost match, which is the first occurrence.
+  if ((lo < n) && (CompareXPDNames(name_at(order[lo]), s, length) == 0)) {
+    return int(order[lo]);
+  }
+  return -1;
+}
+
 // Based on XPD3 file format
 // https://knowledge.autodesk.com/support/maya/learn-explore/caas/CloudHelp/cloudhelp/2016/ENU/Maya/files/GUID-43899CB9-CE0F-476E-9E94-591AE2F1F807-htm.html
 struct XPDHeader {
@@ -67,12 +150,52 @@ struct XPDHeader {
   std::vector<uint32_t> primSize;
 
   std::vector<std::string> key;
+
+  // First occurrence for duplicated keys. Filled for compatibility. Use
+  // `findKey` for lookups.
   std::map<std::string, int> keyToId;
 
   std::vector<int> faceid;
   std::vector<uint32_t> numPrims;
   std::vector<uint64_t> blockPosition; // Absolute from the beginning of XPD data
 
+  ///
+  /// Find a block/key index by name in O(log n) with the sorted name index
+  /// built by the parser. No allocation. Duplicated names resolve to the
+  /// first occurrence. Return -1 when not found.
+  ///
+  /// The index is the only lookup structure, so call `rebuildNameTables()`
+  /// after editing `block` or `key`. Until then, lookups return -1 when the
+  /// number of names changed, and may miss edited names otherwise.
+  ///
+  int findBlock(const char *name, const size_t length) const {
+    return Find(block, blockOrder_, name, length);
+  }
+
+  int findBlock(const std::string &name) const {
+    return findBlock(name.c_str(), name.size());
+  }
+
+  int findKey(const char *name, const size_t length) const {
+    return Find(key, keyOrder_, name, length);
+  }
+
+  int findKey(const std::string &name) const {
+    return findKey(name.c_str(), name.size());
+  }
+
+  ///
+  /// Rebuild the sorted name indices and `keyToId` from `block` and `key`.
+  ///
+  void rebuildNameTables() {
+    Sort(block, &blockOrder_);
+    Sort(key, &keyOrder_);
+    keyToId.clear();
+    for (size_t i = 0; i < key.size(); i++) {
+      keyToId.insert(std::make_pair(key[i], int(i)));
+    }
+  }
+
   XPDHeader()
       : fileVersion(0),
         primType(Xpd::PrimType::Point),  // TODO(syoyo): Set invalid value
@@ -82,6 +205,35 @@ struct XPDHeader {
         coordSpace(Xpd::CoordSpace::World),  // TODO(syoyo): Set invalid value
         numFaces(0),
         numBlocks(0) {}
+
+ private:
+  struct NameAt {
+    const std::vector<std::string> &names;
+    explicit NameAt(const std::vector<std::string> &_names) : names(_names) {}
+    XPDStringRef operator()(const uint32_t i) const {
+      return XPDStringRef(names[i].data(), uint32_t(names[i].size()));
+    }
+  };
+
+  static int Find(const std::vector<std::string> &names,
+                  const std::vector<uint32_t> &order, const char *name,
+                  const size_t length) {
+    if (order.size() != names.size()) {
+      return -1;
+    }
+    return FindXPDNameIndex(NameAt(names), order.data(),
+                            uint32_t(order.size()), name, length);
+  }
+
+  static void Sort(const std::vector<std::string> &names,
+                   std::vector<uint32_t> *order) {
+    order->resize(names.size());
+    SortXPDNameIndex(NameAt(names), uint32_t(names.size()), order->data());
+  }
+
+  // Indices of `block`(`key`) sorted by name.
+  std::vector<uint32_t> blockOrder_;
+  std::vector<uint32_t> keyOrder_;
 };
 
 ///
@@ -170,901 +322,11664 @@ bool ParseXPDHeaderFromMemory(const uint8_t *binary, const size_t binary_length,
 ///
 bool SerializeToXPD(XPDHeaderInput &input, std::vector<uint8_t> &prim_data, std::vector<uint8_t> *xpd_binary, std::string *err);
 
-}  // namespace tiny_xpd
+///
+/// View of prim data for a block in a face. Points into XPD data(no copy).
+///
+/// Prim data is not guaranteed to be 4-byte aligned in XPD data, so use
+/// `get()` to fetch values.
+///
+struct XPDBlockView {
+  const uint8_t *data;  // Points to the first prim of the block.
+  size_t numPrims;
+  uint32_t primSize;  // The number of floats per prim.
 
-#if defined(TINY_XPD_IMPLEMENTATION)
+  XPDBlockView() : data(nullptr), numPrims(0), primSize(0) {}
 
-#include <cstdlib>
-#include <cstring>
-#include <fstream>
-#include <sstream>
-#include <iostream>  // dbg
+  size_t stride() const { return primSize * sizeof(float); }
 
-namespace tiny_xpd {
+  float get(size_t prim, size_t i) const {
+    float value;
+    memcpy(&value, data + prim * stride() + i * sizeof(float), sizeof(float));
+    return value;
+  }
+};
 
 ///
-/// Simple stream reader
+/// Custom attribute channel(e.g. color, clump id) stored in a block.
 ///
-class StreamReader {
-  static inline void swap2(unsigned short *val) {
-    unsigned short tmp = *val;
-    uint8_t *dst = reinterpret_cast<uint8_t *>(val);
-    uint8_t *src = reinterpret_cast<uint8_t *>(&tmp);
+/// Channels are stored in XPD keys with the name `<block>:<name>:<arity>`,
+/// and channel values are placed at the end of each prim in key order.
+/// Keys not following this convention are treated as plain keys and ignored.
+///
+struct XPDChannel {
+  std::string name;
+  uint32_t blockId;
+  uint32_t keyId;
+  uint32_t offset;  // Offset in floats from the beginning of a prim.
+  uint32_t arity;   // The number of float components.
+
+  XPDChannel() : blockId(0), keyId(0), offset(0), arity(0) {}
+};
 
-    dst[0] = src[1];
-    dst[1] = src[0];
-  }
+///
+/// Strided view of a channel in a face. Points into XPD data(no copy).
+///
+struct XPDChannelView {
+  const uint8_t *data;  // Points to the first component of the first prim.
+  size_t numPrims;
+  size_t stride;  // in bytes
+  uint32_t arity;
 
-  static inline void swap4(uint32_t *val) {
-    uint32_t tmp = *val;
-    uint8_t *dst = reinterpret_cast<uint8_t *>(val);
-    uint8_t *src = reinterpret_cast<uint8_t *>(&tmp);
+  XPDChannelView() : data(nullptr), numPrims(0), stride(0), arity(0) {}
 
-    dst[0] = src[3];
-    dst[1] = src[2];
-    dst[2] = src[1];
-    dst[3] = src[0];
+  float get(size_t prim, uint32_t component = 0) const {
+    float value;
+    memcpy(&value, data + prim * stride + component * sizeof(float),
+           sizeof(float));
+    return value;
   }
 
-  static inline void swap4(int *val) {
-    int tmp = *val;
-    uint8_t *dst = reinterpret_cast<uint8_t *>(val);
-    uint8_t *src = reinterpret_cast<uint8_t *>(&tmp);
-
-    dst[0] = src[3];
-    dst[1] = src[2];
-    dst[2] = src[1];
-    dst[3] = src[0];
+  // Copy `arity` components of `prim` to `dst`.
+  void copy(size_t prim, float *dst) const {
+    memcpy(dst, data + prim * stride, arity * sizeof(float));
   }
+};
 
-  static inline void swap8(uint64_t *val) {
-    uint64_t tmp = (*val);
-    uint8_t *dst = reinterpret_cast<uint8_t *>(val);
-    uint8_t *src = reinterpret_cast<uint8_t *>(&tmp);
+///
+/// Get a view of prim data for `block_id` in `face`.
+///
+/// @param[in] xpd Parsed XPD header.
+/// @param[in] binary Pointer to XPD binary data.
+/// @param[in] binary_length Data length of XPD binary data.
+/// @param[in] face Face index(not a faceid).
+/// @param[in] block_id Block index.
+/// @param[out] view Block view.
+/// @param[out] err Error message(filled when failed)
+///
+bool GetBlockView(const XPDHeader &xpd, const uint8_t *binary,
+                  const size_t binary_length, const uint32_t face,
+                  const uint32_t block_id, XPDBlockView *view,
+                  std::string *err);
 
-    dst[0] = src[7];
-    dst[1] = src[6];
-    dst[2] = src[5];
-    dst[3] = src[4];
-    dst[4] = src[3];
-    dst[5] = src[2];
-    dst[6] = src[1];
-    dst[7] = src[0];
+///
+/// Add a custom attribute channel to `block` of serialization input.
+/// Appends a key(and `keyToId` entry) and grows `primSize` of the block by
+/// `arity`. App user must write channel values at `offset`(in floats) of each
+/// prim, so add channels before generating prim data.
+///
+/// @param[inout] input Input XPD header info.
+/// @param[in] block Block name. Must exist in `input->block`.
+/// @param[in] name Channel name. Must not contain '\0'.
+/// @param[in] arity The number of float components(e.g. 3 for color).
+/// @param[out] offset Offset of the channel in floats from the beginning of a
+/// prim(optional).
+/// @param[out] err Error message(filled when failed)
+///
+bool AddChannel(XPDHeaderInput *input, const std::string &block,
+                const std::string &name, const uint32_t arity,
+                uint32_t *offset, std::string *err);
+
+///
+/// Decode channels from keys of parsed XPD header.
+///
+/// @param[in] xpd Parsed XPD header.
+/// @param[out] channels Channels found in XPD.
+/// @param[out] err Error message(filled when failed)
+///
+bool GetChannels(const XPDHeader &xpd, std::vector<XPDChannel> *channels,
+                 std::string *err);
+
+///
+/// Find a channel by block name and channel name.
+/// Resolve a channel once and use `GetChannelView` for each face, rather than
+/// looking up a channel per prim.
+///
+/// Return false when the channel is not found.
+///
+bool FindChannel(const XPDHeader &xpd, const std::string &block,
+                 const std::string &name, XPDChannel *channel);
+
+///
+/// Get a strided view of `channel` in `face`.
+///
+/// @param[in] xpd Parsed XPD header.
+/// @param[in] binary Pointer to XPD binary data.
+/// @param[in] binary_length Data length of XPD binary data.
+/// @param[in] face Face index(not a faceid).
+/// @param[in] channel Channel(from `GetChannels` or `FindChannel`).
+/// @param[out] view Channel view.
+/// @param[out] err Error message(filled when failed)
+///
+bool GetChannelView(const XPDHeader &xpd, const uint8_t *binary,
+                    const size_t binary_length, const uint32_t face,
+                    const XPDChannel &channel, XPDChannelView *view,
+                    std::string *err);
+
+///
+/// Compact XPD header.
+///
+/// Unlike `XPDHeader`, all parsed tables(primSize, faceid, numPrims,
+/// blockPosition, name references and sorted name tables) live in one arena
+/// allocation owned by the header, and names reference XPD data without copy.
+/// Use this when opening many XPD files to reduce allocator churn.
+///
+/// XPD data must not be free'ed until finishing accessing names.
+///
+class XPDCompactHeader {
+ public:
+  unsigned char fileVersion;
+  Xpd::PrimType primType;
+  unsigned char primVersion;
+  float time;
+  uint32_t numCVs;
+  Xpd::CoordSpace coordSpace;
+  uint32_t numFaces;
+  uint32_t numBlocks;
+  uint32_t numKeys;
+
+  XPDCompactHeader()
+      : fileVersion(0),
+        primType(Xpd::PrimType::Point),
+        primVersion(0),
+        time(0.0f),
+        numCVs(0),
+        coordSpace(Xpd::CoordSpace::World),
+        numFaces(0),
+        numBlocks(0),
+        numKeys(0),
+        binary_(nullptr),
+        blockNameOffset_(0),
+        keyNameOffset_(0),
+        primSizeOffset_(0),
+        faceidOffset_(0),
+        numPrimsOffset_(0),
+        blockSortedOffset_(0),
+        keySortedOffset_(0) {}
+
+  XPDStringRef block(const uint32_t i) const { return name(blockNameOffset_, i); }
+  XPDStringRef key(const uint32_t i) const { return name(keyNameOffset_, i); }
+
+  uint32_t primSize(const uint32_t i) const {
+    return table<uint32_t>(primSizeOffset_)[i];
   }
 
-  static inline void swap8(int64_t *val) {
-    int64_t tmp = (*val);
-    uint8_t *dst = reinterpret_cast<uint8_t *>(val);
-    uint8_t *src = reinterpret_cast<uint8_t *>(&tmp);
+  int faceid(const uint32_t face) const {
+    return table<int32_t>(faceidOffset_)[face];
+  }
 
-    dst[0] = src[7];
-    dst[1] = src[6];
-    dst[2] = src[5];
-    dst[3] = src[4];
-    dst[4] = src[3];
-    dst[5] = src[2];
-    dst[6] = src[1];
-    dst[7] = src[0];
+  uint32_t numPrims(const uint32_t face) const {
+    return table<uint32_t>(numPrimsOffset_)[face];
   }
 
-  static void cpy4(int *dst_val, const int *src_val) {
-    unsigned char *dst = reinterpret_cast<unsigned char *>(dst_val);
-    const unsigned char *src = reinterpret_cast<const unsigned char *>(src_val);
+  // Absolute from the beginning of XPD data
+  uint64_t blockPosition(const uint32_t face, const uint32_t block_id) const {
+    return arena_[size_t(face) * numBlocks + block_id];
+  }
 
-    dst[0] = src[0];
-    dst[1] = src[1];
-    dst[2] = src[2];
-    dst[3] = src[3];
+  ///
+  /// Find a block/key index by name with the sorted name index(same as
+  /// `XPDHeader`). No allocation. Duplicated names resolve to the first
+  /// occurrence. Return -1 when not found.
+  ///
+  int findBlock(const char *name, const size_t length) const {
+    return find(blockNameOffset_, blockSortedOffset_, numBlocks, name, length);
   }
 
-  static void cpy4(uint32_t *dst_val, const uint32_t *src_val) {
-    unsigned char *dst = reinterpret_cast<unsigned char *>(dst_val);
-    const unsigned char *src = reinterpret_cast<const unsigned char *>(src_val);
+  int findBlock(const std::string &name) const {
+    return findBlock(name.c_str(), name.size());
+  }
 
-    dst[0] = src[0];
-    dst[1] = src[1];
-    dst[2] = src[2];
-    dst[3] = src[3];
+  int findKey(const char *name, const size_t length) const {
+    return find(keyNameOffset_, keySortedOffset_, numKeys, name, length);
   }
 
- public:
-  explicit StreamReader(const uint8_t *binary, const size_t length,
-                        const bool swap_endian)
-      : binary_(binary), length_(length), swap_endian_(swap_endian), idx_(0) {
-    (void)pad_;
+  int findKey(const std::string &name) const {
+    return findKey(name.c_str(), name.size());
   }
 
-  bool seek_set(const uint64_t offset) {
-    if (offset > length_) {
-      return false;
-    }
+  // Arena size in bytes.
+  size_t arenaSize() const { return arena_.size() * sizeof(uint64_t); }
 
-    idx_ = offset;
-    return true;
+ private:
+  friend bool ParseXPDCompactHeaderFromMemory(const uint8_t *binary,
+                                              const size_t binary_length,
+                                              XPDCompactHeader *xpd_header,
+                                              std::string *err);
+
+  template <typename T>
+  const T *table(const size_t byte_offset) const {
+    return reinterpret_cast<const T *>(
+        reinterpret_cast<const uint8_t *>(arena_.data()) + byte_offset);
   }
 
-  bool seek_from_currect(const int64_t offset) {
-    if ((int64_t(idx_) + offset) < 0) {
-      return false;
-    }
+  // Name table is an array of (offset from `binary_`, length).
+  XPDStringRef name(const size_t table_offset, const uint32_t i) const {
+    const uint32_t *entry = table<uint32_t>(table_offset) + 2 * i;
+    return XPDStringRef(reinterpret_cast<const char *>(binary_ + entry[0]),
+                        entry[1]);
+  }
 
-    if (size_t((int64_t(idx_) + offset)) > length_) {
-      return false;
+  struct NameAt {
+    const XPDCompactHeader *header;
+    size_t tableOffset;
+    NameAt(const XPDCompactHeader *_header, const size_t _table_offset)
+        : header(_header), tableOffset(_table_offset) {}
+    XPDStringRef operator()(const uint32_t i) const {
+      return header->name(tableOffset, i);
     }
+  };
 
-    idx_ = size_t(int64_t(idx_) + offset);
-    return true;
+  int find(const size_t name_offset, const size_t sorted_offset,
+           const uint32_t n, const char *s, const size_t length) const {
+    return FindXPDNameIndex(NameAt(this, name_offset),
+                            table<uint32_t>(sorted_offset), n, s, length);
   }
 
-  size_t read(const size_t n, const uint64_t dst_len, uint8_t *dst) {
-    size_t len = n;
-    if ((idx_ + len) > length_) {
-      len = length_ - idx_;
-    }
+  const uint8_t *binary_;
+  std::vector<uint64_t> arena_;  // `blockPosition` comes first.
+
+  // Byte offsets of each table in `arena_`.
+  size_t blockNameOffset_;
+  size_t keyNameOffset_;
+  size_t primSizeOffset_;
+  size_t faceidOffset_;
+  size_t numPrimsOffset_;
+  size_t blockSortedOffset_;
+  size_t keySortedOffset_;
+};
 
-    if (len > 0) {
-      if (dst_len < len) {
-        // dst does not have enough space. return 0 for a while.
-        return 0;
-      }
+///
+/// Parse XPD header from a memory into `XPDCompactHeader`.
+/// Performs one heap allocation for all tables of the header.
+/// This API does not create an internal copy of `binary`.
+///
+/// @param[in] binary Pointer to XPD binary data.
+/// @param[in] binary_length Data length of XPD binary data.
+/// @param[out] xpd_header Parsed XPD header.
+/// @param[out] err Error string. Filled when failed to parse XPD data.
+///
+bool ParseXPDCompactHeaderFromMemory(const uint8_t *binary,
+                                     const size_t binary_length,
+                                     XPDCompactHeader *xpd_header,
+                                     std::string *err);
 
-      memcpy(dst, &binary_[idx_], len);
-      idx_ += len;
-      return len;
+///
+/// Compute the size of XPD header(the end of `blockPosition` table) from the
+/// beginning of XPD data, without reading the whole header.
+///
+/// When `*required` is greater than `length`, `data` does not contain enough
+/// bytes. Call again with at least `*required` bytes. Otherwise `*required` is
+/// the header size.
+///
+/// @param[in] data Pointer to the beginning of XPD data.
+/// @param[in] length Available data length.
+/// @param[out] required Required bytes or header size.
+/// @param[out] err Error string. Filled when data is not a XPD.
+///
+bool PeekXPDHeaderSize(const uint8_t *data, const size_t length,
+                       uint64_t *required, std::string *err);
 
-    } else {
-      return 0;
-    }
-  }
+///
+/// Read-only memory mapped file.
+///
+class XPDMappedFile {
+ public:
+  XPDMappedFile();
+  ~XPDMappedFile();
 
-  bool read1(uint8_t *ret) {
-    if ((idx_ + 1) > length_) {
-      return false;
-    }
+  XPDMappedFile(XPDMappedFile &&rhs);
+  XPDMappedFile &operator=(XPDMappedFile &&rhs);
 
-    const uint8_t val = binary_[idx_];
+  bool open(const std::string &filename, std::string *err);
 
-    (*ret) = val;
-    idx_ += 1;
+#if !defined(_WIN32)
+  /// Map `size` bytes of an opened file descriptor. `fd` can be closed after
+  /// this call.
+  bool map(const int fd, const uint64_t size, std::string *err);
+#endif
 
-    return true;
-  }
+  void close();
 
-  bool read_bool(bool *ret) {
-    if ((idx_ + 1) > length_) {
-      return false;
-    }
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
 
-    const char val = static_cast<const char>(binary_[idx_]);
+ private:
+  XPDMappedFile(const XPDMappedFile &);
+  XPDMappedFile &operator=(const XPDMappedFile &);
+
+  const uint8_t *data_;
+  size_t size_;
+#if defined(_WIN32)
+  void *file_;
+  void *mapping_;
+#endif
+};
 
-    (*ret) = bool(val);
-    idx_ += 1;
+struct XPDBatchOpenOption {
+  uint32_t numThreads;    // For pread backend. 0 = use hardware concurrency.
+  uint32_t queueDepth;    // For io_uring backend.
+  size_t headerReadSize;  // Size of the first read for each file.
+  bool mapFiles;          // Map whole file after parsing the header.
+  bool useIOUring;  // Requires Linux and TINY_XPD_USE_IO_URING. Falls back to
+                    // pread when io_uring is not available.
+
+  XPDBatchOpenOption()
+      : numThreads(0),
+        queueDepth(64),
+        headerReadSize(64 * 1024),
+        mapFiles(true),
+        useIOUring(true) {}
+};
 
-    return true;
-  }
+struct XPDBatchOpenResult {
+  bool ok;
+  std::string err;
+  uint64_t fileSize;
+  XPDHeader header;
+  XPDMappedFile file;  // Valid when `XPDBatchOpenOption::mapFiles` is true.
 
-  bool read1(char *ret) {
-    if ((idx_ + 1) > length_) {
+  XPDBatchOpenResult() : ok(false), fileSize(0) {}
+};
+
+///
+/// Open many XPD files at once.
+///
+/// Reads only the header region of each file(the first `headerReadSize`
+/// bytes, then the rest of the header if required), and parses headers as
+/// reads complete. Prim data is accessed through the mapped file.
+/// Opens and reads are submitted through io_uring when available, or done in
+/// worker threads with pread.
+///
+/// @param[in] filenames XPD filenames.
+/// @param[in] option Options.
+/// @param[out] results Results. Same length and order with `filenames`.
+/// @param[out] err Error string.
+///
+/// Return false when any file failed to open. Check `XPDBatchOpenResult::ok`
+/// and `XPDBatchOpenResult::err` for each file.
+///
+bool BatchOpenXPDFiles(const std::vector<std::string> &filenames,
+                       const XPDBatchOpenOption &option,
+                       std::vector<XPDBatchOpenResult> *results,
+                       std::string *err);
+
+struct XPDResidencyOption {
+  // Bytes of prim data kept resident. Pages of released faces are dropped
+  // once this is exceeded. 0 = unlimited.
+  uint64_t residentBudget;
+
+  // Bytes of prim data prefetched ahead of an acquired face(in file order).
+  // 0 = no prefetch.
+  uint64_t prefetchWindow;
+
+  bool sequential;     // Advise sequential access for the whole mapping.
+  bool dropPageCache;  // Also drop pages of released faces from page cache.
+
+  XPDResidencyOption()
+      : residentBudget(uint64_t(256) << 20),
+        prefetchWindow(uint64_t(32) << 20),
+        sequential(true),
+        dropPageCache(true) {}
+};
+
+///
+/// Bounds resident memory while decoding faces of a large mapped XPD file.
+///
+/// Call `acquire(face)` before and `release(face)` after decoding a face.
+/// Faces in a sliding window ahead of the acquired face are prefetched
+/// (MADV_WILLNEED), and pages of released faces are dropped(MADV_DONTNEED,
+/// and POSIX_FADV_DONTNEED for page cache) in release order while resident
+/// bytes exceed the budget. Prefetch stops at the budget, and prefetched
+/// faces which are not acquired are dropped after released faces(farthest
+/// first) and prefetched again when the window reaches them. Resident bytes
+/// are estimated from advised ranges, not measured.
+///
+/// Thread-safe. On Windows only bookkeeping is done.
+///
+class XPDResidencyManager {
+ public:
+  XPDResidencyManager();
+  ~XPDResidencyManager();
+
+  /// Open and map `filename`, and parse its header.
+  bool open(const std::string &filename, const XPDResidencyOption &option,
+            std::string *err);
+
+  void close();
+
+  const XPDHeader &header() const { return header_; }
+  const uint8_t *data() const { return file_.data(); }
+  size_t size() const { return file_.size(); }
+
+  /// Call before decoding `face`(index, not a faceid).
+  void acquire(const uint32_t face);
+
+  /// Call after decoding `face`.
+  void release(const uint32_t face);
+
+  /// Drop pages of all faces not acquired.
+  void dropAll();
+
+  uint64_t residentBytes() const;
+  uint64_t peakResidentBytes() const;
+  uint64_t droppedBytes() const;
+
+  /// The number of failed madvise/posix_fadvise calls. Also counted in
+  /// `XPDProfileStats::adviseFailures`.
+  uint64_t adviseFailures() const;
+
+ private:
+  XPDResidencyManager(const XPDResidencyManager &);
+  XPDResidencyManager &operator=(const XPDResidencyManager &);
+
+  enum FaceState { FaceCold = 0, FacePrefetched, FaceAcquired, FaceReleased };
+
+  uint64_t faceBytes(const uint32_t face) const {
+    return face_end_[face] - face_begin_[face];
+  }
+  void advise(uint64_t begin, uint64_t end, const bool drop);
+  void evict();
+  // Drop released faces(and prefetched faces when `prefetched`) until
+  // resident bytes are at most `target`.
+  void evictTo(const uint64_t target, const bool prefetched);
+  void drop(const uint32_t face);
+
+  XPDMappedFile file_;
+  XPDHeader header_;
+  XPDResidencyOption option_;
+  int fd_;
+  uint64_t page_size_;
+
+  // Byte range of prim data of each face. [numFaces]
+  std::vector<uint64_t> face_begin_;
+  std::vector<uint64_t> face_end_;
+  std::vector<uint32_t> file_order_;   // Faces sorted by offset.
+  std::vector<uint32_t> order_index_;  // Index of a face in `file_order_`.
+
+  std::vector<uint8_t> state_;
+  std::vector<uint32_t> refs_;
+  std::vector<uint64_t> state_seq_;  // Seq of the last release or prefetch.
+  std::deque<std::pair<uint32_t, uint64_t> > released_;    // face, seq
+  std::deque<std::pair<uint32_t, uint64_t> > prefetched_;  // face, seq
+  uint64_t seq_;
+  size_t prefetch_cursor_;  // Faces before this in `file_order_` were
+                            // considered for prefetch.
+
+  uint64_t resident_;
+  uint64_t peak_;
+  uint64_t dropped_;
+  uint64_t advise_failures_;
+  mutable std::mutex mutex_;
+};
+
+///
+/// Read `n` bytes at `offset`(from the beginning of XPD data) to `dst`.
+/// Return false when failed to read `n` bytes.
+///
+typedef std::function<bool(uint64_t offset, size_t n, uint8_t *dst)>
+    XPDReadCallback;
+
+class XPDIO;
+
+///
+/// Variable CV count extension.
+///
+/// `numCVs` of XPD is global. Splines with a different CV count per strand
+/// are stored with an extension block `<block>:varyingCVs` next to the spline
+/// block `<block>`. The extension block has 2 values per prim, the CV count
+/// and the index of the first CV in the face(uint32), followed by packed CVs
+/// (xyz) of all prims in the face.
+///
+/// The spline block itself stores the root and tip CVs(`numCVs` = 2), so
+/// readers which do not know the extension still see valid strands.
+///
+struct XPDVaryingCVView {
+  const uint8_t *table;  // CV count and CV offset per prim.
+  const uint8_t *cvs;    // Points to the first CV of the face.
+  size_t numPrims;
+  size_t numCVs;  // The number of CVs referenced from prims of the face.
+
+  XPDVaryingCVView()
+      : table(nullptr), cvs(nullptr), numPrims(0), numCVs(0) {}
+
+  uint32_t count(size_t prim) const {
+    uint32_t value;
+    memcpy(&value, table + prim * 2 * sizeof(uint32_t), sizeof(uint32_t));
+    return value;
+  }
+
+  uint32_t offset(size_t prim) const {
+    uint32_t value;
+    memcpy(&value, table + (prim * 2 + 1) * sizeof(uint32_t),
+           sizeof(uint32_t));
+    return value;
+  }
+
+  // xyz of CVs of `prim`(may be unaligned).
+  const uint8_t *cvData(size_t prim) const {
+    return cvs + size_t(offset(prim)) * 3 * sizeof(float);
+  }
+};
+
+///
+/// Prim data of all blocks in a face, fetched by `XPDPartialReader`.
+///
+struct XPDFaceData {
+  uint32_t face;
+  uint32_t numPrims;
+  std::vector<uint8_t> data;
+  std::vector<XPDBlockView> blocks;  // Points into `data`.
+
+  // Per-prim CV counts and CVs of spline blocks with the variable CV count
+  // extension(see `GetVaryingCVView`), indexed by the spline block. Points
+  // into `data`. `table` is null for other blocks. [numBlocks]
+  std::vector<XPDVaryingCVView> varyingCVs;
+
+  XPDFaceData() : face(0), numPrims(0) {}
+
+ private:
+  XPDFaceData(const XPDFaceData &);
+  XPDFaceData &operator=(const XPDFaceData &);
+};
+
+///
+/// XPD reader which reads only the header at open, and fetches prim data
+/// one face at a time on demand. Fetched faces are kept in a LRU cache.
+/// Useful for inspecting XPD on network storage.
+///
+/// Not thread-safe.
+///
+class XPDPartialReader {
+ public:
+  XPDPartialReader();
+  ~XPDPartialReader();
+
+  ///
+  /// Open XPD file and read its header with pread.
+  ///
+  bool open(const std::string &filename, std::string *err);
+
+  ///
+  /// Open XPD data with a user-supplied read callback.
+  ///
+  /// @param[in] read Read callback.
+  /// @param[in] size XPD data size in bytes. Header and face reads beyond it
+  ///            fail before allocating. Without it, buffers grow
+  ///            geometrically as reads succeed, so corrupt counts fail at the
+  ///            end of data.
+  /// @param[out] err Error string.
+  ///
+  bool open(const XPDReadCallback &read, const uint64_t size,
+            std::string *err);
+  bool open(const XPDReadCallback &read, std::string *err);
+
+  ///
+  /// Open XPD data through an I/O backend. `io` must outlive the reader.
+  ///
+  bool open(XPDIO *io, std::string *err);
+
+  void close();
+
+  const XPDHeader &header() const { return header_; }
+
+  // Header size in bytes(the beginning of prim data).
+  uint64_t headerSize() const { return header_size_; }
+
+  ///
+  /// Set the budget of LRU face cache in bytes. The most recently fetched face
+  /// is always kept. Default 64MB.
+  ///
+  void setCacheSize(const size_t max_bytes);
+
+  ///
+  /// Get prim data of `face`(face index, not a faceid). Fetched from the
+  /// source when not cached. Returned data stays valid after eviction.
+  /// CVs of the variable CV count extension are fetched as well(see
+  /// `XPDFaceData::varyingCVs`).
+  ///
+  bool readFace(const uint32_t face,
+                std::shared_ptr<const XPDFaceData> *face_data,
+                std::string *err);
+
+  // Total bytes read from the source.
+  uint64_t bytesRead() const { return bytes_read_; }
+
+  size_t cacheHits() const { return cache_hits_; }
+  size_t cacheMisses() const { return cache_misses_; }
+
+ private:
+  XPDPartialReader(const XPDPartialReader &);
+  XPDPartialReader &operator=(const XPDPartialReader &);
+
+  bool read(const uint64_t offset, const size_t n, uint8_t *dst,
+            std::string *err);
+  bool readAppend(const uint64_t offset, const uint64_t n,
+                  std::vector<uint8_t> *buf, std::string *err);
+  void evict();
+
+  typedef std::list<uint32_t> LRUList;
+  struct CacheEntry {
+    std::shared_ptr<const XPDFaceData> data;
+    LRUList::iterator lru;
+  };
+
+  XPDReadCallback read_;
+  uint64_t size_;  // UINT64_MAX when unknown.
+  XPDHeader header_;
+  uint64_t header_size_;
+  std::shared_ptr<XPDIO> file_io_;  // Owned backend for `open(filename)`.
+
+  // Variable CV count extension block of each block(numBlocks = none).
+  std::vector<uint32_t> varying_ext_;
+
+  LRUList lru_;  // front = most recently used
+  std::unordered_map<uint32_t, CacheEntry> cache_;
+  size_t cache_bytes_;
+  size_t max_cache_bytes_;
+
+  uint64_t bytes_read_;
+  size_t cache_hits_;
+  size_t cache_misses_;
+};
+
+///
+/// I/O backend interface. Parser, writer and `XPDPartialReader` access XPD
+/// data through this interface, so the same code runs against memory, local
+/// disk and remote storage.
+///
+class XPDIO {
+ public:
+  virtual ~XPDIO();
+
+  // Data size in bytes.
+  virtual uint64_t size() const = 0;
+
+  ///
+  /// Read `n` bytes at `offset` to `dst`.
+  /// Return false when failed to read `n` bytes.
+  ///
+  virtual bool readAt(const uint64_t offset, const size_t n, uint8_t *dst,
+                      std::string *err) = 0;
+
+  ///
+  /// Write `n` bytes of `src` at `offset`. Data is extended when required.
+  /// Return false when the backend is read-only.
+  ///
+  virtual bool writeAt(const uint64_t offset, const uint8_t *src,
+                       const size_t n, std::string *err);
+
+  ///
+  /// Return a pointer to whole data when it is directly accessible(e.g.
+  /// memory, mmap) for zero-copy access. Return nullptr otherwise.
+  ///
+  virtual const uint8_t *map() const { return nullptr; }
+
+  ///
+  /// Hint that `[offset, offset + n)` will be read soon.
+  ///
+  virtual void prefetch(const uint64_t offset, const size_t n) {
+    (void)offset;
+    (void)n;
+  }
+};
+
+///
+/// Memory buffer backend. Read-only when constructed with an external buffer,
+/// otherwise data is owned and writable.
+///
+class XPDMemoryIO : public XPDIO {
+ public:
+  XPDMemoryIO() : binary_(nullptr), length_(0) {}
+  XPDMemoryIO(const uint8_t *binary, const size_t length)
+      : binary_(binary), length_(length) {}
+
+  uint64_t size() const;
+  bool readAt(const uint64_t offset, const size_t n, uint8_t *dst,
+              std::string *err);
+  bool writeAt(const uint64_t offset, const uint8_t *src, const size_t n,
+               std::string *err);
+  const uint8_t *map() const;
+
+  // Owned data(writable mode).
+  const std::vector<uint8_t> &buffer() const { return buffer_; }
+
+ private:
+  const uint8_t *binary_;
+  size_t length_;
+  std::vector<uint8_t> buffer_;
+};
+
+///
+/// File backend using pread/pwrite.
+///
+class XPDFileIO : public XPDIO {
+ public:
+  XPDFileIO();
+  ~XPDFileIO();
+
+  ///
+  /// Open a file. When `writable` is true, the file is created(or truncated).
+  ///
+  bool open(const std::string &filename, const bool writable,
+            std::string *err);
+  void close();
+
+  uint64_t size() const { return size_; }
+  bool readAt(const uint64_t offset, const size_t n, uint8_t *dst,
+              std::string *err);
+  bool writeAt(const uint64_t offset, const uint8_t *src, const size_t n,
+               std::string *err);
+  void prefetch(const uint64_t offset, const size_t n);
+
+ private:
+  XPDFileIO(const XPDFileIO &);
+  XPDFileIO &operator=(const XPDFileIO &);
+
+  int fd_;
+  std::unique_ptr<std::fstream> fs_;  // for platforms without pread
+  uint64_t size_;
+};
+
+///
+/// Read-only mmap backend.
+///
+class XPDMmapIO : public XPDIO {
+ public:
+  bool open(const std::string &filename, std::string *err) {
+    return file_.open(filename, err);
+  }
+
+  uint64_t size() const { return file_.size(); }
+  bool readAt(const uint64_t offset, const size_t n, uint8_t *dst,
+              std::string *err);
+  const uint8_t *map() const { return file_.data(); }
+  void prefetch(const uint64_t offset, const size_t n);
+
+ private:
+  XPDMappedFile file_;
+};
+
+///
+/// In-process fake object store with configurable per-request latency.
+/// Emulates remote(blob) storage for testing prefetching and partial reads.
+/// Concurrent reads are allowed, but writes must not run concurrently.
+///
+class XPDFakeObjectStoreIO : public XPDIO {
+ public:
+  explicit XPDFakeObjectStoreIO(const uint32_t latency_us = 0)
+      : latency_us_(latency_us), num_requests_(0), bytes_transferred_(0) {}
+
+  void setLatency(const uint32_t latency_us) { latency_us_ = latency_us; }
+
+  // Object data. Fill directly or through `writeAt`.
+  std::vector<uint8_t> &object() { return object_; }
+
+  uint64_t size() const { return object_.size(); }
+  bool readAt(const uint64_t offset, const size_t n, uint8_t *dst,
+              std::string *err);
+  bool writeAt(const uint64_t offset, const uint8_t *src, const size_t n,
+               std::string *err);
+
+  uint64_t numRequests() const { return num_requests_; }
+  uint64_t bytesTransferred() const { return bytes_transferred_; }
+
+ private:
+  std::vector<uint8_t> object_;
+  uint32_t latency_us_;
+  std::atomic<uint64_t> num_requests_;
+  std::atomic<uint64_t> bytes_transferred_;
+};
+
+///
+/// Parse XPD header through an I/O backend.
+/// When `io->map()` is available, prim data can be accessed through it
+/// without copy. Otherwise read prim data with `io->readAt()`.
+///
+/// @param[in] io I/O backend.
+/// @param[out] xpd_header Parsed XPD header.
+/// @param[out] err Error string. Filled when failed to parse XPD data.
+///
+bool ParseXPDFromIO(XPDIO *io, XPDHeader *xpd_header, std::string *err);
+
+///
+/// Serialize XPD data(XPD header + prim data) through an I/O backend.
+/// See `SerializeToXPD` above for details.
+///
+bool SerializeToXPD(XPDHeaderInput &input, const std::vector<uint8_t> &prim_data, XPDIO *io, std::string *err);
+
+///
+/// Callback to encode prim data of block `block_id` of face `face`(index,
+/// not a faceid) into `dst`. `dst` has
+/// `numPrims[face] * primSize[block_id] * sizeof(float)` bytes(plus
+/// `XPDParallelSerializeOption::extraBlockSize` bytes) and may be
+/// unaligned. Called concurrently from worker threads for different faces.
+/// Return false(and fill `err`) to abort serialization.
+///
+typedef std::function<bool(uint32_t face, uint32_t block_id, uint8_t *dst,
+                           std::string *err)>
+    XPDEncodeBlockCallback;
+
+struct XPDParallelSerializeOption {
+  uint32_t numThreads;  // 0 = use hardware concurrency.
+
+  // Optional. Bytes appended after prims of a block(e.g. variable length
+  // data which is referenced from prims).
+  std::function<uint64_t(uint32_t face, uint32_t block_id)> extraBlockSize;
+
+  XPDParallelSerializeOption() : numThreads(0) {}
+};
+
+///
+/// Serialize XPD data, encoding prim data of faces concurrently.
+///
+/// Unlike `SerializeToXPD`, prim data is not flattened by the caller. The
+/// size of each block is computed up front(prefix sum of
+/// `numPrims * primSize`), `input.blockOffset` is overwritten with the
+/// computed offsets, and worker threads encode faces directly into their
+/// final place in the output.
+///
+/// @param[inout] input Input XPD header info(`blockOffset` is computed).
+/// @param[in] encode Callback to encode prim data of a block of a face.
+/// @param[in] option Options.
+/// @param[out] xpd_binary Serialized XPD data.
+/// @param[out] err Error message(filled when failed to serialize)
+///
+bool SerializeToXPDParallel(XPDHeaderInput &input,
+                            const XPDEncodeBlockCallback &encode,
+                            const XPDParallelSerializeOption &option,
+                            std::vector<uint8_t> *xpd_binary,
+                            std::string *err);
+
+///
+/// Serialize XPD data through an I/O backend, encoding faces concurrently.
+/// Each face is encoded into a per-thread buffer and written with
+/// `io->writeAt()`(writes are serialized, so backends need not be
+/// thread-safe).
+///
+bool SerializeToXPDParallel(XPDHeaderInput &input,
+                            const XPDEncodeBlockCallback &encode,
+                            const XPDParallelSerializeOption &option,
+                            XPDIO *io, std::string *err);
+
+///
+/// Serialize XPD data to a file, encoding faces concurrently.
+/// On POSIX, the file is preallocated to its final size and mapped, and
+/// faces are encoded in place. Otherwise falls back to `XPDFileIO`.
+/// Data is written to a temporary file which is renamed to `filename` on
+/// success and removed on failure.
+///
+bool SerializeToXPDFileParallel(XPDHeaderInput &input,
+                                const XPDEncodeBlockCallback &encode,
+                                const XPDParallelSerializeOption &option,
+                                const std::string &filename,
+                                std::string *err);
+
+///
+/// Spline prim layout used in `xgSplineDataToXpd` sample:
+/// id, u, v, CVs(xyz * numCVs), length, width, taper, taperStart, widthVector(xyz)
+/// Offsets are in floats from the beginning of a prim.
+///
+struct XPDSplineLayout {
+  uint32_t numCVs;
+  uint32_t id;
+  uint32_t u;
+  uint32_t v;
+  uint32_t cv;
+  uint32_t length;
+  uint32_t width;
+  uint32_t taper;
+  uint32_t taperStart;
+  uint32_t widthVector;
+  uint32_t size;  // The number of floats used by the layout.
+
+  XPDSplineLayout()
+      : numCVs(0),
+        id(0),
+        u(1),
+        v(2),
+        cv(3),
+        length(3),
+        width(4),
+        taper(5),
+        taperStart(6),
+        widthVector(7),
+        size(10) {}
+
+  explicit XPDSplineLayout(const uint32_t num_cvs)
+      : numCVs(num_cvs),
+        id(0),
+        u(1),
+        v(2),
+        cv(3),
+        length(3 + 3 * num_cvs),
+        width(4 + 3 * num_cvs),
+        taper(5 + 3 * num_cvs),
+        taperStart(6 + 3 * num_cvs),
+        widthVector(7 + 3 * num_cvs),
+        size(10 + 3 * num_cvs) {}
+};
+
+///
+/// Get spline layout for `block_id`. Fails when XPD is not a spline or
+/// `primSize` is smaller than the layout.
+///
+bool GetSplineLayout(const XPDHeader &xpd, const uint32_t block_id,
+                     XPDSplineLayout *layout, std::string *err);
+
+///
+/// Find the variable CV count extension block of spline block `block_id`.
+/// Return false when the block has a fixed CV count.
+///
+bool FindVaryingCVBlock(const XPDHeader &xpd, const uint32_t block_id,
+                        uint32_t *ext_block_id);
+
+///
+/// Get a view of per-prim CV counts and CVs of spline block `block_id` in
+/// `face`. Fails when the block has no variable CV count extension.
+///
+/// @param[in] xpd Parsed XPD header.
+/// @param[in] binary Pointer to XPD binary data.
+/// @param[in] binary_length Data length of XPD binary data.
+/// @param[in] face Face index(not a faceid).
+/// @param[in] block_id Block index of the spline block.
+/// @param[out] view Variable CV view.
+/// @param[out] err Error message(filled when failed)
+///
+bool GetVaryingCVView(const XPDHeader &xpd, const uint8_t *binary,
+                      const size_t binary_length, const uint32_t face,
+                      const uint32_t block_id, XPDVaryingCVView *view,
+                      std::string *err);
+
+///
+/// Radius of a CV at parameter `t`(0 at root, 1 at tip).
+/// Width is tapered linearly from `taperStart` to the tip by `taper`.
+/// `ExtractCurveBuffers` computes radii with the same operations.
+///
+inline float XPDSplineRadius(const float width, const float taper,
+                             const float taper_start, const float t) {
+  const float slope =
+      (taper_start < 1.0f) ? (taper / (1.0f - taper_start)) : 0.0f;
+  const float d = (t > taper_start) ? (t - taper_start) : 0.0f;
+  return (0.5f * width) * (1.0f - slope * d);
+}
+
+///
+/// Affine transform applied to CVs and width vectors while extracting spline
+/// data(e.g. Object to World space). Matrices are row-major 4x4 and
+/// transform column vectors(p' = M p). The bottom row is ignored(assumed to
+/// be (0, 0, 0, 1)). Width vectors are transformed without translation.
+/// Widths(and radii of `ExtractCurveBuffers`) are multiplied by the mean
+/// scale(cube root of the absolute determinant) of the linear part of the
+/// transform of each face(`matrix` * `faceMatrices[face]`).
+///
+struct XPDTransform {
+  // [16] Empty = identity.
+  std::vector<float> matrix;
+
+  // Per face matrices applied before `matrix`, for CVs in Local space.
+  // [numFaces * 16] Empty = none.
+  std::vector<float> faceMatrices;
+
+  bool empty() const { return matrix.empty() && faceMatrices.empty(); }
+};
+
+struct XPDCurveBufferOption {
+  enum SegmentType {
+    Linear = 0,  // 2 CVs per segment.
+    Cubic        // 4 CVs per segment(B-spline, Catmull-Rom, etc)
+  };
+
+  enum ResampleMode {
+    ResampleParameter = 0,  // Uniform in curve parameter.
+    ResampleArcLength       // Uniform in arc length(of the CV polyline).
+  };
+
+  enum Interpolation {
+    InterpolateLinear = 0,
+    InterpolateCatmullRom  // Uniform Catmull-Rom through CVs.
+  };
+
+  SegmentType segmentType;
+  uint32_t numThreads;  // 0 = use hardware concurrency.
+
+  // Use decoders specialized for common numCVs(4, 5, 8, 16).
+  // Set false to force the generic decoder(for benchmarking).
+  bool specialize;
+
+  // Resample each curve to `resampleCVs` CVs while extracting.
+  // 0 = no resampling(use `numCVs` of XPD).
+  uint32_t resampleCVs;
+  ResampleMode resampleMode;
+  Interpolation interpolation;
+
+  // Applied to CVs after resampling. Radii are scaled(see `XPDTransform`).
+  XPDTransform transform;
+
+  XPDCurveBufferOption()
+      : segmentType(Cubic),
+        numThreads(0),
+        specialize(true),
+        resampleCVs(0),
+        resampleMode(ResampleParameter),
+        interpolation(InterpolateCatmullRom) {}
+};
+
+///
+/// Renderer-ready curve buffers(Embree/Cycles style).
+///
+struct XPDCurveBuffers {
+  uint32_t numCurves;
+  uint32_t numCVsPerCurve;
+
+  // float4(x, y, z, radius) per CV. Curves are stored in face order.
+  std::vector<float> cvs;
+
+  // Index of the first CV of each curve.
+  std::vector<uint32_t> curveFirstCV;
+
+  // Index of the first CV of each segment.
+  std::vector<uint32_t> segmentIndices;
+
+  XPDCurveBuffers() : numCurves(0), numCVsPerCurve(0) {}
+};
+
+///
+/// Build renderer-ready curve buffers directly from spline prim data of
+/// `block_id`. Width and taper are merged into per-CV radius.
+/// Curves are optionally resampled to `XPDCurveBufferOption::resampleCVs` CVs
+/// in the same pass. Faces are processed in parallel.
+/// Fails for blocks with the variable CV count extension(use
+/// `ExtractSplineSoA`).
+///
+/// @param[in] xpd Parsed XPD header.
+/// @param[in] binary Pointer to XPD binary data.
+/// @param[in] binary_length Data length of XPD binary data.
+/// @param[in] block_id Block index.
+/// @param[in] option Options.
+/// @param[out] buffers Curve buffers.
+/// @param[out] err Error message(filled when failed)
+///
+bool ExtractCurveBuffers(const XPDHeader &xpd, const uint8_t *binary,
+                         const size_t binary_length, const uint32_t block_id,
+                         const XPDCurveBufferOption &option,
+                         XPDCurveBuffers *buffers, std::string *err);
+
+struct XPDSplineSoAOption {
+  uint32_t numThreads;  // 0 = use hardware concurrency.
+
+  // Use decoders specialized for common numCVs(4, 5, 8, 16).
+  // Set false to force the generic decoder(for benchmarking).
+  bool specialize;
+
+  // Applied to CVs, width vectors and widths(see `XPDTransform`).
+  XPDTransform transform;
+
+  XPDSplineSoAOption() : numThreads(0), specialize(true) {}
+};
+
+///
+/// Spline prim data in SoA form. Curves are stored in face order.
+///
+struct XPDSplineSoA {
+  uint32_t numCurves;
+  uint32_t numCVsPerCurve;  // 0 when CV count varies per curve.
+
+  // CV positions. [numCurves * numCVsPerCurve] or [curveCVOffset.back()]
+  std::vector<float> px;
+  std::vector<float> py;
+  std::vector<float> pz;
+
+  // Per curve attributes. [numCurves]
+  std::vector<float> id;
+  std::vector<float> u;
+  std::vector<float> v;
+  std::vector<float> length;
+  std::vector<float> width;
+  std::vector<float> taper;
+  std::vector<float> taperStart;
+  std::vector<float> widthVectorX;
+  std::vector<float> widthVectorY;
+  std::vector<float> widthVectorZ;
+
+  // Index of the first curve of each face. [numFaces + 1]
+  std::vector<uint32_t> faceCurveOffset;
+
+  // Index of the first CV of each curve when CV count varies per curve.
+  // [numCurves + 1] Empty when all curves have `numCVsPerCurve` CVs.
+  std::vector<uint32_t> curveCVOffset;
+
+  XPDSplineSoA() : numCurves(0), numCVsPerCurve(0) {}
+};
+
+///
+/// Extract spline prim data of `block_id` in SoA form. Faces are processed
+/// in parallel. When the block has the variable CV count extension, CVs are
+/// packed and `soa->curveCVOffset` is filled.
+///
+/// @param[in] xpd Parsed XPD header.
+/// @param[in] binary Pointer to XPD binary data.
+/// @param[in] binary_length Data length of XPD binary data.
+/// @param[in] block_id Block index.
+/// @param[in] option Options.
+/// @param[out] soa Spline data in SoA form.
+/// @param[out] err Error message(filled when failed)
+///
+bool ExtractSplineSoA(const XPDHeader &xpd, const uint8_t *binary,
+                      const size_t binary_length, const uint32_t block_id,
+                      const XPDSplineSoAOption &option, XPDSplineSoA *soa,
+                      std::string *err);
+
+///
+/// Space filling curve used to sort faces and prims by root position, so
+/// spatially close strands are close in XPD data.
+///
+enum XPDSpatialOrder {
+  XPDSpatialOrderNone = 0,  // Keep the order.
+  XPDSpatialOrderMorton,    // Z-order curve.
+  XPDSpatialOrderHilbert    // Hilbert curve(better locality than Morton).
+};
+
+struct XPDSplineWriteOption {
+  uint32_t numThreads;  // 0 = use hardware concurrency.
+
+  std::string blockName;
+  float time;
+  Xpd::CoordSpace coordSpace;
+
+  // Sort faces and curves in each face along a space filling curve of root
+  // CVs(see `ReorderXPD`). faceid of each face is kept.
+  XPDSpatialOrder spatialOrder;
+
+  XPDSplineWriteOption()
+      : numThreads(0),
+        blockName("BakedGroom"),
+        time(0.0f),
+        coordSpace(Xpd::CoordSpace::Object),
+        spatialOrder(XPDSpatialOrderNone) {}
+};
+
+///
+/// Write spline XPD data from SoA arrays(inverse of `ExtractSplineSoA`).
+///
+/// Curves are grouped by face with a parallel counting sort(stable, so the
+/// order of curves within a face is kept), and prims are interleaved into
+/// the `xgSplineDataToXpd` layout directly in the output through
+/// `SerializeToXPDParallel`(no intermediate AoS copy).
+///
+/// `soa.px/py/pz` are required. Per curve attributes may be empty, in which
+/// case defaults are written: id = curve index in its face, u = v = 0,
+/// length = polyline length of CVs, width = 1, taper = taperStart = 0 and
+/// widthVector = (0, 0, 0).
+///
+/// When `soa.curveCVOffset` is not empty, the variable CV count extension
+/// is written(see `XPDVaryingCVView`).
+///
+/// `soa.numCurves` may be zero, in which case all faces are written without
+/// prims.
+///
+/// @param[in] soa Spline data. All curves have `soa.numCVsPerCurve` CVs
+///            unless `soa.curveCVOffset` is given.
+/// @param[in] faceid faceid of each face. [numFaces]
+/// @param[in] curve_faces Face index of each curve. [numCurves] When empty,
+///            curves are assumed to be grouped by face as in
+///            `soa.faceCurveOffset`.
+/// @param[in] option Options.
+/// @param[out] xpd_binary Serialized XPD data.
+/// @param[out] err Error message(filled when failed)
+///
+bool WriteSplineXPDFromSoA(const XPDSplineSoA &soa,
+                           const std::vector<int> &faceid,
+                           const std::vector<uint32_t> &curve_faces,
+                           const XPDSplineWriteOption &option,
+                           std::vector<uint8_t> *xpd_binary,
+                           std::string *err);
+
+///
+/// File version of `WriteSplineXPDFromSoA`(through
+/// `SerializeToXPDFileParallel`).
+///
+bool WriteSplineXPDFileFromSoA(const XPDSplineSoA &soa,
+                               const std::vector<int> &faceid,
+                               const std::vector<uint32_t> &curve_faces,
+                               const XPDSplineWriteOption &option,
+                               const std::string &filename, std::string *err);
+
+///
+/// Rewrite spline block `block_id` in another coordinate space. CVs, width
+/// vectors and widths are transformed while extracting(`ExtractSplineSoA`
+/// with `transform`) and written back in place to a copy of XPD data, so
+/// other blocks, channels, keys and prim attributes are kept byte for byte.
+/// Lengths are recomputed from transformed CVs(polyline length), and
+/// `coordSpace` of the header is set to `coord_space`. CVs of the variable CV
+/// count extension are transformed too. CVs in Local space require
+/// `transform.faceMatrices` unless `coord_space` is Local.
+///
+/// @param[in] xpd Parsed XPD header.
+/// @param[in] binary Pointer to XPD binary data.
+/// @param[in] binary_length Data length of XPD binary data.
+/// @param[in] block_id Block index of the spline block.
+/// @param[in] transform Transform to `coord_space`.
+/// @param[in] coord_space Coordinate space written to the output.
+/// @param[in] num_threads The number of threads(0 = use hardware
+///            concurrency).
+/// @param[out] xpd_binary Serialized XPD data.
+/// @param[out] err Error message(filled when failed)
+///
+bool TransformSplineXPD(const XPDHeader &xpd, const uint8_t *binary,
+                        const size_t binary_length, const uint32_t block_id,
+                        const XPDTransform &transform,
+                        const Xpd::CoordSpace coord_space,
+                        const uint32_t num_threads,
+                        std::vector<uint8_t> *xpd_binary, std::string *err);
+
+struct XPDReorderOption {
+  uint32_t numThreads;  // 0 = use hardware concurrency.
+  XPDSpatialOrder order;
+
+  // Spline block whose root CVs(the first CV of prims) give positions.
+  uint32_t blockId;
+
+  // Also sort prims in each face. Faces are sorted in any case.
+  bool sortPrims;
+
+  XPDReorderOption()
+      : numThreads(0),
+        order(XPDSpatialOrderMorton),
+        blockId(0),
+        sortPrims(true) {}
+};
+
+///
+/// Rewrite XPD data with faces(and prims in each face) sorted along a space
+/// filling curve, so spatial queries and tiled renders read mostly
+/// contiguous byte ranges.
+///
+/// Positions are quantized to 21 bits per axis over the bounds of all
+/// roots. Faces are sorted by the center of the bounds of their roots(faces
+/// without prims go last), and prims by their root. Sorting is stable.
+/// All blocks, keys and channels are kept, the same prim permutation is
+/// applied to all blocks of a face, and `blockPosition` is rebuilt. CVs of
+/// the variable CV count extension are repacked in the new prim order.
+/// The extent of a block is computed from its prims(and CVs of the
+/// extension), not from `blockPosition` of the next block, so other bytes
+/// following prims(e.g. padding) are not copied.
+///
+/// @param[in] xpd Parsed XPD header.
+/// @param[in] binary Pointer to XPD binary data.
+/// @param[in] binary_length Data length of XPD binary data.
+/// @param[in] option Options.
+/// @param[out] xpd_binary Serialized XPD data.
+/// @param[out] err Error message(filled when failed)
+///
+bool ReorderXPD(const XPDHeader &xpd, const uint8_t *binary,
+                const size_t binary_length, const XPDReorderOption &option,
+                std::vector<uint8_t> *xpd_binary, std::string *err);
+
+///
+/// File version of `ReorderXPD`(through `SerializeToXPDFileParallel`).
+///
+bool ReorderXPDFile(const XPDHeader &xpd, const uint8_t *binary,
+                    const size_t binary_length,
+                    const XPDReorderOption &option,
+                    const std::string &filename, std::string *err);
+
+///
+/// Immutable handle of an opened XPD(parsed header and mapped or owned XPD
+/// data), shared with `std::shared_ptr<const XPDFile>`. Data is unmapped when
+/// the last reference is released.
+///
+/// All member functions are const and keep no state(no read cursor), so any
+/// number of threads can decode the same or different faces through one
+/// handle without locking. `XPDHeader` is not modified after parsing, and
+/// its const member functions are safe to call concurrently.
+///
+class XPDFile {
+ public:
+  const XPDHeader &header() const { return header_; }
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  uint32_t numFaces() const { return header_.numFaces; }
+  int findBlock(const std::string &name) const {
+    return header_.findBlock(name);
+  }
+
+  /// See `GetBlockView`.
+  bool blockView(const uint32_t face, const uint32_t block_id,
+                 XPDBlockView *view, std::string *err) const;
+
+  /// See `FindChannel`.
+  bool findChannel(const std::string &block, const std::string &name,
+                   XPDChannel *channel) const;
+
+  /// See `GetChannelView`.
+  bool channelView(const uint32_t face, const XPDChannel &channel,
+                   XPDChannelView *view, std::string *err) const;
+
+  /// See `GetVaryingCVView`.
+  bool varyingCVView(const uint32_t face, const uint32_t block_id,
+                     XPDVaryingCVView *view, std::string *err) const;
+
+  /// See `ExtractSplineSoA`.
+  bool extractSplineSoA(const uint32_t block_id,
+                        const XPDSplineSoAOption &option, XPDSplineSoA *soa,
+                        std::string *err) const;
+
+  /// See `ExtractCurveBuffers`.
+  bool extractCurveBuffers(const uint32_t block_id,
+                           const XPDCurveBufferOption &option,
+                           XPDCurveBuffers *buffers, std::string *err) const;
+
+ private:
+  XPDFile() : data_(nullptr), size_(0) {}
+  XPDFile(const XPDFile &);
+  XPDFile &operator=(const XPDFile &);
+
+  friend bool OpenXPDFile(const std::string &filename,
+                          std::shared_ptr<const XPDFile> *file,
+                          std::string *err);
+  friend bool CreateXPDFileFromMemory(std::vector<uint8_t> *data,
+                                      std::shared_ptr<const XPDFile> *file,
+                                      std::string *err);
+  friend bool CreateXPDFileFromMapping(XPDMappedFile *mapped,
+                                       std::shared_ptr<const XPDFile> *file,
+                                       std::string *err);
+
+  XPDHeader header_;
+  XPDMappedFile file_;
+  std::vector<uint8_t> buffer_;
+  const uint8_t *data_;
+  size_t size_;
+};
+
+///
+/// Open and map a XPD file, and parse its header.
+///
+/// @param[in] filename XPD filename.
+/// @param[out] file Shared handle.
+/// @param[out] err Error message(filled when failed)
+///
+bool OpenXPDFile(const std::string &filename,
+                 std::shared_ptr<const XPDFile> *file, std::string *err);
+
+///
+/// Create a handle owning XPD data in memory.
+///
+/// @param[inout] data XPD data. Moved to the handle(`data` becomes empty).
+/// @param[out] file Shared handle.
+/// @param[out] err Error message(filled when failed)
+///
+bool CreateXPDFileFromMemory(std::vector<uint8_t> *data,
+                             std::shared_ptr<const XPDFile> *file,
+                             std::string *err);
+
+///
+/// Create a handle from a mapped XPD file(e.g. to tell I/O errors of
+/// `XPDMappedFile::open` from parse errors without mapping the file twice).
+///
+/// @param[inout] mapped Mapped file. Moved to the handle on success.
+/// @param[out] file Shared handle.
+/// @param[out] err Error message(filled when failed)
+///
+bool CreateXPDFileFromMapping(XPDMappedFile *mapped,
+                              std::shared_ptr<const XPDFile> *file,
+                              std::string *err);
+
+// ---------------------------------------------
+// Decode cache.
+// Derived data(SoA buffers, curve buffers, or user data such as BVHs and
+// bounds) is stored in a local directory, one file per key, and mapped on
+// lookup. Keys are a content hash of XPD data and a hash of the derivation
+// kind and parameters, so a modified XPD or different parameters never hit
+// a stale entry. Files are written to a temporary name and renamed, so
+// several processes can share a directory.
+
+///
+/// 64-bit hash of `data`(XXH64).
+///
+uint64_t XPDHash64(const uint8_t *data, const size_t length,
+                   const uint64_t seed = 0);
+
+///
+/// Content hash of XPD data. Data is hashed in 4MB chunks in parallel, and
+/// the result does not depend on `num_threads`.
+///
+/// @param[in] data Pointer to XPD data.
+/// @param[in] length Data length.
+/// @param[in] num_threads The number of threads(0 = hardware concurrency).
+///
+uint64_t XPDContentHash(const uint8_t *data, const size_t length,
+                        const uint32_t num_threads = 0);
+
+struct XPDCacheKey {
+  uint64_t content;  // `XPDContentHash` of XPD data.
+  uint64_t params;   // Hash of derivation kind and parameters.
+
+  XPDCacheKey() : content(0), params(0) {}
+};
+
+///
+/// Make a cache key.
+///
+/// @param[in] content_hash `XPDContentHash` of XPD data.
+/// @param[in] kind Kind of derived data(e.g. "bvh").
+/// @param[in] params Serialized parameters affecting derived data.
+/// @param[in] params_length Byte length of `params`.
+///
+XPDCacheKey MakeXPDCacheKey(const uint64_t content_hash,
+                            const std::string &kind, const uint8_t *params,
+                            const size_t params_length);
+
+///
+/// Named byte range stored in a cache entry. Names are up to 31 chars.
+///
+struct XPDCacheSection {
+  std::string name;
+  const uint8_t *data;
+  uint64_t size;
+
+  XPDCacheSection() : data(nullptr), size(0) {}
+  XPDCacheSection(const std::string &_name, const void *_data,
+                  const uint64_t _size)
+      : name(_name),
+        data(reinterpret_cast<const uint8_t *>(_data)),
+        size(_size) {}
+};
+
+///
+/// Mapped cache entry. Section data is 64 byte aligned and valid while the
+/// entry is alive.
+///
+class XPDCacheEntry {
+ public:
+  XPDCacheEntry() {}
+
+  bool valid() const { return file_.data() != nullptr; }
+  size_t numSections() const { return sections_.size(); }
+  const std::string &sectionName(const size_t i) const {
+    return sections_[i].name;
+  }
+
+  ///
+  /// Find a section by name.
+  ///
+  /// @param[in] name Section name.
+  /// @param[out] data Pointer to section data.
+  /// @param[out] size Byte size of section data.
+  /// @return false when not found.
+  ///
+  bool section(const std::string &name, const uint8_t **data,
+               uint64_t *size) const;
+
+  void close() {
+    file_.close();
+    sections_.clear();
+  }
+
+ private:
+  friend class XPDDecodeCache;
+
+  struct Section {
+    std::string name;
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  XPDMappedFile file_;
+  std::vector<Section> sections_;
+};
+
+struct XPDDecodeCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t stores;
+  uint64_t evictions;
+  uint64_t totalBytes;  // Current byte size of entries.
+  uint32_t numEntries;  // Current number of entries.
+
+  XPDDecodeCacheStats()
+      : hits(0),
+        misses(0),
+        stores(0),
+        evictions(0),
+        totalBytes(0),
+        numEntries(0) {}
+};
+
+///
+/// On-disk cache of derived data with a LRU byte size cap.
+///
+/// LRU order is kept in file modification times(touched on hit), so it
+/// persists across processes. Entries are evicted after `store` when the
+/// total size exceeds the cap. Thread-safe.
+///
+class XPDDecodeCache {
+ public:
+  XPDDecodeCache();
+  ~XPDDecodeCache();
+
+  ///
+  /// Open a cache directory and scan its entries. The directory is created
+  /// when it does not exist(its parent must exist).
+  ///
+  /// @param[in] directory Cache directory.
+  /// @param[in] max_bytes Byte size cap of entries. 0 = unlimited.
+  /// @param[out] err Error message(filled when failed)
+  ///
+  bool open(const std::string &directory, const uint64_t max_bytes,
+            std::string *err);
+  void close();
+
+  ///
+  /// Map the entry of `key`.
+  ///
+  /// @return false when not found(or the entry is broken).
+  ///
+  bool lookup(const XPDCacheKey &key, XPDCacheEntry *entry);
+
+  ///
+  /// Store sections as the entry of `key`(replaces an existing entry).
+  ///
+  /// @param[in] key Cache key.
+  /// @param[in] sections Sections to store.
+  /// @param[out] err Error message(filled when failed)
+  ///
+  bool store(const XPDCacheKey &key,
+             const std::vector<XPDCacheSection> &sections, std::string *err);
+
+  XPDDecodeCacheStats stats() const;
+
+ private:
+  XPDDecodeCache(const XPDDecodeCache &);
+  XPDDecodeCache &operator=(const XPDDecodeCache &);
+
+  struct Item {
+    std::string name;
+    uint64_t size;
+  };
+
+  std::string path(const std::string &name) const;
+  static bool parse(const XPDCacheKey &key, XPDCacheEntry *entry);
+  void insert(const std::string &name, const uint64_t size);
+  void erase(const std::string &name);
+  void evict(const std::string &keep);
+
+  mutable std::mutex mutex_;
+  std::string directory_;
+  uint64_t max_bytes_;
+
+  std::list<Item> lru_;  // Front = most recently used.
+  std::unordered_map<std::string, std::list<Item>::iterator> items_;
+  XPDDecodeCacheStats stats_;
+};
+
+///
+/// Array in a mapped cache entry(or in decoded data). No copy.
+///
+template <typename T>
+struct XPDCacheArray {
+  const T *data;
+  size_t size;  // The number of elements.
+
+  XPDCacheArray() : data(nullptr), size(0) {}
+
+  bool empty() const { return size == 0; }
+  const T &operator[](const size_t i) const { return data[i]; }
+};
+
+///
+/// `XPDSplineSoA` arrays read in place from a cache entry. The view owns the
+/// mapped entry, so arrays are valid while the view is alive. Movable, not
+/// copyable.
+///
+struct XPDSplineSoAView {
+  uint32_t numCurves;
+  uint32_t numCVsPerCurve;
+
+  XPDCacheArray<float> px, py, pz;
+  XPDCacheArray<float> id, u, v, length, width, taper, taperStart;
+  XPDCacheArray<float> widthVectorX, widthVectorY, widthVectorZ;
+  XPDCacheArray<uint32_t> faceCurveOffset;
+  XPDCacheArray<uint32_t> curveCVOffset;
+
+  XPDCacheEntry entry;   // Mapped entry on a hit.
+  XPDSplineSoA decoded;  // Decoded data on a miss.
+
+  XPDSplineSoAView() : numCurves(0), numCVsPerCurve(0) {}
+};
+
+///
+/// `XPDCurveBuffers` arrays read in place from a cache entry. See
+/// `XPDSplineSoAView`.
+///
+struct XPDCurveBuffersView {
+  uint32_t numCurves;
+  uint32_t numCVsPerCurve;
+
+  XPDCacheArray<float> cvs;
+  XPDCacheArray<uint32_t> curveFirstCV;
+  XPDCacheArray<uint32_t> segmentIndices;
+
+  XPDCacheEntry entry;      // Mapped entry on a hit.
+  XPDCurveBuffers decoded;  // Decoded data on a miss.
+
+  XPDCurveBuffersView() : numCurves(0), numCVsPerCurve(0) {}
+};
+
+///
+/// `ExtractSplineSoA` through `cache` without copying on a hit: `view`
+/// points into the mapped entry(no decode, no copy). On a miss, the result
+/// is decoded to `view->decoded`, stored(store failures are ignored) and
+/// viewed. `cache` may be null.
+///
+/// @param[in] cache Decode cache.
+/// @param[in] content_hash `XPDContentHash` of XPD data.
+/// @param[out] view Arrays of the result.
+///
+bool ExtractSplineSoAViewCached(XPDDecodeCache *cache,
+                                const uint64_t content_hash,
+                                const XPDHeader &xpd, const uint8_t *binary,
+                                const size_t binary_length,
+                                const uint32_t block_id,
+                                const XPDSplineSoAOption &option,
+                                XPDSplineSoAView *view, std::string *err);
+
+///
+/// `ExtractCurveBuffers` through `cache` without copying on a hit. See
+/// `ExtractSplineSoAViewCached`.
+///
+bool ExtractCurveBuffersViewCached(XPDDecodeCache *cache,
+                                   const uint64_t content_hash,
+                                   const XPDHeader &xpd,
+                                   const uint8_t *binary,
+                                   const size_t binary_length,
+                                   const uint32_t block_id,
+                                   const XPDCurveBufferOption &option,
+                                   XPDCurveBuffersView *view,
+                                   std::string *err);
+
+///
+/// `ExtractSplineSoA` through `cache`, copying the result to `soa`. On a hit,
+/// arrays are copied from the mapped entry without decoding. Use
+/// `ExtractSplineSoAViewCached` to read them in place instead. On a miss, the
+/// result is decoded and stored(store failures are ignored). `cache` may be
+/// null.
+///
+/// @param[in] cache Decode cache.
+/// @param[in] content_hash `XPDContentHash` of XPD data.
+///
+bool ExtractSplineSoACached(XPDDecodeCache *cache, const uint64_t content_hash,
+                            const XPDHeader &xpd, const uint8_t *binary,
+                            const size_t binary_length,
+                            const uint32_t block_id,
+                            const XPDSplineSoAOption &option,
+                            XPDSplineSoA *soa, std::string *err);
+
+///
+/// `ExtractCurveBuffers` through `cache`, copying the result to `buffers`.
+/// See `ExtractSplineSoACached`.
+///
+bool ExtractCurveBuffersCached(XPDDecodeCache *cache,
+                               const uint64_t content_hash,
+                               const XPDHeader &xpd, const uint8_t *binary,
+                               const size_t binary_length,
+                               const uint32_t block_id,
+                               const XPDCurveBufferOption &option,
+                               XPDCurveBuffers *buffers, std::string *err);
+
+// ---------------------------------------------
+// Frame sequence.
+
+///
+/// Options for `XPDSequenceWriter`.
+///
+/// A sequence stores keyframes(whole XPD data) and, for other frames, CV
+/// deltas from the previous frame. CVs are predicted by linear extrapolation
+/// of the previous 2 frames(the previous frame for the first delta after a
+/// keyframe), and residuals are zigzag coded and bit-packed in groups of 32.
+///
+/// With `quantizeStep` = 0, residuals are taken between float bit patterns
+/// and frames are reconstructed exactly. With `quantizeStep` > 0, residuals
+/// are quantized to the step against the reconstructed frames, so the error
+/// of each CV component is at most `quantizeStep` / 2 plus float rounding
+/// (it does not accumulate over frames).
+///
+struct XPDSequenceOption {
+  // A keyframe is written every `keyframeInterval` frames for random access.
+  uint32_t keyframeInterval;
+  float quantizeStep;   // 0 = lossless.
+  uint32_t numThreads;  // 0 = use hardware concurrency.
+
+  XPDSequenceOption()
+      : keyframeInterval(48), quantizeStep(0.0f), numThreads(0) {}
+};
+
+///
+/// Strided CV range in XPD data(`numPrims` prims of `numFloats` floats,
+/// `stride` bytes apart). Used by the frame sequence.
+///
+struct XPDSequenceCVRun {
+  uint64_t offset;  // Byte offset of the first CV in XPD data.
+  uint64_t first;   // Index of the first float in the gathered CV array.
+  uint32_t numPrims;
+  uint32_t stride;
+  uint32_t numFloats;
+
+  XPDSequenceCVRun()
+      : offset(0), first(0), numPrims(0), stride(0), numFloats(0) {}
+
+  bool operator==(const XPDSequenceCVRun &rhs) const {
+    return (offset == rhs.offset) && (first == rhs.first) &&
+           (numPrims == rhs.numPrims) && (stride == rhs.stride) &&
+           (numFloats == rhs.numFloats);
+  }
+};
+
+///
+/// Encode XPD frames of an animated groom into a sequence.
+///
+/// A frame is written as a delta when its XPD data is identical to the
+/// keyframe except for CVs(of spline blocks and the variable CV count
+/// extension) and `time`. Otherwise(e.g. faceid, numPrims or u/v changed) a
+/// keyframe is written.
+///
+class XPDSequenceWriter {
+ public:
+  explicit XPDSequenceWriter(
+      const XPDSequenceOption &option = XPDSequenceOption());
+
+  /// Remove the temporary file of an unfinished stream.
+  ~XPDSequenceWriter();
+
+  /// Append a frame. `xpd_data` is whole XPD data of the frame.
+  bool addFrame(const uint8_t *xpd_data, const size_t xpd_length,
+                std::string *err);
+
+  uint32_t numFrames() const { return uint32_t(frames_.size()); }
+  uint32_t numKeyframes() const { return num_keyframes_; }
+
+  /// Serialize the sequence. Not available while streaming.
+  bool finish(std::vector<uint8_t> *data, std::string *err) const;
+
+  /// Write the sequence to `filename`. Frames are written one by one to a
+  /// temporary file, which replaces `filename` on success. Not available
+  /// while streaming.
+  bool finishToFile(const std::string &filename, std::string *err) const;
+
+  /// Start streaming to `filename`(no frames must be added yet). Payloads
+  /// are written to a temporary file as frames are added, so only the
+  /// current keyframe run is kept in memory. `finishStream` writes the frame
+  /// table at the end and replaces `filename`.
+  bool beginStream(const std::string &filename, std::string *err);
+
+  /// Finish streaming. The writer is cleared on success and on failure.
+  bool finishStream(std::string *err);
+
+  bool streaming() const { return stream_.is_open(); }
+
+  /// Remove all frames(and abort streaming).
+  void clear();
+
+ private:
+  struct Frame {
+    float time;
+    bool keyframe;
+    uint64_t size;                 // Payload size.
+    std::vector<uint8_t> payload;  // Empty while streaming.
+  };
+
+  bool addKeyframe(const XPDHeader &header, const uint8_t *xpd_data,
+                   const size_t xpd_length, std::string *err);
+
+  // Append `frame` with payload `data`, which is written to the stream or
+  // copied to `frame.payload`(unless it already points there).
+  bool appendFrame(Frame *frame, const uint8_t *data, const size_t size,
+                   std::string *err);
+
+  // Serialize the header(32 bytes) with the frame table at `table_offset`
+  // to `dst`.
+  void encodeHeader(const uint64_t table_offset, uint8_t *dst) const;
+
+  // Serialize the frame table with payloads from `payload_offset` to
+  // `table`. Return the end offset of payloads.
+  uint64_t encodeTable(const uint64_t payload_offset,
+                       std::vector<uint8_t> *table) const;
+
+  XPDSequenceOption option_;
+  std::vector<Frame> frames_;
+  uint32_t num_keyframes_;
+
+  // Stream state.
+  std::ofstream stream_;
+  std::string stream_filename_;
+  std::string stream_temp_;
+  uint64_t stream_offset_;  // End of written payloads.
+  bool stream_failed_;
+
+  // State of the current keyframe run.
+  std::vector<uint8_t> key_;  // XPD data of the keyframe.
+  std::vector<XPDSequenceCVRun> runs_;
+  uint32_t num_deltas_;      // Deltas written since the keyframe.
+  std::vector<float> prev_;  // Reconstructed CVs of the previous frames.
+  std::vector<float> pprev_;
+  std::vector<float> cur_;
+};
+
+///
+/// Decode frames of a sequence written by `XPDSequenceWriter`.
+///
+/// `readFrame` continues from the previously read frame when possible, so
+/// reading frames in order applies one delta per frame. Otherwise frames are
+/// decoded from the nearest keyframe. Not thread-safe.
+///
+class XPDSequenceReader {
+ public:
+  XPDSequenceReader();
+
+  /// Open sequence data in memory. `data` must be alive while the reader
+  /// is used.
+  bool open(const uint8_t *data, const size_t length, std::string *err);
+
+  /// Open and map a sequence file.
+  bool open(const std::string &filename, std::string *err);
+
+  void close();
+
+  /// The number of threads for decoding deltas(0 = use hardware
+  /// concurrency).
+  void setNumThreads(const uint32_t num_threads) {
+    num_threads_ = num_threads;
+  }
+
+  uint32_t numFrames() const { return uint32_t(frames_.size()); }
+  float time(const uint32_t frame) const { return frames_[frame].time; }
+  bool isKeyframe(const uint32_t frame) const {
+    return frames_[frame].keyframe;
+  }
+
+  /// Reconstruct XPD data of `frame` and parse its header.
+  ///
+  /// @param[in] frame Frame index.
+  /// @param[out] header Parsed XPD header.
+  /// @param[out] xpd_data XPD data of the frame.
+  /// @param[out] err Error message(filled when failed)
+  ///
+  bool readFrame(const uint32_t frame, XPDHeader *header,
+                 std::vector<uint8_t> *xpd_data, std::string *err);
+
+ private:
+  XPDSequenceReader(const XPDSequenceReader &);
+  XPDSequenceReader &operator=(const XPDSequenceReader &);
+
+  struct Frame {
+    uint64_t offset;
+    uint64_t size;
+    float time;
+    bool keyframe;
+  };
+
+  bool parse(const uint8_t *data, const size_t length, std::string *err);
+  bool loadKeyframe(const uint32_t frame, std::string *err);
+  bool applyDelta(const uint32_t frame, std::string *err);
+
+  XPDMappedFile file_;
+  const uint8_t *data_;
+  size_t length_;
+  float quantize_step_;
+  uint32_t num_threads_;
+  std::vector<Frame> frames_;
+
+  // Decoding state. `frame_` is the last decoded frame(-1 = none).
+  int64_t frame_;
+  uint32_t key_frame_;
+  uint32_t num_deltas_;
+  std::vector<XPDSequenceCVRun> runs_;
+  std::vector<float> prev_;
+  std::vector<float> pprev_;
+  std::vector<float> cur_;
+};
+
+///
+/// Reduction over a spline attribute of all prims.
+///
+/// `attribute` is one of `id`, `u`, `v`, `length`, `width`, `taper`,
+/// `taperStart`, `widthVector.x`(`.y`, `.z`), `cv.x`(`.y`, `.z`, over all
+/// CVs), `numCVs`(CV count of each strand), a channel name(`color` for
+/// the first component, `color[1]` for others) or `value[i]`(i-th float of
+/// a prim). Blocks which are not splines only provide channels and
+/// `value[i]`.
+///
+struct XPDReduction {
+  enum Op {
+    ReduceMin = 1,
+    ReduceMax = 2,
+    ReduceSum = 4,        // Also gives the mean.
+    ReduceNonFinite = 8,  // Count NaN and Inf.
+    ReduceHistogram = 16,
+    ReducePerFace = 32,  // Count and sum for each face.
+    ReduceAll = 63
+  };
+
+  std::string attribute;
+  uint32_t ops;  // Bitwise OR of `Op`.
+
+  // Histogram of [histogramMin, histogramMax] with uniform bins.
+  float histogramMin;
+  float histogramMax;
+  uint32_t histogramBins;
+
+  XPDReduction()
+      : ops(ReduceMin | ReduceMax | ReduceSum | ReduceNonFinite),
+        histogramMin(0.0f),
+        histogramMax(1.0f),
+        histogramBins(16) {}
+};
+
+struct XPDReductionResult {
+  // Over finite values. NaN and Inf are counted in `nonFinite`.
+  float min;
+  float max;
+  double sum;
+  uint64_t count;
+  uint64_t nonFinite;
+
+  std::vector<uint64_t> histogram;  // [histogramBins]
+  uint64_t underflow;               // Values below `histogramMin`.
+  uint64_t overflow;                // Values above `histogramMax`.
+
+  std::vector<uint64_t> faceCount;  // [numFaces]
+  std::vector<double> faceSum;      // [numFaces]
+
+  XPDReductionResult()
+      : min(0.0f),
+        max(0.0f),
+        sum(0.0),
+        count(0),
+        nonFinite(0),
+        underflow(0),
+        overflow(0) {}
+
+  double mean() const { return (count > 0) ? (sum / double(count)) : 0.0; }
+};
+
+struct XPDReduceOption {
+  uint32_t numThreads;  // 0 = use hardware concurrency.
+
+  XPDReduceOption() : numThreads(0) {}
+};
+
+///
+/// Run `reductions` over prims of `block_id` in one multithreaded
+/// pass over XPD data. Each worker accumulates into its own partials which
+/// are merged at the end, and sums are added in face order, so results do
+/// not depend on `numThreads`. Prim data is read in place(not decoded into
+/// arrays). Passes of ops not in `XPDReduction::ops` are skipped(a
+/// reduction with no ops reads nothing).
+///
+/// @param[in] xpd Parsed XPD header.
+/// @param[in] binary Pointer to XPD binary data.
+/// @param[in] binary_length Data length of XPD binary data.
+/// @param[in] block_id Block index.
+/// @param[in] reductions Reductions to run.
+/// @param[in] option Options.
+/// @param[out] results Results. Same length and order with `reductions`.
+/// @param[out] err Error message(filled when failed)
+///
+bool ReduceSplineAttributes(const XPDHeader &xpd, const uint8_t *binary,
+                            const size_t binary_length,
+                            const uint32_t block_id,
+                            const std::vector<XPDReduction> &reductions,
+                            const XPDReduceOption &option,
+                            std::vector<XPDReductionResult> *results,
+                            std::string *err);
+
+///
+/// Triangle/quad mesh for rebinding strands.
+///
+struct XPDRebindMesh {
+  std::vector<float> vertices;              // xyz. [numVertices * 3]
+  std::vector<uint32_t> faceVertexCounts;   // 3 or 4. [numFaces]
+  std::vector<uint32_t> faceVertexIndices;  // [sum(faceVertexCounts)]
+
+  // faceid written to XPD for each face. Empty = face index.
+  std::vector<int> faceid;
+};
+
+struct XPDRebindOption {
+  uint32_t numThreads;  // 0 = use hardware concurrency.
+
+  // Strands whose root is farther than this from the mesh are dropped.
+  // 0 = unlimited.
+  float maxDistance;
+
+  XPDRebindOption() : numThreads(0), maxDistance(0.0f) {}
+};
+
+struct XPDRebindStats {
+  uint32_t numStrands;  // The number of strands written.
+  uint32_t numDropped;  // The number of strands dropped by `maxDistance`.
+  float maxDistance;    // Max distance from a root to its new face.
+
+  XPDRebindStats() : numStrands(0), numDropped(0), maxDistance(0.0f) {}
+};
+
+///
+/// Rebind strands of spline block `block_id` to the faces of `mesh`(e.g.
+/// after the mesh is retopologized).
+///
+/// The nearest face of each strand root(first CV) is found with a uniform
+/// grid over mesh triangles(quads are split into 2 triangles), in parallel.
+/// New u/v is barycentric(v1, v2) for triangles. For quads it is linear on
+/// each triangle(v0, v1, v2) and (v0, v2, v3), not bilinear. Strands with a
+/// non-finite root are dropped. Whole prim records are regrouped by new
+/// face like `ReorderXPD`: all blocks, keys and channels are kept(the same
+/// prim goes to the same new face in every block), CVs of the variable CV
+/// count extension are repacked, and only u/v of block `block_id` are
+/// rewritten. Strands keep their order within a face. Only faces with strands
+/// are written. CVs must be in World or Object space.
+///
+/// @param[in] xpd Parsed XPD header.
+/// @param[in] binary Pointer to XPD binary data.
+/// @param[in] binary_length Data length of XPD binary data.
+/// @param[in] block_id Block index of the spline block.
+/// @param[in] mesh New mesh.
+/// @param[in] option Options.
+/// @param[out] xpd_binary Serialized XPD data.
+/// @param[out] stats Statistics(optional).
+/// @param[out] err Error message(filled when failed)
+///
+bool RebindSplineXPD(const XPDHeader &xpd, const uint8_t *binary,
+                     const size_t binary_length, const uint32_t block_id,
+                     const XPDRebindMesh &mesh, const XPDRebindOption &option,
+                     std::vector<uint8_t> *xpd_binary, XPDRebindStats *stats,
+                     std::string *err);
+
+///
+/// File version of `RebindSplineXPD`(through `SerializeToXPDFileParallel`).
+///
+bool RebindSplineXPDFile(const XPDHeader &xpd, const uint8_t *binary,
+                         const size_t binary_length, const uint32_t block_id,
+                         const XPDRebindMesh &mesh,
+                         const XPDRebindOption &option,
+                         const std::string &filename, XPDRebindStats *stats,
+                         std::string *err);
+
+// ---------------------------------------------
+// Runtime SIMD dispatch.
+// On x86-64, decode kernels(CV transpose, float4 expansion and resampling
+// interpolation) have SSE4.2, AVX2 and AVX-512 versions compiled with per
+// function target attributes, so they do not depend on `-march` of the TU
+// defining TINY_XPD_IMPLEMENTATION. The level is detected from cpuid once on
+// first use. `TINY_XPD_SIMD` environment variable(scalar, sse42, avx2 or
+// avx512) lowers the level, e.g. for testing. Define `TINY_XPD_DISABLE_SIMD`
+// to compile scalar kernels only.
+
+enum XPDSIMDLevel {
+  XPDSIMDScalar = 0,
+  XPDSIMDSSE42,
+  XPDSIMDAVX2,
+  XPDSIMDAVX512,
+};
+
+///
+/// Get the name of SIMD level("scalar", "sse42", "avx2" or "avx512").
+///
+const char *GetSIMDLevelName(const XPDSIMDLevel level);
+
+///
+/// Get the highest SIMD level supported by the CPU and OS(and compiled in).
+///
+XPDSIMDLevel GetCPUSIMDLevel();
+
+///
+/// Get the SIMD level used by decode kernels.
+///
+XPDSIMDLevel GetSIMDLevel();
+
+///
+/// Set the SIMD level used by decode kernels. Affects subsequent calls.
+///
+/// @param[in] level SIMD level.
+/// @param[out] err Error message(filled when `level` is not supported)
+///
+bool SetSIMDLevel(const XPDSIMDLevel level, std::string *err);
+
+// ---------------------------------------------
+// Profiling.
+// Define `TINY_XPD_ENABLE_PROFILE` before including tiny_xpd.h(in the .cc
+// defining TINY_XPD_IMPLEMENTATION) to enable instrumentation. When disabled,
+// instrumentation is compiled out and stats stay zero.
+
+enum XPDProfilePhase {
+  XPDProfileParseXPDFromFile = 0,
+  XPDProfileParseXPDFromIO,
+  XPDProfileParseXPDHeader,
+  XPDProfileParseCompactHeader,
+  XPDProfileSerializeToXPD,
+  XPDProfileBatchOpen,
+  XPDProfileReadFace,
+  XPDProfileExtractCurveBuffers,
+  XPDProfileExtractSplineSoA,
+  XPDProfileTransformSplineXPD,
+  XPDProfileReorderXPD,
+  XPDProfileReduceSplineAttributes,
+  XPDProfileRebindSplineXPD,
+  XPDProfileSequenceReadFrame,
+  XPDProfileCacheLookup,
+  XPDProfileCacheStore,
+  XPDProfileNumPhases
+};
+
+const char *GetProfilePhaseName(const XPDProfilePhase phase);
+
+struct XPDProfileStats {
+  uint64_t bytesRead;
+  uint64_t facesDecoded;
+  uint64_t primsDecoded;
+  uint64_t allocations;  // Allocations of large buffers made by tiny_xpd.
+  uint64_t allocatedBytes;
+  uint64_t adviseFailures;  // Failed madvise/posix_fadvise calls.
+
+  // Inclusive wall time and call count per phase.
+  double phaseSeconds[XPDProfileNumPhases];
+  uint64_t phaseCount[XPDProfileNumPhases];
+
+  XPDProfileStats()
+      : bytesRead(0),
+        facesDecoded(0),
+        primsDecoded(0),
+        allocations(0),
+        allocatedBytes(0),
+        adviseFailures(0) {
+    for (int i = 0; i < XPDProfileNumPhases; i++) {
+      phaseSeconds[i] = 0.0;
+      phaseCount[i] = 0;
+    }
+  }
+};
+
+struct XPDProfileEvent {
+  XPDProfilePhase phase;
+  uint64_t beginNs;  // From an arbitrary epoch(steady clock).
+  uint64_t endNs;
+  uint64_t threadId;
+};
+
+///
+/// Callback called at the end of each profiled phase(from any thread).
+///
+typedef void (*XPDProfileCallback)(const XPDProfileEvent &event,
+                                   void *userdata);
+
+void SetProfileCallback(XPDProfileCallback callback, void *userdata);
+
+void GetProfileStats(XPDProfileStats *stats);
+void ResetProfileStats();
+
+///
+/// Record events for Chrome trace(chrome://tracing, Perfetto).
+/// Enabling clears recorded events.
+///
+void EnableProfileTrace(const bool enable);
+
+///
+/// Write recorded events as Chrome trace JSON.
+///
+bool WriteProfileTrace(const std::string &filename, std::string *err);
+
+}  // namespace tiny_xpd
+
+#if defined(TINY_XPD_IMPLEMENTATION)
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <system_error>
+#include <thread>
+#include <iostream>  // dbg
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(TINY_XPD_USE_IO_URING) && defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#if !defined(TINY_XPD_DISABLE_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#define TINY_XPD_X86_SIMD
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define TINY_XPD_TARGET(isa)
+#elif defined(__clang__)
+#include <cpuid.h>
+#define TINY_XPD_TARGET(isa) __attribute__((target(isa)))
+#else
+// GCC contracts mul + add into FMA for AVX-512(which implies FMA) targets.
+// Disable it so that all levels give bit identical results.
+#include <cpuid.h>
+#define TINY_XPD_TARGET(isa) \
+  __attribute__((target(isa), optimize("fp-contract=off")))
+#endif
+#endif
+
+namespace tiny_xpd {
+
+// ---------------------------------------------
+// Profiling
+
+enum ProfileCounter {
+  ProfileBytesRead = 0,
+  ProfileFacesDecoded,
+  ProfilePrimsDecoded,
+  ProfileAllocations,
+  ProfileAllocatedBytes,
+  ProfileAdviseFailures,
+  ProfileNumCounters
+};
+
+static std::atomic<uint64_t> g_profile_counters[ProfileNumCounters];
+static std::atomic<uint64_t> g_profile_phase_ns[XPDProfileNumPhases];
+static std::atomic<uint64_t> g_profile_phase_count[XPDProfileNumPhases];
+static std::atomic<XPDProfileCallback> g_profile_callback(nullptr);
+static std::atomic<void *> g_profile_userdata(nullptr);
+static std::atomic<bool> g_profile_trace_enabled(false);
+static std::mutex g_profile_trace_mutex;
+static std::vector<XPDProfileEvent> g_profile_trace_events;
+
+#if defined(TINY_XPD_ENABLE_PROFILE)
+
+static uint64_t ProfileNow() {
+  return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now().time_since_epoch())
+                      .count());
+}
+
+static void ProfileCount(const ProfileCounter counter, const uint64_t n) {
+  g_profile_counters[counter] += n;
+}
+
+class ProfileScope {
+ public:
+  explicit ProfileScope(const XPDProfilePhase phase)
+      : phase_(phase), begin_(ProfileNow()) {}
+
+  ~ProfileScope() {
+    XPDProfileEvent event;
+    event.phase = phase_;
+    event.beginNs = begin_;
+    event.endNs = ProfileNow();
+    event.threadId =
+        uint64_t(std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+    g_profile_phase_ns[phase_] += event.endNs - event.beginNs;
+    g_profile_phase_count[phase_]++;
+
+    XPDProfileCallback callback = g_profile_callback.load();
+    if (callback) {
+      callback(event, g_profile_userdata.load());
+    }
+
+    if (g_profile_trace_enabled.load()) {
+      std::lock_guard<std::mutex> lock(g_profile_trace_mutex);
+      g_profile_trace_events.push_back(event);
+    }
+  }
+
+ private:
+  XPDProfilePhase phase_;
+  uint64_t begin_;
+};
+
+#define TINY_XPD_PROFILE_SCOPE(phase) \
+  ProfileScope tiny_xpd_profile_scope_(phase)
+#define TINY_XPD_PROFILE_COUNT(counter, n) ProfileCount(counter, uint64_t(n))
+#define TINY_XPD_PROFILE_ALLOC(bytes)                     \
+  do {                                                    \
+    ProfileCount(ProfileAllocations, 1);                  \
+    ProfileCount(ProfileAllocatedBytes, uint64_t(bytes)); \
+  } while (0)
+#else
+#define TINY_XPD_PROFILE_SCOPE(phase)
+#define TINY_XPD_PROFILE_COUNT(counter, n)
+#define TINY_XPD_PROFILE_ALLOC(bytes)
+#endif
+
+///
+/// Simple stream reader
+///
+class StreamReader {
+  static inline void swap2(unsigned short *val) {
+    unsigned short tmp = *val;
+    uint8_t *dst = reinterpret_cast<uint8_t *>(val);
+    uint8_t *src = reinterpret_cast<uint8_t *>(&tmp);
+
+    dst[0] = src[1];
+    dst[1] = src[0];
+  }
+
+  static inline void swap4(uint32_t *val) {
+    uint32_t tmp = *val;
+    uint8_t *dst = reinterpret_cast<uint8_t *>(val);
+    uint8_t *src = reinterpret_cast<uint8_t *>(&tmp);
+
+    dst[0] = src[3];
+    dst[1] = src[2];
+    dst[2] = src[1];
+    dst[3] = src[0];
+  }
+
+  static inline void swap4(int *val) {
+    int tmp = *val;
+    uint8_t *dst = reinterpret_cast<uint8_t *>(val);
+    uint8_t *src = reinterpret_cast<uint8_t *>(&tmp);
+
+    dst[0] = src[3];
+    dst[1] = src[2];
+    dst[2] = src[1];
+    dst[3] = src[0];
+  }
+
+  static inline void swap8(uint64_t *val) {
+    uint64_t tmp = (*val);
+    uint8_t *dst = reinterpret_cast<uint8_t *>(val);
+    uint8_t *src = reinterpret_cast<uint8_t *>(&tmp);
+
+    dst[0] = src[7];
+    dst[1] = src[6];
+    dst[2] = src[5];
+    dst[3] = src[4];
+    dst[4] = src[3];
+    dst[5] = src[2];
+    dst[6] = src[1];
+    dst[7] = src[0];
+  }
+
+  static inline void swap8(int64_t *val) {
+    int64_t tmp = (*val);
+    uint8_t *dst = reinterpret_cast<uint8_t *>(val);
+    uint8_t *src = reinterpret_cast<uint8_t *>(&tmp);
+
+    dst[0] = src[7];
+    dst[1] = src[6];
+    dst[2] = src[5];
+    dst[3] = src[4];
+    dst[4] = src[3];
+    dst[5] = src[2];
+    dst[6] = src[1];
+    dst[7] = src[0];
+  }
+
+  static void cpy4(int *dst_val, const int *src_val) {
+    unsigned char *dst = reinterpret_cast<unsigned char *>(dst_val);
+    const unsigned char *src = reinterpret_cast<const unsigned char *>(src_val);
+
+    dst[0] = src[0];
+    dst[1] = src[1];
+    dst[2] = src[2];
+    dst[3] = src[3];
+  }
+
+  static void cpy4(uint32_t *dst_val, const uint32_t *src_val) {
+    unsigned char *dst = reinterpret_cast<unsigned char *>(dst_val);
+    const unsigned char *src = reinterpret_cast<const unsigned char *>(src_val);
+
+    dst[0] = src[0];
+    dst[1] = src[1];
+    dst[2] = src[2];
+    dst[3] = src[3];
+  }
+
+ public:
+  explicit StreamReader(const uint8_t *binary, const size_t length,
+                        const bool swap_endian)
+      : binary_(binary), length_(length), swap_endian_(swap_endian), idx_(0) {
+    (void)pad_;
+  }
+
+  bool seek_set(const uint64_t offset) {
+    if (offset > length_) {
+      return false;
+    }
+
+    idx_ = offset;
+    return true;
+  }
+
+  bool seek_from_currect(const int64_t offset) {
+    if ((int64_t(idx_) + offset) < 0) {
+      return false;
+    }
+
+    if (size_t((int64_t(idx_) + offset)) > length_) {
+      return false;
+    }
+
+    idx_ = size_t(int64_t(idx_) + offset);
+    return true;
+  }
+
+  size_t read(const size_t n, const uint64_t dst_len, uint8_t *dst) {
+    size_t len = n;
+    if ((idx_ + len) > length_) {
+      len = length_ - idx_;
+    }
+
+    if (len > 0) {
+      if (dst_len < len) {
+        // dst does not have enough space. return 0 for a while.
+        return 0;
+      }
+
+      memcpy(dst, &binary_[idx_], len);
+      idx_ += len;
+      return len;
+
+    } else {
+      return 0;
+    }
+  }
+
+  bool read1(uint8_t *ret) {
+    if ((idx_ + 1) > length_) {
+      return false;
+    }
+
+    const uint8_t val = binary_[idx_];
+
+    (*ret) = val;
+    idx_ += 1;
+
+    return true;
+  }
+
+  bool read_bool(bool *ret) {
+    if ((idx_ + 1) > length_) {
+      return false;
+    }
+
+    const char val = static_cast<const char>(binary_[idx_]);
+
+    (*ret) = bool(val);
+    idx_ += 1;
+
+    return true;
+  }
+
+  bool read1(char *ret) {
+    if ((idx_ + 1) > length_) {
+      return false;
+    }
+
+    const char val = static_cast<const char>(binary_[idx_]);
+
+    (*ret) = val;
+    idx_ += 1;
+
+    return true;
+  }
+
+#if 0
+  bool read2(unsigned short *ret) {
+    if ((idx_ + 2) > length_) {
+      return false;
+    }
+
+    unsigned short val =
+        *(reinterpret_cast<const unsigned short *>(&binary_[idx_]));
+
+    if (swap_endian_) {
+      swap2(&val);
+    }
+
+    (*ret) = val;
+    idx_ += 2;
+
+    return true;
+  }
+#endif
+
+  bool read4(uint32_t *ret) {
+    if ((idx_ + 4) > length_) {
+      return false;
+    }
+
+    // use cpy4 considering unaligned access.
+    const uint32_t *ptr = reinterpret_cast<const uint32_t *>(&binary_[idx_]);
+    uint32_t val;
+    cpy4(&val, ptr);
+
+    if (swap_endian_) {
+      swap4(&val);
+    }
+
+    (*ret) = val;
+    idx_ += 4;
+
+    return true;
+  }
+
+  bool read4(int *ret) {
+    if ((idx_ + 4) > length_) {
+      return false;
+    }
+
+    // use cpy4 considering unaligned access.
+    const int32_t *ptr = reinterpret_cast<const int32_t *>(&binary_[idx_]);
+    int32_t val;
+    cpy4(&val, ptr);
+
+    if (swap_endian_) {
+      swap4(&val);
+    }
+
+    (*ret) = val;
+    idx_ += 4;
+
+    return true;
+  }
+
+#if 0
+  bool read8(uint64_t *ret) {
+    if ((idx_ + 8) > length_) {
+      return false;
+    }
+
+    uint64_t val = *(reinterpret_cast<const uint64_t *>(&binary_[idx_]));
+
+    if (swap_endian_) {
+      swap8(&val);
+    }
+
+    (*ret) = val;
+    idx_ += 8;
+
+    return true;
+  }
+
+  bool read8(int64_t *ret) {
+    if ((idx_ + 8) > length_) {
+      return false;
+    }
+
+    int64_t val = *(reinterpret_cast<const int64_t *>(&binary_[idx_]));
+
+    if (swap_endian_) {
+      swap8(&val);
+    }
+
+    (*ret) = val;
+    idx_ += 8;
+
+    return true;
+  }
+#endif
+
+  bool read_float(float *ret) {
+    if (!ret) {
+      return false;
+    }
+
+    float value;
+    if (!read4(reinterpret_cast<int *>(&value))) {
+      return false;
+    }
+
+    (*ret) = value;
+
+    return true;
+  }
+
+#if 0
+  bool read_double(double *ret) {
+    if (!ret) {
+      return false;
+    }
+
+    double value;
+    if (!read8(reinterpret_cast<uint64_t *>(&value))) {
+      return false;
+    }
+
+    (*ret) = value;
+
+    return true;
+  }
+#endif
+
+  bool read_string(std::string *ret) {
+    if (!ret) {
+      return false;
+    }
+
+    std::string value;
+
+    // read untile '\0' or end of stream.
+    for (;;) {
+      char c;
+      if (!read1(&c)) {
+        return false;
+      }
+
+      value.push_back(c);
+
+      if (c == '\0') {
+        break;
+      }
+    }
+
+    (*ret) = value;
+
+    return true;
+  }
+
+#if 0
+  bool read_value(Value *inout) {
+    if (!inout) {
+      return false;
+    }
+
+    if (inout->Type() == VALUE_TYPE_FLOAT) {
+      float value;
+      if (!read_float(&value)) {
+        return false;
+      }
+
+      (*inout) = Value(value);
+    } else if (inout->Type() == VALUE_TYPE_INT) {
+      int value;
+      if (!read4(&value)) {
+        return false;
+      }
+
+      (*inout) = Value(value);
+    } else {
+      TINYVDBIO_ASSERT(0);
+      return false;
+    }
+
+    return true;
+  }
+#endif
+
+  size_t tell() const { return idx_; }
+
+  const uint8_t *data() const { return binary_; }
+
+  bool swap_endian() const { return swap_endian_; }
+
+  size_t size() const { return length_; }
+
+ private:
+  const uint8_t *binary_;
+  const size_t length_;
+  bool swap_endian_;
+  char pad_[7];
+  uint64_t idx_;
+};
+
+// Parse fixed-size fields(magic to `numBlocks`).
+// `T` is XPDHeader or XPDCompactHeader.
+template <typename T>
+static bool ParseXPDFixedHeader(StreamReader *sr, T *xpd, std::string *err) {
+  // Header: XPD3
+  uint8_t magic[4];
+  if (!sr->read(4, 4, magic)) {
+    if (err) {
+      (*err) += "Failed to read magic number.";
+    }
+    return false;
+  }
+
+  if ((magic[0] == 'X') && (magic[1] == 'P') && (magic[2] == 'D') &&
+      (magic[3] == '3')) {
+    // ok
+  } else {
+    if (err) {
+      (*err) += "Magic number is not a 'XPD3'.";
+    }
+    return false;
+  }
+
+  // fileVersion(char)
+  if (!sr->read1(&xpd->fileVersion)) {
+    if (err) {
+      (*err) += "Failed to read `fileVersion'.";
+    }
+    return false;
+  }
+
+  // primType
+  if (!sr->read4(reinterpret_cast<uint32_t *>(&xpd->primType))) {
+    if (err) {
+      (*err) += "Failed to read `primType'.";
+    }
+    return false;
+  }
+
+  // primVersion
+  if (!sr->read1(&xpd->primVersion)) {
+    if (err) {
+      (*err) += "Failed to read `primVersion'";
+    }
+    return false;
+  }
+
+  // time
+  if (!sr->read_float(&xpd->time)) {
+    if (err) {
+      (*err) += "Failed to read `time'.";
+    }
+    return false;
+  }
+
+  // numCVs
+  if (!sr->read4(&xpd->numCVs)) {
+    if (err) {
+      (*err) += "Failed to read `numCVs'.";
+    }
+    return false;
+  }
+
+  // coordSpace
+  if (!sr->read4(reinterpret_cast<uint32_t *>(&xpd->coordSpace))) {
+    if (err) {
+      (*err) += "Failed to read `coordSpace'.";
+    }
+    return false;
+  }
+
+  // numBlocks
+  if (!sr->read4(&xpd->numBlocks)) {
+    if (err) {
+      (*err) += "Failed to read `numBlocks'.";
+    }
+    return false;
+  }
+
+  return true;
+}
+
+// Location of variable-length tables following the fixed header.
+struct XPDTableLayout {
+  uint32_t blockSize;  // in bytes
+  uint32_t numBlockNames;
+  uint64_t blockNamesOffset;
+  uint64_t primSizeOffset;
+  uint32_t numKeys;
+  uint32_t keySize;  // in bytes
+  uint32_t numKeyNames;
+  uint64_t keyNamesOffset;
+  uint32_t numFaces;
+  uint64_t faceidOffset;
+  uint64_t numPrimsOffset;
+  uint64_t blockPositionOffset;
+  uint64_t headerSize;  // The end of `blockPosition`.
+
+  XPDTableLayout()
+      : blockSize(0),
+        numBlockNames(0),
+        blockNamesOffset(0),
+        primSizeOffset(0),
+        numKeys(0),
+        keySize(0),
+        numKeyNames(0),
+        keyNamesOffset(0),
+        numFaces(0),
+        faceidOffset(0),
+        numPrimsOffset(0),
+        blockPositionOffset(0),
+        headerSize(0) {}
+};
+
+static uint32_t CountNames(const uint8_t *names, const size_t size) {
+  uint32_t n = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (names[i] == '\0') {
+      n++;
+    }
+  }
+  return n;
+}
+
+// Locate tables without copying. `sr` must point to the end of fixed header.
+static bool ScanXPDTables(StreamReader *sr, const uint32_t numBlocks,
+                          XPDTableLayout *layout, std::string *err) {
+  if (!sr->read4(&layout->blockSize)) {
+    if (err) {
+      (*err) += "Failed to parse `blockSize`.";
+    }
+    return false;
+  }
+
+  layout->blockNamesOffset = sr->tell();
+  if (!sr->seek_from_currect(int64_t(layout->blockSize))) {
+    if (err) {
+      (*err) += "Failed to read `blockNames'.";
+    }
+    return false;
+  }
+  layout->numBlockNames =
+      CountNames(sr->data() + layout->blockNamesOffset, layout->blockSize);
+
+  layout->primSizeOffset = sr->tell();
+  if (!sr->seek_from_currect(int64_t(sizeof(uint32_t)) * numBlocks)) {
+    if (err) {
+      (*err) += "Failed to read `primSize'.";
+    }
+    return false;
+  }
+
+  if (!sr->read4(&layout->numKeys)) {
+    if (err) {
+      (*err) += "Failed to parse `numKeys`.";
+    }
+    return false;
+  }
+
+  if (!sr->read4(&layout->keySize)) {
+    if (err) {
+      (*err) += "Failed to parse `keySize`.";
+    }
+    return false;
+  }
+
+  layout->keyNamesOffset = sr->tell();
+  if (!sr->seek_from_currect(int64_t(layout->keySize))) {
+    if (err) {
+      (*err) += "Failed to read `keyNames'.";
+    }
+    return false;
+  }
+  layout->numKeyNames =
+      CountNames(sr->data() + layout->keyNamesOffset, layout->keySize);
+
+  if (!sr->read4(&layout->numFaces)) {
+    if (err) {
+      (*err) += "Failed to parse `numFaces`.";
+    }
+    return false;
+  }
+
+  layout->faceidOffset = sr->tell();
+  layout->numPrimsOffset =
+      layout->faceidOffset + sizeof(int32_t) * uint64_t(layout->numFaces);
+  layout->blockPositionOffset =
+      layout->numPrimsOffset + sizeof(uint32_t) * uint64_t(layout->numFaces);
+  layout->headerSize = layout->blockPositionOffset +
+                       sizeof(uint64_t) * uint64_t(layout->numFaces) *
+                           uint64_t(numBlocks);
+
+  if (layout->headerSize > sr->size()) {
+    if (err) {
+      (*err) += "XPD data is too short for face tables.";
+    }
+    return false;
+  }
+
+  return true;
+}
+
+// Split '\0' terminated names. Characters after the last '\0' are ignored.
+static bool SplitNames(const char *names, const size_t size,
+                       std::vector<std::string> *out) {
+  const uint32_t count =
+      CountNames(reinterpret_cast<const uint8_t *>(names), size);
+  if (count > 0x7fffffffu) {  // Indices are int.
+    return false;
+  }
+
+  out->reserve(out->size() + count);
+
+  size_t last_idx = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (names[i] == '\0') {
+      out->push_back(std::string(names + last_idx, names + i));
+      last_idx = i + 1;
+    }
+  }
+
+  return true;
+}
+
+static bool ParseXPDHeader(StreamReader *sr, XPDHeader *xpd, std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileParseXPDHeader);
+
+  if (!ParseXPDFixedHeader(sr, xpd, err)) {
+    return false;
+  }
+
+  xpd->block.clear();
+  xpd->primSize.clear();
+  xpd->key.clear();
+  xpd->keyToId.clear();
+
+  // blockSize.
+  // Number of characters for all block names combined(including the end of
+  // strinc character for each block)
+  {
+    uint32_t blockSize(0);
+    if (!sr->read4(&blockSize)) {
+      if (err) {
+        (*err) += "Failed to parse `blockSize`.";
+      }
+      return false;
+    }
+
+    std::vector<char> blockNames(blockSize);
+
+    if (!sr->read(blockSize, blockSize,
+                  reinterpret_cast<uint8_t *>(blockNames.data()))) {
+      if (err) {
+        (*err) += "Failed to read `blockNames'.";
+      }
+      return false;
+    }
+
+    // split names
+    if (!SplitNames(blockNames.data(), blockSize, &xpd->block)) {
+      if (err) {
+        (*err) += "Too many block names.\n";
+      }
+      return false;
+    }
+
+    if (xpd->block.size() != xpd->numBlocks) {
+      if (err) {
+        (*err) += "The number of block names(" +
+                  std::to_string(xpd->block.size()) +
+                  ") does not match `numBlocks`(" +
+                  std::to_string(xpd->numBlocks) + ").\n";
+      }
+      return false;
+    }
+  }
+
+  // primSize
+  {
+    for (size_t i = 0; i < xpd->numBlocks; i++) {
+      uint32_t primSize;
+      if (!sr->read4(&primSize)) {
+        if (err) {
+          (*err) += "Failed to read `primSize'.";
+        }
+        return false;
+      }
+
+      if (primSize < 1) {
+        // ???
+        if (err) {
+          (*err) += "primSize[" + std::to_string(i) + " is zero.";
+        }
+        return false;
+      }
+
+      xpd->primSize.push_back(primSize);
+
+    }
+  }
+
+  // numKeys
+  // Number of characters for all key names combined(including the end of strinc
+  // character for each key)
+  {
+    uint32_t numKeys(0);
+    if (!sr->read4(&numKeys)) {
+      if (err) {
+        (*err) += "Failed to parse `numKeys`.";
+      }
+      return false;
+    }
+
+    uint32_t keySize(0);
+    if (!sr->read4(&keySize)) {
+      if (err) {
+        (*err) += "Failed to parse `keySize`.";
+      }
+      return false;
+    }
+
+    // keySize may be 0.
+    if (keySize > 0) {
+      std::vector<char> keyNames(keySize);
+
+      if (!sr->read(keySize, keySize,
+                    reinterpret_cast<uint8_t *>(keyNames.data()))) {
+        if (err) {
+          (*err) += "Failed to read `keyNames'.";
+        }
+        return false;
+      }
+
+      // split names
+      if (!SplitNames(keyNames.data(), keySize, &xpd->key)) {
+        if (err) {
+          (*err) += "Too many key names.\n";
+        }
+        return false;
+      }
+    }
+
+    if (xpd->key.size() != numKeys) {
+      if (err) {
+        (*err) += "The number of key names(" +
+                  std::to_string(xpd->key.size()) +
+                  ") does not match `numKeys`(" + std::to_string(numKeys) +
+                  ").\n";
+      }
+      return false;
+    }
+  }
+
+  xpd->rebuildNameTables();
+
+  // numFaces
+  if (!sr->read4(&xpd->numFaces)) {
+    if (err) {
+      (*err) += "Failed to parse `numFaces`.";
+    }
+    return false;
+  }
+
+  if (xpd->numFaces < 1) {
+    if (err) {
+      (*err) += "numFaces is zero";
+    }
+    return false;
+  }
+
+  // faceid. length = numFaces.
+  xpd->faceid.resize(xpd->numFaces);
+
+  if (!sr->read(sizeof(int32_t) * xpd->numFaces,
+                sizeof(int32_t) * xpd->numFaces,
+                reinterpret_cast<uint8_t *>(xpd->faceid.data()))) {
+    if (err) {
+      (*err) += "Failed to parse `faceid`.";
+    }
+    return false;
+  }
+
+  // numPrims. length = numFaces.
+  xpd->numPrims.resize(xpd->numFaces);
+  if (!sr->read(sizeof(uint32_t) * xpd->numFaces,
+                sizeof(uint32_t) * xpd->numFaces,
+                reinterpret_cast<uint8_t *>(xpd->numPrims.data()))) {
+    if (err) {
+      (*err) += "Failed to parse `numPrims`.";
+    }
+    return false;
+  }
+
+  // blockPosition. length = numFaces * numBlocks.
+  xpd->blockPosition.resize(xpd->numFaces * xpd->numBlocks);
+  if (!sr->read(sizeof(uint64_t) * xpd->blockPosition.size(),
+                sizeof(uint64_t) * xpd->blockPosition.size(),
+                reinterpret_cast<uint8_t *>(xpd->blockPosition.data()))) {
+    if (err) {
+      (*err) += "Failed to parse `blockPosition`.";
+    }
+    return false;
+  }
+
+  return true;
+}
+
+bool ParseXPDFromFile(const std::string &filename, XPDHeader *xpd_header,
+                      std::vector<uint8_t> *binary, std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileParseXPDFromFile);
+
+  if (filename.empty()) {
+    if (err) {
+      (*err) = "`filename` is empty.\n";
+    }
+
+    return false;
+  }
+
+  if (!xpd_header) {
+    if (err) {
+      (*err) = "`xpd_header` argument is null.\n";
+    }
+
+    return false;
+  }
+
+  if (!binary) {
+    if (err) {
+      (*err) = "`binary` argument is null.\n";
+    }
+
+    return false;
+  }
+
+  XPDFileIO io;
+  std::string io_err;
+  if (!io.open(filename, /* writable */ false, &io_err)) {
+    if (err) {
+      (*err) = io_err;
+    }
+    return false;
+  }
+
+  // Read whole content of XPD file.
+  const uint64_t sz = io.size();
+  if (sz < 16) {
+    // ???
+    if (err) {
+      (*err) +=
+          "File size too short. Looks like this file is not a XPD format.\n";
+    }
+    return false;
+  }
+
+  binary->resize(size_t(sz));
+
+  if (!io.readAt(0, size_t(sz), binary->data(), err)) {
+    return false;
+  }
+  TINY_XPD_PROFILE_ALLOC(sz);
+  TINY_XPD_PROFILE_COUNT(ProfileBytesRead, sz);
+
+  bool ret =
+      ParseXPDHeaderFromMemory(binary->data(), binary->size(), xpd_header, err);
+
+  return ret;
+}
+
+bool ParseXPDHeaderFromMemory(const uint8_t *binary, const size_t binary_length,
+                              XPDHeader *xpd_header, std::string *err) {
+  if (!xpd_header) {
+    if (err) {
+      (*err) = "`xpd_header` argument is null.\n";
+    }
+
+    return false;
+  }
+
+  if (!binary) {
+    if (err) {
+      (*err) = "`binary` argument is null\n";
+    }
+
+    return false;
+  }
+
+  if (binary_length < 16) {
+    if (err) {
+      (*err) = "`binary_length` is too short. It looks its not a XPD data\n";
+    }
+
+    return false;
+  }
+
+  // TODO(syoyo): Consider endianness
+  StreamReader sr(binary, binary_length, /* swap endian */ false);
+
+  if (!ParseXPDHeader(&sr, xpd_header, err)) {
+    return false;
+  }
+
+  return true;
+}
+
+bool ParseXPDCompactHeaderFromMemory(const uint8_t *binary,
+                                     const size_t binary_length,
+                                     XPDCompactHeader *xpd_header,
+                                     std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileParseCompactHeader);
+
+  if (!xpd_header) {
+    if (err) {
+      (*err) = "`xpd_header` argument is null.\n";
+    }
+
+    return false;
+  }
+
+  if (!binary) {
+    if (err) {
+      (*err) = "`binary` argument is null\n";
+    }
+
+    return false;
+  }
+
+  if (binary_length < 16) {
+    if (err) {
+      (*err) = "`binary_length` is too short. It looks its not a XPD data\n";
+    }
+
+    return false;
+  }
+
+  StreamReader sr(binary, binary_length, /* swap endian */ false);
+
+  XPDCompactHeader &xpd = (*xpd_header);
+  if (!ParseXPDFixedHeader(&sr, &xpd, err)) {
+    return false;
+  }
+
+  XPDTableLayout layout;
+  if (!ScanXPDTables(&sr, xpd.numBlocks, &layout, err)) {
+    return false;
+  }
+
+  // Name references are stored as 32bit offsets.
+  if ((layout.keyNamesOffset + layout.keySize) > 0xffffffffu) {
+    if (err) {
+      (*err) += "Name tables exceed 4GB.\n";
+    }
+    return false;
+  }
+
+  if (layout.numBlockNames != xpd.numBlocks) {
+    if (err) {
+      (*err) += "The number of block names(" +
+                std::to_string(layout.numBlockNames) +
+                ") does not match `numBlocks`(" +
+                std::to_string(xpd.numBlocks) + ").\n";
+    }
+    return false;
+  }
+
+  if (layout.numKeyNames != layout.numKeys) {
+    if (err) {
+      (*err) += "The number of key names(" +
+                std::to_string(layout.numKeyNames) +
+                ") does not match `numKeys`(" + std::to_string(layout.numKeys) +
+                ").\n";
+    }
+    return false;
+  }
+
+  if (layout.numFaces < 1) {
+    if (err) {
+      (*err) += "numFaces is zero";
+    }
+    return false;
+  }
+
+  xpd.numKeys = layout.numKeys;
+  xpd.numFaces = layout.numFaces;
+
+  // Arena layout(in bytes, 8 byte aligned):
+  // blockPosition | blockName | keyName | primSize | faceid | numPrims |
+  // blockSorted | keySorted
+  const size_t nb = xpd.numBlocks;
+  const size_t nk = xpd.numKeys;
+  const size_t nf = xpd.numFaces;
+
+  size_t offset = sizeof(uint64_t) * nf * nb;
+  xpd.blockNameOffset_ = offset;
+  offset += 2 * sizeof(uint32_t) * nb;
+  xpd.keyNameOffset_ = offset;
+  offset += 2 * sizeof(uint32_t) * nk;
+  xpd.primSizeOffset_ = offset;
+  offset += sizeof(uint32_t) * nb;
+  xpd.faceidOffset_ = offset;
+  offset += sizeof(int32_t) * nf;
+  xpd.numPrimsOffset_ = offset;
+  offset += sizeof(uint32_t) * nf;
+  xpd.blockSortedOffset_ = offset;
+  offset += sizeof(uint32_t) * nb;
+  xpd.keySortedOffset_ = offset;
+  offset += sizeof(uint32_t) * nk;
+
+  xpd.arena_.assign((offset + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+  TINY_XPD_PROFILE_ALLOC(offset);
+  xpd.binary_ = binary;
+
+  uint8_t *arena = reinterpret_cast<uint8_t *>(xpd.arena_.data());
+
+  memcpy(arena, binary + layout.blockPositionOffset,
+         sizeof(uint64_t) * nf * nb);
+  memcpy(arena + xpd.primSizeOffset_, binary + layout.primSizeOffset,
+         sizeof(uint32_t) * nb);
+  memcpy(arena + xpd.faceidOffset_, binary + layout.faceidOffset,
+         sizeof(int32_t) * nf);
+  memcpy(arena + xpd.numPrimsOffset_, binary + layout.numPrimsOffset,
+         sizeof(uint32_t) * nf);
+
+  for (uint32_t i = 0; i < xpd.numBlocks; i++) {
+    if (xpd.primSize(i) < 1) {
+      if (err) {
+        (*err) += "primSize[" + std::to_string(i) + "] is zero.\n";
+      }
+      return false;
+    }
+  }
+
+  // Name references and sorted name tables.
+  struct NameTable {
+    uint64_t namesOffset;
+    uint32_t namesSize;
+    size_t tableOffset;
+    size_t sortedOffset;
+    size_t n;
+  };
+
+  const NameTable tables[2] = {
+      {layout.blockNamesOffset, layout.blockSize, xpd.blockNameOffset_,
+       xpd.blockSortedOffset_, nb},
+      {layout.keyNamesOffset, layout.keySize, xpd.keyNameOffset_,
+       xpd.keySortedOffset_, nk}};
+
+  for (size_t t = 0; t < 2; t++) {
+    uint32_t *entry = reinterpret_cast<uint32_t *>(arena + tables[t].tableOffset);
+    uint32_t *sorted =
+        reinterpret_cast<uint32_t *>(arena + tables[t].sortedOffset);
+
+    size_t last_idx = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < tables[t].namesSize; i++) {
+      if (binary[tables[t].namesOffset + i] == '\0') {
+        entry[2 * n + 0] = uint32_t(tables[t].namesOffset + last_idx);
+        entry[2 * n + 1] = uint32_t(i - last_idx);
+        n++;
+        last_idx = i + 1;
+      }
+    }
+
+    SortXPDNameIndex(XPDCompactHeader::NameAt(&xpd, tables[t].tableOffset),
+                     uint32_t(tables[t].n), sorted);
+  }
+
+  return true;
+}
+
+// Serialize XPD header(including `blockPosition`) to `header`.
+static bool SerializeXPDHeader(XPDHeaderInput &input, const size_t prim_data_size, std::vector<uint8_t> *header, std::string *err) {
+
+  if (input.numFaces == 0) {
+    if (err) {
+      (*err) += "`numFaces' is zero.\n";
+    }
+    return false;
+  }
+
+  if (input.numBlocks == 0) {
+    if (err) {
+      (*err) += "`numBlocks' is zero.\n";
+    }
+    return false;
+  }
+
+  if (input.faceid.size() == 0) {
+    if (err) {
+      (*err) += "Array length of `faceid` is zero.\n";
+    }
+    return false;
+  }
+
+  if (input.numPrims.size() == 0) {
+    if (err) {
+      (*err) += "Array length of `numPrims` is zero.\n";
+    }
+    return false;
+  }
+
+  if (input.blockOffset.size() == 0) {
+    if (err) {
+      (*err) += "Array length of `blockOffset` is zero.\n";
+    }
+    return false;
+  }
+
+  if (input.numFaces != (input.faceid.size())) {
+    if (err) {
+      (*err) += "`numFaces`(" + std::to_string(input.numFaces) + ") must be same with `faceid`.size() which is " + std::to_string(input.faceid.size()) + ".\n";
+    }
+    return false;
+  }
+
+  if ((input.numFaces * input.numBlocks) != (input.blockOffset.size())) {
+    if (err) {
+      (*err) += "`numFaces * numBlocks`(" + std::to_string(input.numFaces * input.numBlocks) + ") must be same with `blockOffset`.size() which is " + std::to_string(input.blockOffset.size()) + ".\n";
+    }
+    return false;
+  }
+
+  if ((input.numFaces != input.numPrims.size()) ||
+      (input.numBlocks != input.primSize.size())) {
+    if (err) {
+      (*err) += "`numPrims.size()` and `primSize.size()` must be same with `numFaces` and `numBlocks`.\n";
+    }
+    return false;
+  }
+
+  // Prim data may be empty(e.g. no prims in any face), but must cover all
+  // blocks with prims.
+  for (size_t f = 0; f < input.numFaces; f++) {
+    if (input.numPrims[f] == 0) {
+      continue;
+    }
+    for (size_t b = 0; b < input.numBlocks; b++) {
+      const uint64_t offset = input.blockOffset[f * input.numBlocks + b];
+      const uint64_t n = uint64_t(input.numPrims[f]) * input.primSize[b];
+      if ((offset > prim_data_size) ||
+          (n > (prim_data_size - offset) / sizeof(float))) {
+        if (err) {
+          (*err) += "Data size too short for primitive data.\n";
+        }
+        return false;
+      }
+    }
+  }
+
+  if (input.block.size() != (input.primSize.size())) {
+    if (err) {
+      (*err) += "`block.size()`(" + std::to_string(input.block.size()) + ") must be same with `primSize.size()`(" + std::to_string(input.primSize.size()) + ".\n";
+    }
+    return false;
+  }
+
+  std::ostringstream ss;
+
+  // TODO(syoyo): Consider endinanness.
+  {
+    // magic
+    char magic[4] = {'X', 'P', 'D', '3'};
+    ss.write(magic, 4);
+
+    // fileVersion(char)
+    ss.write(reinterpret_cast<const char *>(&input.fileVersion), 1);
+
+    ss.write(reinterpret_cast<const char *>(&input.primType), sizeof(uint32_t));
+    ss.write(reinterpret_cast<const char *>(&input.primVersion), 1);
+    ss.write(reinterpret_cast<const char *>(&input.time), sizeof(float));
+
+    ss.write(reinterpret_cast<const char *>(&input.numCVs), sizeof(uint32_t));
+    ss.write(reinterpret_cast<const char *>(&input.coordSpace), sizeof(uint32_t));
+
+  }
+
+  // block
+  {
+    ss.write(reinterpret_cast<const char *>(&input.numBlocks), sizeof(uint32_t));
+
+    // Build a string with flattened block names(using delimiter '\0')
+    uint32_t block_name_size = 0;
+    std::string block_name_str;
+    for (size_t i = 0; i < input.numBlocks; i++) {
+      block_name_str += input.block[i];
+      block_name_str += '\0';
+
+      block_name_size += input.block[i].size() + 1; // +1 for '\0'
+    }
+
+    ss.write(reinterpret_cast<const char *>(&block_name_size), sizeof(uint32_t));
+
+    ss.write(block_name_str.c_str(), block_name_size);
+  }
+
+  // primSize
+  {
+    for (size_t i = 0; i < input.block.size(); i++) {
+      ss.write(reinterpret_cast<const char *>(&input.primSize[i]), sizeof(uint32_t));
+    }
+  }
+
+  // keys
+  {
+    uint32_t numKeys = uint32_t(input.key.size());
+    ss.write(reinterpret_cast<const char *>(&numKeys), sizeof(uint32_t));
+
+    // Build a string with flattened string(using delimiter '\0')
+    uint32_t key_name_size = 0;
+    std::string key_name_str;
+    for (size_t i = 0; i < numKeys; i++) {
+      key_name_str += input.key[i];
+      key_name_str += '\0';
+
+      key_name_size += input.key[i].size() + 1; // +1 for '\0'
+    }
+
+    ss.write(reinterpret_cast<const char *>(&key_name_size), sizeof(uint32_t));
+
+    if (key_name_size > 0) {
+      ss.write(key_name_str.c_str(), key_name_size);
+    }
+  }
+
+
+  // faceid
+  {
+    ss.write(reinterpret_cast<const char *>(&input.numFaces), sizeof(uint32_t));
+
+
+    if (input.numFaces > 0) {
+      ss.write(reinterpret_cast<const char *>(input.faceid.data()), input.numFaces * sizeof(uint32_t));
+    }
+
+  }
+
+  // numPrims. length = numFaces
+  {
+    ss.write(reinterpret_cast<const char *>(input.numPrims.data()), input.numFaces * sizeof(uint32_t));
+  }
+
+
+  // header size includes `blockPosition` data.
+  size_t header_size = ss.str().size() + input.blockOffset.size() * sizeof(uint64_t);
+
+  // Compute absolute blockPosition
+  for (size_t b = 0; b < input.blockOffset.size(); b++) {
+    uint64_t position = header_size + input.blockOffset[b];
+    ss.write(reinterpret_cast<const char *>(&position), sizeof(uint64_t));
+  }
+
+  const std::string str = ss.str();
+  header->assign(str.begin(), str.end());
+
+  return true;
+}
+
+bool SerializeToXPD(XPDHeaderInput &input, std::vector<uint8_t> &prim_data, std::vector<uint8_t> *xpd_binary, std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileSerializeToXPD);
+
+  if (!xpd_binary) {
+    if (err) {
+      (*err) += "Pointer to `xpd_binary' is null.\n";
+    }
+    return false;
+  }
+
+  if (!SerializeXPDHeader(input, prim_data.size(), xpd_binary, err)) {
+    return false;
+  }
+
+  // Append PrimData.
+  xpd_binary->insert(xpd_binary->end(), prim_data.begin(), prim_data.end());
+
+  return true;
+}
+
+bool SerializeToXPD(XPDHeaderInput &input, const std::vector<uint8_t> &prim_data, XPDIO *io, std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileSerializeToXPD);
+
+  if (!io) {
+    if (err) {
+      (*err) += "Pointer to `io' is null.\n";
+    }
+    return false;
+  }
+
+  std::vector<uint8_t> header;
+  if (!SerializeXPDHeader(input, prim_data.size(), &header, err)) {
+    return false;
+  }
+
+  if (!io->writeAt(0, header.data(), header.size(), err)) {
+    return false;
+  }
+
+  return io->writeAt(header.size(), prim_data.data(), prim_data.size(), err);
+}
+
+static std::string ChannelKeyName(const std::string &block,
+                                  const std::string &name,
+                                  const uint32_t arity) {
+  return block + ":" + name + ":" + std::to_string(arity);
+}
+
+// Decode `<block>:<name>:<arity>`. Return false when `key` is not a channel.
+static bool DecodeChannelKeyName(const std::string &key, std::string *block,
+                                 std::string *name, uint32_t *arity) {
+  size_t first = key.find(':');
+  size_t last = key.rfind(':');
+  if ((first == std::string::npos) || (first == last) || (first == 0) ||
+      ((first + 1) == last) || ((last + 1) == key.size())) {
+    return false;
+  }
+
+  uint32_t n = 0;
+  for (size_t i = last + 1; i < key.size(); i++) {
+    if ((key[i] < '0') || (key[i] > '9') || (n > 0xffffff)) {
+      return false;
+    }
+    n = n * 10 + uint32_t(key[i] - '0');
+  }
+
+  if (n == 0) {
+    return false;
+  }
+
+  (*block) = key.substr(0, first);
+  (*name) = key.substr(first + 1, last - first - 1);
+  (*arity) = n;
+
+  return true;
+}
+
+bool GetBlockView(const XPDHeader &xpd, const uint8_t *binary,
+                  const size_t binary_length, const uint32_t face,
+                  const uint32_t block_id, XPDBlockView *view,
+                  std::string *err) {
+  if (!binary || !view) {
+    if (err) {
+      (*err) += "`binary` or `view` argument is null.\n";
+    }
+    return false;
+  }
+
+  if ((face >= xpd.numFaces) || (face >= xpd.numPrims.size())) {
+    if (err) {
+      (*err) += "Face index " + std::to_string(face) + " out of range.\n";
+    }
+    return false;
+  }
+
+  if ((block_id >= xpd.numBlocks) || (block_id >= xpd.primSize.size())) {
+    if (err) {
+      (*err) += "Block index " + std::to_string(block_id) + " out of range.\n";
+    }
+    return false;
+  }
+
+  const size_t idx = size_t(face) * xpd.numBlocks + block_id;
+  if (idx >= xpd.blockPosition.size()) {
+    if (err) {
+      (*err) += "`blockPosition` is too short.\n";
+    }
+    return false;
+  }
+
+  const uint64_t position = xpd.blockPosition[idx];
+  const uint64_t num_bytes =
+      uint64_t(xpd.numPrims[face]) * xpd.primSize[block_id] * sizeof(float);
+  if ((position > binary_length) || (num_bytes > (binary_length - position))) {
+    if (err) {
+      (*err) += "Prim data of face " + std::to_string(face) + ", block " +
+                std::to_string(block_id) + " exceeds XPD data.\n";
+    }
+    return false;
+  }
+
+  view->data = binary + position;
+  view->numPrims = xpd.numPrims[face];
+  view->primSize = xpd.primSize[block_id];
+
+  return true;
+}
+
+bool AddChannel(XPDHeaderInput *input, const std::string &block,
+                const std::string &name, const uint32_t arity,
+                uint32_t *offset, std::string *err) {
+  if (!input) {
+    if (err) {
+      (*err) += "`input` argument is null.\n";
+    }
+    return false;
+  }
+
+  if (arity == 0) {
+    if (err) {
+      (*err) += "`arity` is zero.\n";
+    }
+    return false;
+  }
+
+  if (name.empty() || (name.find('\0') != std::string::npos)) {
+    if (err) {
+      (*err) += "Invalid channel name.\n";
+    }
+    return false;
+  }
+
+  size_t block_id = input->block.size();
+  for (size_t b = 0; b < input->block.size(); b++) {
+    if (input->block[b] == block) {
+      block_id = b;
+      break;
+    }
+  }
+
+  if ((block_id == input->block.size()) ||
+      (block_id >= input->primSize.size()) ||
+      (block.find(':') != std::string::npos)) {
+    if (err) {
+      (*err) += "Block `" + block + "' not found or has invalid name.\n";
+    }
+    return false;
+  }
+
+  for (size_t k = 0; k < input->key.size(); k++) {
+    std::string key_block, key_name;
+    uint32_t key_arity;
+    if (DecodeChannelKeyName(input->key[k], &key_block, &key_name,
+                             &key_arity)) {
+      if ((key_block == block) && (key_name == name)) {
+        if (err) {
+          (*err) += "Channel `" + name + "' already exists in block `" +
+                    block + "'.\n";
+        }
+        return false;
+      }
+    }
+  }
+
+  const std::string key = ChannelKeyName(block, name, arity);
+  input->keyToId[key] = int(input->key.size());
+  input->key.push_back(key);
+
+  if (offset) {
+    (*offset) = input->primSize[block_id];
+  }
+  input->primSize[block_id] += arity;
+
+  return true;
+}
+
+bool GetChannels(const XPDHeader &xpd, std::vector<XPDChannel> *channels,
+                 std::string *err) {
+  if (!channels) {
+    if (err) {
+      (*err) += "`channels` argument is null.\n";
+    }
+    return false;
+  }
+
+  channels->clear();
+
+  // Total arity of channels per block.
+  std::vector<uint32_t> channel_size(xpd.block.size(), 0);
+
+  for (size_t k = 0; k < xpd.key.size(); k++) {
+    std::string block, name;
+    uint32_t arity;
+    if (!DecodeChannelKeyName(xpd.key[k], &block, &name, &arity)) {
+      continue;
+    }
+
+    const int block_id = xpd.findBlock(block);
+    if (block_id < 0) {
+      // Not a channel of this XPD.
+      continue;
+    }
+
+    XPDChannel channel;
+    channel.name = name;
+    channel.blockId = uint32_t(block_id);
+    channel.keyId = uint32_t(k);
+    channel.offset = channel_size[size_t(block_id)];  // relative for a while.
+    channel.arity = arity;
+
+    channel_size[size_t(block_id)] += arity;
+
+    channels->push_back(channel);
+  }
+
+  // Channels are placed at the end of a prim.
+  for (size_t i = 0; i < channels->size(); i++) {
+    XPDChannel &channel = (*channels)[i];
+    if ((channel.blockId >= xpd.primSize.size()) ||
+        (channel_size[channel.blockId] > xpd.primSize[channel.blockId])) {
+      if (err) {
+        (*err) += "Channels of block `" + xpd.block[channel.blockId] +
+                  "' exceed `primSize'.\n";
+      }
+      channels->clear();
+      return false;
+    }
+
+    channel.offset += xpd.primSize[channel.blockId] -
+                      channel_size[channel.blockId];
+  }
+
+  return true;
+}
+
+bool FindChannel(const XPDHeader &xpd, const std::string &block,
+                 const std::string &name, XPDChannel *channel) {
+  if (!channel) {
+    return false;
+  }
+
+  const int block_id = xpd.findBlock(block);
+  if (block_id < 0) {
+    return false;
+  }
+
+  std::vector<XPDChannel> channels;
+  if (!GetChannels(xpd, &channels, nullptr)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < channels.size(); i++) {
+    if ((channels[i].name == name) &&
+        (channels[i].blockId == uint32_t(block_id))) {
+      (*channel) = channels[i];
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool GetChannelView(const XPDHeader &xpd, const uint8_t *binary,
+                    const size_t binary_length, const uint32_t face,
+                    const XPDChannel &channel, XPDChannelView *view,
+                    std::string *err) {
+  if (!view) {
+    if (err) {
+      (*err) += "`view` argument is null.\n";
+    }
+    return false;
+  }
+
+  XPDBlockView block_view;
+  if (!GetBlockView(xpd, binary, binary_length, face, channel.blockId,
+                    &block_view, err)) {
+    return false;
+  }
+
+  if ((channel.arity == 0) ||
+      ((channel.offset + channel.arity) > block_view.primSize)) {
+    if (err) {
+      (*err) += "Channel `" + channel.name + "' exceeds `primSize'.\n";
+    }
+    return false;
+  }
+
+  view->data = block_view.data + channel.offset * sizeof(float);
+  view->numPrims = block_view.numPrims;
+  view->stride = block_view.stride();
+  view->arity = channel.arity;
+
+  return true;
+}
+
+bool PeekXPDHeaderSize(const uint8_t *data, const size_t length,
+                       uint64_t *required, std::string *err) {
+  if (!data || !required) {
+    if (err) {
+      (*err) += "`data` or `required` argument is null.\n";
+    }
+    return false;
+  }
+
+  // magic(4) fileVersion(1) primType(4) primVersion(1) time(4) numCVs(4)
+  // coordSpace(4) numBlocks(4) blockSize(4)
+  uint64_t offset = 30;
+  if (length < offset) {
+    (*required) = offset;
+    return true;
+  }
+
+  if ((data[0] != 'X') || (data[1] != 'P') || (data[2] != 'D') ||
+      (data[3] != '3')) {
+    if (err) {
+      (*err) += "Magic number is not a 'XPD3'.\n";
+    }
+    return false;
+  }
+
+  uint32_t numBlocks, blockSize;
+  memcpy(&numBlocks, data + 22, sizeof(uint32_t));
+  memcpy(&blockSize, data + 26, sizeof(uint32_t));
+
+  // blockNames, primSize, numKeys and keySize
+  offset += uint64_t(blockSize) + sizeof(uint32_t) * uint64_t(numBlocks);
+  if (length < (offset + 8)) {
+    (*required) = offset + 8;
+    return true;
+  }
+
+  uint32_t keySize;
+  memcpy(&keySize, data + offset + 4, sizeof(uint32_t));
+
+  // keyNames, numFaces
+  offset += 8 + uint64_t(keySize);
+  if (length < (offset + 4)) {
+    (*required) = offset + 4;
+    return true;
+  }
+
+  uint32_t numFaces;
+  memcpy(&numFaces, data + offset, sizeof(uint32_t));
+  offset += 4;
+
+  // faceid, numPrims, blockPosition
+  offset += uint64_t(numFaces) *
+            (sizeof(int32_t) + sizeof(uint32_t) +
+             sizeof(uint64_t) * uint64_t(numBlocks));
+
+  (*required) = offset;
+  return true;
+}
+
+XPDMappedFile::XPDMappedFile()
+    : data_(nullptr),
+      size_(0)
+#if defined(_WIN32)
+      ,
+      file_(nullptr),
+      mapping_(nullptr)
+#endif
+{
+}
+
+XPDMappedFile::~XPDMappedFile() { close(); }
+
+XPDMappedFile::XPDMappedFile(XPDMappedFile &&rhs)
+    : data_(rhs.data_),
+      size_(rhs.size_)
+#if defined(_WIN32)
+      ,
+      file_(rhs.file_),
+      mapping_(rhs.mapping_)
+#endif
+{
+  rhs.data_ = nullptr;
+  rhs.size_ = 0;
+#if defined(_WIN32)
+  rhs.file_ = nullptr;
+  rhs.mapping_ = nullptr;
+#endif
+}
+
+XPDMappedFile &XPDMappedFile::operator=(XPDMappedFile &&rhs) {
+  if (this != &rhs) {
+    close();
+    std::swap(data_, rhs.data_);
+    std::swap(size_, rhs.size_);
+#if defined(_WIN32)
+    std::swap(file_, rhs.file_);
+    std::swap(mapping_, rhs.mapping_);
+#endif
+  }
+  return *this;
+}
+
+#if defined(_WIN32)
+
+bool XPDMappedFile::open(const std::string &filename, std::string *err) {
+  close();
+
+  HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    if (err) {
+      (*err) += "Failed to open a file: " + filename + "\n";
+    }
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || (size.QuadPart < 1)) {
+    CloseHandle(file);
+    if (err) {
+      (*err) += "Failed to get file size or file is empty: " + filename + "\n";
+    }
+    return false;
+  }
+
+  HANDLE mapping =
+      CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!mapping) {
+    CloseHandle(file);
+    if (err) {
+      (*err) += "Failed to create file mapping: " + filename + "\n";
+    }
+    return false;
+  }
+
+  void *p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!p) {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    if (err) {
+      (*err) += "Failed to map a file: " + filename + "\n";
+    }
+    return false;
+  }
+
+  data_ = reinterpret_cast<const uint8_t *>(p);
+  size_ = size_t(size.QuadPart);
+  file_ = file;
+  mapping_ = mapping;
+
+  return true;
+}
+
+void XPDMappedFile::close() {
+  if (data_) {
+    UnmapViewOfFile(data_);
+  }
+  if (mapping_) {
+    CloseHandle(mapping_);
+  }
+  if (file_) {
+    CloseHandle(file_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+  file_ = nullptr;
+  mapping_ = nullptr;
+}
+
+#else
+
+bool XPDMappedFile::open(const std::string &filename, std::string *err) {
+  close();
+
+  int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (err) {
+      (*err) += "Failed to open a file: " + filename + "\n";
+    }
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    if (err) {
+      (*err) += "Failed to stat a file: " + filename + "\n";
+    }
+    return false;
+  }
+
+  bool ret = map(fd, uint64_t(st.st_size), err);
+  ::close(fd);
+
+  return ret;
+}
+
+bool XPDMappedFile::map(const int fd, const uint64_t size, std::string *err) {
+  close();
+
+  if (size < 1) {
+    if (err) {
+      (*err) += "File is empty.\n";
+    }
+    return false;
+  }
+
+  void *p = mmap(nullptr, size_t(size), PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    if (err) {
+      (*err) += "Failed to mmap a file.\n";
+    }
+    return false;
+  }
+
+  data_ = reinterpret_cast<const uint8_t *>(p);
+  size_ = size_t(size);
+
+  return true;
+}
+
+void XPDMappedFile::close() {
+  if (data_) {
+    munmap(const_cast<uint8_t *>(data_), size_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+}
+
+#endif
+
+// ---------------------------------------------
+// Residency manager.
+
+XPDResidencyManager::XPDResidencyManager()
+    : fd_(-1),
+      page_size_(4096),
+      seq_(0),
+      prefetch_cursor_(0),
+      resident_(0),
+      peak_(0),
+      dropped_(0),
+      advise_failures_(0) {}
+
+XPDResidencyManager::~XPDResidencyManager() { close(); }
+
+void XPDResidencyManager::close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+#if !defined(_WIN32)
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+#endif
+  fd_ = -1;
+  file_.close();
+  header_ = XPDHeader();
+  face_begin_.clear();
+  face_end_.clear();
+  file_order_.clear();
+  order_index_.clear();
+  state_.clear();
+  refs_.clear();
+  state_seq_.clear();
+  released_.clear();
+  prefetched_.clear();
+  seq_ = 0;
+  prefetch_cursor_ = 0;
+  resident_ = 0;
+  peak_ = 0;
+  dropped_ = 0;
+  advise_failures_ = 0;
+}
+
+bool XPDResidencyManager::open(const std::string &filename,
+                               const XPDResidencyOption &option,
+                               std::string *err) {
+  close();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  option_ = option;
+
+#if defined(_WIN32)
+  if (!file_.open(filename, err)) {
+    return false;
+  }
+#else
+  int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (err) {
+      (*err) += "Failed to open a file: " + filename + "\n";
+    }
+    return false;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || !file_.map(fd, uint64_t(st.st_size), err)) {
+    ::close(fd);
+    if (err) {
+      (*err) += "Failed to map a file: " + filename + "\n";
+    }
+    return false;
+  }
+
+  // Keep the descriptor for dropping page cache.
+  if (option_.dropPageCache) {
+    fd_ = fd;
+  } else {
+    ::close(fd);
+  }
+
+  page_size_ = uint64_t(sysconf(_SC_PAGESIZE));
+  if (option_.sequential && (file_.size() > 0) &&
+      (madvise(const_cast<uint8_t *>(file_.data()), file_.size(),
+               MADV_SEQUENTIAL) != 0)) {
+    advise_failures_++;
+    TINY_XPD_PROFILE_COUNT(ProfileAdviseFailures, 1);
+  }
+#endif
+
+  if (!ParseXPDHeaderFromMemory(file_.data(), file_.size(), &header_, err)) {
+    return false;
+  }
+
+  const uint32_t num_faces = header_.numFaces;
+  const uint32_t num_blocks = header_.numBlocks;
+  if ((header_.numPrims.size() != num_faces) ||
+      (header_.primSize.size() != num_blocks) ||
+      (header_.blockPosition.size() != size_t(num_faces) * num_blocks)) {
+    if (err) {
+      (*err) += "Inconsistent face/block tables in XPD header.\n";
+    }
+    return false;
+  }
+
+  // Byte range of each face. Bytes between faces(e.g. variable length data
+  // appended to a block) belong to the preceding face.
+  const uint64_t file_size = file_.size();
+  face_begin_.resize(num_faces);
+  face_end_.resize(num_faces);
+  for (uint32_t f = 0; f < num_faces; f++) {
+    uint64_t begin = file_size;
+    uint64_t end = 0;
+    for (uint32_t b = 0; b < num_blocks; b++) {
+      const uint64_t position =
+          header_.blockPosition[size_t(f) * num_blocks + b];
+      const uint64_t n =
+          uint64_t(header_.numPrims[f]) * header_.primSize[b] * sizeof(float);
+      begin = std::min(begin, std::min(position, file_size));
+      end = std::max(end, std::min(position + n, file_size));
+    }
+    face_begin_[f] = begin;
+    face_end_[f] = std::max(begin, end);
+  }
+
+  file_order_.resize(num_faces);
+  for (uint32_t f = 0; f < num_faces; f++) {
+    file_order_[f] = f;
+  }
+  std::stable_sort(file_order_.begin(), file_order_.end(),
+                   [&](uint32_t a, uint32_t b) {
+                     return face_begin_[a] < face_begin_[b];
+                   });
+
+  order_index_.resize(num_faces);
+  for (size_t i = 0; i < num_faces; i++) {
+    const uint32_t f = file_order_[i];
+    order_index_[f] = uint32_t(i);
+    const uint64_t next =
+        ((i + 1) < num_faces) ? face_begin_[file_order_[i + 1]] : file_size;
+    face_end_[f] = std::max(face_end_[f], next);
+  }
+
+  state_.assign(num_faces, FaceCold);
+  refs_.assign(num_faces, 0);
+  state_seq_.assign(num_faces, 0);
+
+  return true;
+}
+
+void XPDResidencyManager::advise(uint64_t begin, uint64_t end,
+                                 const bool drop) {
+#if defined(_WIN32)
+  (void)begin;
+  (void)end;
+  (void)drop;
+#else
+  // Prefetch whole pages touching the range, but drop only pages inside the
+  // range so pages shared with neighbor faces stay resident.
+  const uint64_t mask = page_size_ - 1;
+  if (drop) {
+    begin = (begin + mask) & ~mask;
+    if (end < file_.size()) {
+      end &= ~mask;
+    }
+  } else {
+    begin &= ~mask;
+  }
+  if (begin >= end) {
+    return;
+  }
+
+  uint64_t failures = 0;
+  uint8_t *p = const_cast<uint8_t *>(file_.data()) + begin;
+  if (madvise(p, size_t(end - begin), drop ? MADV_DONTNEED : MADV_WILLNEED) !=
+      0) {
+    failures++;
+  }
+#if defined(POSIX_FADV_DONTNEED)
+  // Returns an error number instead of setting errno.
+  if (drop && (fd_ >= 0) &&
+      (posix_fadvise(fd_, off_t(begin), off_t(end - begin),
+                     POSIX_FADV_DONTNEED) != 0)) {
+    failures++;
+  }
+#endif
+  advise_failures_ += failures;
+  TINY_XPD_PROFILE_COUNT(ProfileAdviseFailures, failures);
+#endif
+}
+
+void XPDResidencyManager::drop(const uint32_t face) {
+  advise(face_begin_[face], face_end_[face], /* drop */ true);
+  if (state_[face] == FacePrefetched) {
+    // Prefetch it again when the window reaches it.
+    prefetch_cursor_ = std::min(prefetch_cursor_, size_t(order_index_[face]));
+  }
+  state_[face] = FaceCold;
+  resident_ -= faceBytes(face);
+  dropped_ += faceBytes(face);
+}
+
+void XPDResidencyManager::evict() {
+  if (option_.residentBudget == 0) {
+    return;
+  }
+  evictTo(option_.residentBudget, /* prefetched */ true);
+}
+
+void XPDResidencyManager::evictTo(const uint64_t target,
+                                  const bool prefetched) {
+  // Released faces in release order, then prefetched faces not acquired yet
+  // from the farthest. Skip entries of faces whose state changed after them.
+  while ((resident_ > target) && !released_.empty()) {
+    const std::pair<uint32_t, uint64_t> entry = released_.front();
+    released_.pop_front();
+    if ((state_[entry.first] == FaceReleased) &&
+        (state_seq_[entry.first] == entry.second)) {
+      drop(entry.first);
+    }
+  }
+  while (prefetched && (resident_ > target) && !prefetched_.empty()) {
+    const std::pair<uint32_t, uint64_t> entry = prefetched_.back();
+    prefetched_.pop_back();
+    if ((state_[entry.first] == FacePrefetched) &&
+        (state_seq_[entry.first] == entry.second)) {
+      drop(entry.first);
+    }
+  }
+}
+
+void XPDResidencyManager::acquire(const uint32_t face) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (face >= state_.size()) {
+    return;
+  }
+
+  const uint64_t budget = option_.residentBudget;
+  if (state_[face] == FaceCold) {
+    if (budget > 0) {
+      // Make room before the face is paged in.
+      evictTo((faceBytes(face) < budget) ? (budget - faceBytes(face)) : 0,
+              /* prefetched */ true);
+    }
+    resident_ += faceBytes(face);
+    advise(face_begin_[face], face_end_[face], /* drop */ false);
+  }
+  state_[face] = FaceAcquired;
+  refs_[face]++;
+
+  if (option_.prefetchWindow > 0) {
+    const uint64_t window_end = face_end_[face] + option_.prefetchWindow;
+    size_t i = std::max(prefetch_cursor_, size_t(order_index_[face]) + 1);
+    bool found = false;
+    uint64_t begin = 0, end = 0;
+    for (; (i < file_order_.size()) &&
+           (face_begin_[file_order_[i]] < window_end);
+         i++) {
+      const uint32_t f = file_order_[i];
+      if (state_[f] != FaceCold) {
+        continue;
+      }
+      if ((budget > 0) && (resident_ + faceBytes(f) > budget)) {
+        // Make room by dropping released faces. Stop at the budget.
+        evictTo((faceBytes(f) < budget) ? (budget - faceBytes(f)) : 0,
+                /* prefetched */ false);
+        if (resident_ + faceBytes(f) > budget) {
+          break;
+        }
+      }
+      state_[f] = FacePrefetched;
+      state_seq_[f] = ++seq_;
+      prefetched_.push_back(std::make_pair(f, seq_));
+      resident_ += faceBytes(f);
+      if (!found) {
+        begin = face_begin_[f];
+        found = true;
+      }
+      end = face_end_[f];
+    }
+    prefetch_cursor_ = std::max(prefetch_cursor_, i);
+
+    if (found) {
+      advise(begin, end, /* drop */ false);
+    }
+  }
+
+  peak_ = std::max(peak_, resident_);
+  evict();
+}
+
+void XPDResidencyManager::release(const uint32_t face) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if ((face >= state_.size()) || (refs_[face] == 0)) {
+    return;
+  }
+
+  if (--refs_[face] == 0) {
+    state_[face] = FaceReleased;
+    state_seq_[face] = ++seq_;
+    released_.push_back(std::make_pair(face, seq_));
+  }
+  evict();
+}
+
+void XPDResidencyManager::dropAll() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (uint32_t f = 0; f < state_.size(); f++) {
+    if ((state_[f] == FacePrefetched) || (state_[f] == FaceReleased)) {
+      drop(f);
+    }
+  }
+  released_.clear();
+  prefetched_.clear();
+  prefetch_cursor_ = 0;
+}
+
+uint64_t XPDResidencyManager::residentBytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return resident_;
+}
+
+uint64_t XPDResidencyManager::peakResidentBytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return peak_;
+}
+
+uint64_t XPDResidencyManager::droppedBytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return dropped_;
+}
+
+uint64_t XPDResidencyManager::adviseFailures() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return advise_failures_;
+}
+
+static uint32_t ResolveNumThreads(const uint32_t num_threads,
+                                  const size_t num_tasks) {
+  uint32_t n = num_threads;
+  if (n == 0) {
+    n = std::thread::hardware_concurrency();
+  }
+  if (n == 0) {
+    n = 1;
+  }
+  if (size_t(n) > num_tasks) {
+    n = uint32_t(num_tasks);
+  }
+  return (n == 0) ? 1 : n;
+}
+
+// Parse header bytes read from a file and optionally map the file.
+// `header` contains at least `header_size` bytes.
+static bool FinishBatchOpen(const std::string &filename,
+                            const std::vector<uint8_t> &header,
+                            const uint64_t header_size, const int fd,
+                            const XPDBatchOpenOption &option,
+                            XPDBatchOpenResult *result) {
+  TINY_XPD_PROFILE_COUNT(ProfileBytesRead, header_size);
+
+  if (!ParseXPDHeaderFromMemory(header.data(), size_t(header_size),
+                                &result->header, &result->err)) {
+    return false;
+  }
+
+#if defined(_WIN32)
+  (void)fd;
+  if (option.mapFiles) {
+    if (!result->file.open(filename, &result->err)) {
+      return false;
+    }
+    result->fileSize = result->file.size();
+  }
+#else
+  (void)filename;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    result->err += "Failed to stat a file.\n";
+    return false;
+  }
+  result->fileSize = uint64_t(st.st_size);
+
+  if (option.mapFiles) {
+    if (!result->file.map(fd, result->fileSize, &result->err)) {
+      return false;
+    }
+  }
+#endif
+
+  return true;
+}
+
+#if defined(_WIN32)
+
+static bool OpenXPDHeaderBlocking(const std::string &filename,
+                                  const XPDBatchOpenOption &option,
+                                  XPDBatchOpenResult *result) {
+  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+  if (!ifs) {
+    result->err += "Failed to open a file: " + filename + "\n";
+    return false;
+  }
+
+  ifs.seekg(0, ifs.end);
+  const uint64_t file_size = uint64_t(ifs.tellg());
+  ifs.seekg(0, ifs.beg);
+
+  std::vector<uint8_t> header(option.headerReadSize);
+  uint64_t required = header.size();
+  size_t length = 0;
+
+  for (;;) {
+    // `required` comes from header counts. Check it before allocating.
+    if ((length > 0) && (required > file_size)) {
+      result->err += "Header size(" + std::to_string(required) +
+                     ") exceeds the file size(" + std::to_string(file_size) +
+                     "): " + filename + "\n";
+      return false;
+    }
+    header.resize(size_t(required));
+    ifs.read(reinterpret_cast<char *>(header.data() + length),
+             std::streamsize(required - length));
+    length += size_t(ifs.gcount());
+
+    if (!PeekXPDHeaderSize(header.data(), length, &required, &result->err)) {
+      return false;
+    }
+
+    if (required <= length) {
+      break;
+    }
+
+    if (!ifs) {
+      result->err += "File is too short for XPD header: " + filename + "\n";
+      return false;
+    }
+  }
+
+  return FinishBatchOpen(filename, header, required, -1, option, result);
+}
+
+#else
+
+// pread until `n` bytes are read or EOF. Return the number of bytes read.
+static size_t PreadFull(const int fd, uint8_t *dst, const size_t n,
+                        const uint64_t offset) {
+  size_t total = 0;
+  while (total < n) {
+    ssize_t ret = pread(fd, dst + total, n - total, off_t(offset + total));
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (ret == 0) {
+      break;
+    }
+    total += size_t(ret);
+  }
+  return total;
+}
+
+static bool OpenXPDHeaderBlocking(const std::string &filename,
+                                  const XPDBatchOpenOption &option,
+                                  XPDBatchOpenResult *result) {
+  int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    result->err += "Failed to open a file: " + filename + "\n";
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    result->err += "Failed to stat a file: " + filename + "\n";
+    return false;
+  }
+  const uint64_t file_size = uint64_t(st.st_size);
+
+  std::vector<uint8_t> header(option.headerReadSize);
+  size_t length = PreadFull(fd, header.data(), header.size(), 0);
+  uint64_t required = 0;
+
+  for (;;) {
+    if (!PeekXPDHeaderSize(header.data(), length, &required, &result->err)) {
+      ::close(fd);
+      return false;
+    }
+
+    if (required <= length) {
+      break;
+    }
+
+    // `required` comes from header counts. Check it before allocating.
+    if (required > file_size) {
+      ::close(fd);
+      result->err += "Header size(" + std::to_string(required) +
+                     ") exceeds the file size(" + std::to_string(file_size) +
+                     "): " + filename + "\n";
+      return false;
+    }
+
+    header.resize(size_t(required));
+    const size_t n =
+        PreadFull(fd, header.data() + length, size_t(required) - length,
+                  length);
+    if (n == 0) {
+      ::close(fd);
+      result->err += "File is too short for XPD header: " + filename + "\n";
+      return false;
+    }
+    length += n;
+  }
+
+  bool ret = FinishBatchOpen(filename, header, required, fd, option, result);
+  ::close(fd);
+
+  return ret;
+}
+
+#endif
+
+#if defined(TINY_XPD_USE_IO_URING) && defined(__linux__)
+
+///
+/// Minimal io_uring wrapper using raw syscalls(no liburing dependency).
+///
+class IOUring {
+ public:
+  IOUring()
+      : fd_(-1),
+        sq_ring_(nullptr),
+        cq_ring_(nullptr),
+        sqes_(nullptr),
+        sq_ring_size_(0),
+        cq_ring_size_(0),
+        sqes_size_(0),
+        pending_(0) {}
+
+  ~IOUring() {
+    if (sqes_) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ && (cq_ring_ != sq_ring_)) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_) {
+      munmap(sq_ring_, sq_ring_size_);
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  bool init(const uint32_t entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    fd_ = int(syscall(__NR_io_uring_setup, entries, &p));
+    if (fd_ < 0) {
+      return false;
+    }
+
+    sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      sq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+      cq_ring_size_ = sq_ring_size_;
+    }
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      sq_ring_ = nullptr;
+      return false;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      cq_ring_ = sq_ring_;
+    } else {
+      cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+      if (cq_ring_ == MAP_FAILED) {
+        cq_ring_ = nullptr;
+        return false;
+      }
+    }
+
+    sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      return false;
+    }
+    sqes_ = reinterpret_cast<struct io_uring_sqe *>(sqes);
+
+    uint8_t *sq = reinterpret_cast<uint8_t *>(sq_ring_);
+    sq_tail_ = reinterpret_cast<uint32_t *>(sq + p.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<uint32_t *>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<uint32_t *>(sq + p.sq_off.array);
+    sq_entries_ = p.sq_entries;
+
+    uint8_t *cq = reinterpret_cast<uint8_t *>(cq_ring_);
+    cq_head_ = reinterpret_cast<uint32_t *>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<uint32_t *>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<uint32_t *>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+
+    return true;
+  }
+
+  uint32_t capacity() const { return sq_entries_; }
+
+  // Queue a SQE. Caller must not exceed `capacity()` in-flight requests.
+  struct io_uring_sqe *get_sqe() {
+    const uint32_t tail = *sq_tail_ + pending_;
+    const uint32_t idx = tail & sq_mask_;
+    struct io_uring_sqe *sqe = &sqes_[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[idx] = idx;
+    pending_++;
+    return sqe;
+  }
+
+  // Submit queued SQEs and wait for at least one completion.
+  bool submit_and_wait() {
+    __atomic_store_n(sq_tail_, *sq_tail_ + pending_, __ATOMIC_RELEASE);
+    const uint32_t to_submit = pending_;
+    pending_ = 0;
+    return enter(to_submit, 1);
+  }
+
+  // Wait for at least `min_complete` completions without submitting.
+  bool wait(const uint32_t min_complete) { return enter(0, min_complete); }
+
+  // Pop a completion. Return false when no completion is available.
+  bool pop_cqe(uint64_t *user_data, int32_t *res) {
+    const uint32_t head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    const struct io_uring_cqe &cqe = cqes_[head & cq_mask_];
+    (*user_data) = cqe.user_data;
+    (*res) = cqe.res;
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+ private:
+  IOUring(const IOUring &);
+  IOUring &operator=(const IOUring &);
+
+  bool enter(const uint32_t to_submit, const uint32_t min_complete) {
+    for (;;) {
+      int ret = int(syscall(__NR_io_uring_enter, fd_, to_submit, min_complete,
+                            IORING_ENTER_GETEVENTS, nullptr, 0));
+      if (ret >= 0) {
+        return true;
+      }
+      if (errno != EINTR) {
+        return false;
+      }
+    }
+  }
+
+  int fd_;
+  void *sq_ring_;
+  void *cq_ring_;
+  struct io_uring_sqe *sqes_;
+  size_t sq_ring_size_;
+  size_t cq_ring_size_;
+  size_t sqes_size_;
+
+  uint32_t *sq_tail_;
+  uint32_t sq_mask_;
+  uint32_t *sq_array_;
+  uint32_t sq_entries_;
+  uint32_t pending_;
+
+  uint32_t *cq_head_;
+  uint32_t *cq_tail_;
+  uint32_t cq_mask_;
+  struct io_uring_cqe *cqes_;
+};
+
+// Open files and read headers through io_uring.
+// Return false when io_uring is not available(e.g. io_uring_setup fails with
+// ENOSYS/EINVAL/EPERM on older or restricted kernels). Nothing is processed
+// then, and the caller uses the pread path. Files whose requests are not
+// supported by the kernel are finished with the pread path.
+static bool BatchOpenXPDFilesIOUring(const std::vector<std::string> &filenames,
+                                     const XPDBatchOpenOption &option,
+                                     std::vector<XPDBatchOpenResult> *results) {
+  struct FileState {
+    int fd;
+    uint64_t fileSize;
+    size_t length;  // bytes read so far
+    std::vector<uint8_t> header;
+    FileState() : fd(-1), fileSize(0), length(0) {}
+  };
+
+  // Declared before `ring`, so that in-flight requests are torn down before
+  // their buffers.
+  std::vector<FileState> states;
+
+  IOUring ring;
+  if (!ring.init(std::max(option.queueDepth, 1u))) {
+    return false;
+  }
+
+  const size_t n = filenames.size();
+  states.resize(n);
+
+  // Files whose next request(open or read) is not yet queued.
+  std::vector<size_t> ready;
+  size_t next_open = 0;
+  size_t in_flight = 0;
+  size_t done = 0;
+
+  auto fail = [&](const size_t i, const std::string &msg) {
+    if (states[i].fd >= 0) {
+      ::close(states[i].fd);
+      states[i].fd = -1;
+    }
+    (*results)[i].err += msg;
+    (*results)[i].ok = false;
+    std::vector<uint8_t>().swap(states[i].header);
+    done++;
+  };
+
+  // Leave the file to the pread path.
+  auto defer = [&](const size_t i) {
+    if (states[i].fd >= 0) {
+      ::close(states[i].fd);
+      states[i].fd = -1;
+    }
+    std::vector<uint8_t>().swap(states[i].header);
+    done++;
+  };
+
+  // Start reading an opened file.
+  auto opened = [&](const size_t i) {
+    FileState &st = states[i];
+    struct stat sb;
+    if (fstat(st.fd, &sb) != 0) {
+      fail(i, "Failed to stat a file: " + filenames[i] + "\n");
+      return;
+    }
+    st.fileSize = uint64_t(sb.st_size);
+    st.header.resize(option.headerReadSize);
+    ready.push_back(i);
+  };
+
+  auto queue_read = [&](const size_t i) {
+    FileState &st = states[i];
+    struct io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = st.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(st.header.data() + st.length);
+    sqe->len = uint32_t(st.header.size() - st.length);
+    sqe->off = st.length;
+    sqe->user_data = i;
+    in_flight++;
+  };
+
+  // Handle bytes read so far. Queue next read or finish the file.
+  auto advance = [&](const size_t i, const bool eof) {
+    FileState &st = states[i];
+    XPDBatchOpenResult &result = (*results)[i];
+    uint64_t required = 0;
+    if (!PeekXPDHeaderSize(st.header.data(), st.length, &required,
+                           &result.err)) {
+      fail(i, "");
+      return;
+    }
+
+    if (required > st.length) {
+      if (eof) {
+        fail(i, "File is too short for XPD header: " + filenames[i] + "\n");
+      } else if (required > st.fileSize) {
+        // `required` comes from header counts. Check it before allocating.
+        fail(i, "Header size(" + std::to_string(required) +
+                    ") exceeds the file size(" +
+                    std::to_string(st.fileSize) + "): " + filenames[i] +
+                    "\n");
+      } else {
+        if (st.header.size() < required) {
+          st.header.resize(size_t(required));
+        }
+        ready.push_back(i);
+      }
+      return;
+    }
+
+    result.ok = FinishBatchOpen(filenames[i], st.header, required, st.fd,
+                                option, &result);
+    ::close(st.fd);
+    st.fd = -1;
+    std::vector<uint8_t>().swap(st.header);
+    done++;
+  };
+
+  while (done < n) {
+    // Fill the submission queue.
+    while (in_flight < ring.capacity()) {
+      if (!ready.empty()) {
+        const size_t i = ready.back();
+        ready.pop_back();
+        if (states[i].fd < 0) {
+          // OPENAT is not supported by the kernel. Open synchronously.
+          states[i].fd = ::open(filenames[i].c_str(), O_RDONLY | O_CLOEXEC);
+          if (states[i].fd < 0) {
+            fail(i, "Failed to open a file: " + filenames[i] + "\n");
+          } else {
+            opened(i);
+          }
+          continue;
+        }
+        queue_read(i);
+      } else if (next_open < n) {
+        const size_t i = next_open++;
+        struct io_uring_sqe *sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(filenames[i].c_str());
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe->user_data = i;
+        in_flight++;
+      } else {
+        break;
+      }
+    }
+
+    if (in_flight == 0) {
+      continue;
+    }
+
+    if (!ring.submit_and_wait()) {
+      // Finish remaining files with the pread path, after reaping requests
+      // which may still write to `states`.
+      while (in_flight > 0) {
+        uint64_t user_data;
+        int32_t res;
+        if (ring.pop_cqe(&user_data, &res)) {
+          in_flight--;
+          if ((states[size_t(user_data)].fd < 0) && (res >= 0)) {
+            ::close(res);  // OPENAT completion.
+          }
+        } else if (!ring.wait(1)) {
+          break;
+        }
+      }
+      if (in_flight > 0) {
+        // The kernel may still complete requests after the ring is closed.
+        // Leak their buffers rather than freeing them under the kernel.
+        for (size_t i = 0; i < n; i++) {
+          std::vector<uint8_t> *leaked = new std::vector<uint8_t>();
+          leaked->swap(states[i].header);
+        }
+      }
+      break;
+    }
+
+    uint64_t user_data;
+    int32_t res;
+    while (ring.pop_cqe(&user_data, &res)) {
+      in_flight--;
+      const size_t i = size_t(user_data);
+      FileState &st = states[i];
+
+      if (st.fd < 0) {
+        // OPENAT completion.
+        if (res == -EINVAL) {
+          ready.push_back(i);
+        } else if (res < 0) {
+          fail(i, "Failed to open a file: " + filenames[i] + "\n");
+        } else {
+          st.fd = res;
+          opened(i);
+        }
+        continue;
+      }
+
+      // READ completion.
+      if ((res == -EINVAL) || (res == -EOPNOTSUPP)) {
+        // IORING_OP_READ is not supported by the kernel(< 5.6).
+        defer(i);
+      } else if (res < 0) {
+        fail(i, "Failed to read a file: " + filenames[i] + "\n");
+      } else {
+        st.length += size_t(res);
+        advance(i, res == 0);
+      }
+    }
+  }
+
+  // Finish remaining files(deferred, or left when io_uring_enter failed) with
+  // the pread path.
+  for (size_t i = 0; i < n; i++) {
+    if (states[i].fd >= 0) {
+      ::close(states[i].fd);
+      states[i].fd = -1;
+    }
+    if (!(*results)[i].ok && (*results)[i].err.empty()) {
+      (*results)[i].ok =
+          OpenXPDHeaderBlocking(filenames[i], option, &(*results)[i]);
+    }
+  }
+
+  return true;
+}
+
+#endif
+
+bool BatchOpenXPDFiles(const std::vector<std::string> &filenames,
+                       const XPDBatchOpenOption &option,
+                       std::vector<XPDBatchOpenResult> *results,
+                       std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileBatchOpen);
+
+  if (!results) {
+    if (err) {
+      (*err) += "`results` argument is null.\n";
+    }
+    return false;
+  }
+
+  results->clear();
+  results->resize(filenames.size());
+
+  if (filenames.empty()) {
+    return true;
+  }
+
+  XPDBatchOpenOption opt = option;
+  if (opt.headerReadSize < 64) {
+    opt.headerReadSize = 64;
+  }
+
+  bool processed = false;
+
+#if defined(TINY_XPD_USE_IO_URING) && defined(__linux__)
+  if (opt.useIOUring) {
+    processed = BatchOpenXPDFilesIOUring(filenames, opt, results);
+  }
+#endif
+
+  if (!processed) {
+    const uint32_t num_threads =
+        ResolveNumThreads(opt.numThreads, filenames.size());
+    std::atomic<size_t> next(0);
+
+    auto worker = [&]() {
+      for (;;) {
+        const size_t i = next.fetch_add(1);
+        if (i >= filenames.size()) {
+          break;
+        }
+        (*results)[i].ok =
+            OpenXPDHeaderBlocking(filenames[i], opt, &(*results)[i]);
+      }
+    };
+
+    std::vector<std::thread> threads;
+    try {
+      threads.reserve(num_threads);
+      for (uint32_t t = 1; t < num_threads; t++) {
+        threads.emplace_back(worker);
+      }
+    } catch (const std::system_error &) {
+      // Failed to create a thread. Files are taken from the shared counter,
+      // so the calling thread processes the rest.
+    }
+    worker();
+    for (size_t t = 0; t < threads.size(); t++) {
+      threads[t].join();
+    }
+  }
+
+  size_t num_failed = 0;
+  for (size_t i = 0; i < results->size(); i++) {
+    if (!(*results)[i].ok) {
+      num_failed++;
+    }
+  }
+
+  if (num_failed > 0) {
+    if (err) {
+      (*err) += std::to_string(num_failed) + " of " +
+                std::to_string(filenames.size()) +
+                " files failed to open.\n";
+    }
+    return false;
+  }
+
+  return true;
+}
+
+XPDPartialReader::XPDPartialReader()
+    : size_(std::numeric_limits<uint64_t>::max()),
+      header_size_(0),
+      cache_bytes_(0),
+      max_cache_bytes_(64 * 1024 * 1024),
+      bytes_read_(0),
+      cache_hits_(0),
+      cache_misses_(0) {}
+
+XPDPartialReader::~XPDPartialReader() { close(); }
+
+void XPDPartialReader::close() {
+  read_ = nullptr;
+  size_ = std::numeric_limits<uint64_t>::max();
+  file_io_.reset();
+  header_ = XPDHeader();
+  header_size_ = 0;
+  varying_ext_.clear();
+  lru_.clear();
+  cache_.clear();
+  cache_bytes_ = 0;
+  bytes_read_ = 0;
+  cache_hits_ = 0;
+  cache_misses_ = 0;
+}
+
+bool XPDPartialReader::open(const std::string &filename, std::string *err) {
+  std::shared_ptr<XPDFileIO> io = std::make_shared<XPDFileIO>();
+  if (!io->open(filename, /* writable */ false, err)) {
+    close();
+    return false;
+  }
+
+  // `open(io)` resets state, so keep the backend after it.
+  bool ret = open(io.get(), err);
+  if (ret) {
+    file_io_ = io;
+  }
+  return ret;
+}
+
+bool XPDPartialReader::open(XPDIO *io, std::string *err) {
+  if (!io) {
+    close();
+    if (err) {
+      (*err) += "`io` argument is null.\n";
+    }
+    return false;
+  }
+
+  return open(
+      [io](uint64_t offset, size_t n, uint8_t *dst) {
+        return io->readAt(offset, n, dst, nullptr);
+      },
+      io->size(), err);
+}
+
+bool XPDPartialReader::open(const XPDReadCallback &read, std::string *err) {
+  return open(read, std::numeric_limits<uint64_t>::max(), err);
+}
+
+bool XPDPartialReader::open(const XPDReadCallback &read, const uint64_t size,
+                            std::string *err) {
+  close();
+
+  if (!read) {
+    if (err) {
+      (*err) += "`read` callback is empty.\n";
+    }
+    return false;
+  }
+
+  read_ = read;
+  size_ = size;
+
+  // Read the fixed header, then exactly the rest of the header. `required`
+  // comes from header counts, so reads are bounded by `readAppend`.
+  std::vector<uint8_t> buf;
+  uint64_t required = 30;
+  while (buf.size() < required) {
+    if (!readAppend(buf.size(), required - buf.size(), &buf, err)) {
+      return false;
+    }
+
+    if (!PeekXPDHeaderSize(buf.data(), buf.size(), &required, err)) {
+      return false;
+    }
+  }
+
+  if (!ParseXPDHeaderFromMemory(buf.data(), size_t(required), &header_, err)) {
+    return false;
+  }
+
+  header_size_ = required;
+
+  varying_ext_.assign(header_.numBlocks, header_.numBlocks);
+  for (uint32_t b = 0; b < header_.numBlocks; b++) {
+    FindVaryingCVBlock(header_, b, &varying_ext_[b]);
+  }
+
+  return true;
+}
+
+void XPDPartialReader::setCacheSize(const size_t max_bytes) {
+  max_cache_bytes_ = max_bytes;
+  evict();
+}
+
+bool XPDPartialReader::read(const uint64_t offset, const size_t n,
+                            uint8_t *dst, std::string *err) {
+  if (!read_) {
+    if (err) {
+      (*err) += "XPD is not opened.\n";
+    }
+    return false;
+  }
+
+  if (!read_(offset, n, dst)) {
+    if (err) {
+      (*err) += "Failed to read " + std::to_string(n) + " bytes at " +
+                std::to_string(offset) + ".\n";
+    }
+    return false;
+  }
+
+  bytes_read_ += n;
+  TINY_XPD_PROFILE_COUNT(ProfileBytesRead, n);
+  return true;
+}
+
+// Append `n` bytes at `offset` to `buf`. Fail when the range exceeds the data
+// size. When the size is unknown, read in chunks which grow with `buf`, so a
+// corrupt count fails at the end of data instead of allocating `n` bytes.
+bool XPDPartialReader::readAppend(const uint64_t offset, const uint64_t n,
+                                  std::vector<uint8_t> *buf,
+                                  std::string *err) {
+  const bool known = (size_ != std::numeric_limits<uint64_t>::max());
+  if (known && ((offset > size_) || (n > size_ - offset))) {
+    if (err) {
+      (*err) += "Reading " + std::to_string(n) + " bytes at " +
+                std::to_string(offset) + " exceeds the data size(" +
+                std::to_string(size_) + ").\n";
+    }
+    return false;
+  }
+
+  uint64_t done = 0;
+  while (done < n) {
+    uint64_t chunk = n - done;
+    if (!known) {
+      chunk = std::min(chunk, std::max(uint64_t(buf->size()),
+                                       uint64_t(64 * 1024)));
+    }
+    const size_t at = buf->size();
+    buf->resize(at + size_t(chunk));
+    if (!read(offset + done, size_t(chunk), buf->data() + at, err)) {
+      return false;
+    }
+    done += chunk;
+  }
+  return true;
+}
+
+void XPDPartialReader::evict() {
+  while ((cache_bytes_ > max_cache_bytes_) && (lru_.size() > 1)) {
+    const uint32_t face = lru_.back();
+    lru_.pop_back();
+
+    std::unordered_map<uint32_t, CacheEntry>::iterator it = cache_.find(face);
+    cache_bytes_ -= it->second.data->data.size();
+    cache_.erase(it);
+  }
+}
+
+bool XPDPartialReader::readFace(const uint32_t face,
+                                std::shared_ptr<const XPDFaceData> *face_data,
+                                std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileReadFace);
+
+  if (!face_data) {
+    if (err) {
+      (*err) += "`face_data` argument is null.\n";
+    }
+    return false;
+  }
+
+  std::unordered_map<uint32_t, CacheEntry>::iterator it = cache_.find(face);
+  if (it != cache_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    (*face_data) = it->second.data;
+    cache_hits_++;
+    return true;
+  }
+
+  if ((face >= header_.numFaces) || (face >= header_.numPrims.size())) {
+    if (err) {
+      (*err) += "Face index " + std::to_string(face) + " out of range.\n";
+    }
+    return false;
+  }
+
+  const uint32_t numBlocks = header_.numBlocks;
+  if (header_.primSize.size() < numBlocks) {
+    if (err) {
+      (*err) += "`primSize` is too short.\n";
+    }
+    return false;
+  }
+
+  if ((size_t(face) + 1) * numBlocks > header_.blockPosition.size()) {
+    if (err) {
+      (*err) += "`blockPosition` is too short.\n";
+    }
+    return false;
+  }
+
+  std::shared_ptr<XPDFaceData> data = std::make_shared<XPDFaceData>();
+  data->face = face;
+  data->numPrims = header_.numPrims[face];
+  data->blocks.resize(numBlocks);
+
+  std::vector<bool> is_ext(numBlocks, false);
+  for (uint32_t b = 0; b < numBlocks; b++) {
+    if (varying_ext_[b] < numBlocks) {
+      is_ext[varying_ext_[b]] = true;
+    }
+  }
+
+  // Blocks of a face are not necessarily contiguous, so read each block.
+  // `numPrims` comes from the header, so reads are bounded by `readAppend`.
+  // CVs of the variable CV count extension follow its CV count/offset table.
+  std::vector<size_t> block_offset(numBlocks);
+  std::vector<size_t> cv_offset(numBlocks, 0);
+  std::vector<uint64_t> num_cvs(numBlocks, 0);
+  for (uint32_t b = 0; b < numBlocks; b++) {
+    block_offset[b] = data->data.size();
+    const uint64_t position =
+        header_.blockPosition[size_t(face) * numBlocks + b];
+    const uint64_t n =
+        uint64_t(data->numPrims) * header_.primSize[b] * sizeof(float);
+    if (!readAppend(position, n, &data->data, err)) {
+      return false;
+    }
+
+    if (is_ext[b]) {
+      const uint8_t *table = data->data.data() + block_offset[b];
+      for (uint32_t p = 0; p < data->numPrims; p++) {
+        uint32_t entry[2];  // CV count, CV offset.
+        memcpy(entry, table + p * sizeof(entry), sizeof(entry));
+        num_cvs[b] = std::max(num_cvs[b], uint64_t(entry[0]) + entry[1]);
+      }
+      cv_offset[b] = data->data.size();
+      if (!readAppend(position + n, num_cvs[b] * 3 * sizeof(float),
+                      &data->data, err)) {
+        return false;
+      }
+    }
+  }
+  const size_t total = data->data.size();
+  TINY_XPD_PROFILE_ALLOC(total);
+
+  for (uint32_t b = 0; b < numBlocks; b++) {
+    data->blocks[b].data = data->data.data() + block_offset[b];
+    data->blocks[b].numPrims = data->numPrims;
+    data->blocks[b].primSize = header_.primSize[b];
+  }
+
+  data->varyingCVs.resize(numBlocks);
+  for (uint32_t b = 0; b < numBlocks; b++) {
+    const uint32_t ext = varying_ext_[b];
+    if (ext < numBlocks) {
+      XPDVaryingCVView &v = data->varyingCVs[b];
+      v.table = data->data.data() + block_offset[ext];
+      v.cvs = data->data.data() + cv_offset[ext];
+      v.numPrims = data->numPrims;
+      v.numCVs = size_t(num_cvs[ext]);
+    }
+  }
+
+  cache_misses_++;
+  TINY_XPD_PROFILE_COUNT(ProfileFacesDecoded, 1);
+  TINY_XPD_PROFILE_COUNT(ProfilePrimsDecoded, data->numPrims);
+
+  lru_.push_front(face);
+  CacheEntry entry;
+  entry.data = data;
+  entry.lru = lru_.begin();
+  cache_[face] = entry;
+  cache_bytes_ += total;
+  evict();
+
+  (*face_data) = data;
+
+  return true;
+}
+
+XPDIO::~XPDIO() {}
+
+bool XPDIO::writeAt(const uint64_t offset, const uint8_t *src, const size_t n,
+                    std::string *err) {
+  (void)offset;
+  (void)src;
+  (void)n;
+  if (err) {
+    (*err) += "I/O backend is read-only.\n";
+  }
+  return false;
+}
+
+static bool CheckReadRange(const uint64_t offset, const size_t n,
+                           const uint64_t size, std::string *err) {
+  if ((offset > size) || (uint64_t(n) > (size - offset))) {
+    if (err) {
+      (*err) += "Read range [" + std::to_string(offset) + ", " +
+                std::to_string(offset + n) + ") exceeds data size " +
+                std::to_string(size) + ".\n";
+    }
+    return false;
+  }
+  return true;
+}
+
+uint64_t XPDMemoryIO::size() const {
+  return binary_ ? length_ : buffer_.size();
+}
+
+const uint8_t *XPDMemoryIO::map() const {
+  return binary_ ? binary_ : buffer_.data();
+}
+
+bool XPDMemoryIO::readAt(const uint64_t offset, const size_t n, uint8_t *dst,
+                         std::string *err) {
+  if (!CheckReadRange(offset, n, size(), err)) {
+    return false;
+  }
+  if (n > 0) {
+    memcpy(dst, map() + offset, n);
+  }
+  return true;
+}
+
+bool XPDMemoryIO::writeAt(const uint64_t offset, const uint8_t *src,
+                          const size_t n, std::string *err) {
+  if (binary_) {
+    return XPDIO::writeAt(offset, src, n, err);
+  }
+  if ((offset + n) > buffer_.size()) {
+    buffer_.resize(size_t(offset + n));
+  }
+  if (n > 0) {
+    memcpy(buffer_.data() + offset, src, n);
+  }
+  return true;
+}
+
+XPDFileIO::XPDFileIO() : fd_(-1), size_(0) {}
+
+XPDFileIO::~XPDFileIO() { close(); }
+
+void XPDFileIO::close() {
+#if !defined(_WIN32)
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+#endif
+  fd_ = -1;
+  fs_.reset();
+  size_ = 0;
+}
+
+#if defined(_WIN32)
+
+bool XPDFileIO::open(const std::string &filename, const bool writable,
+                     std::string *err) {
+  close();
+
+  std::ios::openmode mode = std::ios::in | std::ios::binary;
+  if (writable) {
+    mode |= std::ios::out | std::ios::trunc;
+  }
+
+  fs_.reset(new std::fstream(filename, mode));
+  if (!(*fs_)) {
+    fs_.reset();
+    if (err) {
+      (*err) += "Failed to open a file: " + filename + "\n";
+    }
+    return false;
+  }
+
+  fs_->seekg(0, fs_->end);
+  const std::streamoff sz = fs_->tellg();
+  if (sz < 0) {
+    fs_.reset();
+    if (err) {
+      (*err) += "Looks like filename is a directory.\n";
+    }
+    return false;
+  }
+  size_ = uint64_t(sz);
+
+  return true;
+}
+
+bool XPDFileIO::readAt(const uint64_t offset, const size_t n, uint8_t *dst,
+                       std::string *err) {
+  if (!fs_ || !CheckReadRange(offset, n, size_, err)) {
+    return false;
+  }
+  fs_->clear();
+  fs_->seekg(std::streamoff(offset), fs_->beg);
+  fs_->read(reinterpret_cast<char *>(dst), std::streamsize(n));
+  if (size_t(fs_->gcount()) != n) {
+    if (err) {
+      (*err) += "Failed to read a file.\n";
+    }
+    return false;
+  }
+  return true;
+}
+
+bool XPDFileIO::writeAt(const uint64_t offset, const uint8_t *src,
+                        const size_t n, std::string *err) {
+  if (!fs_) {
+    return XPDIO::writeAt(offset, src, n, err);
+  }
+  fs_->clear();
+  fs_->seekp(std::streamoff(offset), fs_->beg);
+  fs_->write(reinterpret_cast<const char *>(src), std::streamsize(n));
+  if (!(*fs_)) {
+    if (err) {
+      (*err) += "Failed to write a file.\n";
+    }
+    return false;
+  }
+  size_ = std::max(size_, offset + n);
+  return true;
+}
+
+void XPDFileIO::prefetch(const uint64_t offset, const size_t n) {
+  (void)offset;
+  (void)n;
+}
+
+#else
+
+bool XPDFileIO::open(const std::string &filename, const bool writable,
+                     std::string *err) {
+  close();
+
+  int flags = O_CLOEXEC | (writable ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY);
+  fd_ = ::open(filename.c_str(), flags, 0644);
+  if (fd_ < 0) {
+    if (err) {
+      (*err) += "Failed to open a file: " + filename + "\n";
+    }
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    close();
+    if (err) {
+      (*err) += "Failed to stat a file: " + filename + "\n";
+    }
+    return false;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    close();
+    if (err) {
+      (*err) += "Looks like filename is a directory.\n";
+    }
+    return false;
+  }
+
+  size_ = uint64_t(st.st_size);
+
+  return true;
+}
+
+bool XPDFileIO::readAt(const uint64_t offset, const size_t n, uint8_t *dst,
+                       std::string *err) {
+  if ((fd_ < 0) || !CheckReadRange(offset, n, size_, err)) {
+    return false;
+  }
+  if (PreadFull(fd_, dst, n, offset) != n) {
+    if (err) {
+      (*err) += "Failed to read a file.\n";
+    }
+    return false;
+  }
+  return true;
+}
+
+bool XPDFileIO::writeAt(const uint64_t offset, const uint8_t *src,
+                        const size_t n, std::string *err) {
+  if (fd_ < 0) {
+    return XPDIO::writeAt(offset, src, n, err);
+  }
+
+  size_t total = 0;
+  while (total < n) {
+    ssize_t ret = pwrite(fd_, src + total, n - total, off_t(offset + total));
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (err) {
+        (*err) += "Failed to write a file.\n";
+      }
+      return false;
+    }
+    total += size_t(ret);
+  }
+
+  size_ = std::max(size_, offset + n);
+  return true;
+}
+
+void XPDFileIO::prefetch(const uint64_t offset, const size_t n) {
+#if defined(POSIX_FADV_WILLNEED)
+  if (fd_ >= 0) {
+    posix_fadvise(fd_, off_t(offset), off_t(n), POSIX_FADV_WILLNEED);
+  }
+#else
+  (void)offset;
+  (void)n;
+#endif
+}
+
+#endif
+
+bool XPDMmapIO::readAt(const uint64_t offset, const size_t n, uint8_t *dst,
+                       std::string *err) {
+  if (!CheckReadRange(offset, n, size(), err)) {
+    return false;
+  }
+  if (n > 0) {
+    memcpy(dst, file_.data() + offset, n);
+  }
+  return true;
+}
+
+void XPDMmapIO::prefetch(const uint64_t offset, const size_t n) {
+#if defined(_WIN32)
+  (void)offset;
+  (void)n;
+#else
+  if (!file_.data() || (offset >= file_.size())) {
+    return;
+  }
+
+  // madvise requires page aligned address.
+  const uint64_t page = uint64_t(sysconf(_SC_PAGESIZE));
+  const uint64_t begin = offset & ~(page - 1);
+  const uint64_t end = std::min(uint64_t(file_.size()), offset + n);
+  madvise(const_cast<uint8_t *>(file_.data()) + begin, size_t(end - begin),
+          MADV_WILLNEED);
+#endif
+}
+
+bool XPDFakeObjectStoreIO::readAt(const uint64_t offset, const size_t n,
+                                  uint8_t *dst, std::string *err) {
+  if (latency_us_ > 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(latency_us_));
+  }
+  num_requests_++;
+
+  if (!CheckReadRange(offset, n, object_.size(), err)) {
+    return false;
+  }
+  if (n > 0) {
+    memcpy(dst, object_.data() + offset, n);
+  }
+  bytes_transferred_ += n;
+  return true;
+}
+
+bool XPDFakeObjectStoreIO::writeAt(const uint64_t offset, const uint8_t *src,
+                                   const size_t n, std::string *err) {
+  (void)err;
+  if (latency_us_ > 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(latency_us_));
+  }
+  num_requests_++;
+
+  if ((offset + n) > object_.size()) {
+    object_.resize(size_t(offset + n));
+  }
+  if (n > 0) {
+    memcpy(object_.data() + offset, src, n);
+  }
+  bytes_transferred_ += n;
+  return true;
+}
+
+bool ParseXPDFromIO(XPDIO *io, XPDHeader *xpd_header, std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileParseXPDFromIO);
+
+  if (!io) {
+    if (err) {
+      (*err) = "`io` argument is null.\n";
+    }
+    return false;
+  }
+
+  if (!xpd_header) {
+    if (err) {
+      (*err) = "`xpd_header` argument is null.\n";
+    }
+    return false;
+  }
+
+  if (io->map()) {
+    return ParseXPDHeaderFromMemory(io->map(), size_t(io->size()), xpd_header,
+                                    err);
+  }
+
+  // Read the fixed header, then exactly the rest of the header.
+  std::vector<uint8_t> buf;
+  uint64_t required = 30;
+  while (buf.size() < required) {
+    if (required > io->size()) {
+      if (err) {
+        (*err) += "Data size too short. Looks like this is not a XPD data.\n";
+      }
+      return false;
+    }
+
+    const size_t offset = buf.size();
+    buf.resize(size_t(required));
+    if (!io->readAt(offset, size_t(required) - offset, buf.data() + offset,
+                    err)) {
+      return false;
+    }
+    TINY_XPD_PROFILE_COUNT(ProfileBytesRead, size_t(required) - offset);
+
+    if (!PeekXPDHeaderSize(buf.data(), buf.size(), &required, err)) {
+      return false;
+    }
+  }
+
+  return ParseXPDHeaderFromMemory(buf.data(), size_t(required), xpd_header,
+                                  err);
+}
+
+// Run `func(begin, end)` over [0, n) in parallel.
+static void ParallelFor(const size_t n, const uint32_t num_threads,
+                        const std::function<void(size_t, size_t)> &func) {
+  if (n == 0) {
+    return;
+  }
+
+  const uint32_t nthreads = ResolveNumThreads(num_threads, n);
+  if (nthreads == 1) {
+    func(0, n);
+    return;
+  }
+
+  // Split into small chunks for load balancing.
+  const size_t num_chunks = std::min(n, size_t(nthreads) * 8);
+  const size_t chunk_size = (n + num_chunks - 1) / num_chunks;
+  std::atomic<size_t> next(0);
+
+  auto worker = [&]() {
+    for (;;) {
+      const size_t begin = next.fetch_add(chunk_size);
+      if (begin >= n) {
+        break;
+      }
+      func(begin, std::min(n, begin + chunk_size));
+    }
+  };
+
+  std::vector<std::thread> threads;
+  try {
+    threads.reserve(nthreads - 1);
+    for (uint32_t t = 1; t < nthreads; t++) {
+      threads.emplace_back(worker);
+    }
+  } catch (const std::system_error &) {
+    // Failed to create a thread. Chunks are taken from the shared counter,
+    // so the calling thread processes the rest.
+  }
+  worker();
+  for (size_t t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+}
+
+// ---------------------------------------------
+// Temporary files. Outputs are written to a temporary file in the same
+// directory, flushed to the disk and renamed on success, so a failed write(or
+// a crash) does not leave a partial file(or replace an existing one).
+
+#if defined(_WIN32)
+
+// Flush a closed file to the disk.
+static bool SyncFile(const std::string &filename) {
+  HANDLE h = CreateFileA(filename.c_str(), GENERIC_WRITE,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (h == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  const bool ret = FlushFileBuffers(h) != 0;
+  CloseHandle(h);
+  return ret;
+}
+
+static bool RenameTempFile(const std::string &src, const std::string &dst) {
+  return MoveFileExA(src.c_str(), dst.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+static uint64_t CurrentProcessId() { return uint64_t(GetCurrentProcessId()); }
+
+#else
+
+// Flush a closed file to the disk.
+static bool SyncFile(const std::string &filename) {
+  const int fd = ::open(filename.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  const bool ret = ::fsync(fd) == 0;
+  return (::close(fd) == 0) && ret;
+}
+
+static bool RenameTempFile(const std::string &src, const std::string &dst) {
+  return std::rename(src.c_str(), dst.c_str()) == 0;
+}
+
+static uint64_t CurrentProcessId() { return uint64_t(getpid()); }
+
+#endif
+
+// Unique(in the process) temporary file name for `filename`.
+static std::string TempFileName(const std::string &filename) {
+  static std::atomic<uint64_t> temp_counter(0);
+  std::stringstream ss;
+  ss << filename << ".tmp." << CurrentProcessId() << "." << temp_counter++;
+  return ss.str();
+}
+
+// ---------------------------------------------
+// Parallel serializer.
+
+// Validate `input`, compute `blockOffset` and serialize the header.
+// `prim_data_size` is the total size of prim data.
+static bool PrepareParallelSerialize(XPDHeaderInput &input,
+                                     const XPDParallelSerializeOption &option,
+                                     std::vector<uint8_t> *header,
+                                     uint64_t *prim_data_size,
+                                     std::string *err) {
+  if ((input.numPrims.size() != input.numFaces) ||
+      (input.faceid.size() != input.numFaces)) {
+    if (err) {
+      (*err) += "`numFaces`(" + std::to_string(input.numFaces) +
+                ") must be same with `faceid.size()` and `numPrims.size()`.\n";
+    }
+    return false;
+  }
+
+  if ((input.primSize.size() != input.numBlocks) ||
+      (input.block.size() != input.numBlocks)) {
+    if (err) {
+      (*err) += "`numBlocks`(" + std::to_string(input.numBlocks) +
+                ") must be same with `block.size()` and `primSize.size()`.\n";
+    }
+    return false;
+  }
+
+  // Blocks are laid out in face-major order, same as `blockPosition`.
+  input.blockOffset.resize(size_t(input.numFaces) * input.numBlocks);
+  uint64_t offset = 0;
+  for (size_t f = 0; f < input.numFaces; f++) {
+    for (size_t b = 0; b < input.numBlocks; b++) {
+      input.blockOffset[f * input.numBlocks + b] = offset;
+      offset += uint64_t(input.numPrims[f]) * input.primSize[b] * sizeof(float);
+      if (option.extraBlockSize) {
+        offset += option.extraBlockSize(uint32_t(f), uint32_t(b));
+      }
+    }
+  }
+
+  if (uint64_t(size_t(offset)) != offset) {
+    if (err) {
+      (*err) += "Prim data too large.\n";
+    }
+    return false;
+  }
+
+  (*prim_data_size) = offset;
+
+  return SerializeXPDHeader(input, size_t(offset), header, err);
+}
+
+// Encode all faces with worker threads. `face_dst(face, buf)` returns the
+// destination of the face's prim data(`buf` is a per-thread buffer of the
+// face size which can be used as a staging area), and `face_done(face, buf)`
+// is called after the face is encoded.
+static bool EncodeFacesParallel(
+    const XPDHeaderInput &input, const XPDEncodeBlockCallback &encode,
+    const uint32_t num_threads,
+    const std::function<uint8_t *(size_t, std::vector<uint8_t> *)> &face_dst,
+    const std::function<bool(size_t, const uint8_t *, std::string *)>
+        &face_done,
+    std::string *err) {
+  std::atomic<bool> failed(false);
+  std::mutex err_mutex;
+
+  ParallelFor(input.numFaces, num_threads, [&](size_t begin, size_t end) {
+    std::vector<uint8_t> buf;
+    std::string local_err;
+    for (size_t f = begin; f < end; f++) {
+      if (failed.load(std::memory_order_relaxed)) {
+        return;
+      }
+
+      uint8_t *dst = face_dst(f, &buf);
+      const uint64_t face_offset = input.blockOffset[f * input.numBlocks];
+      bool ok = true;
+      for (uint32_t b = 0; b < input.numBlocks; b++) {
+        if (input.numPrims[f] == 0) {
+          break;
+        }
+        const uint64_t rel =
+            input.blockOffset[f * input.numBlocks + b] - face_offset;
+        if (!encode(uint32_t(f), b, dst + rel, &local_err)) {
+          ok = false;
+          break;
+        }
+      }
+
+      if (ok) {
+        ok = face_done(f, dst, &local_err);
+      }
+
+      if (!ok) {
+        std::lock_guard<std::mutex> lock(err_mutex);
+        if (!failed.exchange(true) && err) {
+          (*err) += "Failed to encode face " + std::to_string(f) + ".\n" +
+                    local_err;
+        }
+        return;
+      }
+    }
+  });
+
+  return !failed.load();
+}
+
+// Size of prim data of a face in bytes.
+static size_t FacePrimDataSize(const XPDHeaderInput &input,
+                               const uint64_t prim_data_size,
+                               const size_t face) {
+  const uint64_t begin = input.blockOffset[face * input.numBlocks];
+  const uint64_t end = ((face + 1) < input.numFaces)
+                           ? input.blockOffset[(face + 1) * input.numBlocks]
+                           : prim_data_size;
+  return size_t(end - begin);
+}
+
+bool SerializeToXPDParallel(XPDHeaderInput &input,
+                            const XPDEncodeBlockCallback &encode,
+                            const XPDParallelSerializeOption &option,
+                            std::vector<uint8_t> *xpd_binary,
+                            std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileSerializeToXPD);
+
+  if (!xpd_binary || !encode) {
+    if (err) {
+      (*err) += "`xpd_binary' or `encode' is null.\n";
+    }
+    return false;
+  }
+
+  uint64_t prim_data_size = 0;
+  if (!PrepareParallelSerialize(input, option, xpd_binary, &prim_data_size,
+                                err)) {
+    return false;
+  }
+
+  const size_t header_size = xpd_binary->size();
+  xpd_binary->resize(header_size + size_t(prim_data_size));
+  TINY_XPD_PROFILE_ALLOC(xpd_binary->size());
+
+  uint8_t *prim_data = xpd_binary->data() + header_size;
+  return EncodeFacesParallel(
+      input, encode, option.numThreads,
+      [&](size_t f, std::vector<uint8_t> *) {
+        return prim_data + input.blockOffset[f * input.numBlocks];
+      },
+      [](size_t, const uint8_t *, std::string *) { return true; }, err);
+}
+
+bool SerializeToXPDParallel(XPDHeaderInput &input,
+                            const XPDEncodeBlockCallback &encode,
+                            const XPDParallelSerializeOption &option,
+                            XPDIO *io, std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileSerializeToXPD);
+
+  if (!io || !encode) {
+    if (err) {
+      (*err) += "`io' or `encode' is null.\n";
+    }
+    return false;
+  }
+
+  std::vector<uint8_t> header;
+  uint64_t prim_data_size = 0;
+  if (!PrepareParallelSerialize(input, option, &header, &prim_data_size,
+                                err)) {
+    return false;
+  }
+
+  if (!io->writeAt(0, header.data(), header.size(), err)) {
+    return false;
+  }
+
+  std::mutex io_mutex;
+  return EncodeFacesParallel(
+      input, encode, option.numThreads,
+      [&](size_t f, std::vector<uint8_t> *buf) {
+        buf->resize(FacePrimDataSize(input, prim_data_size, f));
+        return buf->data();
+      },
+      [&](size_t f, const uint8_t *data, std::string *local_err) {
+        std::lock_guard<std::mutex> lock(io_mutex);
+        return io->writeAt(header.size() + input.blockOffset[f * input.numBlocks],
+                           data, FacePrimDataSize(input, prim_data_size, f),
+                           local_err);
+      },
+      err);
+}
+
+bool SerializeToXPDFileParallel(XPDHeaderInput &input,
+                                const XPDEncodeBlockCallback &encode,
+                                const XPDParallelSerializeOption &option,
+                                const std::string &filename,
+                                std::string *err) {
+  const std::string temp_filename = TempFileName(filename);
+#if defined(_WIN32)
+  bool ret;
+  {
+    XPDFileIO io;
+    if (!io.open(temp_filename, /* writable */ true, err)) {
+      return false;
+    }
+    ret = SerializeToXPDParallel(input, encode, option, &io, err);
+  }
+  if (ret && !SyncFile(temp_filename)) {
+    if (err) {
+      (*err) += "Failed to flush a file: " + temp_filename + "\n";
+    }
+    ret = false;
+  }
+#else
+  TINY_XPD_PROFILE_SCOPE(XPDProfileSerializeToXPD);
+
+  if (!encode) {
+    if (err) {
+      (*err) += "`encode' is null.\n";
+    }
+    return false;
+  }
+
+  std::vector<uint8_t> header;
+  uint64_t prim_data_size = 0;
+  if (!PrepareParallelSerialize(input, option, &header, &prim_data_size,
+                                err)) {
+    return false;
+  }
+
+  const uint64_t total = header.size() + prim_data_size;
+
+  int fd = ::open(temp_filename.c_str(),
+                  O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    if (err) {
+      (*err) += "Failed to open a file: " + temp_filename + "\n";
+    }
+    return false;
+  }
+
+  if (ftruncate(fd, off_t(total)) != 0) {
+    ::close(fd);
+    ::unlink(temp_filename.c_str());
+    if (err) {
+      (*err) += "Failed to preallocate a file: " + temp_filename + "\n";
+    }
+    return false;
+  }
+
+  void *p = mmap(nullptr, size_t(total), PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+  if (p == MAP_FAILED) {
+    ::close(fd);
+    ::unlink(temp_filename.c_str());
+    if (err) {
+      (*err) += "Failed to mmap a file: " + temp_filename + "\n";
+    }
+    return false;
+  }
+
+  uint8_t *data = reinterpret_cast<uint8_t *>(p);
+  memcpy(data, header.data(), header.size());
+
+  uint8_t *prim_data = data + header.size();
+  bool ret = EncodeFacesParallel(
+      input, encode, option.numThreads,
+      [&](size_t f, std::vector<uint8_t> *) {
+        return prim_data + input.blockOffset[f * input.numBlocks];
+      },
+      [](size_t, const uint8_t *, std::string *) { return true; }, err);
+
+  if (ret && ((msync(p, size_t(total), MS_SYNC) != 0) || (fsync(fd) != 0))) {
+    if (err) {
+      (*err) += "Failed to flush a file: " + temp_filename + "\n";
+    }
+    ret = false;
+  }
+  if (munmap(p, size_t(total)) != 0) {
+    if (ret && err) {
+      (*err) += "Failed to unmap a file: " + temp_filename + "\n";
+    }
+    ret = false;
+  }
+  if (::close(fd) != 0) {
+    if (ret && err) {
+      (*err) += "Failed to close a file: " + temp_filename + "\n";
+    }
+    ret = false;
+  }
+#endif
+
+  if (ret && !RenameTempFile(temp_filename, filename)) {
+    if (err) {
+      (*err) += "Failed to rename a file: " + temp_filename + "\n";
+    }
+    ret = false;
+  }
+  if (!ret) {
+    std::remove(temp_filename.c_str());
+  }
+
+  return ret;
+}
+
+bool GetSplineLayout(const XPDHeader &xpd, const uint32_t block_id,
+                     XPDSplineLayout *layout, std::string *err) {
+  if (!layout) {
+    if (err) {
+      (*err) += "`layout` argument is null.\n";
+    }
+    return false;
+  }
+
+  if (xpd.primType != Xpd::PrimType::Spline) {
+    if (err) {
+      (*err) += "primType is not a Spline.\n";
+    }
+    return false;
+  }
+
+  if (block_id >= xpd.primSize.size()) {
+    if (err) {
+      (*err) += "Block index " + std::to_string(block_id) + " out of range.\n";
+    }
+    return false;
+  }
+
+  XPDSplineLayout l(xpd.numCVs);
+  if (xpd.primSize[block_id] < l.size) {
+    if (err) {
+      (*err) += "primSize(" + std::to_string(xpd.primSize[block_id]) +
+                ") is smaller than spline layout size(" +
+                std::to_string(l.size) + ").\n";
+    }
+    return false;
+  }
+
+  (*layout) = l;
+
+  return true;
+}
+
+static std::string VaryingCVBlockName(const std::string &block) {
+  return block + ":varyingCVs";
+}
+
+bool FindVaryingCVBlock(const XPDHeader &xpd, const uint32_t block_id,
+                        uint32_t *ext_block_id) {
+  if ((block_id >= xpd.block.size()) || !ext_block_id) {
+    return false;
+  }
+
+  const int id = xpd.findBlock(VaryingCVBlockName(xpd.block[block_id]));
+  if ((id < 0) || (size_t(id) >= xpd.primSize.size()) ||
+      (xpd.primSize[size_t(id)] != 2)) {
+    return false;
+  }
+
+  (*ext_block_id) = uint32_t(id);
+  return true;
+}
+
+bool GetVaryingCVView(const XPDHeader &xpd, const uint8_t *binary,
+                      const size_t binary_length, const uint32_t face,
+                      const uint32_t block_id, XPDVaryingCVView *view,
+                      std::string *err) {
+  if (!view) {
+    if (err) {
+      (*err) += "`view` argument is null.\n";
+    }
+    return false;
+  }
+
+  uint32_t ext_block_id;
+  if (!FindVaryingCVBlock(xpd, block_id, &ext_block_id)) {
+    if (err) {
+      (*err) += "Block " + std::to_string(block_id) +
+                " has no variable CV count extension.\n";
+    }
+    return false;
+  }
+
+  XPDBlockView table;
+  if (!GetBlockView(xpd, binary, binary_length, face, ext_block_id, &table,
+                    err)) {
+    return false;
+  }
+
+  XPDVaryingCVView v;
+  v.table = table.data;
+  v.numPrims = table.numPrims;
+
+  uint64_t num_cvs = 0;
+  for (size_t p = 0; p < v.numPrims; p++) {
+    num_cvs = std::max(num_cvs, uint64_t(v.offset(p)) + v.count(p));
+  }
+
+  const uint64_t position = uint64_t(table.data - binary) +
+                            table.numPrims * table.stride();
+  if (num_cvs * 3 * sizeof(float) > (binary_length - position)) {
+    if (err) {
+      (*err) += "CVs of face " + std::to_string(face) + ", block " +
+                std::to_string(block_id) + " exceed XPD data.\n";
+    }
+    return false;
+  }
+
+  v.cvs = binary + position;
+  v.numCVs = size_t(num_cvs);
+  (*view) = v;
+
+  return true;
+}
+
+// Validate block views of all faces and compute the prefix sum of numPrims.
+static bool PrepareFaceViews(const XPDHeader &xpd, const uint8_t *binary,
+                             const size_t binary_length,
+                             const uint32_t block_id,
+                             std::vector<XPDBlockView> *views,
+                             std::vector<size_t> *prim_offsets,
+                             std::string *err) {
+  views->resize(xpd.numFaces);
+  prim_offsets->resize(size_t(xpd.numFaces) + 1);
+
+  size_t total = 0;
+  for (uint32_t f = 0; f < xpd.numFaces; f++) {
+    if (!GetBlockView(xpd, binary, binary_length, f, block_id, &(*views)[f],
+                      err)) {
+      return false;
+    }
+    (*prim_offsets)[f] = total;
+    total += (*views)[f].numPrims;
+  }
+  (*prim_offsets)[xpd.numFaces] = total;
+
+  return true;
+}
+
+// ---------------------------------------------
+// CPU feature detection.
+
+#if defined(TINY_XPD_X86_SIMD)
+static void CPUID(const uint32_t leaf, const uint32_t subleaf,
+                  uint32_t regs[4]) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  int r[4];
+  __cpuidex(r, int(leaf), int(subleaf));
+  for (int i = 0; i < 4; i++) {
+    regs[i] = uint32_t(r[i]);
+  }
+#else
+  __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Read XCR0(OS enabled register state). Requires OSXSAVE.
+static uint64_t ReadXCR0() {
+#if defined(_MSC_VER) && !defined(__clang__)
+  return uint64_t(_xgetbv(0));
+#else
+  uint32_t eax, edx;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return (uint64_t(edx) << 32) | eax;
+#endif
+}
+#endif
+
+static XPDSIMDLevel DetectCPUSIMDLevel() {
+#if defined(TINY_XPD_X86_SIMD)
+  uint32_t regs[4];
+  CPUID(0, 0, regs);
+  const uint32_t max_leaf = regs[0];
+  if (max_leaf < 1) {
+    return XPDSIMDScalar;
+  }
+
+  CPUID(1, 0, regs);
+  const uint32_t ecx1 = regs[2];
+  if ((ecx1 & (1u << 20)) == 0) {  // SSE4.2
+    return XPDSIMDScalar;
+  }
+
+  // AVX needs OS support of YMM state as well as the CPU flag.
+  const bool osxsave = (ecx1 & (1u << 27)) != 0;
+  const bool avx = (ecx1 & (1u << 28)) != 0;
+  if (!osxsave || !avx || (max_leaf < 7)) {
+    return XPDSIMDSSE42;
+  }
+
+  const uint64_t xcr0 = ReadXCR0();
+  if ((xcr0 & 0x6) != 0x6) {  // XMM, YMM
+    return XPDSIMDSSE42;
+  }
+
+  CPUID(7, 0, regs);
+  const uint32_t ebx7 = regs[1];
+  if ((ebx7 & (1u << 5)) == 0) {  // AVX2
+    return XPDSIMDSSE42;
+  }
+
+  // AVX-512F, with opmask and ZMM state enabled.
+  if (((ebx7 & (1u << 16)) != 0) && ((xcr0 & 0xe6) == 0xe6)) {
+    return XPDSIMDAVX512;
+  }
+
+  return XPDSIMDAVX2;
+#else
+  return XPDSIMDScalar;
+#endif
+}
+
+// -1 = not selected yet.
+static std::atomic<int> g_simd_level(-1);
+
+const char *GetSIMDLevelName(const XPDSIMDLevel level) {
+  switch (level) {
+    case XPDSIMDScalar:
+      return "scalar";
+    case XPDSIMDSSE42:
+      return "sse42";
+    case XPDSIMDAVX2:
+      return "avx2";
+    case XPDSIMDAVX512:
+      return "avx512";
+  }
+  return "unknown";
+}
+
+XPDSIMDLevel GetCPUSIMDLevel() {
+  static const XPDSIMDLevel level = DetectCPUSIMDLevel();
+  return level;
+}
+
+XPDSIMDLevel GetSIMDLevel() {
+  int level = g_simd_level.load(std::memory_order_relaxed);
+  if (level >= 0) {
+    return XPDSIMDLevel(level);
+  }
+
+  // Apply `TINY_XPD_SIMD` override. Levels above the CPU support are clamped.
+  int selected = int(GetCPUSIMDLevel());
+  const char *env = std::getenv("TINY_XPD_SIMD");
+  if (env) {
+    for (int i = XPDSIMDScalar; i <= XPDSIMDAVX512; i++) {
+      if (strcmp(env, GetSIMDLevelName(XPDSIMDLevel(i))) == 0) {
+        selected = std::min(selected, i);
+      }
+    }
+  }
+
+  // Keep the level when SetSIMDLevel() was called concurrently.
+  g_simd_level.compare_exchange_strong(level, selected);
+  return XPDSIMDLevel(g_simd_level.load());
+}
+
+bool SetSIMDLevel(const XPDSIMDLevel level, std::string *err) {
+  if ((int(level) < int(XPDSIMDScalar)) || (level > GetCPUSIMDLevel())) {
+    if (err) {
+      (*err) += "SIMD level " + std::string(GetSIMDLevelName(level)) +
+                " is not supported on this CPU(supported up to " +
+                GetSIMDLevelName(GetCPUSIMDLevel()) + ").\n";
+    }
+    return false;
+  }
+
+  g_simd_level.store(int(level));
+  return true;
+}
+
+// Scalar kernels below are the reference for the SIMD ones, so they must not
+// be contracted into FMA either(e.g. when built with -mfma or -march=native).
+#if defined(TINY_XPD_X86_SIMD)
+#if defined(__clang__)
+#pragma float_control(push)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+#endif
+
+// ---------------------------------------------
+// Spline CV decoders.
+// `Fixed<N>` versions are unrolled for a compile-time numCVs. They are
+// selected from the runtime numCVs, with the generic version as a fallback.
+// SIMD versions take N as well(N = 0 for runtime numCVs) and are selected by
+// GetSIMDLevel().
+
+// Decode CVs of a prim into SoA arrays.
+typedef void (*DecodeCVsSoAFunc)(const uint8_t *src, const uint32_t num_cvs,
+                                 float *x, float *y, float *z);
+
+// Decode CVs of a prim into float4(xyz + radius).
+// SIMD versions read up to 4 floats past the last CV, which is fine for
+// spline prims(CVs are followed by length, width, ...).
+typedef void (*DecodeCVsFloat4Func)(const uint8_t *src, const uint32_t num_cvs,
+                                    const float width, const float taper,
+                                    const float taper_start, const float *ts,
+                                    float *dst);
+
+static void DecodeCVsSoAGeneric(const uint8_t *src, const uint32_t num_cvs,
+                                float *x, float *y, float *z) {
+  for (uint32_t c = 0; c < num_cvs; c++) {
+    float xyz[3];
+    memcpy(xyz, src + 3 * c * sizeof(float), 3 * sizeof(float));
+    x[c] = xyz[0];
+    y[c] = xyz[1];
+    z[c] = xyz[2];
+  }
+}
+
+template <uint32_t N>
+static void DecodeCVsSoAFixed(const uint8_t *src, const uint32_t num_cvs,
+                              float *x, float *y, float *z) {
+  (void)num_cvs;
+  float xyz[3 * N];
+  memcpy(xyz, src, sizeof(xyz));
+  for (uint32_t c = 0; c < N; c++) {
+    x[c] = xyz[3 * c + 0];
+    y[c] = xyz[3 * c + 1];
+    z[c] = xyz[3 * c + 2];
+  }
+}
+
+// `XPDSplineRadius` with the per prim terms(`half_width` and `slope`)
+// hoisted. The operations are the same, so results are identical:
+// radius(t) = half_width * (1 - slope * max(0, t - taper_start))
+static inline float TaperedRadius(const float half_width, const float slope,
+                                  const float taper_start, const float t) {
+  return half_width * (1.0f - slope * std::max(0.0f, t - taper_start));
+}
+
+static inline float TaperSlope(const float taper, const float taper_start) {
+  return (taper_start < 1.0f) ? (taper / (1.0f - taper_start)) : 0.0f;
+}
+
+// Radii of `num_cvs` float4 CVs at `ts`(`t_stride` floats apart). Used for
+// resampled CVs, so they get the same radii as decoded CVs.
+static void TaperedRadii(const float width, const float taper,
+                         const float taper_start, const float *ts,
+                         const size_t t_stride, const uint32_t num_cvs,
+                         float *dst) {
+  const float half_width = 0.5f * width;
+  const float slope = TaperSlope(taper, taper_start);
+  for (uint32_t c = 0; c < num_cvs; c++) {
+    dst[4 * c + 3] =
+        TaperedRadius(half_width, slope, taper_start, ts[c * t_stride]);
+  }
+}
+
+static inline void ExpandCVsScalar(const uint8_t *src, const uint32_t num_cvs,
+                                   const float half_width, const float slope,
+                                   const float taper_start, const float *ts,
+                                   float *dst) {
+  for (uint32_t c = 0; c < num_cvs; c++) {
+    memcpy(dst + 4 * c, src + 3 * c * sizeof(float), 3 * sizeof(float));
+    dst[4 * c + 3] = TaperedRadius(half_width, slope, taper_start, ts[c]);
+  }
+}
+
+static void DecodeCVsFloat4Generic(const uint8_t *src, const uint32_t num_cvs,
+                                   const float width, const float taper,
+                                   const float taper_start, const float *ts,
+                                   float *dst) {
+  ExpandCVsScalar(src, num_cvs, 0.5f * width, TaperSlope(taper, taper_start),
+                  taper_start, ts, dst);
+}
+
+template <uint32_t N>
+static void DecodeCVsFloat4Fixed(const uint8_t *src, const uint32_t num_cvs,
+                                 const float width, const float taper,
+                                 const float taper_start, const float *ts,
+                                 float *dst) {
+  (void)num_cvs;
+  float xyz[3 * N];
+  memcpy(xyz, src, sizeof(xyz));
+  const float half_width = 0.5f * width;
+  const float slope = TaperSlope(taper, taper_start);
+  for (uint32_t c = 0; c < N; c++) {
+    dst[4 * c + 0] = xyz[3 * c + 0];
+    dst[4 * c + 1] = xyz[3 * c + 1];
+    dst[4 * c + 2] = xyz[3 * c + 2];
+    dst[4 * c + 3] = TaperedRadius(half_width, slope, taper_start, ts[c]);
+  }
+}
+
+#if defined(TINY_XPD_X86_SIMD)
+
+// Transpose 4 CVs(xyz xyz xyz xyz) into x, y and z.
+// `TransposeCVs*` load exactly the 3 * N floats of the N CVs, so unlike the
+// float4 decoders, SoA decoders never read past the last CV.
+TINY_XPD_TARGET("sse4.2")
+static inline void TransposeCVs4(const uint8_t *src, float *x, float *y,
+                                 float *z) {
+  const float *s = reinterpret_cast<const float *>(src);
+  const __m128 x0y0z0x1 = _mm_loadu_ps(s);
+  const __m128 y1z1x2y2 = _mm_loadu_ps(s + 4);
+  const __m128 z2x3y3z3 = _mm_loadu_ps(s + 8);
+  const __m128 x2y2x3y3 =
+      _mm_shuffle_ps(y1z1x2y2, z2x3y3z3, _MM_SHUFFLE(2, 1, 3, 2));
+  const __m128 y0z0y1z1 =
+      _mm_shuffle_ps(x0y0z0x1, y1z1x2y2, _MM_SHUFFLE(1, 0, 2, 1));
+  _mm_storeu_ps(x, _mm_shuffle_ps(x0y0z0x1, x2y2x3y3, _MM_SHUFFLE(2, 0, 3, 0)));
+  _mm_storeu_ps(y, _mm_shuffle_ps(y0z0y1z1, x2y2x3y3, _MM_SHUFFLE(3, 1, 2, 0)));
+  _mm_storeu_ps(z, _mm_shuffle_ps(y0z0y1z1, z2x3y3z3, _MM_SHUFFLE(3, 0, 3, 1)));
+}
+
+// Transpose 8 CVs. Blend the lanes holding x(y, z) from the 3 loads, then
+// permute them into order.
+TINY_XPD_TARGET("avx2")
+static inline void TransposeCVs8(const uint8_t *src, float *x, float *y,
+                                 float *z) {
+  const float *s = reinterpret_cast<const float *>(src);
+  const __m256 m0 = _mm256_loadu_ps(s);
+  const __m256 m1 = _mm256_loadu_ps(s + 8);
+  const __m256 m2 = _mm256_loadu_ps(s + 16);
+  const __m256 xs = _mm256_blend_ps(_mm256_blend_ps(m0, m1, 0x92), m2, 0x24);
+  const __m256 ys = _mm256_blend_ps(_mm256_blend_ps(m0, m1, 0x24), m2, 0x49);
+  const __m256 zs = _mm256_blend_ps(_mm256_blend_ps(m0, m1, 0x49), m2, 0x92);
+  _mm256_storeu_ps(x, _mm256_permutevar8x32_ps(
+                          xs, _mm256_setr_epi32(0, 3, 6, 1, 4, 7, 2, 5)));
+  _mm256_storeu_ps(y, _mm256_permutevar8x32_ps(
+                          ys, _mm256_setr_epi32(1, 4, 7, 2, 5, 0, 3, 6)));
+  _mm256_storeu_ps(z, _mm256_permutevar8x32_ps(
+                          zs, _mm256_setr_epi32(2, 5, 0, 3, 6, 1, 4, 7)));
+}
+
+// Transpose 16 CVs. Element 3i+k of 48 floats goes to lane i of component k.
+// permutex2var uses the low 5 bits of the index(m0, m1) and permutexvar the
+// low 4 bits(m2), so the same index works for both.
+TINY_XPD_TARGET("avx512f")
+static inline void TransposeCVs16(const uint8_t *src, float *x, float *y,
+                                  float *z) {
+  const float *s = reinterpret_cast<const float *>(src);
+  const __m512 m0 = _mm512_loadu_ps(s);
+  const __m512 m1 = _mm512_loadu_ps(s + 16);
+  const __m512 m2 = _mm512_loadu_ps(s + 32);
+  const __m512i base = _mm512_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21, 24, 27,
+                                         30, 33, 36, 39, 42, 45);
+  float *dst[3] = {x, y, z};
+  // Lanes with 3i+k >= 32.
+  const __mmask16 from_m2[3] = {0xf800, 0xf800, 0xfc00};
+  for (int k = 0; k < 3; k++) {
+    const __m512i idx = _mm512_add_epi32(base, _mm512_set1_epi32(k));
+    const __m512 t = _mm512_permutex2var_ps(m0, idx, m1);
+    _mm512_storeu_ps(dst[k], _mm512_mask_permutexvar_ps(t, from_m2[k], idx, m2));
+  }
+}
+
+template <uint32_t N>
+TINY_XPD_TARGET("sse4.2")
+static void DecodeCVsSoASSE42(const uint8_t *src, const uint32_t num_cvs,
+                              float *x, float *y, float *z) {
+  const uint32_t n = N ? N : num_cvs;
+  uint32_t c = 0;
+  for (; c + 4 <= n; c += 4) {
+    TransposeCVs4(src + 3 * c * sizeof(float), x + c, y + c, z + c);
+  }
+  DecodeCVsSoAGeneric(src + 3 * c * sizeof(float), n - c, x + c, y + c, z + c);
+}
+
+template <uint32_t N>
+TINY_XPD_TARGET("avx2")
+static void DecodeCVsSoAAVX2(const uint8_t *src, const uint32_t num_cvs,
+                             float *x, float *y, float *z) {
+  const uint32_t n = N ? N : num_cvs;
+  uint32_t c = 0;
+  for (; c + 8 <= n; c += 8) {
+    TransposeCVs8(src + 3 * c * sizeof(float), x + c, y + c, z + c);
+  }
+  for (; c + 4 <= n; c += 4) {
+    TransposeCVs4(src + 3 * c * sizeof(float), x + c, y + c, z + c);
+  }
+  DecodeCVsSoAGeneric(src + 3 * c * sizeof(float), n - c, x + c, y + c, z + c);
+}
+
+template <uint32_t N>
+TINY_XPD_TARGET("avx512f")
+static void DecodeCVsSoAAVX512(const uint8_t *src, const uint32_t num_cvs,
+                               float *x, float *y, float *z) {
+  const uint32_t n = N ? N : num_cvs;
+  uint32_t c = 0;
+  for (; c + 16 <= n; c += 16) {
+    TransposeCVs16(src + 3 * c * sizeof(float), x + c, y + c, z + c);
+  }
+  for (; c + 8 <= n; c += 8) {
+    TransposeCVs8(src + 3 * c * sizeof(float), x + c, y + c, z + c);
+  }
+  for (; c + 4 <= n; c += 4) {
+    TransposeCVs4(src + 3 * c * sizeof(float), x + c, y + c, z + c);
+  }
+  DecodeCVsSoAGeneric(src + 3 * c * sizeof(float), n - c, x + c, y + c, z + c);
+}
+
+// Expand 4 CVs to float4. Radii are computed in the same order of operations
+// as `TaperedRadius`, so all levels give identical results.
+TINY_XPD_TARGET("sse4.2")
+static inline void ExpandCVs4(const uint8_t *src, const float half_width,
+                              const float slope, const float taper_start,
+                              const float *ts, float *dst) {
+  const float *s = reinterpret_cast<const float *>(src);
+  const __m128 d = _mm_max_ps(
+      _mm_sub_ps(_mm_loadu_ps(ts), _mm_set1_ps(taper_start)), _mm_setzero_ps());
+  const __m128 r = _mm_mul_ps(
+      _mm_set1_ps(half_width),
+      _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(_mm_set1_ps(slope), d)));
+  // Insert r[k] into w of CV k.
+  _mm_storeu_ps(dst + 0, _mm_insert_ps(_mm_loadu_ps(s + 0), r, 0x30));
+  _mm_storeu_ps(dst + 4, _mm_insert_ps(_mm_loadu_ps(s + 3), r, 0x70));
+  _mm_storeu_ps(dst + 8, _mm_insert_ps(_mm_loadu_ps(s + 6), r, 0xb0));
+  _mm_storeu_ps(dst + 12, _mm_insert_ps(_mm_loadu_ps(s + 9), r, 0xf0));
+}
+
+TINY_XPD_TARGET("avx2")
+static inline void ExpandCVs8(const uint8_t *src, const float half_width,
+                              const float slope, const float taper_start,
+                              const float *ts, float *dst) {
+  const float *s = reinterpret_cast<const float *>(src);
+  const __m256 d = _mm256_max_ps(
+      _mm256_sub_ps(_mm256_loadu_ps(ts), _mm256_set1_ps(taper_start)),
+      _mm256_setzero_ps());
+  const __m256 r = _mm256_mul_ps(
+      _mm256_set1_ps(half_width),
+      _mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(_mm256_set1_ps(slope), d)));
+  // Move r[2k] and r[2k+1] to lane 3 and 7.
+  const __m256i ridx = _mm256_setr_epi32(0, 0, 0, 0, 0, 0, 0, 1);
+  for (int k = 0; k < 4; k++) {
+    const __m256 v = _mm256_insertf128_ps(
+        _mm256_castps128_ps256(_mm_loadu_ps(s + 6 * k)),
+        _mm_loadu_ps(s + 6 * k + 3), 1);
+    const __m256 rk = _mm256_permutevar8x32_ps(
+        r, _mm256_add_epi32(ridx, _mm256_set1_epi32(2 * k)));
+    _mm256_storeu_ps(dst + 8 * k, _mm256_blend_ps(v, rk, 0x88));
+  }
+}
+
+TINY_XPD_TARGET("avx512f")
+static inline void ExpandCVs16(const uint8_t *src, const float half_width,
+                               const float slope, const float taper_start,
+                               const float *ts, float *dst) {
+  const float *s = reinterpret_cast<const float *>(src);
+  // maskz forms with a full mask are used for max and permutexvar below, to
+  // avoid false -Wuninitialized warnings from the undefined passthrough
+  // operand of the unmasked forms in GCC 12 headers.
+  const __mmask16 all = 0xffff;
+  const __m512 d = _mm512_maskz_max_ps(
+      all, _mm512_sub_ps(_mm512_loadu_ps(ts), _mm512_set1_ps(taper_start)),
+      _mm512_setzero_ps());
+  const __m512 r = _mm512_mul_ps(
+      _mm512_set1_ps(half_width),
+      _mm512_sub_ps(_mm512_set1_ps(1.0f), _mm512_mul_ps(_mm512_set1_ps(slope), d)));
+  // xyz of 4 CVs from 12 floats. r[4k..4k+3] to lane 3, 7, 11 and 15.
+  const __m512i xyz_idx =
+      _mm512_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0, 6, 7, 8, 0, 9, 10, 11, 0);
+  const __m512i ridx =
+      _mm512_setr_epi32(0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 3);
+  for (int k = 0; k < 4; k++) {
+    const __m512 v =
+        _mm512_maskz_permutexvar_ps(all, xyz_idx, _mm512_loadu_ps(s + 12 * k));
+    const __m512 rk = _mm512_maskz_permutexvar_ps(
+        all, _mm512_add_epi32(ridx, _mm512_set1_epi32(4 * k)), r);
+    _mm512_storeu_ps(dst + 16 * k, _mm512_mask_mov_ps(v, 0x8888, rk));
+  }
+}
+
+template <uint32_t N>
+TINY_XPD_TARGET("sse4.2")
+static void DecodeCVsFloat4SSE42(const uint8_t *src, const uint32_t num_cvs,
+                                 const float width, const float taper,
+                                 const float taper_start, const float *ts,
+                                 float *dst) {
+  const uint32_t n = N ? N : num_cvs;
+  const float half_width = 0.5f * width;
+  const float slope = TaperSlope(taper, taper_start);
+  uint32_t c = 0;
+  for (; c + 4 <= n; c += 4) {
+    ExpandCVs4(src + 3 * c * sizeof(float), half_width, slope, taper_start,
+               ts + c, dst + 4 * c);
+  }
+  ExpandCVsScalar(src + 3 * c * sizeof(float), n - c, half_width, slope,
+                  taper_start, ts + c, dst + 4 * c);
+}
+
+template <uint32_t N>
+TINY_XPD_TARGET("avx2")
+static void DecodeCVsFloat4AVX2(const uint8_t *src, const uint32_t num_cvs,
+                                const float width, const float taper,
+                                const float taper_start, const float *ts,
+                                float *dst) {
+  const uint32_t n = N ? N : num_cvs;
+  const float half_width = 0.5f * width;
+  const float slope = TaperSlope(taper, taper_start);
+  uint32_t c = 0;
+  for (; c + 8 <= n; c += 8) {
+    ExpandCVs8(src + 3 * c * sizeof(float), half_width, slope, taper_start,
+               ts + c, dst + 4 * c);
+  }
+  for (; c + 4 <= n; c += 4) {
+    ExpandCVs4(src + 3 * c * sizeof(float), half_width, slope, taper_start,
+               ts + c, dst + 4 * c);
+  }
+  ExpandCVsScalar(src + 3 * c * sizeof(float), n - c, half_width, slope,
+                  taper_start, ts + c, dst + 4 * c);
+}
+
+template <uint32_t N>
+TINY_XPD_TARGET("avx512f")
+static void DecodeCVsFloat4AVX512(const uint8_t *src, const uint32_t num_cvs,
+                                  const float width, const float taper,
+                                  const float taper_start, const float *ts,
+                                  float *dst) {
+  const uint32_t n = N ? N : num_cvs;
+  const float half_width = 0.5f * width;
+  const float slope = TaperSlope(taper, taper_start);
+  uint32_t c = 0;
+  for (; c + 16 <= n; c += 16) {
+    ExpandCVs16(src + 3 * c * sizeof(float), half_width, slope, taper_start,
+                ts + c, dst + 4 * c);
+  }
+  for (; c + 8 <= n; c += 8) {
+    ExpandCVs8(src + 3 * c * sizeof(float), half_width, slope, taper_start,
+               ts + c, dst + 4 * c);
+  }
+  for (; c + 4 <= n; c += 4) {
+    ExpandCVs4(src + 3 * c * sizeof(float), half_width, slope, taper_start,
+               ts + c, dst + 4 * c);
+  }
+  ExpandCVsScalar(src + 3 * c * sizeof(float), n - c, half_width, slope,
+                  taper_start, ts + c, dst + 4 * c);
+}
+
+#endif  // TINY_XPD_X86_SIMD
+
+// Return `kernel<n>` for specialized numCVs, `kernel<0>` otherwise.
+#define TINY_XPD_SELECT_NUM_CVS(kernel, n) \
+  switch (n) {                             \
+    case 4:                                \
+      return kernel<4>;                    \
+    case 5:                                \
+      return kernel<5>;                    \
+    case 8:                                \
+      return kernel<8>;                    \
+    case 16:                               \
+      return kernel<16>;                   \
+    default:                               \
+      return kernel<0>;                    \
+  }
+
+static DecodeCVsSoAFunc SelectDecodeCVsSoA(const uint32_t num_cvs,
+                                           const bool specialize,
+                                           const XPDSIMDLevel level) {
+  const uint32_t n = specialize ? num_cvs : 0;
+#if defined(TINY_XPD_X86_SIMD)
+  if (level >= XPDSIMDAVX512) {
+    TINY_XPD_SELECT_NUM_CVS(DecodeCVsSoAAVX512, n)
+  } else if (level >= XPDSIMDAVX2) {
+    TINY_XPD_SELECT_NUM_CVS(DecodeCVsSoAAVX2, n)
+  } else if (level >= XPDSIMDSSE42) {
+    TINY_XPD_SELECT_NUM_CVS(DecodeCVsSoASSE42, n)
+  }
+#else
+  (void)level;
+#endif
+  switch (n) {
+    case 4:
+      return DecodeCVsSoAFixed<4>;
+    case 5:
+      return DecodeCVsSoAFixed<5>;
+    case 8:
+      return DecodeCVsSoAFixed<8>;
+    case 16:
+      return DecodeCVsSoAFixed<16>;
+    default:
+      break;
+  }
+  return DecodeCVsSoAGeneric;
+}
+
+static DecodeCVsFloat4Func SelectDecodeCVsFloat4(const uint32_t num_cvs,
+                                                 const bool specialize,
+                                                 const XPDSIMDLevel level) {
+  const uint32_t n = specialize ? num_cvs : 0;
+#if defined(TINY_XPD_X86_SIMD)
+  if (level >= XPDSIMDAVX512) {
+    TINY_XPD_SELECT_NUM_CVS(DecodeCVsFloat4AVX512, n)
+  } else if (level >= XPDSIMDAVX2) {
+    TINY_XPD_SELECT_NUM_CVS(DecodeCVsFloat4AVX2, n)
+  } else if (level >= XPDSIMDSSE42) {
+    TINY_XPD_SELECT_NUM_CVS(DecodeCVsFloat4SSE42, n)
+  }
+#else
+  (void)level;
+#endif
+  switch (n) {
+    case 4:
+      return DecodeCVsFloat4Fixed<4>;
+    case 5:
+      return DecodeCVsFloat4Fixed<5>;
+    case 8:
+      return DecodeCVsFloat4Fixed<8>;
+    case 16:
+      return DecodeCVsFloat4Fixed<16>;
+    default:
+      break;
+  }
+  return DecodeCVsFloat4Generic;
+}
+
+#undef TINY_XPD_SELECT_NUM_CVS
+
+// ---------------------------------------------
+// Spline CV encoders(SoA to xyz interleaved). Inverse of `DecodeCVsSoA*`.
+
+typedef void (*EncodeCVsAoSFunc)(const float *x, const float *y,
+                                 const float *z, const uint32_t num_cvs,
+                                 uint8_t *dst);
+
+static void EncodeCVsAoSScalar(const float *x, const float *y, const float *z,
+                               const uint32_t num_cvs, uint8_t *dst) {
+  for (uint32_t c = 0; c < num_cvs; c++) {
+    const float xyz[3] = {x[c], y[c], z[c]};
+    memcpy(dst + 3 * c * sizeof(float), xyz, 3 * sizeof(float));
+  }
+}
+
+#if defined(TINY_XPD_X86_SIMD)
+
+// Interleave 4 CVs into (x0 y0 z0 x1)(y1 z1 x2 y2)(z2 x3 y3 z3).
+TINY_XPD_TARGET("sse4.2")
+static inline void InterleaveCVs4(const float *x, const float *y,
+                                  const float *z, uint8_t *dst) {
+  float *d = reinterpret_cast<float *>(dst);
+  const __m128 xs = _mm_loadu_ps(x);
+  const __m128 ys = _mm_loadu_ps(y);
+  const __m128 zs = _mm_loadu_ps(z);
+  const __m128 x0y0x1y1 = _mm_unpacklo_ps(xs, ys);
+  const __m128 x2y2x3y3 = _mm_unpackhi_ps(xs, ys);
+  const __m128 z0z1x0x1 = _mm_shuffle_ps(zs, xs, _MM_SHUFFLE(1, 0, 1, 0));
+  const __m128 y1y1z1z1 = _mm_shuffle_ps(ys, zs, _MM_SHUFFLE(1, 1, 1, 1));
+  const __m128 z2z2x3x3 = _mm_shuffle_ps(zs, xs, _MM_SHUFFLE(3, 3, 2, 2));
+  const __m128 y3y3z3z3 = _mm_shuffle_ps(ys, zs, _MM_SHUFFLE(3, 3, 3, 3));
+  _mm_storeu_ps(d, _mm_shuffle_ps(x0y0x1y1, z0z1x0x1, _MM_SHUFFLE(3, 0, 1, 0)));
+  _mm_storeu_ps(d + 4,
+                _mm_shuffle_ps(y1y1z1z1, x2y2x3y3, _MM_SHUFFLE(1, 0, 2, 0)));
+  _mm_storeu_ps(d + 8,
+                _mm_shuffle_ps(z2z2x3x3, y3y3z3z3, _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+// Interleave 8 CVs. Inverse of `TransposeCVs8`: permute each component to
+// the lanes it occupies in the 3 output vectors, then blend.
+TINY_XPD_TARGET("avx2")
+static inline void InterleaveCVs8(const float *x, const float *y,
+                                  const float *z, uint8_t *dst) {
+  float *d = reinterpret_cast<float *>(dst);
+  const __m256 xs = _mm256_permutevar8x32_ps(
+      _mm256_loadu_ps(x), _mm256_setr_epi32(0, 3, 6, 1, 4, 7, 2, 5));
+  const __m256 ys = _mm256_permutevar8x32_ps(
+      _mm256_loadu_ps(y), _mm256_setr_epi32(5, 0, 3, 6, 1, 4, 7, 2));
+  const __m256 zs = _mm256_permutevar8x32_ps(
+      _mm256_loadu_ps(z), _mm256_setr_epi32(2, 5, 0, 3, 6, 1, 4, 7));
+  _mm256_storeu_ps(d, _mm256_blend_ps(_mm256_blend_ps(xs, ys, 0x92), zs, 0x24));
+  _mm256_storeu_ps(d + 8,
+                   _mm256_blend_ps(_mm256_blend_ps(xs, ys, 0x24), zs, 0x49));
+  _mm256_storeu_ps(d + 16,
+                   _mm256_blend_ps(_mm256_blend_ps(xs, ys, 0x49), zs, 0x92));
+}
+
+TINY_XPD_TARGET("sse4.2")
+static void EncodeCVsAoSSSE42(const float *x, const float *y, const float *z,
+                              const uint32_t num_cvs, uint8_t *dst) {
+  uint32_t c = 0;
+  for (; c + 4 <= num_cvs; c += 4) {
+    InterleaveCVs4(x + c, y + c, z + c, dst + 3 * c * sizeof(float));
+  }
+  EncodeCVsAoSScalar(x + c, y + c, z + c, num_cvs - c,
+                     dst + 3 * c * sizeof(float));
+}
+
+TINY_XPD_TARGET("avx2")
+static void EncodeCVsAoSAVX2(const float *x, const float *y, const float *z,
+                             const uint32_t num_cvs, uint8_t *dst) {
+  uint32_t c = 0;
+  for (; c + 8 <= num_cvs; c += 8) {
+    InterleaveCVs8(x + c, y + c, z + c, dst + 3 * c * sizeof(float));
+  }
+  for (; c + 4 <= num_cvs; c += 4) {
+    InterleaveCVs4(x + c, y + c, z + c, dst + 3 * c * sizeof(float));
+  }
+  EncodeCVsAoSScalar(x + c, y + c, z + c, num_cvs - c,
+                     dst + 3 * c * sizeof(float));
+}
+
+#endif  // TINY_XPD_X86_SIMD
+
+// AVX-512 uses the AVX2 version.
+static EncodeCVsAoSFunc SelectEncodeCVsAoS(const XPDSIMDLevel level) {
+#if defined(TINY_XPD_X86_SIMD)
+  if (level >= XPDSIMDAVX2) {
+    return EncodeCVsAoSAVX2;
+  } else if (level >= XPDSIMDSSE42) {
+    return EncodeCVsAoSSSE42;
+  }
+#else
+  (void)level;
+#endif
+  return EncodeCVsAoSScalar;
+}
+
+// ---------------------------------------------
+// CV transform kernels.
+// `m` is a 3x4 affine matrix(top 3 rows of a row-major 4x4 matrix). All
+// versions evaluate ((m0 * x + m1 * y) + m2 * z) + m3 in the same order, so
+// they give bit identical results.
+
+// Transform `n` points in SoA form in place.
+typedef void (*TransformSoAFunc)(const float *m, const size_t n, float *x,
+                                 float *y, float *z);
+
+// Transform `n` float4(xyz + radius) in place. w is kept.
+typedef void (*TransformFloat4Func)(const float *m, const size_t n,
+                                    float *xyzw);
+
+static void TransformSoAScalar(const float *m, const size_t n, float *x,
+                               float *y, float *z) {
+  for (size_t i = 0; i < n; i++) {
+    const float px = x[i], py = y[i], pz = z[i];
+    x[i] = m[0] * px + m[1] * py + m[2] * pz + m[3];
+    y[i] = m[4] * px + m[5] * py + m[6] * pz + m[7];
+    z[i] = m[8] * px + m[9] * py + m[10] * pz + m[11];
+  }
+}
+
+static void TransformFloat4Scalar(const float *m, const size_t n,
+                                  float *xyzw) {
+  for (size_t i = 0; i < n; i++) {
+    float *p = xyzw + 4 * i;
+    const float px = p[0], py = p[1], pz = p[2];
+    p[0] = m[0] * px + m[1] * py + m[2] * pz + m[3];
+    p[1] = m[4] * px + m[5] * py + m[6] * pz + m[7];
+    p[2] = m[8] * px + m[9] * py + m[10] * pz + m[11];
+  }
+}
+
+#if defined(TINY_XPD_X86_SIMD)
+
+TINY_XPD_TARGET("sse4.2")
+static void TransformSoASSE42(const float *m, const size_t n, float *x,
+                              float *y, float *z) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m128 px = _mm_loadu_ps(x + i);
+    const __m128 py = _mm_loadu_ps(y + i);
+    const __m128 pz = _mm_loadu_ps(z + i);
+    float *dst[3] = {x + i, y + i, z + i};
+    for (int r = 0; r < 3; r++) {
+      const float *row = m + 4 * r;
+      const __m128 s = _mm_add_ps(
+          _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(row[0]), px),
+                                _mm_mul_ps(_mm_set1_ps(row[1]), py)),
+                     _mm_mul_ps(_mm_set1_ps(row[2]), pz)),
+          _mm_set1_ps(row[3]));
+      _mm_storeu_ps(dst[r], s);
+    }
+  }
+  TransformSoAScalar(m, n - i, x + i, y + i, z + i);
+}
+
+TINY_XPD_TARGET("avx2")
+static void TransformSoAAVX2(const float *m, const size_t n, float *x,
+                             float *y, float *z) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256 px = _mm256_loadu_ps(x + i);
+    const __m256 py = _mm256_loadu_ps(y + i);
+    const __m256 pz = _mm256_loadu_ps(z + i);
+    float *dst[3] = {x + i, y + i, z + i};
+    for (int r = 0; r < 3; r++) {
+      const float *row = m + 4 * r;
+      const __m256 sxy =
+          _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(row[0]), px),
+                        _mm256_mul_ps(_mm256_set1_ps(row[1]), py));
+      const __m256 s = _mm256_add_ps(
+          _mm256_add_ps(sxy, _mm256_mul_ps(_mm256_set1_ps(row[2]), pz)),
+          _mm256_set1_ps(row[3]));
+      _mm256_storeu_ps(dst[r], s);
+    }
+  }
+  TransformSoASSE42(m, n - i, x + i, y + i, z + i);
+}
+
+TINY_XPD_TARGET("avx512f")
+static void TransformSoAAVX512(const float *m, const size_t n, float *x,
+                               float *y, float *z) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m512 px = _mm512_loadu_ps(x + i);
+    const __m512 py = _mm512_loadu_ps(y + i);
+    const __m512 pz = _mm512_loadu_ps(z + i);
+    float *dst[3] = {x + i, y + i, z + i};
+    for (int r = 0; r < 3; r++) {
+      const float *row = m + 4 * r;
+      const __m512 sxy =
+          _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(row[0]), px),
+                        _mm512_mul_ps(_mm512_set1_ps(row[1]), py));
+      const __m512 s = _mm512_add_ps(
+          _mm512_add_ps(sxy, _mm512_mul_ps(_mm512_set1_ps(row[2]), pz)),
+          _mm512_set1_ps(row[3]));
+      _mm512_storeu_ps(dst[r], s);
+    }
+  }
+  TransformSoAAVX2(m, n - i, x + i, y + i, z + i);
+}
+
+// Columns of `m` for float4 transform: (m0, m4, m8, 0), ... Lane w of the
+// result is replaced with w of the input.
+TINY_XPD_TARGET("sse4.2")
+static void TransformFloat4SSE42(const float *m, const size_t n,
+                                 float *xyzw) {
+  const __m128 c0 = _mm_setr_ps(m[0], m[4], m[8], 0.0f);
+  const __m128 c1 = _mm_setr_ps(m[1], m[5], m[9], 0.0f);
+  const __m128 c2 = _mm_setr_ps(m[2], m[6], m[10], 0.0f);
+  const __m128 c3 = _mm_setr_ps(m[3], m[7], m[11], 0.0f);
+  for (size_t i = 0; i < n; i++) {
+    float *p = xyzw + 4 * i;
+    const __m128 v = _mm_loadu_ps(p);
+    const __m128 s = _mm_add_ps(
+        _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(c0, _mm_shuffle_ps(v, v, 0x00)),
+                       _mm_mul_ps(c1, _mm_shuffle_ps(v, v, 0x55))),
+            _mm_mul_ps(c2, _mm_shuffle_ps(v, v, 0xaa))),
+        c3);
+    _mm_storeu_ps(p, _mm_blend_ps(s, v, 0x8));
+  }
+}
+
+TINY_XPD_TARGET("avx2")
+static void TransformFloat4AVX2(const float *m, const size_t n, float *xyzw) {
+  const __m256 c0 = _mm256_setr_ps(m[0], m[4], m[8], 0.0f, m[0], m[4], m[8],
+                                   0.0f);
+  const __m256 c1 = _mm256_setr_ps(m[1], m[5], m[9], 0.0f, m[1], m[5], m[9],
+                                   0.0f);
+  const __m256 c2 = _mm256_setr_ps(m[2], m[6], m[10], 0.0f, m[2], m[6], m[10],
+                                   0.0f);
+  const __m256 c3 = _mm256_setr_ps(m[3], m[7], m[11], 0.0f, m[3], m[7], m[11],
+                                   0.0f);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    float *p = xyzw + 4 * i;
+    const __m256 v = _mm256_loadu_ps(p);
+    const __m256 s = _mm256_add_ps(
+        _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(c0, _mm256_permute_ps(v, 0x00)),
+                          _mm256_mul_ps(c1, _mm256_permute_ps(v, 0x55))),
+            _mm256_mul_ps(c2, _mm256_permute_ps(v, 0xaa))),
+        c3);
+    _mm256_storeu_ps(p, _mm256_blend_ps(s, v, 0x88));
+  }
+  TransformFloat4SSE42(m, n - i, xyzw + 4 * i);
+}
+
+TINY_XPD_TARGET("avx512f")
+static void TransformFloat4AVX512(const float *m, const size_t n,
+                                  float *xyzw) {
+  // maskz forms with a full mask, as in `ExpandCVs16`.
+  const __mmask16 all = 0xffff;
+  const __m512 c0 =
+      _mm512_maskz_broadcast_f32x4(all, _mm_setr_ps(m[0], m[4], m[8], 0.0f));
+  const __m512 c1 =
+      _mm512_maskz_broadcast_f32x4(all, _mm_setr_ps(m[1], m[5], m[9], 0.0f));
+  const __m512 c2 =
+      _mm512_maskz_broadcast_f32x4(all, _mm_setr_ps(m[2], m[6], m[10], 0.0f));
+  const __m512 c3 =
+      _mm512_maskz_broadcast_f32x4(all, _mm_setr_ps(m[3], m[7], m[11], 0.0f));
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float *p = xyzw + 4 * i;
+    const __m512 v = _mm512_loadu_ps(p);
+    const __m512 sxy =
+        _mm512_add_ps(_mm512_mul_ps(c0, _mm512_maskz_permute_ps(all, v, 0x00)),
+                      _mm512_mul_ps(c1, _mm512_maskz_permute_ps(all, v, 0x55)));
+    const __m512 s = _mm512_add_ps(
+        _mm512_add_ps(sxy,
+                      _mm512_mul_ps(c2, _mm512_maskz_permute_ps(all, v, 0xaa))),
+        c3);
+    _mm512_storeu_ps(p, _mm512_mask_mov_ps(s, 0x8888, v));
+  }
+  TransformFloat4AVX2(m, n - i, xyzw + 4 * i);
+}
+
+#endif  // TINY_XPD_X86_SIMD
+
+static TransformSoAFunc SelectTransformSoA(const XPDSIMDLevel level) {
+#if defined(TINY_XPD_X86_SIMD)
+  if (level >= XPDSIMDAVX512) {
+    return TransformSoAAVX512;
+  } else if (level >= XPDSIMDAVX2) {
+    return TransformSoAAVX2;
+  } else if (level >= XPDSIMDSSE42) {
+    return TransformSoASSE42;
+  }
+#else
+  (void)level;
+#endif
+  return TransformSoAScalar;
+}
+
+static TransformFloat4Func SelectTransformFloat4(const XPDSIMDLevel level) {
+#if defined(TINY_XPD_X86_SIMD)
+  if (level >= XPDSIMDAVX512) {
+    return TransformFloat4AVX512;
+  } else if (level >= XPDSIMDAVX2) {
+    return TransformFloat4AVX2;
+  } else if (level >= XPDSIMDSSE42) {
+    return TransformFloat4SSE42;
+  }
+#else
+  (void)level;
+#endif
+  return TransformFloat4Scalar;
+}
+
+static bool ValidateTransform(const XPDTransform &transform,
+                              const uint32_t num_faces, std::string *err) {
+  if (!transform.matrix.empty() && (transform.matrix.size() != 16)) {
+    if (err) {
+      (*err) += "Size of `transform.matrix` must be 16.\n";
+    }
+    return false;
+  }
+
+  if (!transform.faceMatrices.empty() &&
+      (transform.faceMatrices.size() != size_t(num_faces) * 16)) {
+    if (err) {
+      (*err) += "Size of `transform.faceMatrices` must be numFaces * 16.\n";
+    }
+    return false;
+  }
+
+  return true;
+}
+
+// 3x4 matrix of `face`(`matrix` * `faceMatrices[face]`).
+static void GetFaceTransform(const XPDTransform &transform, const size_t face,
+                             float m[12]) {
+  static const float kIdentity[12] = {1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+                                      0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f};
+  const float *a = transform.matrix.empty() ? kIdentity
+                                            : transform.matrix.data();
+  if (transform.faceMatrices.empty()) {
+    memcpy(m, a, 12 * sizeof(float));
+    return;
+  }
+
+  const float *b = &transform.faceMatrices[face * 16];
+  for (int i = 0; i < 3; i++) {
+    const float *r = a + 4 * i;
+    for (int j = 0; j < 4; j++) {
+      m[4 * i + j] = r[0] * b[j] + r[1] * b[4 + j] + r[2] * b[8 + j] +
+                     ((j == 3) ? r[3] : 0.0f);
+    }
+  }
+}
+
+// Mean scale(cube root of the absolute determinant) of the linear part of
+// row-major 3x4 `m`. Widths and radii are multiplied by it.
+static float LinearScale(const float m[12]) {
+  const double m0 = double(m[0]), m1 = double(m[1]), m2 = double(m[2]);
+  const double m4 = double(m[4]), m5 = double(m[5]), m6 = double(m[6]);
+  const double m8 = double(m[8]), m9 = double(m[9]), m10 = double(m[10]);
+  const double det = m0 * (m5 * m10 - m6 * m9) - m1 * (m4 * m10 - m6 * m8) +
+                     m2 * (m4 * m9 - m5 * m8);
+  return float(std::cbrt(std::fabs(det)));
+}
+
+// The number of curves resampled at once. CVs of a batch are stored in SoA
+// form([cv][lane]), so the evaluation loop runs across curves.
+static const size_t kResampleBatchSize = 8;
+
+// Interpolate one component of a batch at output CVs.
+// `src` : [num_cvs][kResampleBatchSize]
+// `seg`, `lt` : Segment index and local parameter. [num_out][kResampleBatchSize]
+// `dst` : [num_out][kResampleBatchSize]
+typedef void (*InterpolateBatchFunc)(const float *src, const uint32_t num_cvs,
+                                     const uint32_t *seg, const float *lt,
+                                     const uint32_t num_out,
+                                     const bool catmull_rom, float *dst);
+
+static void InterpolateBatchScalar(const float *src, const uint32_t num_cvs,
+                                   const uint32_t *seg, const float *lt,
+                                   const uint32_t num_out,
+                                   const bool catmull_rom, float *dst) {
+  const size_t B = kResampleBatchSize;
+  for (uint32_t j = 0; j < num_out; j++) {
+    for (size_t l = 0; l < B; l++) {
+      const uint32_t s = seg[j * B + l];
+      const float t = lt[j * B + l];
+      const float p1 = src[s * B + l];
+      const float p2 = src[(s + 1) * B + l];
+      if (catmull_rom) {
+        // Extrapolate phantom end points.
+        const float p0 = (s > 0) ? src[(s - 1) * B + l] : (2.0f * p1 - p2);
+        const float p3 =
+            ((s + 2) < num_cvs) ? src[(s + 2) * B + l] : (2.0f * p2 - p1);
+        const float t2 = t * t;
+        const float t3 = t2 * t;
+        dst[j * B + l] =
+            0.5f * ((2.0f * p1) + (-p0 + p2) * t +
+                    (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t2 +
+                    (-p0 + 3.0f * p1 - 3.0f * p2 + p3) * t3);
+      } else {
+        dst[j * B + l] = p1 + (p2 - p1) * t;
+      }
+    }
+  }
+}
+
+#if defined(TINY_XPD_X86_SIMD)
+// One AVX2 vector per output CV(kResampleBatchSize = 8 lanes). CVs of each
+// lane are gathered with its own segment index. Operations are in the same
+// order as the scalar version.
+TINY_XPD_TARGET("avx2")
+static void InterpolateBatchAVX2(const float *src, const uint32_t num_cvs,
+                                 const uint32_t *seg, const float *lt,
+                                 const uint32_t num_out,
+                                 const bool catmull_rom, float *dst) {
+  static_assert(kResampleBatchSize == 8, "Batch must fit in a AVX2 vector.");
+  const size_t B = kResampleBatchSize;
+  const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i stride = _mm256_set1_epi32(int(B));
+  const __m256i last = _mm256_set1_epi32(int(num_cvs) - 2);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 two = _mm256_set1_ps(2.0f);
+  const __m256 three = _mm256_set1_ps(3.0f);
+  const __m256 four = _mm256_set1_ps(4.0f);
+  const __m256 five = _mm256_set1_ps(5.0f);
+
+  for (uint32_t j = 0; j < num_out; j++) {
+    const __m256i s =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(seg + j * B));
+    const __m256 t = _mm256_loadu_ps(lt + j * B);
+    const __m256i i1 = _mm256_add_epi32(_mm256_mullo_epi32(s, stride), lane);
+    const __m256i i2 = _mm256_add_epi32(i1, stride);
+    const __m256 p1 = _mm256_i32gather_ps(src, i1, 4);
+    const __m256 p2 = _mm256_i32gather_ps(src, i2, 4);
+
+    __m256 v;
+    if (catmull_rom) {
+      // Gather p0(p3) only for lanes having a previous(next) CV.
+      const __m256 has_prev =
+          _mm256_castsi256_ps(_mm256_cmpgt_epi32(s, _mm256_setzero_si256()));
+      const __m256 has_next = _mm256_castsi256_ps(_mm256_cmpgt_epi32(last, s));
+      const __m256 p0 = _mm256_mask_i32gather_ps(
+          _mm256_sub_ps(_mm256_mul_ps(two, p1), p2), src,
+          _mm256_sub_epi32(i1, stride), has_prev, 4);
+      const __m256 p3 = _mm256_mask_i32gather_ps(
+          _mm256_sub_ps(_mm256_mul_ps(two, p2), p1), src,
+          _mm256_add_epi32(i2, stride), has_next, 4);
+      const __m256 t2 = _mm256_mul_ps(t, t);
+      const __m256 t3 = _mm256_mul_ps(t2, t);
+      const __m256 a = _mm256_mul_ps(two, p1);
+      const __m256 b = _mm256_mul_ps(_mm256_sub_ps(p2, p0), t);
+      const __m256 c = _mm256_mul_ps(
+          _mm256_sub_ps(_mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(two, p0),
+                                                    _mm256_mul_ps(five, p1)),
+                                      _mm256_mul_ps(four, p2)),
+                        p3),
+          t2);
+      const __m256 d = _mm256_mul_ps(
+          _mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_mul_ps(three, p1), p0),
+                                      _mm256_mul_ps(three, p2)),
+                        p3),
+          t3);
+      v = _mm256_mul_ps(
+          half, _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(a, b), c), d));
+    } else {
+      v = _mm256_add_ps(p1, _mm256_mul_ps(_mm256_sub_ps(p2, p1), t));
+    }
+    _mm256_storeu_ps(dst + j * B, v);
+  }
+}
+#endif
+
+static InterpolateBatchFunc SelectInterpolateBatch(const XPDSIMDLevel level) {
+#if defined(TINY_XPD_X86_SIMD)
+  if (level >= XPDSIMDAVX2) {
+    return InterpolateBatchAVX2;
+  }
+#else
+  (void)level;
+#endif
+  return InterpolateBatchScalar;
+}
+
+// Resample `count`(<= kResampleBatchSize) curves of `num_cvs` CVs to
+// `num_out` CVs.
+// `xyz` : Input CVs in SoA form. [3][num_cvs][kResampleBatchSize]
+// `out` : Output CVs in SoA form. [3][num_out][kResampleBatchSize]
+// `out_t` : Curve parameter(0 at root, 1 at tip) of each output CV.
+//           [num_out][kResampleBatchSize]
+static void ResampleCurveBatch(const float *xyz, const uint32_t num_cvs,
+                               const size_t count, const uint32_t num_out,
+                               const XPDCurveBufferOption &option,
+                               const InterpolateBatchFunc interpolate,
+                               std::vector<uint32_t> *seg_buf,
+                               std::vector<float> *work, float *out,
+                               float *out_t) {
+  const size_t B = kResampleBatchSize;
+  const float *xs = xyz;
+  const float *ys = xyz + num_cvs * B;
+  const float *zs = xyz + 2 * num_cvs * B;
+
+  // Segment index and local parameter of each output CV.
+  seg_buf->resize(num_out * B);
+  work->resize(num_out * B + num_cvs * B);
+  uint32_t *seg = seg_buf->data();
+  float *lt = work->data();
+  const uint32_t last_seg = num_cvs - 2;
+
+  if (option.resampleMode == XPDCurveBufferOption::ResampleArcLength) {
+    // Cumulative chord length. [num_cvs][B]
+    float *len = work->data() + num_out * B;
+    for (size_t l = 0; l < B; l++) {
+      len[l] = 0.0f;
+    }
+    for (uint32_t c = 1; c < num_cvs; c++) {
+      for (size_t l = 0; l < B; l++) {
+        const float dx = xs[c * B + l] - xs[(c - 1) * B + l];
+        const float dy = ys[c * B + l] - ys[(c - 1) * B + l];
+        const float dz = zs[c * B + l] - zs[(c - 1) * B + l];
+        len[c * B + l] =
+            len[(c - 1) * B + l] + std::sqrt(dx * dx + dy * dy + dz * dz);
+      }
+    }
+
+    for (size_t l = 0; l < count; l++) {
+      const float total = len[(num_cvs - 1) * B + l];
+      uint32_t s = 0;
+      for (uint32_t j = 0; j < num_out; j++) {
+        const float target = total * float(j) / float(num_out - 1);
+        while ((s < last_seg) && (len[(s + 1) * B + l] < target)) {
+          s++;
+        }
+        const float seg_len = len[(s + 1) * B + l] - len[s * B + l];
+        float t = (seg_len > 0.0f) ? (target - len[s * B + l]) / seg_len : 0.0f;
+        t = std::min(1.0f, std::max(0.0f, t));
+        seg[j * B + l] = s;
+        lt[j * B + l] = t;
+        out_t[j * B + l] = (float(s) + t) / float(num_cvs - 1);
+      }
+    }
+  } else {
+    for (uint32_t j = 0; j < num_out; j++) {
+      const float u = float(j) * float(num_cvs - 1) / float(num_out - 1);
+      const uint32_t s = std::min(uint32_t(u), last_seg);
+      for (size_t l = 0; l < B; l++) {
+        seg[j * B + l] = s;
+        lt[j * B + l] = u - float(s);
+        out_t[j * B + l] = u / float(num_cvs - 1);
+      }
+    }
+  }
+
+  const bool catmull_rom =
+      (option.interpolation == XPDCurveBufferOption::InterpolateCatmullRom);
+
+  for (int k = 0; k < 3; k++) {
+    interpolate(xyz + size_t(k) * num_cvs * B, num_cvs, seg, lt, num_out,
+                catmull_rom, out + size_t(k) * num_out * B);
+  }
+}
+
+#if defined(TINY_XPD_X86_SIMD)
+#if defined(__clang__)
+#pragma float_control(pop)
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+#endif
+
+bool ExtractCurveBuffers(const XPDHeader &xpd, const uint8_t *binary,
+                         const size_t binary_length, const uint32_t block_id,
+                         const XPDCurveBufferOption &option,
+                         XPDCurveBuffers *buffers, std::string *err) {
+  if (!buffers) {
+    if (err) {
+      (*err) += "`buffers` argument is null.\n";
+    }
+    return false;
+  }
+
+  TINY_XPD_PROFILE_SCOPE(XPDProfileExtractCurveBuffers);
+
+  XPDSplineLayout layout;
+  if (!GetSplineLayout(xpd, block_id, &layout, err)) {
+    return false;
+  }
+
+  uint32_t ext_block_id;
+  if (FindVaryingCVBlock(xpd, block_id, &ext_block_id)) {
+    if (err) {
+      (*err) += "Variable CV count is not supported. Use "
+                "`ExtractSplineSoA`.\n";
+    }
+    return false;
+  }
+
+  const uint32_t cvs_per_segment =
+      (option.segmentType == XPDCurveBufferOption::Linear) ? 2 : 4;
+  if (layout.numCVs < cvs_per_segment) {
+    if (err) {
+      (*err) += "numCVs(" + std::to_string(layout.numCVs) +
+                ") is too small for the segment type.\n";
+    }
+    return false;
+  }
+
+  if (!ValidateTransform(option.transform, xpd.numFaces, err)) {
+    return false;
+  }
+
+  std::vector<XPDBlockView> views;
+  std::vector<size_t> prim_offsets;
+  if (!PrepareFaceViews(xpd, binary, binary_length, block_id, &views,
+                        &prim_offsets, err)) {
+    return false;
+  }
+
+  const bool resample = (option.resampleCVs > 0);
+  if (resample && ((option.resampleCVs < cvs_per_segment) ||
+                   (option.resampleCVs < 2) || (layout.numCVs < 2))) {
+    if (err) {
+      (*err) += "resampleCVs(" + std::to_string(option.resampleCVs) +
+                ") or numCVs is too small for resampling.\n";
+    }
+    return false;
+  }
+
+  const size_t num_curves = prim_offsets[xpd.numFaces];
+  const uint32_t src_cvs = layout.numCVs;
+  const uint32_t num_cvs = resample ? option.resampleCVs : src_cvs;
+  const uint32_t num_segments = num_cvs - cvs_per_segment + 1;
+
+  if ((num_curves * num_cvs) > 0xffffffffu) {
+    if (err) {
+      (*err) += "Too many CVs for 32bit indices.\n";
+    }
+    return false;
+  }
+
+  buffers->numCurves = uint32_t(num_curves);
+  buffers->numCVsPerCurve = num_cvs;
+  buffers->cvs.resize(num_curves * num_cvs * 4);
+  buffers->curveFirstCV.resize(num_curves);
+  buffers->segmentIndices.resize(num_curves * num_segments);
+  TINY_XPD_PROFILE_ALLOC(buffers->cvs.size() * sizeof(float));
+  TINY_XPD_PROFILE_ALLOC(buffers->curveFirstCV.size() * sizeof(uint32_t));
+  TINY_XPD_PROFILE_ALLOC(buffers->segmentIndices.size() * sizeof(uint32_t));
+  TINY_XPD_PROFILE_COUNT(ProfileFacesDecoded, xpd.numFaces);
+  TINY_XPD_PROFILE_COUNT(ProfilePrimsDecoded, num_curves);
+
+  // Radius scale per CV only depends on taper, so compute t once.
+  std::vector<float> ts(num_cvs);
+  for (uint32_t c = 0; c < num_cvs; c++) {
+    ts[c] = (num_cvs > 1) ? float(c) / float(num_cvs - 1) : 0.0f;
+  }
+
+  const XPDSIMDLevel simd_level = GetSIMDLevel();
+  const DecodeCVsFloat4Func decode =
+      SelectDecodeCVsFloat4(num_cvs, option.specialize, simd_level);
+  const InterpolateBatchFunc interpolate = SelectInterpolateBatch(simd_level);
+  const bool transform = !option.transform.empty();
+  const TransformFloat4Func transform_cvs = SelectTransformFloat4(simd_level);
+
+  float *cvs = buffers->cvs.data();
+  uint32_t *first_cv = buffers->curveFirstCV.data();
+  uint32_t *segments = buffers->segmentIndices.data();
+
+  ParallelFor(xpd.numFaces, option.numThreads, [&](size_t begin, size_t end) {
+    const size_t B = kResampleBatchSize;
+
+    // Per-thread work buffers for resampling.
+    std::vector<float> batch_in, batch_out, batch_t, work;
+    std::vector<uint32_t> seg_buf;
+    if (resample) {
+      batch_in.resize(3 * src_cvs * B, 0.0f);
+      batch_out.resize(3 * num_cvs * B);
+      batch_t.resize(num_cvs * B);
+    }
+
+    for (size_t f = begin; f < end; f++) {
+      const XPDBlockView &view = views[f];
+      for (size_t p0 = 0; p0 < view.numPrims; p0 += B) {
+        const size_t count = std::min(B, view.numPrims - p0);
+
+        if (resample) {
+          // Gather CVs into SoA form.
+          for (size_t l = 0; l < count; l++) {
+            const uint8_t *src = view.data + (p0 + l) * view.stride() +
+                                 layout.cv * sizeof(float);
+            for (uint32_t c = 0; c < src_cvs; c++) {
+              float xyz[3];
+              memcpy(xyz, src + 3 * c * sizeof(float), 3 * sizeof(float));
+              batch_in[(0 * src_cvs + c) * B + l] = xyz[0];
+              batch_in[(1 * src_cvs + c) * B + l] = xyz[1];
+              batch_in[(2 * src_cvs + c) * B + l] = xyz[2];
+            }
+          }
+
+          ResampleCurveBatch(batch_in.data(), src_cvs, count, num_cvs, option,
+                             interpolate, &seg_buf, &work, batch_out.data(),
+                             batch_t.data());
+        }
+
+        for (size_t l = 0; l < count; l++) {
+          const size_t p = p0 + l;
+          const size_t curve = prim_offsets[f] + p;
+          const uint8_t *prim = view.data + p * view.stride();
+
+          float width, taper, taper_start;
+          memcpy(&width, prim + layout.width * sizeof(float), sizeof(float));
+          memcpy(&taper, prim + layout.taper * sizeof(float), sizeof(float));
+          memcpy(&taper_start, prim + layout.taperStart * sizeof(float),
+                 sizeof(float));
+
+          float *dst = cvs + curve * num_cvs * 4;
+          if (resample) {
+            for (uint32_t c = 0; c < num_cvs; c++) {
+              dst[4 * c + 0] = batch_out[(0 * num_cvs + c) * B + l];
+              dst[4 * c + 1] = batch_out[(1 * num_cvs + c) * B + l];
+              dst[4 * c + 2] = batch_out[(2 * num_cvs + c) * B + l];
+            }
+            TaperedRadii(width, taper, taper_start, batch_t.data() + l, B,
+                         num_cvs, dst);
+          } else {
+            decode(prim + layout.cv * sizeof(float), num_cvs, width, taper,
+                   taper_start, ts.data(), dst);
+          }
+
+          const uint32_t first = uint32_t(curve * num_cvs);
+          first_cv[curve] = first;
+          uint32_t *seg = segments + curve * num_segments;
+          for (uint32_t s = 0; s < num_segments; s++) {
+            seg[s] = first + s;
+          }
+        }
+      }
+
+      // Transform CVs of the face while they are in cache.
+      if (transform) {
+        float m[12];
+        GetFaceTransform(option.transform, f, m);
+        float *face_cvs = cvs + prim_offsets[f] * num_cvs * 4;
+        transform_cvs(m, view.numPrims * num_cvs, face_cvs);
+
+        const float scale = LinearScale(m);
+        for (size_t i = 0; i < view.numPrims * num_cvs; i++) {
+          face_cvs[4 * i + 3] *= scale;
+        }
+      }
+    }
+  });
+
+  return true;
+}
+
+const char *GetProfilePhaseName(const XPDProfilePhase phase) {
+  switch (phase) {
+    case XPDProfileParseXPDFromFile:
+      return "ParseXPDFromFile";
+    case XPDProfileParseXPDFromIO:
+      return "ParseXPDFromIO";
+    case XPDProfileParseXPDHeader:
+      return "ParseXPDHeader";
+    case XPDProfileParseCompactHeader:
+      return "ParseXPDCompactHeader";
+    case XPDProfileSerializeToXPD:
+      return "SerializeToXPD";
+    case XPDProfileBatchOpen:
+      return "BatchOpenXPDFiles";
+    case XPDProfileReadFace:
+      return "XPDPartialReader::readFace";
+    case XPDProfileExtractCurveBuffers:
+      return "ExtractCurveBuffers";
+    case XPDProfileExtractSplineSoA:
+      return "ExtractSplineSoA";
+    case XPDProfileTransformSplineXPD:
+      return "TransformSplineXPD";
+    case XPDProfileReorderXPD:
+      return "ReorderXPD";
+    case XPDProfileReduceSplineAttributes:
+      return "ReduceSplineAttributes";
+    case XPDProfileRebindSplineXPD:
+      return "RebindSplineXPD";
+    case XPDProfileSequenceReadFrame:
+      return "XPDSequenceReader::readFrame";
+    case XPDProfileCacheLookup:
+      return "XPDDecodeCache::lookup";
+    case XPDProfileCacheStore:
+      return "XPDDecodeCache::store";
+    case XPDProfileNumPhases:
+      break;
+  }
+  return "Unknown";
+}
+
+void SetProfileCallback(XPDProfileCallback callback, void *userdata) {
+  g_profile_userdata = userdata;
+  g_profile_callback = callback;
+}
+
+void GetProfileStats(XPDProfileStats *stats) {
+  if (!stats) {
+    return;
+  }
+
+  stats->bytesRead = g_profile_counters[ProfileBytesRead];
+  stats->facesDecoded = g_profile_counters[ProfileFacesDecoded];
+  stats->primsDecoded = g_profile_counters[ProfilePrimsDecoded];
+  stats->allocations = g_profile_counters[ProfileAllocations];
+  stats->allocatedBytes = g_profile_counters[ProfileAllocatedBytes];
+  stats->adviseFailures = g_profile_counters[ProfileAdviseFailures];
+
+  for (int i = 0; i < XPDProfileNumPhases; i++) {
+    stats->phaseSeconds[i] = double(g_profile_phase_ns[i]) * 1.0e-9;
+    stats->phaseCount[i] = g_profile_phase_count[i];
+  }
+}
+
+void ResetProfileStats() {
+  for (int i = 0; i < ProfileNumCounters; i++) {
+    g_profile_counters[i] = 0;
+  }
+  for (int i = 0; i < XPDProfileNumPhases; i++) {
+    g_profile_phase_ns[i] = 0;
+    g_profile_phase_count[i] = 0;
+  }
+}
+
+void EnableProfileTrace(const bool enable) {
+  std::lock_guard<std::mutex> lock(g_profile_trace_mutex);
+  if (enable) {
+    g_profile_trace_events.clear();
+  }
+  g_profile_trace_enabled = enable;
+}
+
+bool WriteProfileTrace(const std::string &filename, std::string *err) {
+  std::ofstream ofs(filename);
+  if (!ofs) {
+    if (err) {
+      (*err) += "Failed to open a file for write: " + filename + "\n";
+    }
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(g_profile_trace_mutex);
+
+  // Complete events("ph": "X"). Time is in microseconds.
+  ofs << std::fixed << std::setprecision(3);
+  ofs << "{\"traceEvents\":[\n";
+  for (size_t i = 0; i < g_profile_trace_events.size(); i++) {
+    const XPDProfileEvent &e = g_profile_trace_events[i];
+    ofs << "{\"name\":\"" << GetProfilePhaseName(e.phase)
+        << "\",\"cat\":\"tiny_xpd\",\"ph\":\"X\",\"pid\":0,\"tid\":"
+        << (e.threadId & 0xffffffff) << ",\"ts\":" << double(e.beginNs) * 1.0e-3
+        << ",\"dur\":" << double(e.endNs - e.beginNs) * 1.0e-3 << "}";
+    if ((i + 1) < g_profile_trace_events.size()) {
+      ofs << ",";
+    }
+    ofs << "\n";
+  }
+  ofs << "]}\n";
+
+  if (!ofs) {
+    if (err) {
+      (*err) += "Failed to write a file: " + filename + "\n";
+    }
+    return false;
+  }
+
+  return true;
+}
+
+bool ExtractSplineSoA(const XPDHeader &xpd, const uint8_t *binary,
+                      const size_t binary_length, const uint32_t block_id,
+                      const XPDSplineSoAOption &option, XPDSplineSoA *soa,
+                      std::string *err) {
+  if (!soa) {
+    if (err) {
+      (*err) += "`soa` argument is null.\n";
+    }
+    return false;
+  }
+
+  TINY_XPD_PROFILE_SCOPE(XPDProfileExtractSplineSoA);
+
+  XPDSplineLayout layout;
+  if (!GetSplineLayout(xpd, block_id, &layout, err)) {
+    return false;
+  }
+
+  if (!ValidateTransform(option.transform, xpd.numFaces, err)) {
+    return false;
+  }
+
+  std::vector<XPDBlockView> views;
+  std::vector<size_t> prim_offsets;
+  if (!PrepareFaceViews(xpd, binary, binary_length, block_id, &views,
+                        &prim_offsets, err)) {
+    return false;
+  }
+
+  const size_t num_curves = prim_offsets[xpd.numFaces];
+  const uint32_t num_cvs = layout.numCVs;
+
+  // Variable CV count extension. CVs of each face are packed from
+  // `face_cv_offsets[face]`.
+  uint32_t ext_block_id;
+  const bool varying = FindVaryingCVBlock(xpd, block_id, &ext_block_id);
+  std::vector<XPDVaryingCVView> cv_views;
+  std::vector<uint64_t> face_cv_offsets;
+  uint64_t total_cvs = uint64_t(num_curves) * num_cvs;
+  if (varying) {
+    cv_views.resize(xpd.numFaces);
+    face_cv_offsets.resize(size_t(xpd.numFaces) + 1);
+    total_cvs = 0;
+    for (uint32_t f = 0; f < xpd.numFaces; f++) {
+      if (!GetVaryingCVView(xpd, binary, binary_length, f, block_id,
+                            &cv_views[f], err)) {
+        return false;
+      }
+      face_cv_offsets[f] = total_cvs;
+      for (size_t p = 0; p < cv_views[f].numPrims; p++) {
+        total_cvs += cv_views[f].count(p);
+      }
+    }
+    face_cv_offsets[xpd.numFaces] = total_cvs;
+  }
+
+  if (total_cvs > 0xffffffffu) {
+    if (err) {
+      (*err) += "Too many CVs for 32bit indices.\n";
+    }
+    return false;
+  }
+
+  soa->numCurves = uint32_t(num_curves);
+  soa->numCVsPerCurve = varying ? 0 : num_cvs;
+  soa->px.resize(size_t(total_cvs));
+  soa->py.resize(size_t(total_cvs));
+  soa->pz.resize(size_t(total_cvs));
+  if (varying) {
+    soa->curveCVOffset.resize(num_curves + 1);
+    soa->curveCVOffset[num_curves] = uint32_t(total_cvs);
+  } else {
+    soa->curveCVOffset.clear();
+  }
+
+  std::vector<float> *attribs[10] = {
+      &soa->id,     &soa->u,          &soa->v,
+      &soa->length, &soa->width,      &soa->taper,
+      &soa->taperStart, &soa->widthVectorX, &soa->widthVectorY,
+      &soa->widthVectorZ};
+  const uint32_t attrib_offsets[10] = {
+      layout.id,         layout.u,
+      layout.v,          layout.length,
+      layout.width,      layout.taper,
+      layout.taperStart, layout.widthVector,
+      layout.widthVector + 1, layout.widthVector + 2};
+  for (size_t a = 0; a < 10; a++) {
+    attribs[a]->resize(num_curves);
+  }
+
+  TINY_XPD_PROFILE_ALLOC(3 * total_cvs * sizeof(float));
+  TINY_XPD_PROFILE_ALLOC(10 * num_curves * sizeof(float));
+  TINY_XPD_PROFILE_COUNT(ProfileFacesDecoded, xpd.numFaces);
+  TINY_XPD_PROFILE_COUNT(ProfilePrimsDecoded, num_curves);
+
+  soa->faceCurveOffset.resize(prim_offsets.size());
+  for (size_t f = 0; f < prim_offsets.size(); f++) {
+    soa->faceCurveOffset[f] = uint32_t(prim_offsets[f]);
+  }
+
+  const XPDSIMDLevel simd_level = GetSIMDLevel();
+  const DecodeCVsSoAFunc decode =
+      varying ? SelectDecodeCVsSoA(0, false, simd_level)
+              : SelectDecodeCVsSoA(num_cvs, option.specialize, simd_level);
+  const bool transform = !option.transform.empty();
+  const TransformSoAFunc transform_soa = SelectTransformSoA(simd_level);
+
+  ParallelFor(xpd.numFaces, option.numThreads, [&](size_t begin, size_t end) {
+    for (size_t f = begin; f < end; f++) {
+      const XPDBlockView &view = views[f];
+      size_t cv_offset = varying ? size_t(face_cv_offsets[f]) : 0;
+      for (size_t p = 0; p < view.numPrims; p++) {
+        const size_t curve = prim_offsets[f] + p;
+        const uint8_t *prim = view.data + p * view.stride();
+
+        if (varying) {
+          const uint32_t n = cv_views[f].count(p);
+          soa->curveCVOffset[curve] = uint32_t(cv_offset);
+          decode(cv_views[f].cvData(p), n, soa->px.data() + cv_offset,
+                 soa->py.data() + cv_offset, soa->pz.data() + cv_offset);
+          cv_offset += n;
+        } else {
+          decode(prim + layout.cv * sizeof(float), num_cvs,
+                 &soa->px[curve * num_cvs], &soa->py[curve * num_cvs],
+                 &soa->pz[curve * num_cvs]);
+        }
+
+        for (size_t a = 0; a < 10; a++) {
+          memcpy(&(*attribs[a])[curve], prim + attrib_offsets[a] * sizeof(float),
+                 sizeof(float));
+        }
+      }
+
+      // Transform CVs and width vectors of the face while they are in cache.
+      if (transform) {
+        float m[12];
+        GetFaceTransform(option.transform, f, m);
+        const size_t first_cv =
+            varying ? size_t(face_cv_offsets[f]) : prim_offsets[f] * num_cvs;
+        const size_t face_cvs =
+            varying ? size_t(face_cv_offsets[f + 1] - face_cv_offsets[f])
+                    : view.numPrims * num_cvs;
+        transform_soa(m, face_cvs, soa->px.data() + first_cv,
+                      soa->py.data() + first_cv, soa->pz.data() + first_cv);
+
+        m[3] = m[7] = m[11] = 0.0f;
+        const size_t first_curve = prim_offsets[f];
+        transform_soa(m, view.numPrims, soa->widthVectorX.data() + first_curve,
+                      soa->widthVectorY.data() + first_curve,
+                      soa->widthVectorZ.data() + first_curve);
+
+        const float scale = LinearScale(m);
+        for (size_t p = 0; p < view.numPrims; p++) {
+          soa->width[first_curve + p] *= scale;
+        }
+      }
+    }
+  });
+
+  return true;
+}
+
+// ---------------------------------------------
+// Spline writer.
+
+// Length of the polyline through `n` CVs.
+static float PolylineLength(const float *x, const float *y, const float *z,
+                            const uint32_t n) {
+  float length = 0.0f;
+  for (uint32_t k = 1; k < n; k++) {
+    const float dx = x[k] - x[k - 1];
+    const float dy = y[k] - y[k - 1];
+    const float dz = z[k] - z[k - 1];
+    length += std::sqrt(dx * dx + dy * dy + dz * dz);
+  }
+  return length;
+}
+
+// Group curves by face with a parallel counting sort(stable).
+// `order` : Curve indices sorted by face. [numCurves]
+// `face_offset` : Index of the first curve of each face in `order`.
+//                 [numFaces + 1]
+static bool SortCurvesByFace(const std::vector<uint32_t> &curve_faces,
+                             const uint32_t num_faces,
+                             const uint32_t num_threads,
+                             std::vector<uint32_t> *order,
+                             std::vector<uint32_t> *face_offset,
+                             std::string *err) {
+  const size_t n = curve_faces.size();
+  const size_t num_chunks = ResolveNumThreads(num_threads, n);
+
+  // Histogram per chunk. [chunk][face]
+  std::vector<uint32_t> counts(num_chunks * num_faces, 0);
+  std::atomic<bool> invalid(false);
+
+  ParallelFor(num_chunks, num_threads, [&](size_t begin, size_t end) {
+    for (size_t c = begin; c < end; c++) {
+      uint32_t *count = &counts[c * num_faces];
+      for (size_t i = c * n / num_chunks; i < (c + 1) * n / num_chunks; i++) {
+        if (curve_faces[i] >= num_faces) {
+          invalid = true;
+          return;
+        }
+        count[curve_faces[i]]++;
+      }
+    }
+  });
+
+  if (invalid) {
+    if (err) {
+      (*err) += "Face index of a curve is out of range(numFaces = " +
+                std::to_string(num_faces) + ").\n";
+    }
+    return false;
+  }
+
+  // Exclusive prefix sum in (face, chunk) order, which keeps curves of a
+  // face in input order.
+  face_offset->resize(size_t(num_faces) + 1);
+  uint32_t sum = 0;
+  for (size_t f = 0; f < num_faces; f++) {
+    (*face_offset)[f] = sum;
+    for (size_t c = 0; c < num_chunks; c++) {
+      const uint32_t count = counts[c * num_faces + f];
+      counts[c * num_faces + f] = sum;
+      sum += count;
+    }
+  }
+  (*face_offset)[num_faces] = sum;
+
+  order->resize(n);
+  ParallelFor(num_chunks, num_threads, [&](size_t begin, size_t end) {
+    for (size_t c = begin; c < end; c++) {
+      uint32_t *next = &counts[c * num_faces];
+      for (size_t i = c * n / num_chunks; i < (c + 1) * n / num_chunks; i++) {
+        (*order)[next[curve_faces[i]]++] = uint32_t(i);
+      }
+    }
+  });
+
+  return true;
+}
+
+// Spread the low 21 bits of `v` to every 3rd bit.
+static inline uint64_t SpreadBits3(uint64_t v) {
+  v &= 0x1fffffull;
+  v = (v | (v << 32)) & 0x1f00000000ffffull;
+  v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+  v = (v | (v << 8)) & 0x100f00f00f00f00full;
+  v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+  v = (v | (v << 2)) & 0x1249249249249249ull;
+  return v;
+}
+
+static const uint32_t kSpatialBits = 21;
+
+// Position on the space filling curve of a quantized point(`kSpatialBits`
+// per axis).
+static uint64_t SpatialCurveKey(const XPDSpatialOrder order, uint32_t x,
+                                uint32_t y, uint32_t z) {
+  if (order == XPDSpatialOrderHilbert) {
+    // Skilling, "Programming the Hilbert curve", AIP Conf. Proc. 707, 2004.
+    // Transform axes in place, then interleave bits like Morton code.
+    uint32_t X[3] = {x, y, z};
+    for (uint32_t q = 1u << (kSpatialBits - 1); q > 1; q >>= 1) {
+      const uint32_t p = q - 1;
+      for (int i = 0; i < 3; i++) {
+        if (X[i] & q) {
+          X[0] ^= p;
+        } else {
+          const uint32_t t = (X[0] ^ X[i]) & p;
+          X[0] ^= t;
+          X[i] ^= t;
+        }
+      }
+    }
+    X[1] ^= X[0];
+    X[2] ^= X[1];
+    uint32_t t = 0;
+    for (uint32_t q = 1u << (kSpatialBits - 1); q > 1; q >>= 1) {
+      if (X[2] & q) {
+        t ^= q - 1;
+      }
+    }
+    x = X[0] ^ t;
+    y = X[1] ^ t;
+    z = X[2] ^ t;
+  }
+  return (SpreadBits3(x) << 2) | (SpreadBits3(y) << 1) | SpreadBits3(z);
+}
+
+// Sort faces along the space filling curve by the center of the bounds of
+// their roots, and prims of each face by their root.
+//
+// `roots` has xyz of prims grouped by face(`face_offset`, [numFaces + 1]).
+// `face_order` receives old face indices in the new order, and `prim_order`
+// receives, for each face(at `face_offset[face]`), local prim indices in the
+// new order.
+static void ComputeSpatialOrder(const XPDSpatialOrder order,
+                                const std::vector<float> &roots,
+                                const std::vector<uint32_t> &face_offset,
+                                const bool sort_prims,
+                                const uint32_t num_threads,
+                                std::vector<uint32_t> *face_order,
+                                std::vector<uint32_t> *prim_order) {
+  const size_t num_faces = face_offset.size() - 1;
+  const size_t num_prims = face_offset[num_faces];
+
+  face_order->resize(num_faces);
+  for (size_t f = 0; f < num_faces; f++) {
+    (*face_order)[f] = uint32_t(f);
+  }
+  prim_order->resize(num_prims);
+  for (size_t f = 0; f < num_faces; f++) {
+    for (uint32_t p = face_offset[f]; p < face_offset[f + 1]; p++) {
+      (*prim_order)[p] = p - face_offset[f];
+    }
+  }
+  if (order == XPDSpatialOrderNone) {
+    return;
+  }
+
+  // Bounds of finite roots, and per face bounds.
+  std::vector<float> face_bounds(num_faces * 6);
+  ParallelFor(num_faces, num_threads, [&](size_t begin, size_t end) {
+    for (size_t f = begin; f < end; f++) {
+      float *b = &face_bounds[f * 6];
+      for (int k = 0; k < 3; k++) {
+        b[k] = std::numeric_limits<float>::infinity();
+        b[3 + k] = -std::numeric_limits<float>::infinity();
+      }
+      for (size_t p = face_offset[f]; p < face_offset[f + 1]; p++) {
+        for (int k = 0; k < 3; k++) {
+          const float v = roots[p * 3 + size_t(k)];
+          if (std::isfinite(v)) {
+            b[k] = std::min(b[k], v);
+            b[3 + k] = std::max(b[3 + k], v);
+          }
+        }
+      }
+    }
+  });
+
+  float bmin[3], scale[3];
+  for (int k = 0; k < 3; k++) {
+    float lo = std::numeric_limits<float>::infinity();
+    float hi = -std::numeric_limits<float>::infinity();
+    for (size_t f = 0; f < num_faces; f++) {
+      lo = std::min(lo, face_bounds[f * 6 + size_t(k)]);
+      hi = std::max(hi, face_bounds[f * 6 + 3 + size_t(k)]);
+    }
+    bmin[k] = (lo <= hi) ? lo : 0.0f;
+    scale[k] = (lo < hi) ? float((1u << kSpatialBits) - 1) / (hi - lo) : 0.0f;
+  }
+
+  auto key = [&](const float p[3]) {
+    uint32_t q[3];
+    for (int k = 0; k < 3; k++) {
+      float t = (p[k] - bmin[k]) * scale[k];
+      if (!(t >= 0.0f)) {
+        t = 0.0f;  // Also NaN.
+      }
+      q[k] = uint32_t(std::min(t, float((1u << kSpatialBits) - 1)));
+    }
+    return SpatialCurveKey(order, q[0], q[1], q[2]);
+  };
+
+  std::vector<uint64_t> face_keys(num_faces);
+  ParallelFor(num_faces, num_threads, [&](size_t begin, size_t end) {
+    std::vector<std::pair<uint64_t, uint32_t> > prim_keys;
+    for (size_t f = begin; f < end; f++) {
+      const float *b = &face_bounds[f * 6];
+      if (b[0] > b[3]) {
+        // No prims(or no finite roots). Goes last.
+        face_keys[f] = std::numeric_limits<uint64_t>::max();
+      } else {
+        const float center[3] = {0.5f * (b[0] + b[3]), 0.5f * (b[1] + b[4]),
+                                 0.5f * (b[2] + b[5])};
+        face_keys[f] = key(center);
+      }
+
+      if (!sort_prims) {
+        continue;
+      }
+      const uint32_t first = face_offset[f];
+      const uint32_t n = face_offset[f + 1] - first;
+      prim_keys.resize(n);
+      for (uint32_t p = 0; p < n; p++) {
+        prim_keys[p] =
+            std::make_pair(key(&roots[size_t(first + p) * 3]), p);
+      }
+      std::sort(prim_keys.begin(), prim_keys.end());
+      for (uint32_t p = 0; p < n; p++) {
+        (*prim_order)[first + p] = prim_keys[p].second;
+      }
+    }
+  });
+
+  std::stable_sort(face_order->begin(), face_order->end(),
+                   [&face_keys](const uint32_t a, const uint32_t b) {
+                     return face_keys[a] < face_keys[b];
+                   });
+}
+
+// State referenced by the encode callback of the spline writer.
+struct SplineWriteContext {
+  std::vector<uint32_t> order;       // Curve indices sorted by face.
+  std::vector<uint32_t> faceOffset;  // Index of the first curve of each face
+                                     // in `order`. [numFaces + 1]
+  std::vector<uint64_t> faceCVs;     // The number of CVs in each face.
+                                     // Variable CV count only.
+};
+
+// Validate `soa`, build the header input, serialize options and an encode
+// callback. `ctx` is referenced by the callback.
+static bool PrepareSplineWrite(const XPDSplineSoA &soa,
+                               const std::vector<int> &faceid,
+                               const std::vector<uint32_t> &curve_faces,
+                               const XPDSplineWriteOption &option,
+                               SplineWriteContext *ctx, XPDHeaderInput *input,
+                               XPDParallelSerializeOption *serialize_option,
+                               XPDEncodeBlockCallback *encode,
+                               std::string *err) {
+  const size_t num_curves = soa.numCurves;
+  const uint32_t num_faces = uint32_t(faceid.size());
+  const bool varying = !soa.curveCVOffset.empty();
+  const uint32_t num_cvs = varying ? 2 : soa.numCVsPerCurve;
+
+  if ((num_faces == 0) || (num_cvs == 0)) {
+    if (err) {
+      (*err) += "`faceid` is empty or `numCVsPerCurve` is zero.\n";
+    }
+    return false;
+  }
+
+  if (varying) {
+    const std::vector<uint32_t> &offsets = soa.curveCVOffset;
+    bool valid = (offsets.size() == (num_curves + 1)) && (offsets[0] == 0) &&
+                 (offsets[num_curves] == soa.px.size());
+    for (size_t i = 0; valid && (i < num_curves); i++) {
+      valid = (offsets[i] < offsets[i + 1]);
+    }
+    if (!valid) {
+      if (err) {
+        (*err) += "`curveCVOffset` must be a prefix sum of [numCurves + 1] "
+                  "ending at the number of CVs, and each curve must have at "
+                  "least one CV.\n";
+      }
+      return false;
+    }
+  }
+
+  const size_t total_cvs =
+      varying ? soa.px.size() : num_curves * soa.numCVsPerCurve;
+  if ((soa.px.size() != total_cvs) || (soa.py.size() != total_cvs) ||
+      (soa.pz.size() != total_cvs)) {
+    if (err) {
+      (*err) += "Size of `px`, `py` or `pz` must be numCurves * "
+                "numCVsPerCurve(" +
+                std::to_string(total_cvs) + ").\n";
+    }
+    return false;
+  }
+
+  const std::vector<float> *attribs[10] = {
+      &soa.id,         &soa.u,           &soa.v,
+      &soa.length,     &soa.width,       &soa.taper,
+      &soa.taperStart, &soa.widthVectorX, &soa.widthVectorY,
+      &soa.widthVectorZ};
+  for (size_t a = 0; a < 10; a++) {
+    if (!attribs[a]->empty() && (attribs[a]->size() != num_curves)) {
+      if (err) {
+        (*err) += "Size of per curve attribute must be numCurves(" +
+                  std::to_string(num_curves) + ") or zero.\n";
+      }
+      return false;
+    }
+  }
+
+  if (!curve_faces.empty()) {
+    if (curve_faces.size() != num_curves) {
+      if (err) {
+        (*err) += "Size of `curve_faces` must be numCurves(" +
+                  std::to_string(num_curves) + ").\n";
+      }
+      return false;
+    }
+    if (!SortCurvesByFace(curve_faces, num_faces, option.numThreads,
+                          &ctx->order, &ctx->faceOffset, err)) {
+      return false;
+    }
+  } else {
+    const std::vector<uint32_t> &offsets = soa.faceCurveOffset;
+    bool valid = (offsets.size() == (size_t(num_faces) + 1)) &&
+                 (offsets[0] == 0) && (offsets[num_faces] == num_curves);
+    for (size_t f = 0; valid && (f < num_faces); f++) {
+      valid = (offsets[f] <= offsets[f + 1]);
+    }
+    if (!valid) {
+      if (err) {
+        (*err) += "`faceCurveOffset` must be a prefix sum of [numFaces + 1] "
+                  "ending at numCurves when `curve_faces` is empty.\n";
+      }
+      return false;
+    }
+    ctx->faceOffset = offsets;
+    ctx->order.resize(num_curves);
+    for (size_t i = 0; i < num_curves; i++) {
+      ctx->order[i] = uint32_t(i);
+    }
+  }
+
+  // Sort faces and curves in each face along a space filling curve of root
+  // CVs.
+  std::vector<int> sorted_faceid = faceid;
+  if (option.spatialOrder != XPDSpatialOrderNone) {
+    std::vector<float> roots(num_curves * 3);
+    ParallelFor(num_curves, option.numThreads, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        const size_t c = ctx->order[i];
+        const size_t first =
+            varying ? soa.curveCVOffset[c] : c * soa.numCVsPerCurve;
+        roots[i * 3 + 0] = soa.px[first];
+        roots[i * 3 + 1] = soa.py[first];
+        roots[i * 3 + 2] = soa.pz[first];
+      }
+    });
+
+    std::vector<uint32_t> face_order, prim_order;
+    ComputeSpatialOrder(option.spatialOrder, roots, ctx->faceOffset, true,
+                        option.numThreads, &face_order, &prim_order);
+
+    std::vector<uint32_t> order(num_curves);
+    std::vector<uint32_t> face_offset(size_t(num_faces) + 1);
+    uint32_t sum = 0;
+    for (size_t i = 0; i < num_faces; i++) {
+      const uint32_t f = face_order[i];
+      const uint32_t first = ctx->faceOffset[f];
+      face_offset[i] = sum;
+      sorted_faceid[i] = faceid[f];
+      for (uint32_t p = first; p < ctx->faceOffset[f + 1]; p++) {
+        order[sum++] = ctx->order[first + prim_order[p]];
+      }
+    }
+    face_offset[num_faces] = sum;
+    ctx->order.swap(order);
+    ctx->faceOffset.swap(face_offset);
+  }
+
+  XPDSplineLayout layout(num_cvs);
+
+  input->primType = Xpd::PrimType::Spline;
+  input->primVersion = 3;
+  input->time = option.time;
+  input->numCVs = num_cvs;
+  input->coordSpace = option.coordSpace;
+  input->numFaces = num_faces;
+  input->numBlocks = 1;
+  input->block.assign(1, option.blockName);
+  input->primSize.assign(1, layout.size);
+  input->faceid.swap(sorted_faceid);
+  input->numPrims.resize(num_faces);
+  for (size_t f = 0; f < num_faces; f++) {
+    input->numPrims[f] = ctx->faceOffset[f + 1] - ctx->faceOffset[f];
+  }
+
+  serialize_option->numThreads = option.numThreads;
+
+  if (varying) {
+    input->numBlocks = 2;
+    input->block.push_back(VaryingCVBlockName(option.blockName));
+    input->primSize.push_back(2);
+
+    ctx->faceCVs.assign(num_faces, 0);
+    ParallelFor(num_faces, option.numThreads, [&](size_t begin, size_t end) {
+      for (size_t f = begin; f < end; f++) {
+        for (uint32_t p = ctx->faceOffset[f]; p < ctx->faceOffset[f + 1];
+             p++) {
+          const uint32_t c = ctx->order[p];
+          ctx->faceCVs[f] += soa.curveCVOffset[c + 1] - soa.curveCVOffset[c];
+        }
+      }
+    });
+
+    // Packed CVs follow the CV count/offset table.
+    serialize_option->extraBlockSize = [ctx](uint32_t face,
+                                             uint32_t block_id) {
+      return (block_id == 1) ? ctx->faceCVs[face] * 3 * sizeof(float)
+                             : uint64_t(0);
+    };
+  }
+
+  const EncodeCVsAoSFunc encode_cvs = SelectEncodeCVsAoS(GetSIMDLevel());
+
+  (*encode) = [&soa, ctx, layout, varying, encode_cvs](
+                  uint32_t face, uint32_t block_id, uint8_t *dst,
+                  std::string *) {
+    const uint32_t begin = ctx->faceOffset[face];
+    const uint32_t end = ctx->faceOffset[face + 1];
+
+    if (block_id == 1) {
+      // CV count/offset table, then packed CVs.
+      uint8_t *cvs = dst + size_t(end - begin) * 2 * sizeof(uint32_t);
+      uint32_t offset = 0;
+      for (uint32_t p = begin; p < end; p++) {
+        const size_t c = ctx->order[p];
+        const uint32_t first = soa.curveCVOffset[c];
+        const uint32_t table[2] = {soa.curveCVOffset[c + 1] - first, offset};
+        memcpy(dst + (p - begin) * sizeof(table), table, sizeof(table));
+        encode_cvs(&soa.px[first], &soa.py[first], &soa.pz[first], table[0],
+                   cvs + size_t(offset) * 3 * sizeof(float));
+        offset += table[0];
+      }
+      return true;
+    }
+
+    const size_t stride = layout.size * sizeof(float);
+    for (uint32_t p = begin; p < end; p++, dst += stride) {
+      const size_t c = ctx->order[p];
+      const size_t first =
+          varying ? soa.curveCVOffset[c] : c * layout.numCVs;
+      const uint32_t n =
+          varying ? uint32_t(soa.curveCVOffset[c + 1] - first) : layout.numCVs;
+      const float *x = &soa.px[first];
+      const float *y = &soa.py[first];
+      const float *z = &soa.pz[first];
+
+      const float length =
+          soa.length.empty() ? PolylineLength(x, y, z, n) : soa.length[c];
+
+      const float head[3] = {
+          soa.id.empty() ? float(p - begin) : soa.id[c],
+          soa.u.empty() ? 0.0f : soa.u[c], soa.v.empty() ? 0.0f : soa.v[c]};
+      const float tail[7] = {
+          length,
+          soa.width.empty() ? 1.0f : soa.width[c],
+          soa.taper.empty() ? 0.0f : soa.taper[c],
+          soa.taperStart.empty() ? 0.0f : soa.taperStart[c],
+          soa.widthVectorX.empty() ? 0.0f : soa.widthVectorX[c],
+          soa.widthVectorY.empty() ? 0.0f : soa.widthVectorY[c],
+          soa.widthVectorZ.empty() ? 0.0f : soa.widthVectorZ[c]};
+
+      memcpy(dst + layout.id * sizeof(float), head, sizeof(head));
+      if (varying) {
+        // Root and tip CVs for readers which ignore the extension.
+        const float cvs[6] = {x[0],     y[0],     z[0],
+                              x[n - 1], y[n - 1], z[n - 1]};
+        memcpy(dst + layout.cv * sizeof(float), cvs, sizeof(cvs));
+      } else {
+        encode_cvs(x, y, z, n, dst + layout.cv * sizeof(float));
+      }
+      memcpy(dst + layout.length * sizeof(float), tail, sizeof(tail));
+    }
+    return true;
+  };
+
+  return true;
+}
+
+bool WriteSplineXPDFromSoA(const XPDSplineSoA &soa,
+                           const std::vector<int> &faceid,
+                           const std::vector<uint32_t> &curve_faces,
+                           const XPDSplineWriteOption &option,
+                           std::vector<uint8_t> *xpd_binary,
+                           std::string *err) {
+  SplineWriteContext ctx;
+  XPDHeaderInput input;
+  XPDParallelSerializeOption serialize_option;
+  XPDEncodeBlockCallback encode;
+  if (!PrepareSplineWrite(soa, faceid, curve_faces, option, &ctx, &input,
+                          &serialize_option, &encode, err)) {
+    return false;
+  }
+
+  return SerializeToXPDParallel(input, encode, serialize_option, xpd_binary,
+                                err);
+}
+
+bool WriteSplineXPDFileFromSoA(const XPDSplineSoA &soa,
+                               const std::vector<int> &faceid,
+                               const std::vector<uint32_t> &curve_faces,
+                               const XPDSplineWriteOption &option,
+                               const std::string &filename, std::string *err) {
+  SplineWriteContext ctx;
+  XPDHeaderInput input;
+  XPDParallelSerializeOption serialize_option;
+  XPDEncodeBlockCallback encode;
+  if (!PrepareSplineWrite(soa, faceid, curve_faces, option, &ctx, &input,
+                          &serialize_option, &encode, err)) {
+    return false;
+  }
+
+  return SerializeToXPDFileParallel(input, encode, serialize_option, filename,
+                                    err);
+}
+
+bool TransformSplineXPD(const XPDHeader &xpd, const uint8_t *binary,
+                        const size_t binary_length, const uint32_t block_id,
+                        const XPDTransform &transform,
+                        const Xpd::CoordSpace coord_space,
+                        const uint32_t num_threads,
+                        std::vector<uint8_t> *xpd_binary, std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileTransformSplineXPD);
+
+  if (!xpd_binary) {
+    if (err) {
+      (*err) += "`xpd_binary` argument is null.\n";
+    }
+    return false;
+  }
+
+  if ((xpd.coordSpace == Xpd::CoordSpace::Local) &&
+      (coord_space != Xpd::CoordSpace::Local) &&
+      transform.faceMatrices.empty()) {
+    if (err) {
+      (*err) += "CVs are in Local space. `transform.faceMatrices` is "
+                "required.\n";
+    }
+    return false;
+  }
+
+  XPDSplineLayout layout;
+  if (!GetSplineLayout(xpd, block_id, &layout, err)) {
+    return false;
+  }
+
+  // Transformed CVs, width vectors and widths.
+  XPDSplineSoAOption soa_option;
+  soa_option.numThreads = num_threads;
+  soa_option.transform = transform;
+  XPDSplineSoA soa;
+  if (!ExtractSplineSoA(xpd, binary, binary_length, block_id, soa_option,
+                        &soa, err)) {
+    return false;
+  }
+
+  const bool varying = !soa.curveCVOffset.empty();
+  std::vector<XPDBlockView> views(xpd.numFaces);
+  std::vector<XPDVaryingCVView> cv_views(varying ? xpd.numFaces : 0);
+  for (uint32_t f = 0; f < xpd.numFaces; f++) {
+    if (!GetBlockView(xpd, binary, binary_length, f, block_id, &views[f],
+                      err) ||
+        (varying && !GetVaryingCVView(xpd, binary, binary_length, f, block_id,
+                                      &cv_views[f], err))) {
+      return false;
+    }
+  }
+
+  // Copy XPD data and overwrite CVs, width vectors, widths and lengths of the
+  // block in place. Other blocks, channels and bytes are kept.
+  xpd_binary->assign(binary, binary + binary_length);
+  uint8_t *out = xpd_binary->data();
+
+  // magic(4) fileVersion(1) primType(4) primVersion(1) time(4) numCVs(4)
+  const size_t kCoordSpaceOffset = 18;
+  const uint32_t space = uint32_t(coord_space);
+  memcpy(out + kCoordSpaceOffset, &space, sizeof(uint32_t));
+
+  const EncodeCVsAoSFunc encode_cvs = SelectEncodeCVsAoS(GetSIMDLevel());
+  ParallelFor(xpd.numFaces, num_threads, [&](size_t begin, size_t end) {
+    for (size_t f = begin; f < end; f++) {
+      const XPDBlockView &view = views[f];
+      uint8_t *prims = out + (view.data - binary);
+      for (size_t p = 0; p < view.numPrims; p++) {
+        const size_t c = soa.faceCurveOffset[f] + p;
+        const size_t first = varying ? soa.curveCVOffset[c] : c * layout.numCVs;
+        const uint32_t n =
+            varying ? uint32_t(soa.curveCVOffset[c + 1] - first)
+                    : layout.numCVs;
+        const float *x = &soa.px[first];
+        const float *y = &soa.py[first];
+        const float *z = &soa.pz[first];
+        uint8_t *dst = prims + p * view.stride();
+
+        if (varying) {
+          // Root and tip CVs in the block, all CVs in the extension.
+          const float cvs[6] = {x[0],     y[0],     z[0],
+                                x[n - 1], y[n - 1], z[n - 1]};
+          memcpy(dst + layout.cv * sizeof(float), cvs, sizeof(cvs));
+          encode_cvs(x, y, z, n, out + (cv_views[f].cvData(p) - binary));
+        } else {
+          encode_cvs(x, y, z, n, dst + layout.cv * sizeof(float));
+        }
+
+        // Lengths are recomputed from transformed CVs.
+        const float length = PolylineLength(x, y, z, n);
+        const float width_vector[3] = {soa.widthVectorX[c],
+                                       soa.widthVectorY[c],
+                                       soa.widthVectorZ[c]};
+        memcpy(dst + layout.length * sizeof(float), &length, sizeof(float));
+        memcpy(dst + layout.width * sizeof(float), &soa.width[c],
+               sizeof(float));
+        memcpy(dst + layout.widthVector * sizeof(float), width_vector,
+               sizeof(width_vector));
+      }
+    }
+  });
+
+  return true;
+}
+
+// ---------------------------------------------
+// Spatial reorder.
+
+// State referenced by the encode callback of `ReorderXPD` and
+// `RebindSplineXPD`. Each new face gathers whole prim records(all blocks,
+// including channels and CVs of the variable CV count extension) from old
+// faces.
+struct ReorderContext {
+  uint32_t numBlocks;
+  std::vector<XPDBlockView> views;    // Old blocks. [numFaces * numBlocks]
+  std::vector<bool> varyingCVBlock;   // [numBlocks]
+  std::vector<uint32_t> srcOffset;    // Index of the first prim of each new
+                                      // face. [numNewFaces + 1]
+  std::vector<uint32_t> srcFace;      // Old face of each new prim.
+  std::vector<uint32_t> srcPrim;      // Old local prim index of each new prim.
+  std::vector<uint64_t> extra;        // CV bytes after prims of each new
+                                      // block. [numNewFaces * numBlocks]
+
+  // u/v of each new prim written to spline block `uvBlock`(rebind only).
+  std::vector<float> uv;
+  uint32_t uvBlock;
+  XPDSplineLayout uvLayout;
+
+  ReorderContext() : numBlocks(0), uvBlock(0) {}
+};
+
+// Get views of all blocks of `xpd` and validate CVs of the variable CV count
+// extension. `prim_offset` receives the index of the first prim of each old
+// face. [numFaces + 1]
+static bool PrepareReorderViews(const XPDHeader &xpd, const uint8_t *binary,
+                                const size_t binary_length,
+                                ReorderContext *ctx,
+                                std::vector<uint32_t> *prim_offset,
+                                std::string *err) {
+  const uint32_t num_faces = xpd.numFaces;
+  const uint32_t num_blocks = xpd.numBlocks;
+  const size_t num_views = size_t(num_faces) * num_blocks;
+  if ((xpd.numPrims.size() != num_faces) ||
+      (xpd.faceid.size() != num_faces) ||
+      (xpd.blockPosition.size() != num_views)) {
+    if (err) {
+      (*err) += "Inconsistent XPD header.\n";
+    }
+    return false;
+  }
+
+  ctx->numBlocks = num_blocks;
+  ctx->views.resize(num_views);
+  prim_offset->resize(size_t(num_faces) + 1);
+  uint32_t num_prims = 0;
+  for (uint32_t f = 0; f < num_faces; f++) {
+    for (uint32_t b = 0; b < num_blocks; b++) {
+      if (!GetBlockView(xpd, binary, binary_length, f, b,
+                        &ctx->views[size_t(f) * num_blocks + b], err)) {
+        return false;
+      }
+    }
+    (*prim_offset)[f] = num_prims;
+    num_prims += xpd.numPrims[f];
+  }
+  (*prim_offset)[num_faces] = num_prims;
+
+  // Extent of a block is `numPrims * primSize * 4` bytes, plus CVs for the
+  // variable CV count extension. CVs are repacked in prim order.
+  ctx->varyingCVBlock.assign(num_blocks, false);
+  for (uint32_t b = 0; b < num_blocks; b++) {
+    uint32_t ext_block_id;
+    if (FindVaryingCVBlock(xpd, b, &ext_block_id)) {
+      ctx->varyingCVBlock[ext_block_id] = true;
+    }
+  }
+  for (size_t idx = 0; idx < num_views; idx++) {
+    if (!ctx->varyingCVBlock[idx % num_blocks]) {
+      continue;
+    }
+    const XPDBlockView &view = ctx->views[idx];
+    const uint64_t prims_end =
+        uint64_t(view.data - binary) + view.numPrims * view.stride();
+    const uint64_t available = uint64_t(binary_length) - prims_end;
+    XPDVaryingCVView cvs;
+    cvs.table = view.data;
+    for (size_t p = 0; p < view.numPrims; p++) {
+      const uint64_t end = uint64_t(cvs.offset(p)) + cvs.count(p);
+      if (end * 3 * sizeof(float) > available) {
+        if (err) {
+          (*err) += "CVs of face " + std::to_string(idx / num_blocks) +
+                    ", block " + std::to_string(idx % num_blocks) +
+                    " exceed XPD data.\n";
+        }
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+// Copy header fields other than faces from `xpd`.
+static void CopyReorderHeader(const XPDHeader &xpd, XPDHeaderInput *input) {
+  input->fileVersion = xpd.fileVersion;
+  input->primType = xpd.primType;
+  input->primVersion = xpd.primVersion;
+  input->time = xpd.time;
+  input->numCVs = xpd.numCVs;
+  input->coordSpace = xpd.coordSpace;
+  input->numBlocks = xpd.numBlocks;
+  input->block = xpd.block;
+  input->primSize = xpd.primSize;
+  input->key = xpd.key;
+  input->keyToId = xpd.keyToId;
+}
+
+// Compute CV bytes of new blocks from `srcOffset/srcFace/srcPrim`, and build
+// serialize options and an encode callback gathering prim records. `ctx` is
+// referenced by the callbacks.
+static void SetReorderCallbacks(ReorderContext *ctx,
+                                const uint32_t num_threads,
+                                XPDParallelSerializeOption *serialize_option,
+                                XPDEncodeBlockCallback *encode) {
+  const uint32_t num_blocks = ctx->numBlocks;
+  const size_t num_new_faces = ctx->srcOffset.size() - 1;
+  ctx->extra.assign(num_new_faces * num_blocks, 0);
+  for (size_t f = 0; f < num_new_faces; f++) {
+    for (uint32_t b = 0; b < num_blocks; b++) {
+      if (!ctx->varyingCVBlock[b]) {
+        continue;
+      }
+      uint64_t total = 0;
+      for (uint32_t i = ctx->srcOffset[f]; i < ctx->srcOffset[f + 1]; i++) {
+        XPDVaryingCVView cvs;
+        cvs.table = ctx->views[size_t(ctx->srcFace[i]) * num_blocks + b].data;
+        total += cvs.count(ctx->srcPrim[i]);
+      }
+      ctx->extra[f * num_blocks + b] = total * 3 * sizeof(float);
+    }
+  }
+
+  serialize_option->numThreads = num_threads;
+  serialize_option->extraBlockSize = [ctx](uint32_t face, uint32_t block_id) {
+    return ctx->extra[size_t(face) * ctx->numBlocks + block_id];
+  };
+
+  (*encode) = [ctx](uint32_t face, uint32_t block_id, uint8_t *dst,
+                    std::string *) {
+    const uint32_t begin = ctx->srcOffset[face];
+    const size_t n = ctx->srcOffset[face + 1] - begin;
+    const size_t stride = ctx->views[block_id].stride();
+
+    for (size_t p = 0; p < n; p++) {
+      const XPDBlockView &view =
+          ctx->views[size_t(ctx->srcFace[begin + p]) * ctx->numBlocks +
+                     block_id];
+      memcpy(dst + p * stride,
+             view.data + size_t(ctx->srcPrim[begin + p]) * stride, stride);
+    }
+
+    if (ctx->varyingCVBlock[block_id]) {
+      // Rewrite CV offsets of the table copied above and repack CVs.
+      uint8_t *cvs = dst + n * stride;
+      uint32_t offset = 0;
+      for (size_t p = 0; p < n; p++) {
+        const XPDBlockView &view =
+            ctx->views[size_t(ctx->srcFace[begin + p]) * ctx->numBlocks +
+                       block_id];
+        XPDVaryingCVView src;
+        src.table = view.data;
+        src.cvs = view.data + view.numPrims * stride;
+        const uint32_t prim = ctx->srcPrim[begin + p];
+        const uint32_t count = src.count(prim);
+        memcpy(dst + p * stride + sizeof(uint32_t), &offset,
+               sizeof(uint32_t));
+        memcpy(cvs + size_t(offset) * 3 * sizeof(float), src.cvData(prim),
+               size_t(count) * 3 * sizeof(float));
+        offset += count;
+      }
+    }
+
+    if (!ctx->uv.empty() && (block_id == ctx->uvBlock)) {
+      for (size_t p = 0; p < n; p++) {
+        uint8_t *prim = dst + p * stride;
+        memcpy(prim + ctx->uvLayout.u * sizeof(float),
+               &ctx->uv[2 * (begin + p) + 0], sizeof(float));
+        memcpy(prim + ctx->uvLayout.v * sizeof(float),
+               &ctx->uv[2 * (begin + p) + 1], sizeof(float));
+      }
+    }
+    return true;
+  };
+}
+
+// Validate `xpd`, compute the new order, and build the header input,
+// serialize options and an encode callback. `ctx` is referenced by the
+// callback.
+static bool PrepareReorder(const XPDHeader &xpd, const uint8_t *binary,
+                           const size_t binary_length,
+                           const XPDReorderOption &option,
+                           ReorderContext *ctx, XPDHeaderInput *input,
+                           XPDParallelSerializeOption *serialize_option,
+                           XPDEncodeBlockCallback *encode, std::string *err) {
+  XPDSplineLayout layout;
+  if (!GetSplineLayout(xpd, option.blockId, &layout, err)) {
+    return false;
+  }
+
+  std::vector<uint32_t> prim_offset;
+  if (!PrepareReorderViews(xpd, binary, binary_length, ctx, &prim_offset,
+                           err)) {
+    return false;
+  }
+
+  const uint32_t num_faces = xpd.numFaces;
+  const uint32_t num_blocks = xpd.numBlocks;
+  const uint32_t num_prims = prim_offset[num_faces];
+
+  std::vector<float> roots(size_t(num_prims) * 3);
+  ParallelFor(num_faces, option.numThreads, [&](size_t begin, size_t end) {
+    for (size_t f = begin; f < end; f++) {
+      const XPDBlockView &view = ctx->views[f * num_blocks + option.blockId];
+      float *dst = &roots[size_t(prim_offset[f]) * 3];
+      for (size_t p = 0; p < view.numPrims; p++) {
+        for (uint32_t k = 0; k < 3; k++) {
+          dst[p * 3 + k] = view.get(p, layout.cv + k);
+        }
+      }
+    }
+  });
+
+  std::vector<uint32_t> face_order, prim_order;
+  ComputeSpatialOrder(option.order, roots, prim_offset, option.sortPrims,
+                      option.numThreads, &face_order, &prim_order);
+
+  CopyReorderHeader(xpd, input);
+  input->numFaces = num_faces;
+  input->faceid.resize(num_faces);
+  input->numPrims.resize(num_faces);
+  ctx->srcOffset.resize(size_t(num_faces) + 1);
+  ctx->srcFace.resize(num_prims);
+  ctx->srcPrim.resize(num_prims);
+  uint32_t i = 0;
+  for (uint32_t f = 0; f < num_faces; f++) {
+    const uint32_t old_face = face_order[f];
+    input->faceid[f] = xpd.faceid[old_face];
+    input->numPrims[f] = xpd.numPrims[old_face];
+    ctx->srcOffset[f] = i;
+    for (uint32_t p = 0; p < xpd.numPrims[old_face]; p++, i++) {
+      ctx->srcFace[i] = old_face;
+      ctx->srcPrim[i] = prim_order[prim_offset[old_face] + p];
+    }
+  }
+  ctx->srcOffset[num_faces] = i;
+
+  SetReorderCallbacks(ctx, option.numThreads, serialize_option, encode);
+  return true;
+}
+
+bool ReorderXPD(const XPDHeader &xpd, const uint8_t *binary,
+                const size_t binary_length, const XPDReorderOption &option,
+                std::vector<uint8_t> *xpd_binary, std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileReorderXPD);
+
+  ReorderContext ctx;
+  XPDHeaderInput input;
+  XPDParallelSerializeOption serialize_option;
+  XPDEncodeBlockCallback encode;
+  if (!PrepareReorder(xpd, binary, binary_length, option, &ctx, &input,
+                      &serialize_option, &encode, err)) {
+    return false;
+  }
+
+  return SerializeToXPDParallel(input, encode, serialize_option, xpd_binary,
+                                err);
+}
+
+bool ReorderXPDFile(const XPDHeader &xpd, const uint8_t *binary,
+                    const size_t binary_length,
+                    const XPDReorderOption &option,
+                    const std::string &filename, std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileReorderXPD);
+
+  ReorderContext ctx;
+  XPDHeaderInput input;
+  XPDParallelSerializeOption serialize_option;
+  XPDEncodeBlockCallback encode;
+  if (!PrepareReorder(xpd, binary, binary_length, option, &ctx, &input,
+                      &serialize_option, &encode, err)) {
+    return false;
+  }
+
+  return SerializeToXPDFileParallel(input, encode, serialize_option, filename,
+                                    err);
+}
+
+// ---------------------------------------------
+// Shared XPD file handle.
+
+bool XPDFile::blockView(const uint32_t face, const uint32_t block_id,
+                        XPDBlockView *view, std::string *err) const {
+  return GetBlockView(header_, data_, size_, face, block_id, view, err);
+}
+
+bool XPDFile::findChannel(const std::string &block, const std::string &name,
+                          XPDChannel *channel) const {
+  return FindChannel(header_, block, name, channel);
+}
+
+bool XPDFile::channelView(const uint32_t face, const XPDChannel &channel,
+                          XPDChannelView *view, std::string *err) const {
+  return GetChannelView(header_, data_, size_, face, channel, view, err);
+}
+
+bool XPDFile::varyingCVView(const uint32_t face, const uint32_t block_id,
+                            XPDVaryingCVView *view, std::string *err) const {
+  return GetVaryingCVView(header_, data_, size_, face, block_id, view, err);
+}
+
+bool XPDFile::extractSplineSoA(const uint32_t block_id,
+                               const XPDSplineSoAOption &option,
+                               XPDSplineSoA *soa, std::string *err) const {
+  return ExtractSplineSoA(header_, data_, size_, block_id, option, soa, err);
+}
+
+bool XPDFile::extractCurveBuffers(const uint32_t block_id,
+                                  const XPDCurveBufferOption &option,
+                                  XPDCurveBuffers *buffers,
+                                  std::string *err) const {
+  return ExtractCurveBuffers(header_, data_, size_, block_id, option, buffers,
+                             err);
+}
+
+bool OpenXPDFile(const std::string &filename,
+                 std::shared_ptr<const XPDFile> *file, std::string *err) {
+  if (!file) {
+    if (err) {
+      (*err) += "`file` argument is null.\n";
+    }
+    return false;
+  }
+
+  XPDMappedFile mapped;
+  if (!mapped.open(filename, err)) {
+    return false;
+  }
+
+  return CreateXPDFileFromMapping(&mapped, file, err);
+}
+
+bool CreateXPDFileFromMemory(std::vector<uint8_t> *data,
+                             std::shared_ptr<const XPDFile> *file,
+                             std::string *err) {
+  if (!data || !file) {
+    if (err) {
+      (*err) += "`data` or `file` argument is null.\n";
+    }
+    return false;
+  }
+
+  std::shared_ptr<XPDFile> f(new XPDFile());
+  if (!ParseXPDHeaderFromMemory(data->data(), data->size(), &f->header_,
+                                err)) {
+    return false;
+  }
+
+  f->buffer_.swap(*data);
+  f->data_ = f->buffer_.data();
+  f->size_ = f->buffer_.size();
+
+  (*file) = f;
+  return true;
+}
+
+bool CreateXPDFileFromMapping(XPDMappedFile *mapped,
+                              std::shared_ptr<const XPDFile> *file,
+                              std::string *err) {
+  if (!mapped || !file) {
+    if (err) {
+      (*err) += "`mapped` or `file` argument is null.\n";
+    }
+    return false;
+  }
+
+  std::shared_ptr<XPDFile> f(new XPDFile());
+  if (!ParseXPDHeaderFromMemory(mapped->data(), mapped->size(), &f->header_,
+                                err)) {
+    return false;
+  }
+
+  f->file_ = std::move(*mapped);
+  f->data_ = f->file_.data();
+  f->size_ = f->file_.size();
+
+  (*file) = f;
+  return true;
+}
+
+// ---------------------------------------------
+// Decode cache.
+//
+// Entry file layout(little endian):
+//   magic "XPDC"(4) version(4) content(8) params(8) numSections(4)
+//   reserved(4)
+//   Section table [numSections]: name(32, NUL padded) offset(8) size(8)
+//   Section data, each aligned to `kCacheAlignment` bytes.
+//
+// Entry files are named <content hex><params hex>.xpdc.
+
+// 2: widths and radii are scaled by `transform`.
+static const uint32_t kCacheVersion = 2;
+static const size_t kCacheHeaderSize = 32;
+static const size_t kCacheNameSize = 32;
+static const size_t kCacheSectionEntrySize = kCacheNameSize + 16;
+static const uint64_t kCacheAlignment = 64;
+static const size_t kContentHashChunkSize = 4 * 1024 * 1024;
+
+// Temporary files older than this(e.g. left by a crashed process) are
+// removed when a cache is opened.
+static const uint64_t kCacheStaleTempNanoseconds = 3600ull * 1000000000ull;
+
+static const uint64_t kXXH64Prime1 = 0x9E3779B185EBCA87ull;
+static const uint64_t kXXH64Prime2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64_t kXXH64Prime3 = 0x165667B19E3779F9ull;
+static const uint64_t kXXH64Prime4 = 0x85EBCA77C2B2AE63ull;
+static const uint64_t kXXH64Prime5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64_t Rotl64(const uint64_t x, const int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t XXH64Round(uint64_t acc, const uint64_t input) {
+  acc += input * kXXH64Prime2;
+  acc = Rotl64(acc, 31);
+  return acc * kXXH64Prime1;
+}
+
+static inline uint64_t XXH64MergeRound(uint64_t acc, const uint64_t val) {
+  acc ^= XXH64Round(0, val);
+  return acc * kXXH64Prime1 + kXXH64Prime4;
+}
+
+static inline uint64_t ReadU64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(uint64_t));
+  return v;
+}
+
+static inline uint32_t ReadU32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(uint32_t));
+  return v;
+}
+
+uint64_t XPDHash64(const uint8_t *data, const size_t length,
+                   const uint64_t seed) {
+  const uint8_t *p = data;
+  const uint8_t *end = data + length;
+  uint64_t h;
+
+  if (length >= 32) {
+    uint64_t v1 = seed + kXXH64Prime1 + kXXH64Prime2;
+    uint64_t v2 = seed + kXXH64Prime2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - kXXH64Prime1;
+    const uint8_t *limit = end - 32;
+    do {
+      v1 = XXH64Round(v1, ReadU64(p));
+      v2 = XXH64Round(v2, ReadU64(p + 8));
+      v3 = XXH64Round(v3, ReadU64(p + 16));
+      v4 = XXH64Round(v4, ReadU64(p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = Rotl64(v1, 1) + Rotl64(v2, 7) + Rotl64(v3, 12) + Rotl64(v4, 18);
+    h = XXH64MergeRound(h, v1);
+    h = XXH64MergeRound(h, v2);
+    h = XXH64MergeRound(h, v3);
+    h = XXH64MergeRound(h, v4);
+  } else {
+    h = seed + kXXH64Prime5;
+  }
+
+  h += uint64_t(length);
+
+  while (p + 8 <= end) {
+    h ^= XXH64Round(0, ReadU64(p));
+    h = Rotl64(h, 27) * kXXH64Prime1 + kXXH64Prime4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= uint64_t(ReadU32(p)) * kXXH64Prime1;
+    h = Rotl64(h, 23) * kXXH64Prime2 + kXXH64Prime3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= uint64_t(*p) * kXXH64Prime5;
+    h = Rotl64(h, 11) * kXXH64Prime1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= kXXH64Prime2;
+  h ^= h >> 29;
+  h *= kXXH64Prime3;
+  h ^= h >> 32;
+  return h;
+}
+
+uint64_t XPDContentHash(const uint8_t *data, const size_t length,
+                        const uint32_t num_threads) {
+  const size_t num_chunks =
+      (length + kContentHashChunkSize - 1) / kContentHashChunkSize;
+  std::vector<uint64_t> hashes(num_chunks);
+
+  ParallelFor(num_chunks, num_threads, [&](size_t begin, size_t end) {
+    for (size_t c = begin; c < end; c++) {
+      const size_t offset = c * kContentHashChunkSize;
+      const size_t n = std::min(kContentHashChunkSize, length - offset);
+      hashes[c] = XPDHash64(data + offset, n, uint64_t(c));
+    }
+  });
+
+  return XPDHash64(reinterpret_cast<const uint8_t *>(hashes.data()),
+                   hashes.size() * sizeof(uint64_t), uint64_t(length));
+}
+
+XPDCacheKey MakeXPDCacheKey(const uint64_t content_hash,
+                            const std::string &kind, const uint8_t *params,
+                            const size_t params_length) {
+  XPDCacheKey key;
+  key.content = content_hash;
+  const uint64_t seed =
+      XPDHash64(reinterpret_cast<const uint8_t *>(kind.data()), kind.size(),
+                uint64_t(kCacheVersion));
+  key.params = XPDHash64(params, params_length, seed);
+  return key;
+}
+
+static std::string CacheFileName(const XPDCacheKey &key) {
+  std::stringstream ss;
+  ss << std::hex << std::setfill('0') << std::setw(16) << key.content
+     << std::setw(16) << key.params << ".xpdc";
+  return ss.str();
+}
+
+static bool IsCacheFileName(const std::string &name) {
+  return (name.size() == 37) && (name.compare(32, 5, ".xpdc") == 0);
+}
+
+static bool IsCacheTempFileName(const std::string &name) {
+  return (name.size() > 42) && (name.compare(32, 10, ".xpdc.tmp.") == 0);
+}
+
+bool XPDCacheEntry::section(const std::string &name, const uint8_t **data,
+                            uint64_t *size) const {
+  for (size_t i = 0; i < sections_.size(); i++) {
+    if (sections_[i].name == name) {
+      if (data) {
+        (*data) = file_.data() + sections_[i].offset;
+      }
+      if (size) {
+        (*size) = sections_[i].size;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+XPDDecodeCache::XPDDecodeCache() : max_bytes_(0) {}
+
+XPDDecodeCache::~XPDDecodeCache() { close(); }
+
+void XPDDecodeCache::close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  directory_.clear();
+  max_bytes_ = 0;
+  lru_.clear();
+  items_.clear();
+  stats_ = XPDDecodeCacheStats();
+}
+
+std::string XPDDecodeCache::path(const std::string &name) const {
+  return directory_ + "/" + name;
+}
+
+void XPDDecodeCache::insert(const std::string &name, const uint64_t size) {
+  erase(name);
+  Item item;
+  item.name = name;
+  item.size = size;
+  lru_.push_front(item);
+  items_[name] = lru_.begin();
+  stats_.totalBytes += size;
+  stats_.numEntries++;
+}
+
+void XPDDecodeCache::erase(const std::string &name) {
+  auto it = items_.find(name);
+  if (it == items_.end()) {
+    return;
+  }
+  stats_.totalBytes -= it->second->size;
+  stats_.numEntries--;
+  lru_.erase(it->second);
+  items_.erase(it);
+}
+
+void XPDDecodeCache::evict(const std::string &keep) {
+  if (max_bytes_ == 0) {
+    return;
+  }
+  while ((stats_.totalBytes > max_bytes_) && !lru_.empty()) {
+    const std::string name = lru_.back().name;
+    if (name == keep) {
+      break;
+    }
+    // Mapped entries stay valid after the file is removed on POSIX. On
+    // Windows removal fails while mapped, and the file is picked up again
+    // on the next `open`.
+    std::remove(path(name).c_str());
+    erase(name);
+    stats_.evictions++;
+  }
+}
+
+struct CacheDirEntry {
+  std::string name;
+  uint64_t size;
+  uint64_t mtime;  // Nanoseconds since epoch.
+};
+
+#if defined(_WIN32)
+
+static uint64_t FileTimeToNanoseconds(const FILETIME &ft) {
+  const uint64_t t =
+      (uint64_t(ft.dwHighDateTime) << 32) | uint64_t(ft.dwLowDateTime);
+  // 100ns intervals since 1601 -> nanoseconds since 1970.
+  return (t - 116444736000000000ull) * 100ull;
+}
+
+static bool ListCacheDirectory(const std::string &directory,
+                               std::vector<CacheDirEntry> *entries,
+                               std::string *err) {
+  WIN32_FIND_DATAA fd;
+  HANDLE h = FindFirstFileA((directory + "\\*").c_str(), &fd);
+  if (h == INVALID_HANDLE_VALUE) {
+    if (err) {
+      (*err) += "Failed to list a directory: " + directory + "\n";
+    }
+    return false;
+  }
+  do {
+    if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+      continue;
+    }
+    CacheDirEntry e;
+    e.name = fd.cFileName;
+    e.size = (uint64_t(fd.nFileSizeHigh) << 32) | uint64_t(fd.nFileSizeLow);
+    e.mtime = FileTimeToNanoseconds(fd.ftLastWriteTime);
+    entries->push_back(e);
+  } while (FindNextFileA(h, &fd));
+  FindClose(h);
+  return true;
+}
+
+static bool MakeCacheDirectory(const std::string &directory) {
+  const DWORD attr = GetFileAttributesA(directory.c_str());
+  if (attr != INVALID_FILE_ATTRIBUTES) {
+    return (attr & FILE_ATTRIBUTE_DIRECTORY) != 0;
+  }
+  return CreateDirectoryA(directory.c_str(), nullptr) != 0;
+}
+
+static void TouchCacheFile(const std::string &filename) {
+  HANDLE h = CreateFileA(filename.c_str(), FILE_WRITE_ATTRIBUTES,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                         nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                         nullptr);
+  if (h == INVALID_HANDLE_VALUE) {
+    return;
+  }
+  FILETIME now;
+  GetSystemTimeAsFileTime(&now);
+  SetFileTime(h, nullptr, nullptr, &now);
+  CloseHandle(h);
+}
+
+#else
+
+static bool ListCacheDirectory(const std::string &directory,
+                               std::vector<CacheDirEntry> *entries,
+                               std::string *err) {
+  DIR *dir = opendir(directory.c_str());
+  if (!dir) {
+    if (err) {
+      (*err) += "Failed to list a directory: " + directory + "\n";
+    }
+    return false;
+  }
+  while (struct dirent *d = readdir(dir)) {
+    CacheDirEntry e;
+    e.name = d->d_name;
+    struct stat st;
+    if ((stat((directory + "/" + e.name).c_str(), &st) != 0) ||
+        !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    e.size = uint64_t(st.st_size);
+#if defined(__APPLE__)
+    const struct timespec &mtime = st.st_mtimespec;
+#else
+    const struct timespec &mtime = st.st_mtim;
+#endif
+    e.mtime = uint64_t(mtime.tv_sec) * 1000000000ull + uint64_t(mtime.tv_nsec);
+    entries->push_back(e);
+  }
+  closedir(dir);
+  return true;
+}
+
+static bool MakeCacheDirectory(const std::string &directory) {
+  struct stat st;
+  if (stat(directory.c_str(), &st) == 0) {
+    return S_ISDIR(st.st_mode);
+  }
+  return (mkdir(directory.c_str(), 0755) == 0) || (errno == EEXIST);
+}
+
+static void TouchCacheFile(const std::string &filename) {
+  utimensat(AT_FDCWD, filename.c_str(), nullptr, 0);
+}
+
+#endif
+
+bool XPDDecodeCache::open(const std::string &directory,
+                          const uint64_t max_bytes, std::string *err) {
+  close();
+
+  std::string dir = directory;
+  while ((dir.size() > 1) && ((dir.back() == '/') || (dir.back() == '\\'))) {
+    dir.pop_back();
+  }
+  if (dir.empty()) {
+    if (err) {
+      (*err) += "Cache directory is empty.\n";
+    }
+    return false;
+  }
+
+  if (!MakeCacheDirectory(dir)) {
+    if (err) {
+      (*err) += "Failed to create a cache directory: " + dir + "\n";
+    }
+    return false;
+  }
+
+  std::vector<CacheDirEntry> files;
+  if (!ListCacheDirectory(dir, &files, err)) {
+    return false;
+  }
+
+  const uint64_t now =
+      uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+                   .count());
+
+  std::vector<CacheDirEntry> entries;
+  for (size_t i = 0; i < files.size(); i++) {
+    if (IsCacheFileName(files[i].name)) {
+      entries.push_back(files[i]);
+    } else if (IsCacheTempFileName(files[i].name) &&
+               (files[i].mtime + kCacheStaleTempNanoseconds < now)) {
+      std::remove((dir + "/" + files[i].name).c_str());
+    }
+  }
+
+  // Oldest first, so the most recently used entry ends up at the front.
+  std::sort(entries.begin(), entries.end(),
+            [](const CacheDirEntry &a, const CacheDirEntry &b) {
+              return (a.mtime != b.mtime) ? (a.mtime < b.mtime)
+                                          : (a.name < b.name);
+            });
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  directory_ = dir;
+  max_bytes_ = max_bytes;
+  for (size_t i = 0; i < entries.size(); i++) {
+    insert(entries[i].name, entries[i].size);
+  }
+  evict(std::string());
+
+  return true;
+}
+
+bool XPDDecodeCache::parse(const XPDCacheKey &key, XPDCacheEntry *entry) {
+  const uint8_t *data = entry->file_.data();
+  const uint64_t size = entry->file_.size();
+  std::vector<XPDCacheEntry::Section> &sections = entry->sections_;
+  sections.clear();
+  if ((size < kCacheHeaderSize) || (memcmp(data, "XPDC", 4) != 0) ||
+      (ReadU32(data + 4) != kCacheVersion) ||
+      (ReadU64(data + 8) != key.content) ||
+      (ReadU64(data + 16) != key.params)) {
+    return false;
+  }
+
+  const uint64_t num_sections = ReadU32(data + 24);
+  if (num_sections > (size - kCacheHeaderSize) / kCacheSectionEntrySize) {
+    return false;
+  }
+
+  for (uint64_t i = 0; i < num_sections; i++) {
+    const uint8_t *p = data + kCacheHeaderSize + i * kCacheSectionEntrySize;
+    if (p[kCacheNameSize - 1] != '\0') {
+      return false;
+    }
+    XPDCacheEntry::Section s;
+    s.name = reinterpret_cast<const char *>(p);
+    s.offset = ReadU64(p + kCacheNameSize);
+    s.size = ReadU64(p + kCacheNameSize + 8);
+    if ((s.offset > size) || (s.size > size - s.offset)) {
+      return false;
+    }
+    sections.push_back(s);
+  }
+
+  return true;
+}
+
+bool XPDDecodeCache::lookup(const XPDCacheKey &key, XPDCacheEntry *entry) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileCacheLookup);
+
+  const std::string name = CacheFileName(key);
+  std::string filename;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (directory_.empty() || !entry) {
+      return false;
+    }
+    filename = path(name);
+  }
+
+  // The entry may have been stored by another process after `open`, so
+  // the file is looked up even when it is not indexed.
+  entry->close();
+  bool ok = entry->file_.open(filename, nullptr);
+  if (ok) {
+    ok = parse(key, entry);
+    if (!ok) {
+      entry->close();
+      std::remove(filename.c_str());
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!ok) {
+    erase(name);
+    stats_.misses++;
+    return false;
+  }
+
+  TouchCacheFile(filename);
+  insert(name, entry->file_.size());
+  stats_.hits++;
+  return true;
+}
+
+bool XPDDecodeCache::store(const XPDCacheKey &key,
+                           const std::vector<XPDCacheSection> &sections,
+                           std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileCacheStore);
+
+  const std::string name = CacheFileName(key);
+  std::string filename;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (directory_.empty()) {
+      if (err) {
+        (*err) += "Decode cache is not opened.\n";
+      }
+      return false;
+    }
+    filename = path(name);
+  }
+
+  // Header and section table.
+  const size_t table_size =
+      kCacheHeaderSize + sections.size() * kCacheSectionEntrySize;
+  std::vector<uint8_t> table(table_size, 0);
+  memcpy(table.data(), "XPDC", 4);
+  memcpy(table.data() + 4, &kCacheVersion, sizeof(uint32_t));
+  memcpy(table.data() + 8, &key.content, sizeof(uint64_t));
+  memcpy(table.data() + 16, &key.params, sizeof(uint64_t));
+  const uint32_t num_sections = uint32_t(sections.size());
+  memcpy(table.data() + 24, &num_sections, sizeof(uint32_t));
+
+  std::vector<uint64_t> offsets(sections.size());
+  uint64_t offset = table_size;
+  for (size_t i = 0; i < sections.size(); i++) {
+    const XPDCacheSection &s = sections[i];
+    if (s.name.empty() || (s.name.size() >= kCacheNameSize) ||
+        (!s.data && (s.size > 0))) {
+      if (err) {
+        (*err) += "Invalid cache section: `" + s.name + "`\n";
+      }
+      return false;
+    }
+    offset = (offset + kCacheAlignment - 1) / kCacheAlignment *
+             kCacheAlignment;
+    offsets[i] = offset;
+
+    uint8_t *p = table.data() + kCacheHeaderSize + i * kCacheSectionEntrySize;
+    memcpy(p, s.name.data(), s.name.size());
+    memcpy(p + kCacheNameSize, &offset, sizeof(uint64_t));
+    memcpy(p + kCacheNameSize + 8, &s.size, sizeof(uint64_t));
+    offset += s.size;
+  }
+  const uint64_t total_size = offset;
+
+  const std::string temp_filename = TempFileName(filename);
+
+  {
+    std::ofstream ofs(temp_filename, std::ios::binary);
+    if (!ofs) {
+      if (err) {
+        (*err) += "Failed to open a file for write: " + temp_filename + "\n";
+      }
+      return false;
+    }
+
+    const char zeros[kCacheAlignment] = {};
+    ofs.write(reinterpret_cast<const char *>(table.data()),
+              std::streamsize(table.size()));
+    uint64_t written = table.size();
+    for (size_t i = 0; i < sections.size(); i++) {
+      ofs.write(zeros, std::streamsize(offsets[i] - written));
+      ofs.write(reinterpret_cast<const char *>(sections[i].data),
+                std::streamsize(sections[i].size));
+      written = offsets[i] + sections[i].size;
+    }
+    ofs.close();
+
+    if (!ofs || !SyncFile(temp_filename)) {
+      std::remove(temp_filename.c_str());
+      if (err) {
+        (*err) += "Failed to write a file: " + temp_filename + "\n";
+      }
       return false;
     }
+  }
+
+  if (!RenameTempFile(temp_filename, filename)) {
+    std::remove(temp_filename.c_str());
+    if (err) {
+      (*err) += "Failed to rename a file: " + temp_filename + "\n";
+    }
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  insert(name, total_size);
+  stats_.stores++;
+  evict(name);
+  return true;
+}
+
+XPDDecodeCacheStats XPDDecodeCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+template <typename T>
+static void AppendCacheParam(std::vector<uint8_t> *params, const T &value) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(&value);
+  params->insert(params->end(), p, p + sizeof(T));
+}
+
+static void AppendCacheParam(std::vector<uint8_t> *params,
+                             const std::vector<float> &values) {
+  AppendCacheParam(params, uint64_t(values.size()));
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(values.data());
+  params->insert(params->end(), p, p + values.size() * sizeof(float));
+}
+
+template <typename T>
+static XPDCacheSection CacheArraySection(const char *name,
+                                         const std::vector<T> &values) {
+  return XPDCacheSection(name, values.data(), values.size() * sizeof(T));
+}
+
+template <typename T>
+static bool ViewCacheArray(const XPDCacheEntry &entry, const char *name,
+                           XPDCacheArray<T> *array) {
+  const uint8_t *data;
+  uint64_t size;
+  if (!entry.section(name, &data, &size) || (size % sizeof(T))) {
+    return false;
+  }
+  // Sections are 64 byte aligned.
+  array->data = reinterpret_cast<const T *>(data);
+  array->size = size_t(size / sizeof(T));
+  return true;
+}
 
-    const char val = static_cast<const char>(binary_[idx_]);
+template <typename T>
+static void ViewArray(const std::vector<T> &values, XPDCacheArray<T> *array) {
+  array->data = values.data();
+  array->size = values.size();
+}
 
-    (*ret) = val;
-    idx_ += 1;
+template <typename T>
+static void CopyCacheArray(const XPDCacheArray<T> &array,
+                           std::vector<T> *values) {
+  values->assign(array.data, array.data + array.size);
+}
 
-    return true;
-  }
+// Float arrays of `XPDSplineSoA` in cache section order.
+static const size_t kSoACacheFloatArrays = 13;
+static const char *const kSoACacheFloatNames[kSoACacheFloatArrays] = {
+    "px",           "py",           "pz",          "id",
+    "u",            "v",            "length",      "width",
+    "taper",        "taperStart",   "widthVectorX", "widthVectorY",
+    "widthVectorZ"};
+
+static void SoAFloatArrays(XPDSplineSoA *soa,
+                           std::vector<float> *arrays[kSoACacheFloatArrays]) {
+  std::vector<float> *a[kSoACacheFloatArrays] = {
+      &soa->px,          &soa->py,           &soa->pz,
+      &soa->id,          &soa->u,            &soa->v,
+      &soa->length,      &soa->width,        &soa->taper,
+      &soa->taperStart,  &soa->widthVectorX, &soa->widthVectorY,
+      &soa->widthVectorZ};
+  memcpy(arrays, a, sizeof(a));
+}
 
-#if 0
-  bool read2(unsigned short *ret) {
-    if ((idx_ + 2) > length_) {
+static void SoAFloatArrays(XPDSplineSoAView *view,
+                           XPDCacheArray<float> *arrays[kSoACacheFloatArrays]) {
+  XPDCacheArray<float> *a[kSoACacheFloatArrays] = {
+      &view->px,         &view->py,           &view->pz,
+      &view->id,         &view->u,            &view->v,
+      &view->length,     &view->width,        &view->taper,
+      &view->taperStart, &view->widthVectorX, &view->widthVectorY,
+      &view->widthVectorZ};
+  memcpy(arrays, a, sizeof(a));
+}
+
+// `numThreads` and `specialize` do not change the result.
+static XPDCacheKey SplineSoACacheKey(const uint64_t content_hash,
+                                     const uint32_t block_id,
+                                     const XPDSplineSoAOption &option) {
+  std::vector<uint8_t> params;
+  AppendCacheParam(&params, block_id);
+  AppendCacheParam(&params, option.transform.matrix);
+  AppendCacheParam(&params, option.transform.faceMatrices);
+  return MakeXPDCacheKey(content_hash, "spline_soa", params.data(),
+                         params.size());
+}
+
+static bool ViewSplineSoAEntry(const XPDCacheEntry &entry,
+                               XPDSplineSoAView *view) {
+  XPDCacheArray<uint32_t> counts;
+  if (!ViewCacheArray(entry, "counts", &counts) || (counts.size != 2) ||
+      !ViewCacheArray(entry, "faceCurveOffset", &view->faceCurveOffset) ||
+      !ViewCacheArray(entry, "curveCVOffset", &view->curveCVOffset)) {
+    return false;
+  }
+  XPDCacheArray<float> *arrays[kSoACacheFloatArrays];
+  SoAFloatArrays(view, arrays);
+  for (size_t i = 0; i < kSoACacheFloatArrays; i++) {
+    if (!ViewCacheArray(entry, kSoACacheFloatNames[i], arrays[i])) {
       return false;
     }
+  }
+  view->numCurves = counts[0];
+  view->numCVsPerCurve = counts[1];
+  return true;
+}
 
-    unsigned short val =
-        *(reinterpret_cast<const unsigned short *>(&binary_[idx_]));
+static void StoreSplineSoA(XPDDecodeCache *cache, const XPDCacheKey &key,
+                           XPDSplineSoA *soa) {
+  const uint32_t counts[2] = {soa->numCurves, soa->numCVsPerCurve};
+  std::vector<XPDCacheSection> sections;
+  sections.push_back(XPDCacheSection("counts", counts, sizeof(counts)));
+  std::vector<float> *arrays[kSoACacheFloatArrays];
+  SoAFloatArrays(soa, arrays);
+  for (size_t i = 0; i < kSoACacheFloatArrays; i++) {
+    sections.push_back(CacheArraySection(kSoACacheFloatNames[i], *arrays[i]));
+  }
+  sections.push_back(
+      CacheArraySection("faceCurveOffset", soa->faceCurveOffset));
+  sections.push_back(CacheArraySection("curveCVOffset", soa->curveCVOffset));
+  cache->store(key, sections, nullptr);
+}
 
-    if (swap_endian_) {
-      swap2(&val);
+bool ExtractSplineSoAViewCached(XPDDecodeCache *cache,
+                                const uint64_t content_hash,
+                                const XPDHeader &xpd, const uint8_t *binary,
+                                const size_t binary_length,
+                                const uint32_t block_id,
+                                const XPDSplineSoAOption &option,
+                                XPDSplineSoAView *view, std::string *err) {
+  if (!view) {
+    if (err) {
+      (*err) += "`view` argument is null.\n";
     }
+    return false;
+  }
 
-    (*ret) = val;
-    idx_ += 2;
+  (*view) = XPDSplineSoAView();
+  XPDCacheKey key;
+  if (cache) {
+    key = SplineSoACacheKey(content_hash, block_id, option);
+    if (cache->lookup(key, &view->entry) &&
+        ViewSplineSoAEntry(view->entry, view)) {
+      return true;
+    }
+    (*view) = XPDSplineSoAView();
+  }
 
-    return true;
+  XPDSplineSoA &soa = view->decoded;
+  if (!ExtractSplineSoA(xpd, binary, binary_length, block_id, option, &soa,
+                        err)) {
+    return false;
+  }
+  if (cache) {
+    StoreSplineSoA(cache, key, &soa);
   }
-#endif
 
-  bool read4(uint32_t *ret) {
-    if ((idx_ + 4) > length_) {
-      return false;
-    }
+  view->numCurves = soa.numCurves;
+  view->numCVsPerCurve = soa.numCVsPerCurve;
+  XPDCacheArray<float> *arrays[kSoACacheFloatArrays];
+  std::vector<float> *values[kSoACacheFloatArrays];
+  SoAFloatArrays(view, arrays);
+  SoAFloatArrays(&soa, values);
+  for (size_t i = 0; i < kSoACacheFloatArrays; i++) {
+    ViewArray(*values[i], arrays[i]);
+  }
+  ViewArray(soa.faceCurveOffset, &view->faceCurveOffset);
+  ViewArray(soa.curveCVOffset, &view->curveCVOffset);
+  return true;
+}
 
-    // use cpy4 considering unaligned access.
-    const uint32_t *ptr = reinterpret_cast<const uint32_t *>(&binary_[idx_]);
-    uint32_t val;
-    cpy4(&val, ptr);
+bool ExtractSplineSoACached(XPDDecodeCache *cache, const uint64_t content_hash,
+                            const XPDHeader &xpd, const uint8_t *binary,
+                            const size_t binary_length,
+                            const uint32_t block_id,
+                            const XPDSplineSoAOption &option,
+                            XPDSplineSoA *soa, std::string *err) {
+  if (!cache || !soa) {
+    return ExtractSplineSoA(xpd, binary, binary_length, block_id, option, soa,
+                            err);
+  }
 
-    if (swap_endian_) {
-      swap4(&val);
+  const XPDCacheKey key = SplineSoACacheKey(content_hash, block_id, option);
+  XPDSplineSoAView view;
+  if (cache->lookup(key, &view.entry) &&
+      ViewSplineSoAEntry(view.entry, &view)) {
+    soa->numCurves = view.numCurves;
+    soa->numCVsPerCurve = view.numCVsPerCurve;
+    XPDCacheArray<float> *arrays[kSoACacheFloatArrays];
+    std::vector<float> *values[kSoACacheFloatArrays];
+    SoAFloatArrays(&view, arrays);
+    SoAFloatArrays(soa, values);
+    for (size_t i = 0; i < kSoACacheFloatArrays; i++) {
+      CopyCacheArray(*arrays[i], values[i]);
     }
+    CopyCacheArray(view.faceCurveOffset, &soa->faceCurveOffset);
+    CopyCacheArray(view.curveCVOffset, &soa->curveCVOffset);
+    return true;
+  }
 
-    (*ret) = val;
-    idx_ += 4;
+  if (!ExtractSplineSoA(xpd, binary, binary_length, block_id, option, soa,
+                        err)) {
+    return false;
+  }
+  StoreSplineSoA(cache, key, soa);
+  return true;
+}
 
-    return true;
+// `numThreads` and `specialize` do not change the result.
+static XPDCacheKey CurveBuffersCacheKey(const uint64_t content_hash,
+                                        const uint32_t block_id,
+                                        const XPDCurveBufferOption &option) {
+  std::vector<uint8_t> params;
+  AppendCacheParam(&params, block_id);
+  AppendCacheParam(&params, uint32_t(option.segmentType));
+  AppendCacheParam(&params, option.resampleCVs);
+  AppendCacheParam(&params, uint32_t(option.resampleMode));
+  AppendCacheParam(&params, uint32_t(option.interpolation));
+  AppendCacheParam(&params, option.transform.matrix);
+  AppendCacheParam(&params, option.transform.faceMatrices);
+  return MakeXPDCacheKey(content_hash, "curve_buffers", params.data(),
+                         params.size());
+}
+
+static bool ViewCurveBuffersEntry(const XPDCacheEntry &entry,
+                                  XPDCurveBuffersView *view) {
+  XPDCacheArray<uint32_t> counts;
+  if (!ViewCacheArray(entry, "counts", &counts) || (counts.size != 2) ||
+      !ViewCacheArray(entry, "cvs", &view->cvs) ||
+      !ViewCacheArray(entry, "curveFirstCV", &view->curveFirstCV) ||
+      !ViewCacheArray(entry, "segmentIndices", &view->segmentIndices)) {
+    return false;
   }
+  view->numCurves = counts[0];
+  view->numCVsPerCurve = counts[1];
+  return true;
+}
 
-  bool read4(int *ret) {
-    if ((idx_ + 4) > length_) {
-      return false;
-    }
+static void StoreCurveBuffers(XPDDecodeCache *cache, const XPDCacheKey &key,
+                              const XPDCurveBuffers &buffers) {
+  const uint32_t counts[2] = {buffers.numCurves, buffers.numCVsPerCurve};
+  std::vector<XPDCacheSection> sections;
+  sections.push_back(XPDCacheSection("counts", counts, sizeof(counts)));
+  sections.push_back(CacheArraySection("cvs", buffers.cvs));
+  sections.push_back(CacheArraySection("curveFirstCV", buffers.curveFirstCV));
+  sections.push_back(
+      CacheArraySection("segmentIndices", buffers.segmentIndices));
+  cache->store(key, sections, nullptr);
+}
 
-    // use cpy4 considering unaligned access.
-    const int32_t *ptr = reinterpret_cast<const int32_t *>(&binary_[idx_]);
-    int32_t val;
-    cpy4(&val, ptr);
+bool ExtractCurveBuffersViewCached(XPDDecodeCache *cache,
+                                   const uint64_t content_hash,
+                                   const XPDHeader &xpd,
+                                   const uint8_t *binary,
+                                   const size_t binary_length,
+                                   const uint32_t block_id,
+                                   const XPDCurveBufferOption &option,
+                                   XPDCurveBuffersView *view,
+                                   std::string *err) {
+  if (!view) {
+    if (err) {
+      (*err) += "`view` argument is null.\n";
+    }
+    return false;
+  }
 
-    if (swap_endian_) {
-      swap4(&val);
+  (*view) = XPDCurveBuffersView();
+  XPDCacheKey key;
+  if (cache) {
+    key = CurveBuffersCacheKey(content_hash, block_id, option);
+    if (cache->lookup(key, &view->entry) &&
+        ViewCurveBuffersEntry(view->entry, view)) {
+      return true;
     }
+    (*view) = XPDCurveBuffersView();
+  }
 
-    (*ret) = val;
-    idx_ += 4;
+  XPDCurveBuffers &buffers = view->decoded;
+  if (!ExtractCurveBuffers(xpd, binary, binary_length, block_id, option,
+                           &buffers, err)) {
+    return false;
+  }
+  if (cache) {
+    StoreCurveBuffers(cache, key, buffers);
+  }
+
+  view->numCurves = buffers.numCurves;
+  view->numCVsPerCurve = buffers.numCVsPerCurve;
+  ViewArray(buffers.cvs, &view->cvs);
+  ViewArray(buffers.curveFirstCV, &view->curveFirstCV);
+  ViewArray(buffers.segmentIndices, &view->segmentIndices);
+  return true;
+}
+
+bool ExtractCurveBuffersCached(XPDDecodeCache *cache,
+                               const uint64_t content_hash,
+                               const XPDHeader &xpd, const uint8_t *binary,
+                               const size_t binary_length,
+                               const uint32_t block_id,
+                               const XPDCurveBufferOption &option,
+                               XPDCurveBuffers *buffers, std::string *err) {
+  if (!cache || !buffers) {
+    return ExtractCurveBuffers(xpd, binary, binary_length, block_id, option,
+                               buffers, err);
+  }
 
+  const XPDCacheKey key = CurveBuffersCacheKey(content_hash, block_id, option);
+  XPDCurveBuffersView view;
+  if (cache->lookup(key, &view.entry) &&
+      ViewCurveBuffersEntry(view.entry, &view)) {
+    buffers->numCurves = view.numCurves;
+    buffers->numCVsPerCurve = view.numCVsPerCurve;
+    CopyCacheArray(view.cvs, &buffers->cvs);
+    CopyCacheArray(view.curveFirstCV, &buffers->curveFirstCV);
+    CopyCacheArray(view.segmentIndices, &buffers->segmentIndices);
     return true;
   }
 
-#if 0
-  bool read8(uint64_t *ret) {
-    if ((idx_ + 8) > length_) {
-      return false;
+  if (!ExtractCurveBuffers(xpd, binary, binary_length, block_id, option,
+                           buffers, err)) {
+    return false;
+  }
+  StoreCurveBuffers(cache, key, *buffers);
+  return true;
+}
+
+// ---------------------------------------------
+// Frame sequence.
+//
+// Layout(little endian):
+//   magic "XPDS"(4) version(4) numFrames(4) keyframeInterval(4)
+//   quantizeStep(4) reserved(4) tableOffset(8)
+//   Frame payloads and the frame table at `tableOffset`:
+//     [numFrames] offset(8) size(8) time(4) keyframe(4)
+// `finish` writes the table right after the header. Streamed files have it
+// after payloads. Version 1 has no `tableOffset`(24 byte header) and the
+// table follows the header.
+//
+// A keyframe payload is XPD data of the frame. A delta payload is:
+//   numValues(8) numChunks(4) reserved(4) chunkEnd(8)[numChunks]
+//   Chunks of residuals of `kSequenceChunkValues` CV floats. Residuals of x,
+//   y and z are coded separately(so an axis with little motion gets a small
+//   width) in groups of 32: bit width(1), then 32 zigzag values of that
+//   width(4 * width bytes).
+
+static const uint32_t kSequenceVersion = 2;
+static const size_t kSequenceHeaderSize = 32;
+static const size_t kSequenceHeaderSizeV1 = 24;
+static const size_t kSequenceFrameEntrySize = 24;
+static const size_t kSequenceChunkValues = 3 * 8192;  // xyz
+
+// magic(4) fileVersion(1) primType(4) primVersion(1)
+static const size_t kXPDTimeOffset = 10;
+
+static bool BuildSequenceCVRuns(const XPDHeader &xpd, const uint8_t *binary,
+                                const size_t binary_length,
+                                std::vector<XPDSequenceCVRun> *runs,
+                                uint64_t *num_floats, std::string *err) {
+  runs->clear();
+  uint64_t total = 0;
+
+  for (uint32_t b = 0; b < xpd.numBlocks; b++) {
+    XPDSplineLayout layout;
+    if (!GetSplineLayout(xpd, b, &layout, nullptr) || (layout.numCVs == 0)) {
+      continue;
     }
 
-    uint64_t val = *(reinterpret_cast<const uint64_t *>(&binary_[idx_]));
+    uint32_t ext_block_id;
+    const bool varying = FindVaryingCVBlock(xpd, b, &ext_block_id);
 
-    if (swap_endian_) {
-      swap8(&val);
-    }
+    for (uint32_t f = 0; f < xpd.numFaces; f++) {
+      XPDBlockView view;
+      if (!GetBlockView(xpd, binary, binary_length, f, b, &view, err)) {
+        return false;
+      }
 
-    (*ret) = val;
-    idx_ += 8;
+      if (view.numPrims > 0) {
+        XPDSequenceCVRun run;
+        run.offset = uint64_t(view.data - binary) + layout.cv * sizeof(float);
+        run.first = total;
+        run.numPrims = uint32_t(view.numPrims);
+        run.stride = uint32_t(view.stride());
+        run.numFloats = 3 * layout.numCVs;
+        total += uint64_t(run.numPrims) * run.numFloats;
+        runs->push_back(run);
+      }
 
-    return true;
-  }
+      if (varying) {
+        XPDVaryingCVView cv_view;
+        if (!GetVaryingCVView(xpd, binary, binary_length, f, b, &cv_view,
+                              err)) {
+          return false;
+        }
 
-  bool read8(int64_t *ret) {
-    if ((idx_ + 8) > length_) {
-      return false;
+        if (cv_view.numCVs > 0) {
+          XPDSequenceCVRun run;
+          run.offset = uint64_t(cv_view.cvs - binary);
+          run.first = total;
+          run.numPrims = 1;
+          run.stride = 0;
+          run.numFloats = uint32_t(3 * cv_view.numCVs);
+          total += run.numFloats;
+          runs->push_back(run);
+        }
+      }
     }
+  }
 
-    int64_t val = *(reinterpret_cast<const int64_t *>(&binary_[idx_]));
+  (*num_floats) = total;
+  return true;
+}
 
-    if (swap_endian_) {
-      swap8(&val);
+static void GatherSequenceCVs(const uint8_t *binary,
+                              const std::vector<XPDSequenceCVRun> &runs,
+                              const uint32_t num_threads, float *dst) {
+  ParallelFor(runs.size(), num_threads, [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; r++) {
+      const XPDSequenceCVRun &run = runs[r];
+      for (size_t p = 0; p < run.numPrims; p++) {
+        memcpy(dst + run.first + p * run.numFloats,
+               binary + run.offset + p * run.stride,
+               run.numFloats * sizeof(float));
+      }
     }
+  });
+}
 
-    (*ret) = val;
-    idx_ += 8;
+// Write `src` to CV runs of `binary`. Clear CVs when `src` is null.
+static void ScatterSequenceCVs(const float *src,
+                               const std::vector<XPDSequenceCVRun> &runs,
+                               const uint32_t num_threads, uint8_t *binary) {
+  ParallelFor(runs.size(), num_threads, [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; r++) {
+      const XPDSequenceCVRun &run = runs[r];
+      for (size_t p = 0; p < run.numPrims; p++) {
+        uint8_t *dst = binary + run.offset + p * run.stride;
+        if (src) {
+          memcpy(dst, src + run.first + p * run.numFloats,
+                 run.numFloats * sizeof(float));
+        } else {
+          memset(dst, 0, run.numFloats * sizeof(float));
+        }
+      }
+    }
+  });
+}
 
-    return true;
-  }
-#endif
+// Linear extrapolation from the previous 2 frames. Written without a
+// multiply so that it is never contracted into FMA.
+static inline float PredictSequenceCV(const float *prev, const float *pprev,
+                                      const size_t i) {
+  return pprev ? (prev[i] + (prev[i] - pprev[i])) : prev[i];
+}
 
-  bool read_float(float *ret) {
-    if (!ret) {
-      return false;
+static inline uint32_t FloatToBits(const float f) {
+  uint32_t u;
+  memcpy(&u, &f, sizeof(float));
+  return u;
+}
+
+static inline float BitsToFloat(const uint32_t u) {
+  float f;
+  memcpy(&f, &u, sizeof(float));
+  return f;
+}
+
+static inline float DequantizeSequenceCV(const float pred, const int32_t q,
+                                         const float step) {
+  return float(double(pred) + double(q) * double(step));
+}
+
+// Encode residuals of `n` CV floats(xyz interleaved) into `dst`. `recon`
+// receives reconstructed CVs(may alias `cur`). Return false when a quantized
+// residual is out of range.
+static bool EncodeSequenceChunk(const float *cur, const float *prev,
+                                const float *pprev, const size_t n,
+                                const float step, float *recon,
+                                std::vector<uint8_t> *dst) {
+  dst->clear();
+  const size_t m = n / 3;
+  uint32_t zz[32];
+  for (size_t axis = 0; axis < 3; axis++) {
+    for (size_t g = 0; g < m; g += 32) {
+      const size_t count = std::min(size_t(32), m - g);
+      uint32_t bits = 0;
+      for (size_t k = 0; k < 32; k++) {
+        uint32_t r = 0;
+        if (k < count) {
+          const size_t i = 3 * (g + k) + axis;
+          const float pred = PredictSequenceCV(prev, pprev, i);
+          if (step > 0.0f) {
+            const double d = (double(cur[i]) - double(pred)) / double(step);
+            if (!(std::fabs(d) < 1073741824.0)) {  // Also rejects NaN.
+              return false;
+            }
+            const int32_t q = int32_t(std::floor(d + 0.5));
+            recon[i] = DequantizeSequenceCV(pred, q, step);
+            r = uint32_t(q);
+          } else {
+            r = FloatToBits(cur[i]) - FloatToBits(pred);
+            recon[i] = cur[i];
+          }
+        }
+        zz[k] = (r << 1) ^ uint32_t(int32_t(r) >> 31);
+        bits |= zz[k];
+      }
+
+      uint32_t width = 0;
+      while ((width < 32) && (bits >> width)) {
+        width++;
+      }
+
+      dst->push_back(uint8_t(width));
+      uint64_t acc = 0;
+      uint32_t acc_bits = 0;
+      for (size_t k = 0; k < 32; k++) {
+        acc |= uint64_t(zz[k]) << acc_bits;
+        acc_bits += width;
+        while (acc_bits >= 8) {
+          dst->push_back(uint8_t(acc & 0xff));
+          acc >>= 8;
+          acc_bits -= 8;
+        }
+      }
     }
+  }
 
-    float value;
-    if (!read4(reinterpret_cast<int *>(&value))) {
-      return false;
+  return true;
+}
+
+static bool DecodeSequenceChunk(const uint8_t *src, const size_t src_length,
+                                const float *prev, const float *pprev,
+                                const size_t n, const float step, float *dst) {
+  const size_t m = n / 3;
+  size_t pos = 0;
+  for (size_t axis = 0; axis < 3; axis++) {
+    for (size_t g = 0; g < m; g += 32) {
+      if (pos >= src_length) {
+        return false;
+      }
+      const uint32_t width = src[pos++];
+      if ((width > 32) || ((pos + 4 * width) > src_length)) {
+        return false;
+      }
+
+      const size_t count = std::min(size_t(32), m - g);
+      const uint64_t mask = (uint64_t(1) << width) - 1;
+      const uint8_t *s = src + pos;
+      uint64_t acc = 0;
+      uint32_t acc_bits = 0;
+      for (size_t k = 0; k < count; k++) {
+        while (acc_bits < width) {
+          acc |= uint64_t(*s++) << acc_bits;
+          acc_bits += 8;
+        }
+        const uint32_t z = uint32_t(acc & mask);
+        acc >>= width;
+        acc_bits -= width;
+
+        const uint32_t r = (z >> 1) ^ (0u - (z & 1u));
+        const size_t i = 3 * (g + k) + axis;
+        const float pred = PredictSequenceCV(prev, pprev, i);
+        if (step > 0.0f) {
+          dst[i] = DequantizeSequenceCV(pred, int32_t(r), step);
+        } else {
+          dst[i] = BitsToFloat(FloatToBits(pred) + r);
+        }
+      }
+      pos += 4 * width;
     }
+  }
 
-    (*ret) = value;
+  return true;
+}
 
-    return true;
+template <typename T>
+static void AppendValue(const T value, std::vector<uint8_t> *dst) {
+  const size_t offset = dst->size();
+  dst->resize(offset + sizeof(T));
+  memcpy(dst->data() + offset, &value, sizeof(T));
+}
+
+template <typename T>
+static T ReadValue(const uint8_t *src) {
+  T value;
+  memcpy(&value, src, sizeof(T));
+  return value;
+}
+
+template <typename T>
+static void WriteValue(const T value, uint8_t *dst) {
+  memcpy(dst, &value, sizeof(T));
+}
+
+XPDSequenceWriter::XPDSequenceWriter(const XPDSequenceOption &option)
+    : option_(option),
+      num_keyframes_(0),
+      stream_offset_(0),
+      stream_failed_(false),
+      num_deltas_(0) {}
+
+XPDSequenceWriter::~XPDSequenceWriter() { clear(); }
+
+void XPDSequenceWriter::clear() {
+  if (stream_.is_open()) {
+    stream_.close();
+    std::remove(stream_temp_.c_str());
   }
+  stream_.clear();
+  stream_filename_.clear();
+  stream_temp_.clear();
+  stream_offset_ = 0;
+  stream_failed_ = false;
+
+  frames_.clear();
+  num_keyframes_ = 0;
+  key_.clear();
+  runs_.clear();
+  num_deltas_ = 0;
+  prev_.clear();
+  pprev_.clear();
+  cur_.clear();
+}
 
-#if 0
-  bool read_double(double *ret) {
-    if (!ret) {
-      return false;
+bool XPDSequenceWriter::beginStream(const std::string &filename,
+                                    std::string *err) {
+  if (!frames_.empty() || stream_.is_open()) {
+    if (err) {
+      (*err) += "Streaming must begin before adding frames.\n";
     }
+    return false;
+  }
 
-    double value;
-    if (!read8(reinterpret_cast<uint64_t *>(&value))) {
-      return false;
+  const std::string temp = TempFileName(filename);
+  stream_.open(temp, std::ios::binary);
+  if (!stream_) {
+    stream_.close();
+    stream_.clear();
+    if (err) {
+      (*err) += "Failed to open a file for write: " + temp + "\n";
     }
+    return false;
+  }
 
-    (*ret) = value;
+  // Placeholder header, written by `finishStream`.
+  const char header[kSequenceHeaderSize] = {};
+  stream_.write(header, std::streamsize(kSequenceHeaderSize));
+  stream_filename_ = filename;
+  stream_temp_ = temp;
+  stream_offset_ = kSequenceHeaderSize;
+  stream_failed_ = !stream_;
+  return true;
+}
 
-    return true;
+bool XPDSequenceWriter::finishStream(std::string *err) {
+  if (!stream_.is_open()) {
+    if (err) {
+      (*err) += "Not streaming.\n";
+    }
+    return false;
   }
-#endif
 
-  bool read_string(std::string *ret) {
-    if (!ret) {
+  std::vector<uint8_t> table;
+  encodeTable(kSequenceHeaderSize, &table);
+  uint8_t header[kSequenceHeaderSize];
+  encodeHeader(stream_offset_, header);
+
+  stream_.write(reinterpret_cast<const char *>(table.data()),
+                std::streamsize(table.size()));
+  stream_.seekp(0);
+  stream_.write(reinterpret_cast<const char *>(header),
+                std::streamsize(kSequenceHeaderSize));
+  stream_.close();
+
+  const std::string filename = stream_filename_;
+  const std::string temp = stream_temp_;
+  const bool ok = !stream_failed_ && stream_ && SyncFile(temp) &&
+                  RenameTempFile(temp, filename);
+  if (!ok) {
+    std::remove(temp.c_str());
+    if (err) {
+      (*err) += "Failed to write a file: " + filename + "\n";
+    }
+  }
+  clear();
+  return ok;
+}
+
+bool XPDSequenceWriter::appendFrame(Frame *frame, const uint8_t *data,
+                                    const size_t size, std::string *err) {
+  frame->size = size;
+  if (stream_.is_open()) {
+    stream_.write(reinterpret_cast<const char *>(data),
+                  std::streamsize(size));
+    if (!stream_) {
+      stream_failed_ = true;
+      if (err) {
+        (*err) += "Failed to write a file: " + stream_temp_ + "\n";
+      }
       return false;
     }
+    stream_offset_ += size;
+    std::vector<uint8_t>().swap(frame->payload);
+  } else if (frame->payload.data() != data) {
+    frame->payload.assign(data, data + size);
+  }
+  frames_.push_back(std::move(*frame));
+  return true;
+}
 
-    std::string value;
+bool XPDSequenceWriter::addKeyframe(const XPDHeader &header,
+                                    const uint8_t *xpd_data,
+                                    const size_t xpd_length,
+                                    std::string *err) {
+  uint64_t num_floats;
+  if (!BuildSequenceCVRuns(header, xpd_data, xpd_length, &runs_, &num_floats,
+                           err)) {
+    return false;
+  }
 
-    // read untile '\0' or end of stream.
-    for (;;) {
-      char c;
-      if (!read1(&c)) {
-        return false;
-      }
+  Frame frame;
+  frame.time = header.time;
+  frame.keyframe = true;
+  if (!appendFrame(&frame, xpd_data, xpd_length, err)) {
+    return false;
+  }
+  num_keyframes_++;
 
-      value.push_back(c);
+  prev_.resize(size_t(num_floats));
+  GatherSequenceCVs(xpd_data, runs_, option_.numThreads, prev_.data());
+  pprev_.clear();
+  num_deltas_ = 0;
 
-      if (c == '\0') {
-        break;
-      }
+  // Keep the keyframe with CVs and time cleared to compare with frames.
+  key_.assign(xpd_data, xpd_data + xpd_length);
+  ScatterSequenceCVs(nullptr, runs_, option_.numThreads, key_.data());
+  memset(key_.data() + kXPDTimeOffset, 0, sizeof(float));
+
+  return true;
+}
+
+bool XPDSequenceWriter::addFrame(const uint8_t *xpd_data,
+                                 const size_t xpd_length, std::string *err) {
+  if (!xpd_data) {
+    if (err) {
+      (*err) += "`xpd_data` argument is null.\n";
     }
+    return false;
+  }
 
-    (*ret) = value;
+  XPDHeader header;
+  if (!ParseXPDHeaderFromMemory(xpd_data, xpd_length, &header, err)) {
+    return false;
+  }
 
-    return true;
+  const uint32_t interval = std::max(1u, option_.keyframeInterval);
+  if (frames_.empty() || ((num_deltas_ + 1) >= interval)) {
+    return addKeyframe(header, xpd_data, xpd_length, err);
   }
 
-#if 0
-  bool read_value(Value *inout) {
-    if (!inout) {
-      return false;
-    }
+  // Write a delta only when the frame matches the keyframe except for CVs
+  // and time.
+  std::vector<XPDSequenceCVRun> runs;
+  uint64_t num_floats;
+  if (!BuildSequenceCVRuns(header, xpd_data, xpd_length, &runs, &num_floats,
+                           err)) {
+    return false;
+  }
+  if ((xpd_length != key_.size()) || !(runs == runs_)) {
+    return addKeyframe(header, xpd_data, xpd_length, err);
+  }
 
-    if (inout->Type() == VALUE_TYPE_FLOAT) {
-      float value;
-      if (!read_float(&value)) {
-        return false;
-      }
+  std::vector<uint8_t> masked(xpd_data, xpd_data + xpd_length);
+  ScatterSequenceCVs(nullptr, runs_, option_.numThreads, masked.data());
+  memset(masked.data() + kXPDTimeOffset, 0, sizeof(float));
+  if (memcmp(masked.data(), key_.data(), xpd_length) != 0) {
+    return addKeyframe(header, xpd_data, xpd_length, err);
+  }
 
-      (*inout) = Value(value);
-    } else if (inout->Type() == VALUE_TYPE_INT) {
-      int value;
-      if (!read4(&value)) {
-        return false;
+  const size_t n = prev_.size();
+  cur_.resize(n);
+  GatherSequenceCVs(xpd_data, runs_, option_.numThreads, cur_.data());
+
+  // Encode chunks in parallel. `cur_` is replaced with reconstructed CVs.
+  const size_t num_chunks =
+      (n + kSequenceChunkValues - 1) / kSequenceChunkValues;
+  std::vector<std::vector<uint8_t> > chunks(num_chunks);
+  const float *pprev = (num_deltas_ > 0) ? pprev_.data() : nullptr;
+  std::atomic<bool> overflow(false);
+  ParallelFor(num_chunks, option_.numThreads, [&](size_t begin, size_t end) {
+    for (size_t c = begin; c < end; c++) {
+      const size_t first = c * kSequenceChunkValues;
+      const size_t count = std::min(kSequenceChunkValues, n - first);
+      if (!EncodeSequenceChunk(cur_.data() + first, prev_.data() + first,
+                               pprev ? pprev + first : nullptr, count,
+                               option_.quantizeStep, cur_.data() + first,
+                               &chunks[c])) {
+        overflow = true;
       }
-
-      (*inout) = Value(value);
-    } else {
-      TINYVDBIO_ASSERT(0);
-      return false;
     }
+  });
 
-    return true;
+  if (overflow) {
+    // CVs moved too far(or are not finite) for quantized residuals.
+    return addKeyframe(header, xpd_data, xpd_length, err);
   }
-#endif
 
-  size_t tell() const { return idx_; }
+  Frame frame;
+  frame.time = header.time;
+  frame.keyframe = false;
+  AppendValue(uint64_t(n), &frame.payload);
+  AppendValue(uint32_t(num_chunks), &frame.payload);
+  AppendValue(uint32_t(0), &frame.payload);
+  uint64_t chunk_end = 0;
+  for (size_t c = 0; c < num_chunks; c++) {
+    chunk_end += chunks[c].size();
+    AppendValue(chunk_end, &frame.payload);
+  }
+  for (size_t c = 0; c < num_chunks; c++) {
+    frame.payload.insert(frame.payload.end(), chunks[c].begin(),
+                         chunks[c].end());
+  }
+  if (!appendFrame(&frame, frame.payload.data(), frame.payload.size(),
+                   err)) {
+    return false;
+  }
 
-  const uint8_t *data() const { return binary_; }
+  pprev_.swap(prev_);
+  prev_.swap(cur_);
+  num_deltas_++;
 
-  bool swap_endian() const { return swap_endian_; }
+  return true;
+}
 
-  size_t size() const { return length_; }
+void XPDSequenceWriter::encodeHeader(const uint64_t table_offset,
+                                     uint8_t *dst) const {
+  const char magic[4] = {'X', 'P', 'D', 'S'};
+  memcpy(dst, magic, 4);
+  WriteValue(kSequenceVersion, dst + 4);
+  WriteValue(uint32_t(frames_.size()), dst + 8);
+  WriteValue(option_.keyframeInterval, dst + 12);
+  WriteValue(option_.quantizeStep, dst + 16);
+  WriteValue(uint32_t(0), dst + 20);
+  WriteValue(table_offset, dst + 24);
+}
 
- private:
-  const uint8_t *binary_;
-  const size_t length_;
-  bool swap_endian_;
-  char pad_[7];
-  uint64_t idx_;
-};
+uint64_t XPDSequenceWriter::encodeTable(const uint64_t payload_offset,
+                                        std::vector<uint8_t> *table) const {
+  table->resize(frames_.size() * kSequenceFrameEntrySize);
+  uint64_t offset = payload_offset;
+  for (size_t i = 0; i < frames_.size(); i++) {
+    uint8_t *entry = table->data() + i * kSequenceFrameEntrySize;
+    WriteValue(offset, entry);
+    WriteValue(frames_[i].size, entry + 8);
+    WriteValue(frames_[i].time, entry + 16);
+    WriteValue(uint32_t(frames_[i].keyframe ? 1 : 0), entry + 20);
+    offset += frames_[i].size;
+  }
+  return offset;
+}
 
-static bool ParseXPDHeader(StreamReader *sr, XPDHeader *xpd, std::string *err) {
-  // Header: XPD3
-  uint8_t magic[4];
-  if (!sr->read(4, 4, magic)) {
+bool XPDSequenceWriter::finish(std::vector<uint8_t> *data,
+                               std::string *err) const {
+  if (!data) {
     if (err) {
-      (*err) += "Failed to read magic number.";
+      (*err) += "`data` argument is null.\n";
     }
     return false;
   }
 
-  if ((magic[0] == 'X') && (magic[1] == 'P') && (magic[2] == 'D') &&
-      (magic[3] == '3')) {
-    // ok
-  } else {
+  if (stream_.is_open()) {
     if (err) {
-      (*err) += "Magic number is not a 'XPD3'.";
+      (*err) += "Frames are streamed. Use `finishStream`.\n";
     }
     return false;
   }
 
-  // fileVersion(char)
-  if (!sr->read1(&xpd->fileVersion)) {
+  const uint64_t table_size =
+      uint64_t(frames_.size()) * kSequenceFrameEntrySize;
+  std::vector<uint8_t> table;
+  const uint64_t total =
+      encodeTable(kSequenceHeaderSize + table_size, &table);
+  if (total > uint64_t(std::numeric_limits<size_t>::max())) {
     if (err) {
-      (*err) += "Failed to read `fileVersion'.";
+      (*err) += "Sequence is too large for memory.\n";
     }
     return false;
   }
 
-  // primType
-  if (!sr->read4(reinterpret_cast<uint32_t *>(&xpd->primType))) {
+  data->resize(size_t(total));
+  encodeHeader(kSequenceHeaderSize, data->data());
+  size_t offset = kSequenceHeaderSize;
+  if (!table.empty()) {
+    memcpy(data->data() + offset, table.data(), table.size());
+  }
+  offset += table.size();
+  for (size_t i = 0; i < frames_.size(); i++) {
+    const std::vector<uint8_t> &payload = frames_[i].payload;
+    if (!payload.empty()) {
+      memcpy(data->data() + offset, payload.data(), payload.size());
+    }
+    offset += payload.size();
+  }
+
+  return true;
+}
+
+bool XPDSequenceWriter::finishToFile(const std::string &filename,
+                                     std::string *err) const {
+  if (stream_.is_open()) {
     if (err) {
-      (*err) += "Failed to read `primType'.";
+      (*err) += "Frames are streamed. Use `finishStream`.\n";
     }
     return false;
   }
 
-  // primVersion
-  if (!sr->read1(&xpd->primVersion)) {
+  const uint64_t table_size =
+      uint64_t(frames_.size()) * kSequenceFrameEntrySize;
+  std::vector<uint8_t> index(kSequenceHeaderSize);
+  encodeHeader(kSequenceHeaderSize, index.data());
+  std::vector<uint8_t> table;
+  encodeTable(kSequenceHeaderSize + table_size, &table);
+  index.insert(index.end(), table.begin(), table.end());
+
+  const std::string temp = TempFileName(filename);
+  std::ofstream ofs(temp, std::ios::binary);
+  if (!ofs) {
     if (err) {
-      (*err) += "Failed to read `primVersion'";
+      (*err) += "Failed to open a file for write: " + temp + "\n";
     }
     return false;
   }
 
-  // time
-  if (!sr->read_float(&xpd->time)) {
+  ofs.write(reinterpret_cast<const char *>(index.data()),
+            std::streamsize(index.size()));
+  for (size_t i = 0; ofs && (i < frames_.size()); i++) {
+    ofs.write(reinterpret_cast<const char *>(frames_[i].payload.data()),
+              std::streamsize(frames_[i].payload.size()));
+  }
+  ofs.close();
+
+  if (!ofs || !SyncFile(temp) || !RenameTempFile(temp, filename)) {
+    std::remove(temp.c_str());
     if (err) {
-      (*err) += "Failed to read `time'.";
+      (*err) += "Failed to write a file: " + filename + "\n";
     }
     return false;
   }
 
-  // numCVs
-  if (!sr->read4(&xpd->numCVs)) {
+  return true;
+}
+
+XPDSequenceReader::XPDSequenceReader()
+    : data_(nullptr),
+      length_(0),
+      quantize_step_(0.0f),
+      num_threads_(0),
+      frame_(-1),
+      key_frame_(0),
+      num_deltas_(0) {}
+
+void XPDSequenceReader::close() {
+  file_.close();
+  data_ = nullptr;
+  length_ = 0;
+  frames_.clear();
+  frame_ = -1;
+  runs_.clear();
+  prev_.clear();
+  pprev_.clear();
+  cur_.clear();
+}
+
+bool XPDSequenceReader::open(const std::string &filename, std::string *err) {
+  close();
+  if (!file_.open(filename, err)) {
+    return false;
+  }
+
+  if (!parse(file_.data(), file_.size(), err)) {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+bool XPDSequenceReader::open(const uint8_t *data, const size_t length,
+                             std::string *err) {
+  close();
+  return parse(data, length, err);
+}
+
+bool XPDSequenceReader::parse(const uint8_t *data, const size_t length,
+                              std::string *err) {
+  if (!data || (length < kSequenceHeaderSizeV1) || (data[0] != 'X') ||
+      (data[1] != 'P') || (data[2] != 'D') || (data[3] != 'S')) {
     if (err) {
-      (*err) += "Failed to read `numCVs'.";
+      (*err) += "Not a XPD sequence data.\n";
     }
     return false;
   }
 
-  // coordSpace
-  if (!sr->read4(reinterpret_cast<uint32_t *>(&xpd->coordSpace))) {
+  const uint32_t version = ReadValue<uint32_t>(data + 4);
+  if ((version != 1) && (version != kSequenceVersion)) {
     if (err) {
-      (*err) += "Failed to read `coordSpace'.";
+      (*err) += "Unsupported XPD sequence version " +
+                std::to_string(version) + ".\n";
     }
     return false;
   }
 
-  // numBlocks
-  if (!sr->read4(&xpd->numBlocks)) {
+  if ((version != 1) && (length < kSequenceHeaderSize)) {
     if (err) {
-      (*err) += "Failed to read `numBlocks'.";
+      (*err) += "XPD sequence header exceeds data size.\n";
     }
     return false;
   }
 
-  // blockSize.
-  // Number of characters for all block names combined(including the end of
-  // strinc character for each block)
-  {
-    uint32_t blockSize(0);
-    if (!sr->read4(&blockSize)) {
-      if (err) {
-        (*err) += "Failed to parse `blockSize`.";
-      }
-      return false;
+  const uint32_t num_frames = ReadValue<uint32_t>(data + 8);
+  const float quantize_step = ReadValue<float>(data + 16);
+  const uint64_t table_offset = (version == 1)
+                                    ? uint64_t(kSequenceHeaderSizeV1)
+                                    : ReadValue<uint64_t>(data + 24);
+  if ((table_offset > length) ||
+      ((uint64_t(num_frames) * kSequenceFrameEntrySize) >
+       (length - table_offset))) {
+    if (err) {
+      (*err) += "XPD sequence frame table exceeds data size.\n";
     }
+    return false;
+  }
 
-    std::vector<char> blockNames(blockSize);
-
-    if (!sr->read(blockSize, blockSize,
-                  reinterpret_cast<uint8_t *>(blockNames.data()))) {
+  std::vector<Frame> frames(num_frames);
+  for (uint32_t i = 0; i < num_frames; i++) {
+    const uint8_t *entry =
+        data + table_offset + size_t(i) * kSequenceFrameEntrySize;
+    frames[i].offset = ReadValue<uint64_t>(entry);
+    frames[i].size = ReadValue<uint64_t>(entry + 8);
+    frames[i].time = ReadValue<float>(entry + 16);
+    frames[i].keyframe = (ReadValue<uint32_t>(entry + 20) != 0);
+    if ((frames[i].offset > length) ||
+        (frames[i].size > (length - frames[i].offset))) {
       if (err) {
-        (*err) += "Failed to read `blockNames'.";
+        (*err) += "Frame " + std::to_string(i) + " exceeds data size.\n";
       }
       return false;
     }
+  }
 
-    // split names
-    {
-      size_t last_idx = 0;
-      for (size_t i = 0; i < blockSize; i++) {
-        if (blockNames[i] == '\0') {
-          std::string name(&blockNames[last_idx], &blockNames[i]);
-          xpd->block.push_back(name);
-          last_idx = i + 1;
-        }
-      }
+  if ((num_frames > 0) && !frames[0].keyframe) {
+    if (err) {
+      (*err) += "The first frame of XPD sequence is not a keyframe.\n";
     }
+    return false;
   }
 
-  // primSize
-  {
-    for (size_t i = 0; i < xpd->block.size(); i++) {
-      uint32_t primSize;
-      if (!sr->read4(&primSize)) {
-        if (err) {
-          (*err) += "Failed to read `primSize'.";
-        }
-        return false;
-      }
+  data_ = data;
+  length_ = length;
+  quantize_step_ = quantize_step;
+  frames_.swap(frames);
+  frame_ = -1;
 
-      if (primSize < 1) {
-        // ???
-        if (err) {
-          (*err) += "primSize[" + std::to_string(i) + " is zero.";
-        }
-        return false;
-      }
+  return true;
+}
 
-      xpd->primSize.push_back(primSize);
+bool XPDSequenceReader::loadKeyframe(const uint32_t frame,
+                                     std::string *err) {
+  frame_ = -1;
 
-    }
+  const Frame &key = frames_[frame];
+  XPDHeader header;
+  if (!ParseXPDHeaderFromMemory(data_ + key.offset, size_t(key.size), &header,
+                                err)) {
+    return false;
   }
 
-  // numKeys
-  // Number of characters for all key names combined(including the end of strinc
-  // character for each key)
-  {
-    uint32_t numKeys(0);
-    if (!sr->read4(&numKeys)) {
-      if (err) {
-        (*err) += "Failed to parse `numKeys`.";
-      }
-      return false;
-    }
+  uint64_t num_floats;
+  if (!BuildSequenceCVRuns(header, data_ + key.offset, size_t(key.size),
+                           &runs_, &num_floats, err)) {
+    return false;
+  }
 
-    uint32_t keySize(0);
-    if (!sr->read4(&keySize)) {
-      if (err) {
-        (*err) += "Failed to parse `keySize`.";
-      }
-      return false;
-    }
+  prev_.resize(size_t(num_floats));
+  GatherSequenceCVs(data_ + key.offset, runs_, num_threads_, prev_.data());
+  pprev_.clear();
+  num_deltas_ = 0;
+  key_frame_ = frame;
+  frame_ = frame;
 
-    // keySize may be 0.
-    if (keySize > 0) {
-      std::vector<char> keyNames(keySize);
+  return true;
+}
 
-      if (!sr->read(keySize, keySize,
-                    reinterpret_cast<uint8_t *>(keyNames.data()))) {
-        if (err) {
-          (*err) += "Failed to read `keyNames'.";
-        }
-        return false;
-      }
+bool XPDSequenceReader::applyDelta(const uint32_t frame, std::string *err) {
+  const Frame &delta = frames_[frame];
+  const uint8_t *payload = data_ + delta.offset;
+  const size_t n = prev_.size();
+  const size_t num_chunks =
+      (n + kSequenceChunkValues - 1) / kSequenceChunkValues;
+  const uint64_t table_size = 16 + 8 * uint64_t(num_chunks);
+
+  bool ok = (delta.size >= 16) && (ReadValue<uint64_t>(payload) == n) &&
+            (ReadValue<uint32_t>(payload + 8) == num_chunks) &&
+            (delta.size >= table_size);
+  std::vector<uint64_t> chunk_begin(num_chunks + 1, 0);
+  for (size_t c = 0; ok && (c < num_chunks); c++) {
+    chunk_begin[c + 1] = ReadValue<uint64_t>(payload + 16 + 8 * c);
+    ok = (chunk_begin[c + 1] >= chunk_begin[c]) &&
+         (chunk_begin[c + 1] <= (delta.size - table_size));
+  }
 
-      // split names
-      {
-        size_t last_idx = 0;
-        for (size_t i = 0; i < keySize; i++) {
-          if (keyNames[i] == '\0') {
-            std::string name(&keyNames[last_idx], &keyNames[i]);
-            xpd->key.push_back(name);
-            last_idx = i + 1;
-          }
+  if (ok) {
+    cur_.resize(n);
+    const uint8_t *chunk_data = payload + table_size;
+    const float *pprev = (num_deltas_ > 0) ? pprev_.data() : nullptr;
+    std::atomic<bool> invalid(false);
+    ParallelFor(num_chunks, num_threads_, [&](size_t begin, size_t end) {
+      for (size_t c = begin; c < end; c++) {
+        const size_t first = c * kSequenceChunkValues;
+        const size_t count = std::min(kSequenceChunkValues, n - first);
+        if (!DecodeSequenceChunk(
+                chunk_data + chunk_begin[c],
+                size_t(chunk_begin[c + 1] - chunk_begin[c]),
+                prev_.data() + first, pprev ? pprev + first : nullptr, count,
+                quantize_step_, cur_.data() + first)) {
+          invalid = true;
         }
       }
-    }
+    });
+    ok = !invalid;
   }
 
-  // numFaces
-  if (!sr->read4(&xpd->numFaces)) {
+  if (!ok) {
+    frame_ = -1;
     if (err) {
-      (*err) += "Failed to parse `numFaces`.";
+      (*err) += "Invalid delta data in frame " + std::to_string(frame) +
+                ".\n";
     }
     return false;
   }
 
-  if (xpd->numFaces < 1) {
+  pprev_.swap(prev_);
+  prev_.swap(cur_);
+  num_deltas_++;
+  frame_ = frame;
+
+  return true;
+}
+
+bool XPDSequenceReader::readFrame(const uint32_t frame, XPDHeader *header,
+                                  std::vector<uint8_t> *xpd_data,
+                                  std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileSequenceReadFrame);
+
+  if (!xpd_data) {
     if (err) {
-      (*err) += "numFaces is zero";
+      (*err) += "`xpd_data` argument is null.\n";
     }
     return false;
   }
 
-  // faceid. length = numFaces.
-  xpd->faceid.resize(xpd->numFaces);
-
-  if (!sr->read(sizeof(int32_t) * xpd->numFaces,
-                sizeof(int32_t) * xpd->numFaces,
-                reinterpret_cast<uint8_t *>(xpd->faceid.data()))) {
+  if (frame >= frames_.size()) {
     if (err) {
-      (*err) += "Failed to parse `faceid`.";
+      (*err) += "Frame " + std::to_string(frame) + " out of range.\n";
     }
     return false;
   }
 
-  // numPrims. length = numFaces.
-  xpd->numPrims.resize(xpd->numFaces);
-  if (!sr->read(sizeof(uint32_t) * xpd->numFaces,
-                sizeof(uint32_t) * xpd->numFaces,
-                reinterpret_cast<uint8_t *>(xpd->numPrims.data()))) {
-    if (err) {
-      (*err) += "Failed to parse `numPrims`.";
+  uint32_t key = frame;
+  while (!frames_[key].keyframe) {
+    key--;
+  }
+
+  // Continue from the last decoded frame when it is in the same run.
+  if ((frame_ < 0) || (key_frame_ != key) || (uint64_t(frame_) > frame)) {
+    if (!loadKeyframe(key, err)) {
+      return false;
     }
-    return false;
   }
 
-  // blockPosition. length = numFaces * numBlocks.
-  xpd->blockPosition.resize(xpd->numFaces * xpd->numBlocks);
-  if (!sr->read(sizeof(uint64_t) * xpd->blockPosition.size(),
-                sizeof(uint64_t) * xpd->blockPosition.size(),
-                reinterpret_cast<uint8_t *>(xpd->blockPosition.data()))) {
-    if (err) {
-      (*err) += "Failed to parse `blockPosition`.";
+  while (uint64_t(frame_) < frame) {
+    if (!applyDelta(uint32_t(frame_ + 1), err)) {
+      return false;
     }
-    return false;
+  }
+
+  const Frame &k = frames_[key_frame_];
+  xpd_data->assign(data_ + k.offset, data_ + k.offset + k.size);
+  ScatterSequenceCVs(prev_.data(), runs_, num_threads_, xpd_data->data());
+  memcpy(xpd_data->data() + kXPDTimeOffset, &frames_[frame].time,
+         sizeof(float));
+
+  if (header) {
+    return ParseXPDHeaderFromMemory(xpd_data->data(), xpd_data->size(),
+                                    header, err);
   }
 
   return true;
 }
 
-bool ParseXPDFromFile(const std::string &filename, XPDHeader *xpd_header,
-                      std::vector<uint8_t> *binary, std::string *err) {
-  if (filename.empty()) {
-    if (err) {
-      (*err) = "`filename` is empty.\n";
+// ---------------------------------------------
+// Reductions.
+
+// Where values of a reduction are read from.
+struct ReductionSource {
+  enum Kind {
+    PrimValue = 0,  // A float in each prim at `offset`.
+    CVComponent,    // Component `offset` of all CVs.
+    CVCount         // CV count of each prim.
+  };
+
+  Kind kind;
+  uint32_t offset;
+
+  ReductionSource() : kind(PrimValue), offset(0) {}
+};
+
+// `layout` is null for blocks which are not splines.
+static bool ResolveReductionSource(const XPDHeader &xpd,
+                                   const uint32_t block_id,
+                                   const XPDSplineLayout *layout,
+                                   const std::string &name,
+                                   ReductionSource *source) {
+  if (layout) {
+    const char *attrib_names[10] = {
+        "id",         "u",          "v",
+        "length",     "width",      "taper",
+        "taperStart", "widthVector.x", "widthVector.y",
+        "widthVector.z"};
+    const uint32_t attrib_offsets[10] = {
+        layout->id,         layout->u,
+        layout->v,          layout->length,
+        layout->width,      layout->taper,
+        layout->taperStart, layout->widthVector,
+        layout->widthVector + 1, layout->widthVector + 2};
+    for (uint32_t a = 0; a < 10; a++) {
+      if (name == attrib_names[a]) {
+        source->kind = ReductionSource::PrimValue;
+        source->offset = attrib_offsets[a];
+        return true;
+      }
     }
 
-    return false;
+    const char *cv_names[3] = {"cv.x", "cv.y", "cv.z"};
+    for (uint32_t k = 0; k < 3; k++) {
+      if (name == cv_names[k]) {
+        source->kind = ReductionSource::CVComponent;
+        source->offset = k;
+        return true;
+      }
+    }
+
+    if (name == "numCVs") {
+      source->kind = ReductionSource::CVCount;
+      return true;
+    }
   }
 
-  if (!xpd_header) {
-    if (err) {
-      (*err) = "`xpd_header` argument is null.\n";
+  // Channel or raw prim value: `name` or `name[component]`.
+  std::string channel_name = name;
+  uint32_t component = 0;
+  const size_t bracket = name.find('[');
+  if ((bracket != std::string::npos) && (name.back() == ']')) {
+    channel_name = name.substr(0, bracket);
+    for (size_t i = bracket + 1; (i + 1) < name.size(); i++) {
+      if ((name[i] < '0') || (name[i] > '9') || (component > 0xffffff)) {
+        return false;
+      }
+      component = component * 10 + uint32_t(name[i] - '0');
     }
+  }
 
-    return false;
+  XPDChannel channel;
+  if (FindChannel(xpd, xpd.block[block_id], channel_name, &channel)) {
+    if (component >= channel.arity) {
+      return false;
+    }
+    source->kind = ReductionSource::PrimValue;
+    source->offset = channel.offset + component;
+    return true;
   }
 
-  if (!binary) {
-    if (err) {
-      (*err) = "`binary` argument is null.\n";
+  if ((channel_name == "value") && (channel_name != name) &&
+      (component < xpd.primSize[block_id])) {
+    source->kind = ReductionSource::PrimValue;
+    source->offset = component;
+    return true;
+  }
+  return false;
+}
+
+// Partial result of a reduction. Merging is exact and order independent.
+// Sums are accumulated per face and added in face order instead, so results
+// do not depend on the number of threads or scheduling.
+struct ReductionAccumulator {
+  float min;
+  float max;
+  uint64_t count;
+  uint64_t nonFinite;
+  uint64_t underflow;
+  uint64_t overflow;
+  std::vector<uint64_t> histogram;
+
+  explicit ReductionAccumulator(const XPDReduction &r)
+      : min(std::numeric_limits<float>::infinity()),
+        max(-std::numeric_limits<float>::infinity()),
+        count(0),
+        nonFinite(0),
+        underflow(0),
+        overflow(0) {
+    if (r.ops & XPDReduction::ReduceHistogram) {
+      histogram.assign(r.histogramBins, 0);
     }
+  }
 
-    return false;
+  void merge(const ReductionAccumulator &rhs) {
+    min = std::min(min, rhs.min);
+    max = std::max(max, rhs.max);
+    count += rhs.count;
+    nonFinite += rhs.nonFinite;
+    underflow += rhs.underflow;
+    overflow += rhs.overflow;
+    for (size_t i = 0; i < histogram.size(); i++) {
+      histogram[i] += rhs.histogram[i];
+    }
+  }
+};
+
+// Ops computed by the min/max/sum pass of `AccumulateValues`.
+static const uint32_t kReduceStatOps =
+    XPDReduction::ReduceMin | XPDReduction::ReduceMax |
+    XPDReduction::ReduceSum | XPDReduction::ReduceNonFinite |
+    XPDReduction::ReducePerFace;
+
+// Accumulate `n` values `get(i)`. Finite values are counted in `face_count`
+// and summed in `face_sum`. Passes of disabled ops are skipped.
+template <typename Getter>
+static void AccumulateValues(const size_t n, const Getter &get,
+                             const XPDReduction &r,
+                             ReductionAccumulator *acc, uint64_t *face_count,
+                             double *face_sum) {
+  const bool stats = (r.ops & kReduceStatOps) != 0;
+  uint64_t bad = 0;
+  if (stats) {
+    // Branch free so the loop can be vectorized.
+    float lo = acc->min, hi = acc->max;
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      const float v = get(i);
+      // All exponent bits set is NaN or Inf. No float compare(-Wfloat-equal,
+      // -ffast-math).
+      const bool finite = (FloatToBits(v) & 0x7f800000u) != 0x7f800000u;
+      bad += finite ? 0 : 1;
+      lo = finite ? std::min(lo, v) : lo;
+      hi = finite ? std::max(hi, v) : hi;
+      sum += finite ? double(v) : 0.0;
+    }
+    acc->min = lo;
+    acc->max = hi;
+    (*face_sum) += sum;
+  }
+
+  if (!acc->histogram.empty()) {
+    const uint32_t bins = uint32_t(acc->histogram.size());
+    const float scale = float(bins) / (r.histogramMax - r.histogramMin);
+    for (size_t i = 0; i < n; i++) {
+      const float v = get(i);
+      if ((FloatToBits(v) & 0x7f800000u) == 0x7f800000u) {
+        bad += stats ? 0 : 1;
+        continue;
+      } else if (v < r.histogramMin) {
+        acc->underflow++;
+      } else if (v > r.histogramMax) {
+        acc->overflow++;
+      } else {
+        const uint32_t bin = uint32_t((v - r.histogramMin) * scale);
+        acc->histogram[std::min(bin, bins - 1)]++;
+      }
+    }
   }
 
-  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
-  if (!ifs) {
+  acc->count += n - bad;
+  acc->nonFinite += bad;
+  (*face_count) += n - bad;
+}
+
+bool ReduceSplineAttributes(const XPDHeader &xpd, const uint8_t *binary,
+                            const size_t binary_length,
+                            const uint32_t block_id,
+                            const std::vector<XPDReduction> &reductions,
+                            const XPDReduceOption &option,
+                            std::vector<XPDReductionResult> *results,
+                            std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileReduceSplineAttributes);
+
+  if (!results) {
     if (err) {
-      (*err) = "Failed to open a file.\n";
+      (*err) += "`results` argument is null.\n";
     }
     return false;
   }
 
-  // Read whole content of XPD file.
-  ifs.seekg(0, ifs.end);
-  size_t sz = static_cast<size_t>(ifs.tellg());
-  if (int64_t(sz) < 0) {
-    // Looks reading directory, not a file.
+  if ((block_id >= xpd.block.size()) || (block_id >= xpd.primSize.size())) {
     if (err) {
-      (*err) += "Looks like filename is a directory.\n";
+      (*err) += "Block index " + std::to_string(block_id) + " out of range.\n";
     }
     return false;
   }
 
-  if (sz < 16) {
-    // ???
-    if (err) {
-      (*err) +=
-          "File size too short. Looks like this file is not a XPD format.\n";
+  // Blocks which are not splines only provide channels and `value[i]`.
+  XPDSplineLayout layout;
+  std::string layout_err;
+  const bool spline = GetSplineLayout(xpd, block_id, &layout, &layout_err);
+
+  const size_t num_reductions = reductions.size();
+  std::vector<ReductionSource> sources(num_reductions);
+  for (size_t r = 0; r < num_reductions; r++) {
+    const XPDReduction &reduction = reductions[r];
+    if (!ResolveReductionSource(xpd, block_id, spline ? &layout : nullptr,
+                                reduction.attribute, &sources[r])) {
+      if (err) {
+        (*err) += "Unknown attribute: " + reduction.attribute + "\n";
+        if (!spline) {
+          (*err) += layout_err;
+        }
+      }
+      return false;
+    }
+    if ((reduction.ops & XPDReduction::ReduceHistogram) &&
+        ((reduction.histogramBins == 0) ||
+         !(reduction.histogramMax > reduction.histogramMin))) {
+      if (err) {
+        (*err) += "Invalid histogram range or bins for " +
+                  reduction.attribute + "\n";
+      }
+      return false;
     }
+  }
+
+  std::vector<XPDBlockView> views;
+  std::vector<size_t> prim_offsets;
+  if (!PrepareFaceViews(xpd, binary, binary_length, block_id, &views,
+                        &prim_offsets, err)) {
     return false;
   }
 
-  binary->resize(sz);
+  uint32_t ext_block_id;
+  const bool varying =
+      spline && FindVaryingCVBlock(xpd, block_id, &ext_block_id);
+  std::vector<XPDVaryingCVView> cv_views;
+  if (varying) {
+    cv_views.resize(xpd.numFaces);
+    for (uint32_t f = 0; f < xpd.numFaces; f++) {
+      if (!GetVaryingCVView(xpd, binary, binary_length, f, block_id,
+                            &cv_views[f], err)) {
+        return false;
+      }
+    }
+  }
 
-  ifs.seekg(0, ifs.beg);
-  ifs.read(reinterpret_cast<char *>(binary->data()),
-           static_cast<std::streamsize>(sz));
+  results->assign(num_reductions, XPDReductionResult());
+  for (size_t r = 0; r < num_reductions; r++) {
+    if (reductions[r].ops & XPDReduction::ReducePerFace) {
+      (*results)[r].faceCount.assign(xpd.numFaces, 0);
+      (*results)[r].faceSum.assign(xpd.numFaces, 0.0);
+    }
+  }
 
-  bool ret =
-      ParseXPDHeaderFromMemory(binary->data(), binary->size(), xpd_header, err);
+  std::vector<ReductionAccumulator> totals;
+  for (size_t r = 0; r < num_reductions; r++) {
+    totals.push_back(ReductionAccumulator(reductions[r]));
+  }
+  std::mutex merge_mutex;
 
-  return ret;
-}
+  // Sum of each face. [numFaces][num_reductions]
+  std::vector<double> face_sums(size_t(xpd.numFaces) * num_reductions, 0.0);
 
-bool ParseXPDHeaderFromMemory(const uint8_t *binary, const size_t binary_length,
-                              XPDHeader *xpd_header, std::string *err) {
-  if (!xpd_header) {
-    if (err) {
-      (*err) = "`xpd_header` argument is null.\n";
+  ParallelFor(xpd.numFaces, option.numThreads, [&](size_t begin, size_t end) {
+    std::vector<ReductionAccumulator> partials;
+    for (size_t r = 0; r < num_reductions; r++) {
+      partials.push_back(ReductionAccumulator(reductions[r]));
     }
 
-    return false;
-  }
+    for (size_t f = begin; f < end; f++) {
+      const XPDBlockView &view = views[f];
+      for (size_t r = 0; r < num_reductions; r++) {
+        const XPDReduction &reduction = reductions[r];
+        if (reduction.ops == 0) {
+          continue;
+        }
+        ReductionAccumulator *acc = &partials[r];
+        uint64_t face_count = 0;
+        double face_sum = 0.0;
+
+        if (sources[r].kind == ReductionSource::PrimValue) {
+          const uint8_t *src = view.data + sources[r].offset * sizeof(float);
+          const size_t stride = view.stride();
+          AccumulateValues(
+              view.numPrims,
+              [src, stride](size_t p) {
+                float v;
+                memcpy(&v, src + p * stride, sizeof(float));
+                return v;
+              },
+              reduction, acc, &face_count, &face_sum);
+        } else if (sources[r].kind == ReductionSource::CVCount) {
+          const XPDVaryingCVView *cv_view = varying ? &cv_views[f] : nullptr;
+          const uint32_t num_cvs = layout.numCVs;
+          AccumulateValues(
+              view.numPrims,
+              [cv_view, num_cvs](size_t p) {
+                return float(cv_view ? cv_view->count(p) : num_cvs);
+              },
+              reduction, acc, &face_count, &face_sum);
+        } else {
+          for (size_t p = 0; p < view.numPrims; p++) {
+            const uint8_t *cvs =
+                varying ? cv_views[f].cvData(p)
+                        : view.data + p * view.stride() +
+                              layout.cv * sizeof(float);
+            cvs += sources[r].offset * sizeof(float);
+            AccumulateValues(
+                varying ? cv_views[f].count(p) : layout.numCVs,
+                [cvs](size_t i) {
+                  float v;
+                  memcpy(&v, cvs + i * 3 * sizeof(float), sizeof(float));
+                  return v;
+                },
+                reduction, acc, &face_count, &face_sum);
+          }
+        }
 
-  if (!binary) {
-    if (err) {
-      (*err) = "`binary` argument is null\n";
+        face_sums[f * num_reductions + r] = face_sum;
+        if (reduction.ops & XPDReduction::ReducePerFace) {
+          (*results)[r].faceCount[f] = face_count;
+          (*results)[r].faceSum[f] = face_sum;
+        }
+      }
     }
 
-    return false;
+    std::lock_guard<std::mutex> lock(merge_mutex);
+    for (size_t r = 0; r < num_reductions; r++) {
+      totals[r].merge(partials[r]);
+    }
+  });
+
+  for (size_t r = 0; r < num_reductions; r++) {
+    const ReductionAccumulator &total = totals[r];
+    XPDReductionResult &result = (*results)[r];
+    const uint32_t ops = reductions[r].ops;
+    result.count = total.count;
+    if (total.count > 0) {
+      result.min = (ops & XPDReduction::ReduceMin) ? total.min : 0.0f;
+      result.max = (ops & XPDReduction::ReduceMax) ? total.max : 0.0f;
+    }
+    if (ops & XPDReduction::ReduceSum) {
+      // In face order, so the result is deterministic.
+      double sum = 0.0;
+      for (size_t f = 0; f < xpd.numFaces; f++) {
+        sum += face_sums[f * num_reductions + r];
+      }
+      result.sum = sum;
+    }
+    result.nonFinite =
+        (ops & XPDReduction::ReduceNonFinite) ? total.nonFinite : 0;
+    result.histogram = total.histogram;
+    result.underflow = total.underflow;
+    result.overflow = total.overflow;
   }
 
-  if (binary_length < 16) {
-    if (err) {
-      (*err) = "`binary_length` is too short. It looks its not a XPD data\n";
-    }
+  return true;
+}
 
-    return false;
+// ---------------------------------------------
+// Strand rebinding.
+
+// Closest point on triangle(a, b, c) to p(Real-Time Collision Detection,
+// 5.1.5). Returns squared distance and barycentric weights of b and c.
+static float ClosestPointOnTriangle(const float p[3], const float a[3],
+                                    const float b[3], const float c[3],
+                                    float *wb, float *wc) {
+  float ab[3], ac[3], ap[3];
+  for (int k = 0; k < 3; k++) {
+    ab[k] = b[k] - a[k];
+    ac[k] = c[k] - a[k];
+    ap[k] = p[k] - a[k];
   }
 
-  // TODO(syoyo): Consider endianness
-  StreamReader sr(binary, binary_length, /* swap endian */ false);
+  const float d1 = ab[0] * ap[0] + ab[1] * ap[1] + ab[2] * ap[2];
+  const float d2 = ac[0] * ap[0] + ac[1] * ap[1] + ac[2] * ap[2];
 
-  if (!ParseXPDHeader(&sr, xpd_header, err)) {
-    return false;
+  float v = 0.0f, w = 0.0f;
+  float bp[3], cp[3];
+  for (int k = 0; k < 3; k++) {
+    bp[k] = p[k] - b[k];
+    cp[k] = p[k] - c[k];
+  }
+  const float d3 = ab[0] * bp[0] + ab[1] * bp[1] + ab[2] * bp[2];
+  const float d4 = ac[0] * bp[0] + ac[1] * bp[1] + ac[2] * bp[2];
+  const float d5 = ab[0] * cp[0] + ab[1] * cp[1] + ab[2] * cp[2];
+  const float d6 = ac[0] * cp[0] + ac[1] * cp[1] + ac[2] * cp[2];
+  const float va = d3 * d6 - d5 * d4;
+  const float vb = d5 * d2 - d1 * d6;
+  const float vc = d1 * d4 - d3 * d2;
+
+  if ((d1 <= 0.0f) && (d2 <= 0.0f)) {
+    // Vertex a.
+  } else if ((d3 >= 0.0f) && (d4 <= d3)) {
+    v = 1.0f;
+  } else if ((d6 >= 0.0f) && (d5 <= d6)) {
+    w = 1.0f;
+  } else if ((vc <= 0.0f) && (d1 >= 0.0f) && (d3 <= 0.0f)) {
+    v = d1 / (d1 - d3);
+  } else if ((vb <= 0.0f) && (d2 >= 0.0f) && (d6 <= 0.0f)) {
+    w = d2 / (d2 - d6);
+  } else if ((va <= 0.0f) && ((d4 - d3) >= 0.0f) && ((d5 - d6) >= 0.0f)) {
+    w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+    v = 1.0f - w;
+  } else {
+    const float denom = 1.0f / (va + vb + vc);
+    v = vb * denom;
+    w = vc * denom;
   }
 
-  return true;
+  float dist2 = 0.0f;
+  for (int k = 0; k < 3; k++) {
+    const float d = a[k] + ab[k] * v + ac[k] * w - p[k];
+    dist2 += d * d;
+  }
+  (*wb) = v;
+  (*wc) = w;
+  return dist2;
 }
 
-bool SerializeToXPD(XPDHeaderInput &input, std::vector<uint8_t> &prim_data, std::vector<uint8_t> *xpd_binary, std::string *err) {
+// Mesh triangles bucketed in a uniform grid.
+class TriangleGrid {
+ public:
+  struct Triangle {
+    uint32_t face;
+    uint32_t v[3];
+    // uv of the triangle corners in the face. Quads are split into 2
+    // triangles, so uv is linear on each half.
+    float uv[3][2];
+  };
+
+  bool build(const XPDRebindMesh &mesh, std::string *err);
+
+  // Find the closest triangle to `p`. Return false when `p` is not finite.
+  // `stamp` is a per-thread scratch of
+  // `numTriangles()` elements(initialized to 0) and `query` must be unique
+  // per query within a thread.
+  bool closest(const float p[3], std::vector<uint32_t> *stamp,
+               const uint32_t query, uint32_t *tri, float *u, float *v,
+               float *dist2) const;
+
+  size_t numTriangles() const { return triangles_.size(); }
+  const Triangle &triangle(const size_t i) const { return triangles_[i]; }
 
-  if (prim_data.size() < 4) {
-    if (err) {
-      (*err) += "Data size too short for primitive data.\n";
+ private:
+  // Clamped in float, so the conversion to int is defined for any finite
+  // `p`.
+  void cellOf(const float p[3], int c[3]) const {
+    for (int k = 0; k < 3; k++) {
+      const float i = std::floor((p[k] - origin_[k]) / cell_size_);
+      c[k] = int(std::max(0.0f, std::min(float(res_[k] - 1), i)));
     }
-    return false;
   }
 
-  if (!xpd_binary) {
-    if (err) {
-      (*err) += "Pointer to `xpd_binary' is null.\n";
+  const float *vertex(const uint32_t i) const { return &vertices_[3 * i]; }
+
+  std::vector<float> vertices_;
+  std::vector<Triangle> triangles_;
+  float origin_[3];
+  float cell_size_;
+  int res_[3];
+  std::vector<uint32_t> cell_start_;  // [numCells + 1]
+  std::vector<uint32_t> cell_tris_;
+};
+
+bool TriangleGrid::build(const XPDRebindMesh &mesh, std::string *err) {
+  const size_t num_vertices = mesh.vertices.size() / 3;
+  vertices_ = mesh.vertices;
+  triangles_.clear();
+
+  size_t index = 0;
+  for (size_t f = 0; f < mesh.faceVertexCounts.size(); f++) {
+    const uint32_t n = mesh.faceVertexCounts[f];
+    if (((n != 3) && (n != 4)) ||
+        ((index + n) > mesh.faceVertexIndices.size())) {
+      if (err) {
+        (*err) += "Face " + std::to_string(f) +
+                  " must have 3 or 4 vertices within `faceVertexIndices`.\n";
+      }
+      return false;
     }
-    return false;
+    const uint32_t *fv = &mesh.faceVertexIndices[index];
+    for (uint32_t i = 0; i < n; i++) {
+      if (fv[i] >= num_vertices) {
+        if (err) {
+          (*err) += "Vertex index out of range in face " + std::to_string(f) +
+                    ".\n";
+        }
+        return false;
+      }
+      const float *p = vertex(fv[i]);
+      if (!std::isfinite(p[0]) || !std::isfinite(p[1]) ||
+          !std::isfinite(p[2])) {
+        if (err) {
+          (*err) += "Non-finite vertex in face " + std::to_string(f) + ".\n";
+        }
+        return false;
+      }
+    }
+
+    Triangle t;
+    t.face = uint32_t(f);
+    if (n == 3) {
+      const float uv[3][2] = {{0.0f, 0.0f}, {1.0f, 0.0f}, {0.0f, 1.0f}};
+      memcpy(t.v, fv, sizeof(t.v));
+      memcpy(t.uv, uv, sizeof(t.uv));
+      triangles_.push_back(t);
+    } else {
+      const float uv0[3][2] = {{0.0f, 0.0f}, {1.0f, 0.0f}, {1.0f, 1.0f}};
+      const uint32_t v0[3] = {fv[0], fv[1], fv[2]};
+      memcpy(t.v, v0, sizeof(t.v));
+      memcpy(t.uv, uv0, sizeof(t.uv));
+      triangles_.push_back(t);
+
+      const float uv1[3][2] = {{0.0f, 0.0f}, {1.0f, 1.0f}, {0.0f, 1.0f}};
+      const uint32_t v1[3] = {fv[0], fv[2], fv[3]};
+      memcpy(t.v, v1, sizeof(t.v));
+      memcpy(t.uv, uv1, sizeof(t.uv));
+      triangles_.push_back(t);
+    }
+    index += n;
   }
 
-  if (input.numFaces == 0) {
+  if (triangles_.empty()) {
     if (err) {
-      (*err) += "`numFaces' is zero.\n";
+      (*err) += "Mesh has no faces.\n";
     }
     return false;
   }
 
-  if (input.numBlocks == 0) {
-    if (err) {
-      (*err) += "`numBlocks' is zero.\n";
+  float bmin[3], bmax[3];
+  for (int k = 0; k < 3; k++) {
+    bmin[k] = std::numeric_limits<float>::max();
+    bmax[k] = -std::numeric_limits<float>::max();
+  }
+  for (size_t t = 0; t < triangles_.size(); t++) {
+    for (int i = 0; i < 3; i++) {
+      const float *p = vertex(triangles_[t].v[i]);
+      for (int k = 0; k < 3; k++) {
+        bmin[k] = std::min(bmin[k], p[k]);
+        bmax[k] = std::max(bmax[k], p[k]);
+      }
     }
-    return false;
   }
 
-  if (input.faceid.size() == 0) {
-    if (err) {
-      (*err) += "Array length of `faceid` is zero.\n";
+  // Find the cell size giving about one cell per triangle.
+  float extent[3];
+  float max_extent = 0.0f;
+  for (int k = 0; k < 3; k++) {
+    extent[k] = bmax[k] - bmin[k];
+    max_extent = std::max(max_extent, extent[k]);
+  }
+  if (!(max_extent > 0.0f)) {
+    max_extent = 1.0f;
+  }
+  const double target = double(triangles_.size());
+  double lo = double(max_extent) / 1024.0, hi = double(max_extent);
+  for (int i = 0; i < 32; i++) {
+    const double mid = 0.5 * (lo + hi);
+    double cells = 1.0;
+    for (int k = 0; k < 3; k++) {
+      cells *= std::max(1.0, std::ceil(double(extent[k]) / mid));
     }
-    return false;
+    if (cells > target) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  cell_size_ = float(hi);
+
+  size_t num_cells = 1;
+  for (int k = 0; k < 3; k++) {
+    origin_[k] = bmin[k];
+    res_[k] = std::max(1, std::min(1024, int(std::ceil(extent[k] /
+                                                       cell_size_))));
+    num_cells *= size_t(res_[k]);
   }
 
-  if (input.numPrims.size() == 0) {
-    if (err) {
-      (*err) += "Array length of `numPrims` is zero.\n";
+  // Bucket triangles by bounding box(counting pass, then fill).
+  std::vector<int> ranges(triangles_.size() * 6);
+  cell_start_.assign(num_cells + 1, 0);
+  for (size_t t = 0; t < triangles_.size(); t++) {
+    float tmin[3], tmax[3];
+    for (int k = 0; k < 3; k++) {
+      tmin[k] = std::min(vertex(triangles_[t].v[0])[k],
+                         std::min(vertex(triangles_[t].v[1])[k],
+                                  vertex(triangles_[t].v[2])[k]));
+      tmax[k] = std::max(vertex(triangles_[t].v[0])[k],
+                         std::max(vertex(triangles_[t].v[1])[k],
+                                  vertex(triangles_[t].v[2])[k]));
     }
-    return false;
+    int *r = &ranges[t * 6];
+    cellOf(tmin, r);
+    cellOf(tmax, r + 3);
+    for (int z = r[2]; z <= r[5]; z++) {
+      for (int y = r[1]; y <= r[4]; y++) {
+        for (int x = r[0]; x <= r[3]; x++) {
+          cell_start_[(size_t(z) * size_t(res_[1]) + size_t(y)) *
+                          size_t(res_[0]) +
+                      size_t(x) + 1]++;
+        }
+      }
+    }
+  }
+  for (size_t c = 0; c < num_cells; c++) {
+    cell_start_[c + 1] += cell_start_[c];
   }
 
-  if (input.blockOffset.size() == 0) {
-    if (err) {
-      (*err) += "Array length of `blockOffset` is zero.\n";
+  cell_tris_.resize(cell_start_[num_cells]);
+  std::vector<uint32_t> next(cell_start_.begin(), cell_start_.end() - 1);
+  for (size_t t = 0; t < triangles_.size(); t++) {
+    const int *r = &ranges[t * 6];
+    for (int z = r[2]; z <= r[5]; z++) {
+      for (int y = r[1]; y <= r[4]; y++) {
+        for (int x = r[0]; x <= r[3]; x++) {
+          cell_tris_[next[(size_t(z) * size_t(res_[1]) + size_t(y)) *
+                              size_t(res_[0]) +
+                          size_t(x)]++] = uint32_t(t);
+        }
+      }
     }
+  }
+
+  return true;
+}
+
+bool TriangleGrid::closest(const float p[3], std::vector<uint32_t> *stamp,
+                           const uint32_t query, uint32_t *tri, float *u,
+                           float *v, float *dist2) const {
+  if (!std::isfinite(p[0]) || !std::isfinite(p[1]) || !std::isfinite(p[2])) {
     return false;
   }
 
-  if (input.numFaces != (input.faceid.size())) {
-    if (err) {
-      (*err) += "`numFaces`(" + std::to_string(input.numFaces) + ") must be same with `faceid`.size() which is " + std::to_string(input.faceid.size()) + ".\n";
+  int c[3];
+  cellOf(p, c);
+
+  float best = std::numeric_limits<float>::max();
+  uint32_t best_tri = 0;
+  float best_wb = 0.0f, best_wc = 0.0f;
+  bool found = false;
+
+  // Visit shells of cells around `c` until no unvisited cell can be closer.
+  for (int ring = 0;; ring++) {
+    int lo[3], hi[3];
+    bool whole = true;
+    for (int k = 0; k < 3; k++) {
+      lo[k] = std::max(0, c[k] - ring);
+      hi[k] = std::min(res_[k] - 1, c[k] + ring);
+      whole = whole && (lo[k] == 0) && (hi[k] == (res_[k] - 1));
+    }
+
+    for (int z = lo[2]; z <= hi[2]; z++) {
+      for (int y = lo[1]; y <= hi[1]; y++) {
+        for (int x = lo[0]; x <= hi[0]; x++) {
+          // Only the shell(inner cells were visited in previous rings).
+          if ((std::abs(x - c[0]) != ring) && (std::abs(y - c[1]) != ring) &&
+              (std::abs(z - c[2]) != ring)) {
+            continue;
+          }
+          const size_t cell =
+              (size_t(z) * size_t(res_[1]) + size_t(y)) * size_t(res_[0]) +
+              size_t(x);
+          for (uint32_t i = cell_start_[cell]; i < cell_start_[cell + 1];
+               i++) {
+            const uint32_t t = cell_tris_[i];
+            if ((*stamp)[t] == query) {
+              continue;
+            }
+            (*stamp)[t] = query;
+
+            float wb, wc;
+            const float d2 = ClosestPointOnTriangle(
+                p, vertex(triangles_[t].v[0]), vertex(triangles_[t].v[1]),
+                vertex(triangles_[t].v[2]), &wb, &wc);
+            if (d2 < best) {
+              best = d2;
+              best_tri = t;
+              best_wb = wb;
+              best_wc = wc;
+              found = true;
+            }
+          }
+        }
+      }
+    }
+
+    if (whole) {
+      break;
+    }
+
+    // Lower bound of the distance to cells not visited yet.
+    float bound = std::numeric_limits<float>::max();
+    for (int k = 0; k < 3; k++) {
+      if (lo[k] > 0) {
+        bound = std::min(bound,
+                         p[k] - (origin_[k] + float(lo[k]) * cell_size_));
+      }
+      if (hi[k] < (res_[k] - 1)) {
+        bound = std::min(bound,
+                         (origin_[k] + float(hi[k] + 1) * cell_size_) - p[k]);
+      }
+    }
+    bound = std::max(bound, 0.0f);
+    if (found && (best <= bound * bound)) {
+      break;
     }
+  }
+
+  if (!found) {
     return false;
   }
 
-  if ((input.numFaces * input.numBlocks) != (input.blockOffset.size())) {
+  const Triangle &t = triangles_[best_tri];
+  const float wa = 1.0f - best_wb - best_wc;
+  (*tri) = best_tri;
+  (*u) = wa * t.uv[0][0] + best_wb * t.uv[1][0] + best_wc * t.uv[2][0];
+  (*v) = wa * t.uv[0][1] + best_wb * t.uv[1][1] + best_wc * t.uv[2][1];
+  (*dist2) = best;
+  return true;
+}
+
+// Validate inputs, bind strands to `mesh`, and build the header input,
+// serialize options and an encode callback(see `PrepareReorder`). `ctx` is
+// referenced by the callback.
+static bool PrepareRebind(const XPDHeader &xpd, const uint8_t *binary,
+                          const size_t binary_length, const uint32_t block_id,
+                          const XPDRebindMesh &mesh,
+                          const XPDRebindOption &option, ReorderContext *ctx,
+                          XPDHeaderInput *input,
+                          XPDParallelSerializeOption *serialize_option,
+                          XPDEncodeBlockCallback *encode,
+                          XPDRebindStats *stats, std::string *err) {
+  if ((xpd.coordSpace != Xpd::CoordSpace::World) &&
+      (xpd.coordSpace != Xpd::CoordSpace::Object)) {
     if (err) {
-      (*err) += "`numFaces * numBlocks`(" + std::to_string(input.numFaces * input.numBlocks) + ") must be same with `blockOffset`.size() which is " + std::to_string(input.blockOffset.size()) + ".\n";
+      (*err) += "Rebinding requires CVs in World or Object space.\n";
     }
+    return false;
   }
 
-  if (input.block.size() != (input.primSize.size())) {
+  const size_t num_faces = mesh.faceVertexCounts.size();
+  if (!mesh.faceid.empty() && (mesh.faceid.size() != num_faces)) {
     if (err) {
-      (*err) += "`block.size()`(" + std::to_string(input.block.size()) + ") must be same with `primSize.size()`(" + std::to_string(input.primSize.size()) + ".\n";
+      (*err) += "Size of `faceid` must be the number of mesh faces.\n";
     }
     return false;
   }
 
-  std::ostringstream ss;
-
-  // TODO(syoyo): Consider endinanness.
-  {
-    // magic
-    char magic[4] = {'X', 'P', 'D', '3'};
-    ss.write(magic, 4);
-
-    // fileVersion(char)
-    ss.write(reinterpret_cast<const char *>(&input.fileVersion), 1);
-
-    ss.write(reinterpret_cast<const char *>(&input.primType), sizeof(uint32_t));
-    ss.write(reinterpret_cast<const char *>(&input.primVersion), 1);
-    ss.write(reinterpret_cast<const char *>(&input.time), sizeof(float));
-
-    ss.write(reinterpret_cast<const char *>(&input.numCVs), sizeof(uint32_t));
-    ss.write(reinterpret_cast<const char *>(&input.coordSpace), sizeof(uint32_t));
+  if (!GetSplineLayout(xpd, block_id, &ctx->uvLayout, err)) {
+    return false;
+  }
 
+  std::vector<uint32_t> prim_offset;
+  if (!PrepareReorderViews(xpd, binary, binary_length, ctx, &prim_offset,
+                           err)) {
+    return false;
   }
 
-  // block
-  {
-    ss.write(reinterpret_cast<const char *>(&input.numBlocks), sizeof(uint32_t));
+  TriangleGrid grid;
+  if (!grid.build(mesh, err)) {
+    return false;
+  }
 
-    // Build a string with flattened block names(using delimiter '\0')
-    uint32_t block_name_size = 0;
-    std::string block_name_str;
-    for (size_t i = 0; i < input.numBlocks; i++) {
-      block_name_str += input.block[i];
-      block_name_str += '\0';
+  // Find the new face and u/v of each strand root. Roots are the first CVs
+  // of the spline block(also with the variable CV count extension).
+  const uint32_t num_old_faces = xpd.numFaces;
+  const size_t num_curves = prim_offset[num_old_faces];
+  const uint32_t kDropped = 0xffffffffu;
+  std::vector<uint32_t> new_face(num_curves, kDropped);
+  std::vector<float> uv(num_curves * 2, 0.0f);
+  std::vector<float> dist2(num_curves, 0.0f);
+  const float max_dist2 = option.maxDistance * option.maxDistance;
+  const uint32_t cv = ctx->uvLayout.cv;
+
+  ParallelFor(num_old_faces, option.numThreads, [&](size_t begin, size_t end) {
+    std::vector<uint32_t> stamp(grid.numTriangles(), 0);
+    uint32_t query = 0;
+    for (size_t f = begin; f < end; f++) {
+      const XPDBlockView &view = ctx->views[f * ctx->numBlocks + block_id];
+      for (size_t p = 0; p < view.numPrims; p++) {
+        const size_t i = prim_offset[f] + p;
+        const float root[3] = {view.get(p, cv + 0), view.get(p, cv + 1),
+                               view.get(p, cv + 2)};
+
+        if (++query == 0) {
+          std::fill(stamp.begin(), stamp.end(), 0);
+          query = 1;
+        }
 
-      block_name_size += input.block[i].size() + 1; // +1 for '\0'
+        uint32_t tri;
+        float u, v, d2;
+        if (!grid.closest(root, &stamp, query, &tri, &u, &v, &d2)) {
+          continue;
+        }
+        if ((option.maxDistance > 0.0f) && (d2 > max_dist2)) {
+          continue;
+        }
+        new_face[i] = grid.triangle(tri).face;
+        uv[2 * i + 0] = u;
+        uv[2 * i + 1] = v;
+        dist2[i] = d2;
+      }
     }
+  });
 
-    ss.write(reinterpret_cast<const char *>(&block_name_size), sizeof(uint32_t));
-
-    ss.write(block_name_str.c_str(), block_name_size);
+  // Keep faces with strands, in mesh face order.
+  std::vector<uint32_t> face_index(num_faces, kDropped);
+  for (size_t i = 0; i < num_curves; i++) {
+    if (new_face[i] != kDropped) {
+      face_index[new_face[i]] = 0;
+    }
   }
-
-  // primSize
-  {
-    for (size_t i = 0; i < input.block.size(); i++) {
-      ss.write(reinterpret_cast<const char *>(&input.primSize[i]), sizeof(uint32_t));
+  CopyReorderHeader(xpd, input);
+  input->faceid.clear();
+  for (size_t f = 0; f < num_faces; f++) {
+    if (face_index[f] != kDropped) {
+      face_index[f] = uint32_t(input->faceid.size());
+      input->faceid.push_back(mesh.faceid.empty() ? int(f) : mesh.faceid[f]);
     }
   }
 
-  // keys
-  {
-    uint32_t numKeys = uint32_t(input.key.size());
-    ss.write(reinterpret_cast<const char *>(&numKeys), sizeof(uint32_t));
-
-    // Build a string with flattened string(using delimiter '\0')
-    uint32_t key_name_size = 0;
-    std::string key_name_str;
-    for (size_t i = 0; i < numKeys; i++) {
-      key_name_str += input.key[i];
-      key_name_str += '\0';
-
-      key_name_size += input.key[i].size() + 1; // +1 for '\0'
+  if (input->faceid.empty()) {
+    if (err) {
+      (*err) += "No strand is bound to the mesh.\n";
     }
+    return false;
+  }
 
-    ss.write(reinterpret_cast<const char *>(&key_name_size), sizeof(uint32_t));
-
-    if (key_name_size > 0) {
-      ss.write(key_name_str.c_str(), key_name_size);
+  // Regroup prim records by new face(stable counting sort, so strands keep
+  // their order within a face).
+  const uint32_t num_new_faces = uint32_t(input->faceid.size());
+  XPDRebindStats s;
+  input->numFaces = num_new_faces;
+  input->numPrims.assign(num_new_faces, 0);
+  for (size_t i = 0; i < num_curves; i++) {
+    if (new_face[i] == kDropped) {
+      s.numDropped++;
+      continue;
     }
+    input->numPrims[face_index[new_face[i]]]++;
+    s.maxDistance = std::max(s.maxDistance, std::sqrt(dist2[i]));
   }
+  s.numStrands = uint32_t(num_curves) - s.numDropped;
 
-
-  // faceid
-  {
-    ss.write(reinterpret_cast<const char *>(&input.numFaces), sizeof(uint32_t));
-
-
-    if (input.numFaces > 0) {
-      ss.write(reinterpret_cast<const char *>(input.faceid.data()), input.numFaces * sizeof(uint32_t));
+  ctx->srcOffset.assign(size_t(num_new_faces) + 1, 0);
+  for (uint32_t f = 0; f < num_new_faces; f++) {
+    ctx->srcOffset[f + 1] = ctx->srcOffset[f] + input->numPrims[f];
+  }
+  std::vector<uint32_t> next(ctx->srcOffset.begin(),
+                             ctx->srcOffset.end() - 1);
+  ctx->srcFace.resize(s.numStrands);
+  ctx->srcPrim.resize(s.numStrands);
+  ctx->uv.resize(size_t(s.numStrands) * 2);
+  ctx->uvBlock = block_id;
+  for (uint32_t f = 0; f < num_old_faces; f++) {
+    for (uint32_t p = 0; p < xpd.numPrims[f]; p++) {
+      const size_t i = prim_offset[f] + p;
+      if (new_face[i] == kDropped) {
+        continue;
+      }
+      const uint32_t dst = next[face_index[new_face[i]]]++;
+      ctx->srcFace[dst] = f;
+      ctx->srcPrim[dst] = p;
+      ctx->uv[2 * dst + 0] = uv[2 * i + 0];
+      ctx->uv[2 * dst + 1] = uv[2 * i + 1];
     }
-
   }
 
-  // numPrims. length = numFaces
-  {
-    ss.write(reinterpret_cast<const char *>(input.numPrims.data()), input.numFaces * sizeof(uint32_t));
+  if (stats) {
+    (*stats) = s;
   }
 
+  SetReorderCallbacks(ctx, option.numThreads, serialize_option, encode);
+  return true;
+}
 
-  // header size includes `blockPosition` data.
-  size_t header_size = ss.str().size() + input.blockOffset.size() * sizeof(uint64_t);
+bool RebindSplineXPD(const XPDHeader &xpd, const uint8_t *binary,
+                     const size_t binary_length, const uint32_t block_id,
+                     const XPDRebindMesh &mesh, const XPDRebindOption &option,
+                     std::vector<uint8_t> *xpd_binary, XPDRebindStats *stats,
+                     std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileRebindSplineXPD);
 
-  // Compute absolute blockPosition
-  for (size_t b = 0; b < input.blockOffset.size(); b++) {
-    uint64_t position = header_size + input.blockOffset[b];
-    ss.write(reinterpret_cast<const char *>(&position), sizeof(uint64_t));
+  if (!xpd_binary) {
+    if (err) {
+      (*err) += "`xpd_binary` argument is null.\n";
+    }
+    return false;
   }
 
-  // Append PrimData.
-  ss.write(reinterpret_cast<const char *>(prim_data.data()), std::streamsize(prim_data.size()));
+  ReorderContext ctx;
+  XPDHeaderInput input;
+  XPDParallelSerializeOption serialize_option;
+  XPDEncodeBlockCallback encode;
+  if (!PrepareRebind(xpd, binary, binary_length, block_id, mesh, option, &ctx,
+                     &input, &serialize_option, &encode, stats, err)) {
+    return false;
+  }
 
-  size_t binary_length = ss.str().size();
+  return SerializeToXPDParallel(input, encode, serialize_option, xpd_binary,
+                                err);
+}
 
-  xpd_binary->resize(binary_length);
-  memcpy(xpd_binary->data(), ss.str().c_str(), binary_length);
+bool RebindSplineXPDFile(const XPDHeader &xpd, const uint8_t *binary,
+                         const size_t binary_length, const uint32_t block_id,
+                         const XPDRebindMesh &mesh,
+                         const XPDRebindOption &option,
+                         const std::string &filename, XPDRebindStats *stats,
+                         std::string *err) {
+  TINY_XPD_PROFILE_SCOPE(XPDProfileRebindSplineXPD);
+
+  ReorderContext ctx;
+  XPDHeaderInput input;
+  XPDParallelSerializeOption serialize_option;
+  XPDEncodeBlockCallback encode;
+  if (!PrepareRebind(xpd, binary, binary_length, block_id, mesh, option, &ctx,
+                     &input, &serialize_option, &encode, stats, err)) {
+    return false;
+  }
 
-  return true;
+  return SerializeToXPDFileParallel(input, encode, serialize_option, filename,
+                                    err);
 }
 
 }  // namespace tiny_xpd
@@ -0,0 +1,578 @@
+//
+// C API of tiny_xpd. See tiny_xpd_c.h.
+//
+#define TINY_XPD_IMPLEMENTATION
+#include "tiny_xpd.h"
+
+#ifndef TINY_XPD_C_BUILD
+#define TINY_XPD_C_BUILD
+#endif
+#include "tiny_xpd_c.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace tiny_xpd;
+
+static_assert(sizeof(int) == sizeof(int32_t), "faceid must be 32 bit.");
+
+struct tiny_xpd_file {
+  std::shared_ptr<const XPDFile> file;
+  std::vector<XPDChannel> channels;
+  std::atomic<uint32_t> refs;
+
+  tiny_xpd_file() : refs(1) {}
+};
+
+struct tiny_xpd_soa {
+  XPDSplineSoA soa;
+};
+
+namespace {
+
+thread_local std::string g_last_error;
+
+tiny_xpd_status Fail(const tiny_xpd_status status, const char *msg) {
+  try {
+    g_last_error = msg;
+  } catch (...) {
+    g_last_error.clear();
+  }
+  return status;
+}
+
+tiny_xpd_status Fail(const tiny_xpd_status status, const std::string &msg) {
+  return Fail(status, msg.c_str());
+}
+
+tiny_xpd_status Succeed() {
+  g_last_error.clear();
+  return TINY_XPD_OK;
+}
+
+// Status of the exception being handled. Call only from a catch block.
+tiny_xpd_status FailException() {
+  try {
+    throw;
+  } catch (const std::bad_alloc &) {
+    return Fail(TINY_XPD_ERROR_OUT_OF_MEMORY, "Out of memory.");
+  } catch (const std::exception &e) {
+    return Fail(TINY_XPD_ERROR_INTERNAL, e.what());
+  } catch (...) {
+    return Fail(TINY_XPD_ERROR_INTERNAL, "Unknown exception.");
+  }
+}
+
+// Copy `src` to caller allocated `dst`, whose first field is `struct_size`.
+// Only the first `dst->struct_size` bytes are written, so callers built
+// against an older(smaller) struct are not overrun. `min_size` is the size
+// of the struct when `struct_size` was introduced(API version 2).
+template <typename T>
+tiny_xpd_status CopyOut(const T &src, T *dst, const size_t min_size) {
+  const size_t size = dst->struct_size;
+  if (size < min_size) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT,
+                "`struct_size` must be set to the size of the struct.");
+  }
+  const uint32_t struct_size = dst->struct_size;
+  memcpy(dst, &src, std::min(size, sizeof(T)));
+  dst->struct_size = struct_size;
+  return Succeed();
+}
+
+// Wrap a parsed handle. Channels are decoded once.
+tiny_xpd_status CreateHandle(const std::shared_ptr<const XPDFile> &f,
+                             tiny_xpd_file **file) {
+  std::unique_ptr<tiny_xpd_file> handle(new tiny_xpd_file());
+  handle->file = f;
+  std::string err;
+  if (!GetChannels(f->header(), &handle->channels, &err)) {
+    return Fail(TINY_XPD_ERROR_PARSE, err);
+  }
+  (*file) = handle.release();
+  return Succeed();
+}
+
+bool IsValid(const tiny_xpd_file *file) { return file && file->file; }
+
+tiny_xpd_status ToBlockView(const XPDBlockView &v,
+                            tiny_xpd_block_view *view) {
+  tiny_xpd_block_view out;
+  memset(&out, 0, sizeof(out));
+  out.data = v.data;
+  out.numPrims = v.numPrims;
+  out.primSize = v.primSize;
+  out.stride = uint32_t(v.stride());
+  return CopyOut(out, view, sizeof(tiny_xpd_block_view));
+}
+
+tiny_xpd_status ToChannel(const XPDChannel &c, tiny_xpd_channel *channel) {
+  tiny_xpd_channel out;
+  memset(&out, 0, sizeof(out));
+  out.name.data = c.name.c_str();
+  out.name.length = c.name.size();
+  out.blockId = c.blockId;
+  out.keyId = c.keyId;
+  out.offset = c.offset;
+  out.arity = c.arity;
+  return CopyOut(out, channel, sizeof(tiny_xpd_channel));
+}
+
+}  // namespace
+
+// Entry points which may throw are function-try-blocks, so no exception
+// crosses the C ABI.
+
+uint32_t tiny_xpd_api_version(void) { return TINY_XPD_C_API_VERSION; }
+
+const char *tiny_xpd_last_error(void) { return g_last_error.c_str(); }
+
+const char *tiny_xpd_status_name(tiny_xpd_status status) {
+  switch (status) {
+    case TINY_XPD_OK:
+      return "ok";
+    case TINY_XPD_ERROR_INVALID_ARGUMENT:
+      return "invalid argument";
+    case TINY_XPD_ERROR_IO:
+      return "I/O error";
+    case TINY_XPD_ERROR_PARSE:
+      return "parse error";
+    case TINY_XPD_ERROR_OUT_OF_RANGE:
+      return "out of range";
+    case TINY_XPD_ERROR_NOT_FOUND:
+      return "not found";
+    case TINY_XPD_ERROR_UNSUPPORTED:
+      return "unsupported";
+    case TINY_XPD_ERROR_OUT_OF_MEMORY:
+      return "out of memory";
+    case TINY_XPD_ERROR_INTERNAL:
+      return "internal error";
+  }
+  return "unknown";
+}
+
+tiny_xpd_status tiny_xpd_open(const char *filename,
+                              tiny_xpd_file **file) try {
+  if (!filename || !file) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT,
+                "`filename` or `file` argument is null.");
+  }
+  (*file) = nullptr;
+
+  // Map once, and tell I/O errors from parse errors.
+  XPDMappedFile mapped;
+  std::string err;
+  if (!mapped.open(filename, &err)) {
+    return Fail(TINY_XPD_ERROR_IO, err);
+  }
+
+  std::shared_ptr<const XPDFile> f;
+  if (!CreateXPDFileFromMapping(&mapped, &f, &err)) {
+    return Fail(TINY_XPD_ERROR_PARSE, err);
+  }
+  return CreateHandle(f, file);
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_open_memory(const uint8_t *data, size_t length,
+                                     tiny_xpd_file **file) try {
+  if (!data || !file) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT,
+                "`data` or `file` argument is null.");
+  }
+  (*file) = nullptr;
+
+  std::vector<uint8_t> buffer(data, data + length);
+  std::shared_ptr<const XPDFile> f;
+  std::string err;
+  if (!CreateXPDFileFromMemory(&buffer, &f, &err)) {
+    return Fail(TINY_XPD_ERROR_PARSE, err);
+  }
+  return CreateHandle(f, file);
+} catch (...) {
+  return FailException();
+}
+
+void tiny_xpd_retain(tiny_xpd_file *file) {
+  if (file) {
+    file->refs.fetch_add(1);
+  }
+}
+
+void tiny_xpd_release(tiny_xpd_file *file) try {
+  if (file && (file->refs.fetch_sub(1) == 1)) {
+    delete file;
+  }
+} catch (...) {
+}
+
+tiny_xpd_status tiny_xpd_get_data(const tiny_xpd_file *file,
+                                  const uint8_t **data, uint64_t *size) try {
+  if (!IsValid(file) || !data || !size) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  (*data) = file->file->data();
+  (*size) = file->file->size();
+  return Succeed();
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_get_header(const tiny_xpd_file *file,
+                                    tiny_xpd_header *header) try {
+  if (!IsValid(file) || !header) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  const XPDHeader &h = file->file->header();
+  tiny_xpd_header out;
+  memset(&out, 0, sizeof(out));
+  out.fileVersion = h.fileVersion;
+  out.primType = uint32_t(h.primType);
+  out.primVersion = h.primVersion;
+  out.time = h.time;
+  out.numCVs = h.numCVs;
+  out.coordSpace = uint32_t(h.coordSpace);
+  out.numFaces = h.numFaces;
+  out.numBlocks = h.numBlocks;
+  out.numKeys = uint32_t(h.key.size());
+  out.numChannels = uint32_t(file->channels.size());
+  return CopyOut(out, header, sizeof(tiny_xpd_header));
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_get_faceids(const tiny_xpd_file *file,
+                                     const int32_t **faceid) try {
+  if (!IsValid(file) || !faceid) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  (*faceid) = reinterpret_cast<const int32_t *>(
+      file->file->header().faceid.data());
+  return Succeed();
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_get_num_prims(const tiny_xpd_file *file,
+                                       const uint32_t **num_prims) try {
+  if (!IsValid(file) || !num_prims) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  (*num_prims) = file->file->header().numPrims.data();
+  return Succeed();
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_get_block_positions(const tiny_xpd_file *file,
+                                             const uint64_t **positions) try {
+  if (!IsValid(file) || !positions) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  (*positions) = file->file->header().blockPosition.data();
+  return Succeed();
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_get_block(const tiny_xpd_file *file,
+                                   uint32_t block_id, tiny_xpd_string *name,
+                                   uint32_t *prim_size) try {
+  if (!IsValid(file)) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  const XPDHeader &h = file->file->header();
+  if ((block_id >= h.block.size()) || (block_id >= h.primSize.size())) {
+    return Fail(TINY_XPD_ERROR_OUT_OF_RANGE,
+                "Block index " + std::to_string(block_id) + " out of range.");
+  }
+  if (name) {
+    name->data = h.block[block_id].c_str();
+    name->length = h.block[block_id].size();
+  }
+  if (prim_size) {
+    (*prim_size) = h.primSize[block_id];
+  }
+  return Succeed();
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_find_block(const tiny_xpd_file *file,
+                                    const char *name, uint32_t *block_id) try {
+  if (!IsValid(file) || !name || !block_id) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  const int id = file->file->findBlock(name);
+  if (id < 0) {
+    return Fail(TINY_XPD_ERROR_NOT_FOUND,
+                std::string("Block not found: ") + name);
+  }
+  (*block_id) = uint32_t(id);
+  return Succeed();
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_get_key(const tiny_xpd_file *file, uint32_t key_id,
+                                 tiny_xpd_string *name) try {
+  if (!IsValid(file) || !name) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  const XPDHeader &h = file->file->header();
+  if (key_id >= h.key.size()) {
+    return Fail(TINY_XPD_ERROR_OUT_OF_RANGE,
+                "Key index " + std::to_string(key_id) + " out of range.");
+  }
+  name->data = h.key[key_id].c_str();
+  name->length = h.key[key_id].size();
+  return Succeed();
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_get_block_view(const tiny_xpd_file *file,
+                                        uint32_t face, uint32_t block_id,
+                                        tiny_xpd_block_view *view) try {
+  if (!IsValid(file) || !view) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  const XPDHeader &h = file->file->header();
+  if ((face >= h.numFaces) || (block_id >= h.numBlocks)) {
+    return Fail(TINY_XPD_ERROR_OUT_OF_RANGE,
+                "Face or block index out of range.");
+  }
+  XPDBlockView v;
+  std::string err;
+  if (!file->file->blockView(face, block_id, &v, &err)) {
+    return Fail(TINY_XPD_ERROR_PARSE, err);
+  }
+  return ToBlockView(v, view);
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_get_block_range(const tiny_xpd_file *file,
+                                         uint32_t block_id,
+                                         tiny_xpd_block_view *view) try {
+  if (!IsValid(file) || !view) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  const XPDHeader &h = file->file->header();
+  if (block_id >= h.numBlocks) {
+    return Fail(TINY_XPD_ERROR_OUT_OF_RANGE,
+                "Block index " + std::to_string(block_id) + " out of range.");
+  }
+
+  XPDBlockView range;
+  range.primSize = h.primSize[block_id];
+  std::string err;
+  for (uint32_t f = 0; f < h.numFaces; f++) {
+    XPDBlockView v;
+    if (!file->file->blockView(f, block_id, &v, &err)) {
+      return Fail(TINY_XPD_ERROR_PARSE, err);
+    }
+    // Empty faces may be anywhere.
+    if (v.numPrims == 0) {
+      continue;
+    }
+    if (!range.data) {
+      range.data = v.data;
+    } else if (v.data != range.data + range.numPrims * range.stride()) {
+      return Fail(TINY_XPD_ERROR_UNSUPPORTED,
+                  "Prim data of block " + std::to_string(block_id) +
+                      " is not contiguous.");
+    }
+    range.numPrims += v.numPrims;
+  }
+
+  return ToBlockView(range, view);
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_get_channel(const tiny_xpd_file *file,
+                                     uint32_t index,
+                                     tiny_xpd_channel *channel) try {
+  if (!IsValid(file) || !channel) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  if (index >= file->channels.size()) {
+    return Fail(TINY_XPD_ERROR_OUT_OF_RANGE,
+                "Channel index " + std::to_string(index) + " out of range.");
+  }
+  return ToChannel(file->channels[index], channel);
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_find_channel(const tiny_xpd_file *file,
+                                      const char *block, const char *name,
+                                      tiny_xpd_channel *channel) try {
+  if (!IsValid(file) || !block || !name || !channel) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  const int block_id = file->file->findBlock(block);
+  for (size_t i = 0; i < file->channels.size(); i++) {
+    const XPDChannel &c = file->channels[i];
+    if ((int(c.blockId) == block_id) && (c.name == name)) {
+      return ToChannel(c, channel);
+    }
+  }
+  return Fail(TINY_XPD_ERROR_NOT_FOUND, std::string("Channel not found: ") +
+                                            block + ":" + name);
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_get_spline_layout(const tiny_xpd_file *file,
+                                           uint32_t block_id,
+                                           tiny_xpd_spline_layout *layout) try {
+  if (!IsValid(file) || !layout) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  XPDSplineLayout l;
+  std::string err;
+  if (!GetSplineLayout(file->file->header(), block_id, &l, &err)) {
+    return Fail(TINY_XPD_ERROR_UNSUPPORTED, err);
+  }
+  tiny_xpd_spline_layout out;
+  memset(&out, 0, sizeof(out));
+  out.numCVs = l.numCVs;
+  out.id = l.id;
+  out.u = l.u;
+  out.v = l.v;
+  out.cv = l.cv;
+  out.length = l.length;
+  out.width = l.width;
+  out.taper = l.taper;
+  out.taperStart = l.taperStart;
+  out.widthVector = l.widthVector;
+  out.size = l.size;
+  return CopyOut(out, layout, sizeof(tiny_xpd_spline_layout));
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_get_varying_cv_view(
+    const tiny_xpd_file *file, uint32_t face, uint32_t block_id,
+    tiny_xpd_varying_cv_view *view) try {
+  if (!IsValid(file) || !view) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  uint32_t ext_block_id;
+  if (!FindVaryingCVBlock(file->file->header(), block_id, &ext_block_id)) {
+    return Fail(TINY_XPD_ERROR_NOT_FOUND,
+                "Block " + std::to_string(block_id) +
+                    " has no variable CV count extension.");
+  }
+  XPDVaryingCVView v;
+  std::string err;
+  if (!file->file->varyingCVView(face, block_id, &v, &err)) {
+    return Fail(TINY_XPD_ERROR_PARSE, err);
+  }
+  tiny_xpd_varying_cv_view out;
+  memset(&out, 0, sizeof(out));
+  out.table = v.table;
+  out.cvs = v.cvs;
+  out.numPrims = v.numPrims;
+  out.numCVs = v.numCVs;
+  return CopyOut(out, view, sizeof(tiny_xpd_varying_cv_view));
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_extract_spline_soa(const tiny_xpd_file *file,
+                                            uint32_t block_id,
+                                            uint32_t num_threads,
+                                            const float *matrix,
+                                            const float *face_matrices,
+                                            tiny_xpd_soa **soa) try {
+  if (!IsValid(file) || !soa) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  (*soa) = nullptr;
+
+  XPDSplineSoAOption option;
+  option.numThreads = num_threads;
+  if (matrix) {
+    option.transform.matrix.assign(matrix, matrix + 16);
+  }
+  if (face_matrices) {
+    option.transform.faceMatrices.assign(
+        face_matrices, face_matrices + size_t(file->file->numFaces()) * 16);
+  }
+
+  std::unique_ptr<tiny_xpd_soa> s(new tiny_xpd_soa());
+  std::string err;
+  if (!file->file->extractSplineSoA(block_id, option, &s->soa, &err)) {
+    return Fail(TINY_XPD_ERROR_PARSE, err);
+  }
+  (*soa) = s.release();
+  return Succeed();
+} catch (...) {
+  return FailException();
+}
+
+void tiny_xpd_soa_free(tiny_xpd_soa *soa) try {
+  delete soa;
+} catch (...) {
+}
+
+tiny_xpd_status tiny_xpd_soa_get_counts(const tiny_xpd_soa *soa,
+                                        uint32_t *num_curves,
+                                        uint32_t *num_cvs_per_curve) try {
+  if (!soa) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+  if (num_curves) {
+    (*num_curves) = soa->soa.numCurves;
+  }
+  if (num_cvs_per_curve) {
+    (*num_cvs_per_curve) = soa->soa.numCVsPerCurve;
+  }
+  return Succeed();
+} catch (...) {
+  return FailException();
+}
+
+tiny_xpd_status tiny_xpd_soa_get_array(const tiny_xpd_soa *soa,
+                                       tiny_xpd_soa_array array,
+                                       const void **data, uint64_t *count) try {
+  if (!soa || !data || !count) {
+    return Fail(TINY_XPD_ERROR_INVALID_ARGUMENT, "Null argument.");
+  }
+
+  const XPDSplineSoA &s = soa->soa;
+  const std::vector<float> *floats[] = {
+      &s.px,         &s.py,           &s.pz,           &s.id,
+      &s.u,          &s.v,            &s.length,       &s.width,
+      &s.taper,      &s.taperStart,   &s.widthVectorX, &s.widthVectorY,
+      &s.widthVectorZ};
+  const size_t num_floats = sizeof(floats) / sizeof(floats[0]);
+
+  const size_t a = size_t(array);
+  if (a < num_floats) {
+    (*data) = floats[a]->data();
+    (*count) = floats[a]->size();
+  } else if (array == TINY_XPD_SOA_FACE_CURVE_OFFSET) {
+    (*data) = s.faceCurveOffset.data();
+    (*count) = s.faceCurveOffset.size();
+  } else if (array == TINY_XPD_SOA_CURVE_CV_OFFSET) {
+    (*data) = s.curveCVOffset.data();
+    (*count) = s.curveCVOffset.size();
+  } else {
+    return Fail(TINY_XPD_ERROR_OUT_OF_RANGE,
+                "Array " + std::to_string(a) + " out of range.");
+  }
+  return Succeed();
+} catch (...) {
+  return FailException();
+}
@@ -0,0 +1,310 @@
+#ifndef TINY_XPD_C_H_
+#define TINY_XPD_C_H_
+
+/*
+The MIT License (MIT)
+
+Copyright (c) 2019 Syoyo Fujita.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*
+
+ C API of tiny_xpd(C99), built as a shared library from tiny_xpd_c.cc.
+
+ Handles are opaque, and views are explicit-length pointers into mapped XPD
+ data(no copy). Views are valid while the file handle is alive. Functions
+ return `tiny_xpd_status`, and the message of the last error of the calling
+ thread is available from `tiny_xpd_last_error`.
+
+ File handles are immutable after opening, so any number of threads can
+ read through one handle(see `XPDFile`).
+
+ Structs filled by the library(`tiny_xpd_header`, `tiny_xpd_block_view`,
+ `tiny_xpd_channel`, `tiny_xpd_spline_layout` and `tiny_xpd_varying_cv_view`)
+ start with `struct_size`, which the caller sets to `sizeof` of the struct
+ before the call:
+
+   tiny_xpd_header header;
+   header.struct_size = sizeof(header);
+   tiny_xpd_get_header(file, &header);
+
+ Structs are only extended by appending fields to the end and bumping
+ TINY_XPD_C_API_VERSION. The library writes only the first `struct_size`
+ bytes, so callers built against an older header keep working with a newer
+ library.
+
+ Every entry point catches C++ exceptions and returns them as status codes.
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(TINY_XPD_C_STATIC)
+#define TINY_XPD_C_API
+#elif defined(_WIN32)
+#if defined(TINY_XPD_C_BUILD)
+#define TINY_XPD_C_API __declspec(dllexport)
+#else
+#define TINY_XPD_C_API __declspec(dllimport)
+#endif
+#else
+#define TINY_XPD_C_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TINY_XPD_C_API_VERSION 2
+
+typedef enum {
+  TINY_XPD_OK = 0,
+  TINY_XPD_ERROR_INVALID_ARGUMENT = 1,
+  TINY_XPD_ERROR_IO = 2,
+  TINY_XPD_ERROR_PARSE = 3,
+  TINY_XPD_ERROR_OUT_OF_RANGE = 4,
+  TINY_XPD_ERROR_NOT_FOUND = 5,
+  TINY_XPD_ERROR_UNSUPPORTED = 6,
+  TINY_XPD_ERROR_OUT_OF_MEMORY = 7,
+  TINY_XPD_ERROR_INTERNAL = 8  // Unexpected exception inside the library.
+} tiny_xpd_status;
+
+typedef struct tiny_xpd_file tiny_xpd_file;
+typedef struct tiny_xpd_soa tiny_xpd_soa;
+
+/// String owned by a file handle. `data` is also NUL terminated.
+typedef struct {
+  const char *data;
+  size_t length;
+} tiny_xpd_string;
+
+typedef struct {
+  uint32_t struct_size;  // sizeof(tiny_xpd_header), set by the caller.
+  uint32_t fileVersion;
+  uint32_t primType;  // Xpd::PrimType
+  uint32_t primVersion;
+  float time;
+  uint32_t numCVs;
+  uint32_t coordSpace;  // Xpd::CoordSpace
+  uint32_t numFaces;
+  uint32_t numBlocks;
+  uint32_t numKeys;
+  uint32_t numChannels;
+} tiny_xpd_header;
+
+/// Prim data of a block. Prims are `stride` bytes apart and may be
+/// unaligned.
+typedef struct {
+  uint32_t struct_size;  // sizeof(tiny_xpd_block_view), set by the caller.
+  const uint8_t *data;
+  uint64_t numPrims;
+  uint32_t primSize;  // The number of floats per prim.
+  uint32_t stride;    // in bytes
+} tiny_xpd_block_view;
+
+typedef struct {
+  uint32_t struct_size;  // sizeof(tiny_xpd_channel), set by the caller.
+  tiny_xpd_string name;
+  uint32_t blockId;
+  uint32_t keyId;
+  uint32_t offset;  // Offset in floats from the beginning of a prim.
+  uint32_t arity;   // The number of float components.
+} tiny_xpd_channel;
+
+/// Offsets in floats from the beginning of a prim. See `XPDSplineLayout`.
+typedef struct {
+  uint32_t struct_size;  // sizeof(tiny_xpd_spline_layout), set by the caller.
+  uint32_t numCVs;
+  uint32_t id;
+  uint32_t u;
+  uint32_t v;
+  uint32_t cv;
+  uint32_t length;
+  uint32_t width;
+  uint32_t taper;
+  uint32_t taperStart;
+  uint32_t widthVector;
+  uint32_t size;
+} tiny_xpd_spline_layout;
+
+/// See `XPDVaryingCVView`.
+typedef struct {
+  uint32_t struct_size;  // sizeof(tiny_xpd_varying_cv_view), set by the
+                         // caller.
+  const uint8_t *table;  // CV count and CV offset(uint32) per prim.
+  const uint8_t *cvs;    // xyz of the first CV of the face.
+  uint64_t numPrims;
+  uint64_t numCVs;
+} tiny_xpd_varying_cv_view;
+
+/// Arrays of `tiny_xpd_soa`. See `XPDSplineSoA`.
+typedef enum {
+  TINY_XPD_SOA_PX = 0,  // float
+  TINY_XPD_SOA_PY,
+  TINY_XPD_SOA_PZ,
+  TINY_XPD_SOA_ID,
+  TINY_XPD_SOA_U,
+  TINY_XPD_SOA_V,
+  TINY_XPD_SOA_LENGTH,
+  TINY_XPD_SOA_WIDTH,
+  TINY_XPD_SOA_TAPER,
+  TINY_XPD_SOA_TAPER_START,
+  TINY_XPD_SOA_WIDTH_VECTOR_X,
+  TINY_XPD_SOA_WIDTH_VECTOR_Y,
+  TINY_XPD_SOA_WIDTH_VECTOR_Z,
+  TINY_XPD_SOA_FACE_CURVE_OFFSET,  // uint32_t
+  TINY_XPD_SOA_CURVE_CV_OFFSET,    // uint32_t
+  TINY_XPD_SOA_NUM_ARRAYS
+} tiny_xpd_soa_array;
+
+/// Return TINY_XPD_C_API_VERSION of the library.
+TINY_XPD_C_API uint32_t tiny_xpd_api_version(void);
+
+/// Message of the last error of the calling thread("" when none).
+TINY_XPD_C_API const char *tiny_xpd_last_error(void);
+
+/// Name of a status code.
+TINY_XPD_C_API const char *tiny_xpd_status_name(tiny_xpd_status status);
+
+///
+/// Open and map a XPD file. Release the handle with `tiny_xpd_release`.
+///
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_open(const char *filename,
+                                             tiny_xpd_file **file);
+
+///
+/// Create a handle from XPD data in memory. `data` is copied.
+///
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_open_memory(const uint8_t *data,
+                                                    size_t length,
+                                                    tiny_xpd_file **file);
+
+/// Add a reference(e.g. for arrays of a foreign language viewing the data).
+TINY_XPD_C_API void tiny_xpd_retain(tiny_xpd_file *file);
+
+/// Release a reference. Data is unmapped when the last one is released.
+TINY_XPD_C_API void tiny_xpd_release(tiny_xpd_file *file);
+
+/// Whole XPD data.
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_get_data(const tiny_xpd_file *file,
+                                                 const uint8_t **data,
+                                                 uint64_t *size);
+
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_get_header(const tiny_xpd_file *file,
+                                                   tiny_xpd_header *header);
+
+///
+/// Per face arrays. [numFaces]
+///
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_get_faceids(const tiny_xpd_file *file,
+                                                    const int32_t **faceid);
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_get_num_prims(
+    const tiny_xpd_file *file, const uint32_t **num_prims);
+
+///
+/// Absolute byte position of each block of each face.
+/// [numFaces * numBlocks], indexed by face * numBlocks + block_id.
+///
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_get_block_positions(
+    const tiny_xpd_file *file, const uint64_t **positions);
+
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_get_block(const tiny_xpd_file *file,
+                                                  uint32_t block_id,
+                                                  tiny_xpd_string *name,
+                                                  uint32_t *prim_size);
+
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_find_block(const tiny_xpd_file *file,
+                                                   const char *name,
+                                                   uint32_t *block_id);
+
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_get_key(const tiny_xpd_file *file,
+                                                uint32_t key_id,
+                                                tiny_xpd_string *name);
+
+///
+/// Prim data of `block_id` in `face`.
+///
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_get_block_view(
+    const tiny_xpd_file *file, uint32_t face, uint32_t block_id,
+    tiny_xpd_block_view *view);
+
+///
+/// Prim data of `block_id` in all faces, when prims of non-empty faces are
+/// contiguous in XPD data (e.g. single block files). Return
+/// TINY_XPD_ERROR_UNSUPPORTED otherwise. `data` is NULL when no face has
+/// prims.
+///
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_get_block_range(
+    const tiny_xpd_file *file, uint32_t block_id, tiny_xpd_block_view *view);
+
+/// Channels decoded from keys. [numChannels] See `GetChannels`.
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_get_channel(const tiny_xpd_file *file,
+                                                    uint32_t index,
+                                                    tiny_xpd_channel *channel);
+
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_find_channel(
+    const tiny_xpd_file *file, const char *block, const char *name,
+    tiny_xpd_channel *channel);
+
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_get_spline_layout(
+    const tiny_xpd_file *file, uint32_t block_id,
+    tiny_xpd_spline_layout *layout);
+
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_get_varying_cv_view(
+    const tiny_xpd_file *file, uint32_t face, uint32_t block_id,
+    tiny_xpd_varying_cv_view *view);
+
+///
+/// Extract spline data of `block_id` in SoA form(`ExtractSplineSoA`).
+/// Free with `tiny_xpd_soa_free`.
+///
+/// @param[in] file File handle.
+/// @param[in] block_id Block index.
+/// @param[in] num_threads The number of threads(0 = hardware concurrency).
+/// @param[in] matrix Row-major 4x4 transform(NULL = identity).
+/// @param[in] face_matrices Per face transforms for Local space CVs.
+///            [numFaces * 16](NULL = none).
+/// @param[out] soa SoA handle.
+///
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_extract_spline_soa(
+    const tiny_xpd_file *file, uint32_t block_id, uint32_t num_threads,
+    const float *matrix, const float *face_matrices, tiny_xpd_soa **soa);
+
+TINY_XPD_C_API void tiny_xpd_soa_free(tiny_xpd_soa *soa);
+
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_soa_get_counts(
+    const tiny_xpd_soa *soa, uint32_t *num_curves,
+    uint32_t *num_cvs_per_curve);
+
+///
+/// Array of `soa`. `count` is the number of elements(0 for arrays which are
+/// not present, e.g. curveCVOffset of fixed CV count splines).
+///
+TINY_XPD_C_API tiny_xpd_status tiny_xpd_soa_get_array(
+    const tiny_xpd_soa *soa, tiny_xpd_soa_array array, const void **data,
+    uint64_t *count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // TINY_XPD_C_H_